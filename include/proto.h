@@ -15,25 +15,87 @@ enum {
   NS_FLAG_ENCRYPTED = 1u << 0,
   NS_FLAG_COMPRESSED = 1u << 1,
   NS_FLAG_IS_RESPONSE = 1u << 2,
+  // Checksum coverage; both clear means CRC32 over header + body.
+  NS_FLAG_CRC_HEADER_ONLY = 1u << 3,
+  NS_FLAG_CRC_NONE = 1u << 4,
+  // Ledger ops that move funds (listed with the opcodes below): req_id is an idempotency key. A
+  // request repeating the (user, req_id) of one of the user's recent ledger ops gets that op's
+  // response again instead of running twice. The client keeps req_id unique per user across reconnects.
+  NS_FLAG_IDEMPOTENT = 1u << 5,
 };
 
+// Per-connection integrity modes, negotiated in HELLO.
+// Ordered strongest -> weakest: a frame may always carry stronger coverage
+// than the connection negotiated, never weaker.
+typedef enum {
+  NS_INTEGRITY_FULL = 0,   // CRC32(header_without_checksum + body)
+  NS_INTEGRITY_HEADER = 1, // CRC32(header_without_checksum) only
+  NS_INTEGRITY_NONE = 2,   // checksum is 0 and not verified
+} ns_integrity_t;
+
+#define NS_INTEGRITY_COUNT 3u
+
 typedef enum {
   OP_HELLO = 0x0001,
   OP_LOGIN = 0x0002,
   OP_LOGOUT = 0x0003,
   OP_HEARTBEAT = 0x0004,
 
-  OP_JOIN_ROOM = 0x0101,
+  OP_JOIN_ROOM = 0x0101, // u16 room_id [+ u8 ns_join_replay_t + u64 arg]; resp: u64 seq + u64 missed + u32 replayed
   OP_LEAVE_ROOM = 0x0102,
   OP_CHAT_SEND = 0x0103,
   OP_CHAT_BROADCAST = 0x0104, // server push
-
-  OP_DEPOSIT = 0x0201,
-  OP_WITHDRAW = 0x0202,
-  OP_TRANSFER = 0x0203,
-  OP_BALANCE = 0x0204,
+  OP_CHAT_BROADCAST_BATCH = 0x0105, // server push: u16 count + count * CHAT_BROADCAST bodies
+  OP_DIRECT_MSG = 0x0106,  // u32 to_user_id + u16 msg_len + msg
+  OP_DIRECT_PUSH = 0x0107, // server push: u32 from_user_id + u16 msg_len + msg
+
+  // Ledger ops take a trailing u8 asset id (ns_asset_t; absent = cash); resp: i64 balance of that asset
+  // DEPOSIT, WITHDRAW, TRANSFER and TRANSFER_MULTI move funds and honour NS_FLAG_IDEMPOTENT
+  OP_DEPOSIT = 0x0201,  // i64 amount [+ u8 asset]
+  OP_WITHDRAW = 0x0202, // i64 amount [+ u8 asset]
+  OP_TRANSFER = 0x0203, // u32 to_user_id + i64 amount [+ u8 asset]
+  OP_BALANCE = 0x0204,  // [u8 asset]
+  // [u16 max [+ u64 before_seq]]: the caller's newest ledger events, or those before before_seq;
+  // resp: u16 count + count * (u64 seq + u64 ts_ms + u16 opcode + u16 status + u32 from + u32 to + i64 amount
+  // + u8 asset)
+  OP_TXN_HISTORY = 0x0205,
+  OP_BALANCE_SUBSCRIBE = 0x0206, // u8 on; resp: i64 balance
+  OP_BALANCE_PUSH = 0x0207,      // server push to subscribers credited by a TRANSFER
+  OP_TRANSFER_MULTI = 0x0208,    // u16 count + count * (u32 to_user_id + i64 amount); all or none; resp: i64 balance
+  OP_LEADERBOARD = 0x0209,       // [u16 n]; resp: u16 count + count * (u32 user_id + i64 balance), richest first
+
+  // u8 symbol + u8 side + u8 flags + u32 price + u32 qty;
+  // resp: u64 order_id (0 = nothing rests) + u32 filled + u32 rested + i64 notional + i64 balance
+  OP_ORDER_PLACE = 0x0301,
+  OP_ORDER_CANCEL = 0x0302, // u64 order_id; resp: u32 canceled qty + i64 balance
+  // server push to the maker: u64 order_id + u8 symbol + u8 side + u32 price + u32 qty + u32 remaining
+  OP_ORDER_FILL = 0x0303,
+
+  // Market data: the latest value per symbol, conflated for slow subscribers
+  OP_MD_SUBSCRIBE = 0x0304, // u64 symbol mask (replaces the previous one; 0 = none)
+  OP_MD_PUBLISH = 0x0305,   // u8 symbol + u32 bid + u32 ask + u32 last_price + u32 last_qty
+  // server push: u8 symbol + u32 bid + u32 ask + u32 last_price + u32 last_qty + u64 volume
+  // + u64 version (publishes so far; gaps are conflated ticks) + u64 ts_ns (CLOCK_MONOTONIC at publish)
+  OP_MD_UPDATE = 0x0306,
 } opcode_t;
 
+typedef enum {
+  NS_SIDE_BUY = 0,
+  NS_SIDE_SELL = 1,
+} ns_side_t;
+
+enum {
+  NS_ORDER_IOC = 1u << 0, // fill what crosses now and cancel the rest instead of resting it
+};
+
+// JOIN_ROOM replay: events sent to the joining connection before live pushes.
+// arg is a seq for NS_JOIN_AFTER_SEQ and an event count for NS_JOIN_LAST.
+typedef enum {
+  NS_JOIN_LIVE = 0,      // only events sent after the join
+  NS_JOIN_AFTER_SEQ = 1, // resume after the last seq the client saw
+  NS_JOIN_LAST = 2,      // the newest arg events
+} ns_join_replay_t;
+
 typedef enum {
   ST_OK = 0x0000,
   ST_ERR_BAD_PACKET = 0x0001,
@@ -49,7 +111,7 @@ typedef enum {
 // Fixed 32-byte header on the wire (big-endian)
 // Layout:
 // magic(2) version(1) flags(1) header_len(2) body_len(4) opcode(2) status(2)
-// req_id(8) checksum(4) reserved(6)
+// req_id(8) checksum(4) deadline_ms(4) reserved(2)
 typedef struct __attribute__((packed)) {
   uint16_t magic;
   uint8_t version;
@@ -60,19 +122,33 @@ typedef struct __attribute__((packed)) {
   uint16_t status;
   uint64_t req_id;
   uint32_t checksum;
-  uint8_t reserved[6];
+  // Requests: give up after this many ms from when the server received the frame (0 = no
+  // deadline). A request still unexecuted by then is answered ST_ERR_TIMEOUT. 0 in responses.
+  uint32_t deadline_ms;
+  uint8_t reserved[2];
 } ns_header_t;
 
 // Helpers
 uint32_t ns_crc32(const void *data, size_t len);
+// Continue a finished CRC32 over more bytes: ns_crc32_extend(ns_crc32(a), b) == CRC32(a + b).
+uint32_t ns_crc32_extend(uint32_t crc, const void *data, size_t len);
+// Checksum coverage follows the NS_FLAG_CRC_* bits in hdr_be->flags.
 uint32_t ns_frame_checksum(const ns_header_t *hdr_be, const uint8_t *body, size_t body_len);
 
+// Integrity mode helpers
+uint8_t ns_integrity_flags(ns_integrity_t mode);            // NS_FLAG_CRC_* bits for mode
+ns_integrity_t ns_frame_integrity(const ns_header_t *hdr_be); // coverage carried by a frame
+const char *ns_integrity_name(ns_integrity_t mode);
+// Parses "full" / "header" / "none"; returns 0 on success.
+int ns_integrity_parse(const char *s, ns_integrity_t *out);
+
 // Simple symmetric XOR "encryption" for demo purposes.
 // Uses NS_XOR_KEY as the key; applying it twice recovers the original.
 void ns_xor_crypt(uint8_t *data, size_t len, uint32_t key);
 
 // Encode a header in big-endian into out_hdr (checksum is filled).
-// out_hdr points to a ns_header_t (wire format).
+// out_hdr points to a ns_header_t (wire format). OR ns_integrity_flags(mode)
+// into flags to emit a weaker checksum.
 void ns_build_header(ns_header_t *out_hdr_be,
                      uint8_t flags,
                      uint16_t opcode,
@@ -81,6 +157,15 @@ void ns_build_header(ns_header_t *out_hdr_be,
                      const uint8_t *body,
                      uint32_t body_len);
 
+// ns_build_header for a request with a deadline (see ns_header_t.deadline_ms); the checksum covers it.
+void ns_build_header_deadline(ns_header_t *out_hdr_be,
+                              uint8_t flags,
+                              uint16_t opcode,
+                              uint64_t req_id,
+                              uint32_t deadline_ms,
+                              const uint8_t *body,
+                              uint32_t body_len);
+
 bool ns_validate_header_basic(const ns_header_t *hdr_be, uint32_t max_body_len);
 bool ns_validate_checksum(const ns_header_t *hdr_be, const uint8_t *body, size_t body_len);
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "proto.h"
+
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -7,21 +9,137 @@
 #define NS_MAX_USERS 1024u
 #define NS_MAX_ROOMS 64u
 #define NS_MAX_USERNAME 32u
-#define NS_MAX_CHAT_MSG 256u
+#define NS_CHAT_MSG_LIMIT 65535u  // msg_len is a u16 on the wire
+#define NS_CHAT_MSG_DEFAULT 4096u // default server limit (NS_CHAT_MAX_MSG)
+#define NS_MAX_WORKERS 64u // room_workers keeps one bit per worker
+#define NS_ROOM_MASK_WORDS ((NS_MAX_ROOMS + 63u) / 64u)
 
-#define NS_CHAT_RING_SIZE 4096u
+// Chat history: every room owns a byte ring carved from one shared arena, so a busy room
+// only evicts its own history. Capacities are set at startup (ns_chat_set_room_caps).
+#define NS_CHAT_ARENA_BYTES (4u << 20)
+#define NS_CHAT_ROOM_MIN_BYTES 4096u
 #define NS_TXN_RING_SIZE 4096u
+// Direct messages: each worker has an inbox other workers append to (many producers, one consumer).
+#define NS_INBOX_BYTES (128u << 10)
 
 #define NS_SHM_MAGIC 0x4E535348u /* 'N''S''S''H' */
+#define NS_SHM_VERSION 22u // bump on any ns_shm_t layout change
+
+// OP_CHAT_BROADCAST push: header + u16 room_id + u32 from_user_id + u16 msg_len + msg + u64 seq
+// (the event's sequence number in its room; a client resumes after it with OP_JOIN_ROOM).
+#define NS_CHAT_BODY_HDR 8u
+#define NS_CHAT_BODY_SEQ 8u
+
+static inline uint32_t ns_chat_frame_len(uint32_t msg_len) {
+  return (uint32_t)sizeof(ns_header_t) + NS_CHAT_BODY_HDR + msg_len + NS_CHAT_BODY_SEQ;
+}
+static inline const char *ns_chat_frame_msg(const uint8_t *frame) {
+  return (const char *)frame + sizeof(ns_header_t) + NS_CHAT_BODY_HDR;
+}
 
+// One chat event in a room's byte ring: this header, then the ready-to-send push frame,
+// built and checksummed (full CRC) once at append time. A full-coverage frame is valid on
+// every connection whatever integrity mode it negotiated. A record never straddles the end
+// of the ring; the tail gap is skipped (marked with frame_len 0 when it can hold a header).
 typedef struct {
+  uint32_t size;      // bytes to the next record: header + frame, rounded up to 8
+  uint32_t frame_len; // 0 = wrap marker
   uint64_t seq;
   uint64_t ts_ms;
-  uint16_t room_id;
   uint32_t from_user_id;
+  uint16_t room_id;
   uint16_t msg_len;
-  char msg[NS_MAX_CHAT_MSG];
-} ns_chat_event_t;
+} ns_chat_rec_t;
+
+static inline uint32_t ns_chat_rec_size(uint32_t msg_len) {
+  return ((uint32_t)sizeof(ns_chat_rec_t) + ns_chat_frame_len(msg_len) + 7u) & ~7u;
+}
+
+// Smallest record (empty message) = ns_chat_rec_size(0). A ring of cap bytes never holds
+// more than cap / NS_CHAT_REC_MIN events, which sizes its seq index.
+#define NS_CHAT_REC_MIN \
+  (((uint32_t)sizeof(ns_chat_rec_t) + (uint32_t)sizeof(ns_header_t) + NS_CHAT_BODY_HDR + NS_CHAT_BODY_SEQ + 7u) & ~7u)
+#define NS_CHAT_INDEX_SLOTS (NS_CHAT_ARENA_BYTES / NS_CHAT_REC_MIN)
+
+// Byte positions below are logical (monotonic); the ring offset is pos % cap.
+typedef struct {
+  pthread_mutex_t mu;     // serializes appends and reads of this room's ring
+  uint64_t write_seq;     // last seq appended to this room (atomic; peeked without mu)
+  uint64_t head_seq;      // oldest retained event (write_seq + 1 when empty)
+  uint64_t head_pos;      // its position
+  uint64_t tail_pos;      // where the next record goes
+  uint64_t live_msg_bytes; // message bytes of the retained events
+  uint32_t base;          // offset of this room's ring in chat_arena
+  uint32_t cap;           // ring size in bytes (multiple of 8)
+  uint32_t idx_base;      // this room's slots in chat_index: position of seq at idx_base + seq % idx_cap
+  uint32_t idx_cap;       // cap / NS_CHAT_REC_MIN, so retained seqs never share a slot
+} ns_chat_room_t;
+
+// A reader's place in one room: the last seq it consumed and where the next record starts.
+// {0, 0} reads from the oldest retained event.
+typedef struct {
+  uint64_t seq;
+  uint64_t pos;
+} ns_chat_cursor_t;
+
+// Where one event's frame landed in a ns_chat_read_frames() buffer.
+typedef struct {
+  uint64_t seq;
+  uint64_t ts_ms;
+  uint16_t room_id;
+  uint16_t msg_len;
+  uint32_t from_user_id;
+  uint32_t off;
+  uint32_t len;
+} ns_chat_frame_ref_t;
+
+// OP_DIRECT_PUSH: header + u32 from_user_id + u16 msg_len + msg
+#define NS_DM_BODY_HDR 6u
+
+static inline uint32_t ns_dm_frame_len(uint32_t msg_len) {
+  return (uint32_t)sizeof(ns_header_t) + NS_DM_BODY_HDR + msg_len;
+}
+
+// OP_BALANCE_PUSH: header + u32 user_id + i64 balance + i64 credited + u32 credits
+// (transfers received since the previous push, coalesced over the worker's window)
+#define NS_BALANCE_PUSH_BODY 24u
+
+// OP_TRANSFER_MULTI: legs per request (each locks one more account) and bytes per leg on the wire
+#define NS_TRANSFER_MULTI_MAX 64u
+#define NS_TRANSFER_LEG_BYTES 12u
+
+typedef struct {
+  uint32_t to_user_id;
+  int64_t amount;
+} ns_transfer_leg_t;
+
+typedef enum {
+  NS_INBOX_FRAME = 0,   // payload is a ready-to-send push frame
+  NS_INBOX_BALANCE = 1, // payload is the i64 amount credited to to_user_id
+} ns_inbox_kind_t;
+
+// One message in a worker inbox: this header, then the payload, padded to 8.
+// Like the chat rings, a record never straddles the end (frame_len 0 marks the skipped gap).
+typedef struct {
+  uint32_t size;
+  uint32_t frame_len; // payload bytes; 0 = wrap marker
+  uint64_t conn_handle; // recipient connection on the owning worker
+  uint32_t to_user_id;
+  uint32_t kind; // ns_inbox_kind_t
+} ns_inbox_rec_t;
+
+static inline uint32_t ns_inbox_rec_size(uint32_t frame_len) {
+  return ((uint32_t)sizeof(ns_inbox_rec_t) + frame_len + 7u) & ~7u;
+}
+
+// Producers serialize on mu and publish with a release store of tail; the owning worker reads
+// [head, tail) and frees records by advancing head, never taking mu. Positions are logical.
+typedef struct {
+  pthread_mutex_t mu;
+  uint64_t head; // atomic: consumer position
+  uint64_t tail; // atomic: end of published records
+  _Alignas(8) uint8_t buf[NS_INBOX_BYTES];
+} ns_inbox_t;
 
 typedef struct {
   uint64_t seq;
@@ -30,9 +148,212 @@ typedef struct {
   uint16_t status;
   uint32_t from_user_id;
   uint32_t to_user_id;
+  uint16_t batch_idx; // leg index within a TRANSFER_MULTI batch (0 for single ops)
+  uint16_t batch_len; // legs in that batch, all logged back to back (0 for single ops)
+  uint8_t asset;      // ns_asset_t of amount (order fills log their cash leg)
   int64_t amount;
+  // Per-user index: the previous event of from_user_id and of to_user_id (0 = none). An event of a
+  // user with itself (DEPOSIT, WITHDRAW) is linked once, through prev_from_seq.
+  uint64_t prev_from_seq;
+  uint64_t prev_to_seq;
 } ns_txn_event_t;
 
+// OP_TXN_HISTORY: events per response, and bytes per event on the wire
+// (u64 seq + u64 ts_ms + u16 opcode + u16 status + u32 from_user_id + u32 to_user_id + i64 amount + u8 asset)
+#define NS_TXN_HISTORY_MAX 64u
+#define NS_TXN_HISTORY_REC 37u
+
+// Worker scheduling classes: parsed requests wait in one ready queue per class and each worker
+// runs them weighted by class, so a chat flood does not queue in front of trading.
+typedef enum {
+  NS_SCHED_TRADING = 0, // ledger, orders, market data and account queries
+  NS_SCHED_CONTROL = 1, // session, room and subscription ops
+  NS_SCHED_CHAT = 2,    // CHAT_SEND, DIRECT_MSG
+  NS_SCHED_CLASSES = 3,
+} ns_sched_class_t;
+// Latency histograms: bucket b counts latencies in [2^(b-1), 2^b) us (bucket 0: under 1 us; the
+// last bucket also takes everything longer).
+#define NS_LAT_BUCKETS 24u
+
+// Per-worker gauges; each slot is written only by its worker.
+typedef struct {
+  int32_t pid;
+  uint32_t connections;
+  uint64_t conn_bytes;        // connection structs
+  uint64_t rx_buf_bytes;      // receive rings attached to connections
+  uint64_t tx_buf_bytes;      // write buffers attached to connections
+  uint64_t pool_cached_bytes; // free buffers kept for reuse
+  uint64_t tx_frames;         // frames queued for sending
+  uint64_t tx_bytes;          // bytes queued for sending
+  uint64_t tx_bytes_copied;   // bytes memcpy'd while building them (shared frames count once)
+  uint64_t tx_zerocopy_bytes; // bytes sent with MSG_ZEROCOPY
+  uint64_t chat_events;       // chat events delivered to connections
+  uint64_t chat_frames;       // push frames carrying them (< chat_events when batching)
+  uint64_t chat_wakeups;      // chat notifications received
+  uint64_t chat_overrun;      // events lost because a room's ring wrapped before this worker read them
+  uint64_t chat_replayed;     // events replayed to connections joining with a resume cursor
+  uint64_t chat_resume_gaps;  // resumes that asked for events already evicted
+  uint64_t dm_sent;           // direct messages accepted from local senders
+  uint64_t dm_delivered;      // direct messages queued to local recipients
+  uint64_t dm_stale;          // inbox messages whose recipient connection had gone
+  uint64_t dm_inbox_full;     // sends refused because the recipient worker's inbox was full
+  uint64_t bal_updates;       // credits to local balance subscribers
+  uint64_t bal_pushes;        // BALANCE_PUSH frames sent for them (< bal_updates when coalesced)
+  uint64_t dedup_hits;        // NS_FLAG_IDEMPOTENT ledger ops answered from the dedup table
+  uint64_t dedup_misses;      // ... executed and recorded
+  uint64_t dedup_conflicts;   // ... refused: req_id already used for a different request
+  uint64_t orders_placed;     // ORDER_PLACE requests accepted (filled, rested or both)
+  uint64_t order_fills;       // fills this worker's takers made (one ORDER_FILL push to the maker each)
+  uint64_t md_changes;        // changed symbols picked up from md_dirty (once per wake-up, however many ticks)
+  uint64_t md_updates;        // MD_UPDATE frames sent
+  uint64_t md_conflated;      // changes folded into an update a backed-up subscriber had not been sent yet
+  uint64_t throttled;         // requests refused by a per-user rate limit
+  uint64_t shed;              // requests refused by admission control (queued too long)
+  uint64_t accepts_refused;   // connections closed by the accept-rate limit
+  uint64_t queue_delay_us;    // lowest request queueing delay in the last shed interval
+  uint64_t expired;           // requests whose deadline_ms passed before they ran (ST_ERR_TIMEOUT)
+  uint32_t overloaded;        // 1 while admission control is shedding
+  // Per class: request arrival (kernel receive time) -> response queued, log2 us histogram.
+  uint64_t sched_lat[NS_SCHED_CLASSES][NS_LAT_BUCKETS];
+} ns_worker_stats_t;
+
+// Order books (OP_ORDER_*), one per symbol. Prices are integer ticks in [1, NS_BOOK_LEVELS),
+// so a price is directly an index into the level arrays.
+#define NS_BOOK_SYMBOLS 4u
+#define NS_BOOK_LEVELS 4096u
+#define NS_BOOK_ORDERS 16384u // resting orders per book (order ids keep the slot in 24 bits)
+#define NS_BOOK_MASK_WORDS (NS_BOOK_LEVELS / 64u)
+#define NS_ORDER_FILL_BODY 22u
+
+// Ledger assets: cash, then one instrument per book symbol, whose units fills move from seller
+// to buyer. DEPOSIT / WITHDRAW / TRANSFER / BALANCE take an optional trailing u8 asset id
+// (absent = cash). The leaderboard, escrow, TRANSFER_MULTI and balance pushes are cash only.
+typedef enum {
+  NS_ASSET_CASH = 0,
+  NS_ASSET_SYMBOL0 = 1, // + symbol
+} ns_asset_t;
+#define NS_ASSETS (1u + NS_BOOK_SYMBOLS)
+#define NS_ASSET_OF_SYMBOL(sym) (NS_ASSET_SYMBOL0 + (uint32_t)(sym))
+#define NS_INITIAL_CASH 100000LL // every user's opening cash balance
+
+// FIFO of the resting orders at one price; links are arena index + 1, 0 = none.
+typedef struct {
+  uint32_t head; // oldest order, matched first
+  uint32_t tail;
+  uint64_t qty;  // resting quantity at this price
+} ns_book_level_t;
+
+typedef struct {
+  uint32_t next; // FIFO neighbours within the level; next also links the free list
+  uint32_t prev;
+  uint32_t gen;  // bumped on free; part of the order id, so stale ids miss
+  uint32_t user_id;
+  uint32_t price;
+  uint32_t qty;  // remaining
+  uint8_t side;  // ns_side_t
+  uint8_t live;
+  uint16_t reserved;
+} ns_order_t;
+
+typedef struct {
+  pthread_mutex_t mu;  // everything below, and the ledger updates of fills it makes
+  uint32_t best_bid;   // 0 = no bids
+  uint32_t best_ask;   // 0 = no asks
+  uint32_t free_head;  // arena free list (index + 1)
+  uint32_t arena_used; // slots ever handed out
+  uint32_t live_orders;
+  uint64_t trades;
+  uint64_t volume;
+  uint64_t bid_mask[NS_BOOK_MASK_WORDS]; // non-empty levels, to find the next best price without a scan
+  uint64_t ask_mask[NS_BOOK_MASK_WORDS];
+  ns_book_level_t bids[NS_BOOK_LEVELS];
+  ns_book_level_t asks[NS_BOOK_LEVELS];
+  ns_order_t orders[NS_BOOK_ORDERS];
+} ns_book_t;
+
+// Market data: one latest-value slot per symbol. The first NS_BOOK_SYMBOLS are written by the
+// order books (top of book after every change, last trade); OP_MD_PUBLISH writes the others.
+#define NS_MD_SYMBOLS 64u // md_dirty keeps one bit per symbol
+#define NS_MD_UPDATE_BODY 41u
+
+typedef struct {
+  uint32_t bid;        // 0 = none
+  uint32_t ask;        // 0 = none
+  uint32_t last_price; // last trade or tick
+  uint32_t last_qty;
+  uint64_t volume;     // sum of last_qty over all publishes
+  uint64_t version;    // publishes so far, 0 = never published
+  uint64_t ts_ns;      // CLOCK_MONOTONIC of the latest publish
+} ns_md_quote_t;
+
+// Seqlock: writers make seq odd (a CAS, so writers on different workers exclude each other),
+// update q and make it even again; readers retry until they see the same even seq on both sides.
+typedef struct {
+  uint32_t seq;
+  uint32_t reserved;
+  ns_md_quote_t q;
+} ns_md_slot_t;
+
+// Balance leaderboard (OP_LEADERBOARD), kept exact on every balance change: the top K users in a
+// min-heap (root = K-th place) and all other users in a max-heap (root = best of the rest). A change
+// re-sifts the user in its heap and swaps the two roots if they now cross, so neither updates nor
+// queries scan balance[].
+#define NS_LEADERBOARD_K 32u
+#define NS_LEADERBOARD_REC 12u // u32 user_id + i64 balance on the wire
+
+typedef struct {
+  uint32_t user_id;
+  int64_t balance;
+} ns_lb_entry_t;
+
+typedef struct {
+  pthread_mutex_t mu; // taken inside acct_mu, never the other way round
+  uint32_t top_len;
+  uint32_t rest_len;
+  uint32_t top[NS_LEADERBOARD_K];
+  uint32_t rest[NS_MAX_USERS];
+  int64_t key[NS_MAX_USERS];  // the user's balance as of its last update
+  uint16_t pos[NS_MAX_USERS]; // index in its heap
+  uint8_t heap[NS_MAX_USERS]; // 0 = not tracked yet, 1 = top, 2 = rest
+} ns_leaderboard_t;
+
+// Idempotent ledger ops (NS_FLAG_IDEMPOTENT): the results of each user's last NS_DEDUP_WAYS
+// such requests, keyed by req_id. A retry within that window gets the stored result back.
+#define NS_DEDUP_WAYS 16u
+
+typedef struct {
+  uint64_t req_id;   // 0 = empty
+  uint32_t body_crc; // tells a retry from a different request reusing the req_id
+  uint16_t opcode;
+  uint16_t status;
+  int64_t balance;   // the response body
+} ns_dedup_entry_t;
+
+typedef enum {
+  NS_DEDUP_MISS = 0,
+  NS_DEDUP_HIT = 1,
+  NS_DEDUP_CONFLICT = 2,
+} ns_dedup_result_t;
+
+// Per-user rate limits, one token bucket per user and opcode class, shared by every worker. Each
+// bucket is a single u64 in GCRA form (the time its next token is due, in CLOCK_MONOTONIC ns):
+// refill is implied by the clock and a consume is one CAS, so no lock is taken. The limits live
+// in shm as well, so they can be changed while the server runs (bin/metrics --rate-limits).
+typedef enum {
+  NS_RL_LEDGER = 0, // DEPOSIT, WITHDRAW, TRANSFER, TRANSFER_MULTI
+  NS_RL_ORDERS = 1, // ORDER_PLACE, ORDER_CANCEL, MD_PUBLISH
+  NS_RL_CHAT = 2,   // CHAT_SEND, DIRECT_MSG
+  NS_RL_QUERY = 3,  // BALANCE, TXN_HISTORY, LEADERBOARD
+  NS_RL_CLASSES = 4,
+  NS_RL_NONE = NS_RL_CLASSES, // not limited (session, room and subscription ops)
+} ns_rate_class_t;
+#define NS_RATE_MAX 1000000u // requests per second, and burst, per class
+
+typedef struct {
+  uint32_t rate;  // requests per second, 0 = unlimited
+  uint32_t burst; // requests allowed back to back after an idle period
+} ns_rate_limit_t;
+
 typedef struct {
   uint32_t magic;
   uint32_t version;
@@ -42,7 +363,8 @@ typedef struct {
   uint64_t total_connections;
   uint64_t total_requests;
   uint64_t total_errors;
-  uint64_t op_counts[0x0300]; // enough for our opcodes
+  uint64_t op_counts[0x0400]; // enough for our opcodes
+  ns_worker_stats_t worker_stats[NS_MAX_WORKERS];
 
   // User table
   pthread_mutex_t user_mu;
@@ -52,20 +374,52 @@ typedef struct {
 
   // Ledger
   pthread_mutex_t acct_mu[NS_MAX_USERS];
-  int64_t balance[NS_MAX_USERS];
+  // One column per asset, so a per-asset scan or audit walks contiguous memory. Instrument
+  // balances go negative when a user sells short.
+  int64_t balance[NS_ASSETS][NS_MAX_USERS];
+  // Cash held by the user's resting buy orders (counted with cash for asset conservation).
+  int64_t escrow[NS_MAX_USERS];
+  // Per-user dedup window, guarded by acct_mu[user]; dedup_next is the slot to overwrite next.
+  ns_dedup_entry_t dedup[NS_MAX_USERS][NS_DEDUP_WAYS];
+  uint8_t dedup_next[NS_MAX_USERS];
+  ns_leaderboard_t leaderboard;
+  // Rate limits: per class rate << 32 | burst (atomic, so a pair is always read whole), each
+  // user's buckets, and requests refused per class (atomic add).
+  uint64_t rate_limit[NS_RL_CLASSES];
+  uint64_t rate_tat[NS_MAX_USERS][NS_RL_CLASSES];
+  uint64_t rate_throttled[NS_RL_CLASSES];
 
   // Rooms (bitset: NS_MAX_USERS bits per room)
   pthread_mutex_t room_mu[NS_MAX_ROOMS];
   uint64_t room_members[NS_MAX_ROOMS][NS_MAX_USERS / 64u];
+  // Workers with at least one local connection in the room (bit = worker id, atomic).
+  // OP_CHAT_SEND only wakes these workers.
+  uint64_t room_workers[NS_MAX_ROOMS];
+
+  // Direct-message routing: per user, the worker and connection of its newest login
+  // (packed by ns_route_set, 0 = offline; atomic), and one inbox per worker.
+  uint64_t user_route[NS_MAX_USERS];
+  ns_inbox_t inbox[NS_MAX_WORKERS];
+  // Users whose routed connection asked for OP_BALANCE_PUSH (bitset, atomic)
+  uint64_t balance_watch[NS_MAX_USERS / 64u];
+
+  ns_book_t books[NS_BOOK_SYMBOLS];
+
+  // Market data: latest value per symbol; workers with local subscribers per symbol (bit = worker
+  // id), and per worker the symbols changed since it last looked (bit = symbol). All atomic.
+  ns_md_slot_t md[NS_MD_SYMBOLS];
+  uint64_t md_workers[NS_MD_SYMBOLS];
+  uint64_t md_dirty[NS_MAX_WORKERS];
 
-  // Chat event ring (cross-worker broadcast)
-  pthread_mutex_t chat_mu;
-  uint64_t chat_write_seq;
-  ns_chat_event_t chat_ring[NS_CHAT_RING_SIZE];
+  // Chat event rings (cross-worker broadcast), one per room; seqs are per room
+  ns_chat_room_t chat_rooms[NS_MAX_ROOMS];
+  _Alignas(8) uint8_t chat_arena[NS_CHAT_ARENA_BYTES];
+  uint64_t chat_index[NS_CHAT_INDEX_SLOTS]; // seq -> record position, per room (see ns_chat_room_t)
 
   // Transaction log ring (auditing)
   pthread_mutex_t txn_mu;
   uint64_t txn_write_seq;
+  uint64_t txn_user_head[NS_MAX_USERS]; // newest event involving the user (0 = none)
   ns_txn_event_t txn_ring[NS_TXN_RING_SIZE];
 } ns_shm_t;
 
@@ -84,18 +438,138 @@ int ns_user_find_or_create(ns_shm_t *s, const char *username, uint32_t *out_user
 // Room membership helpers
 void ns_room_set_member(ns_shm_t *s, uint16_t room_id, uint32_t user_id, bool member);
 bool ns_room_is_member(const ns_shm_t *s, uint16_t room_id, uint32_t user_id);
+// Worker interest (lock-free): set when a worker's first local connection joins, cleared when the last leaves.
+void ns_room_set_worker(ns_shm_t *s, uint16_t room_id, uint32_t worker_id, bool interested);
+uint64_t ns_room_workers(const ns_shm_t *s, uint16_t room_id);
+
+// Direct-message routing (lock-free). Routes address a connection slot below 2^24.
+// ns_route_set returns the packed route (0 if the handle cannot be routed); pass it to
+// ns_route_clear, which only clears the entry (and returns true) if the user has not logged in
+// elsewhere since.
+uint64_t ns_route_set(ns_shm_t *s, uint32_t user_id, uint32_t worker_id, uint64_t conn_handle);
+bool ns_route_clear(ns_shm_t *s, uint32_t user_id, uint64_t route);
+bool ns_route_get(const ns_shm_t *s, uint32_t user_id, uint32_t *out_worker_id, uint64_t *out_conn_handle);
+// Drop every route to worker_id (a restarted worker has none of its predecessor's connections).
+void ns_route_clear_worker(ns_shm_t *s, uint32_t worker_id);
+
+// Balance-change subscriptions (lock-free)
+void ns_balance_watch_set(ns_shm_t *s, uint32_t user_id, bool on);
+bool ns_balance_watched(const ns_shm_t *s, uint32_t user_id);
+
+// Market data (lock-free). ns_md_publish updates the symbol's slot: bid and ask are replaced,
+// and a trade_qty > 0 sets the last trade and adds to volume. It then marks the symbol dirty for
+// every worker with subscribers and returns the workers whose dirty set was empty before: only
+// those need a wake-up, the others have one pending. Returns 0 for an unknown symbol.
+uint64_t ns_md_publish(ns_shm_t *s, uint32_t symbol, uint32_t bid, uint32_t ask, uint32_t trade_price,
+                       uint32_t trade_qty);
+// Consistent copy of a symbol's latest value; false for an unknown symbol.
+bool ns_md_read(const ns_shm_t *s, uint32_t symbol, ns_md_quote_t *out);
+void ns_md_set_worker(ns_shm_t *s, uint32_t symbol, uint32_t worker_id, bool interested);
+// Symbols changed since the last call, cleared in the same step (for the owning worker).
+uint64_t ns_md_take_dirty(ns_shm_t *s, uint32_t worker_id);
+
+// Leaderboard of registered users only; a user enters when ns_user_find_or_create claims the slot
+// and updates for unclaimed ids are ignored. Call ns_leaderboard_update after changing the cash
+// balance of user_id, still holding acct_mu[user_id], so updates of one user arrive in order.
+// ns_leaderboard_top copies the top entries, best first (higher balance, then lower user id), and
+// returns how many. ns_leaderboard_reset rebuilds it from the registered users' cash (startup only).
+void ns_leaderboard_update(ns_shm_t *s, uint32_t user_id);
+uint32_t ns_leaderboard_top(ns_shm_t *s, ns_lb_entry_t *out, uint32_t max);
+void ns_leaderboard_reset(ns_shm_t *s);
+
+// Idempotent ledger ops; the caller holds acct_mu[user_id] across lookup, execution and record,
+// so concurrent retries on two connections cannot both execute. On a hit the original status and
+// balance are returned through out_status / out_balance.
+ns_dedup_result_t ns_dedup_lookup(const ns_shm_t *s, uint32_t user_id, uint64_t req_id, uint16_t opcode,
+                                  uint32_t body_crc, uint16_t *out_status, int64_t *out_balance);
+// Remember a result, replacing the user's oldest entry.
+void ns_dedup_record(ns_shm_t *s, uint32_t user_id, uint64_t req_id, uint16_t opcode, uint32_t body_crc,
+                     uint16_t status, int64_t balance);
+// Occupied entries across all users (unlocked; for metrics).
+uint32_t ns_dedup_used(const ns_shm_t *s);
+
+// Worker inboxes. Push copies one payload of the given ns_inbox_kind_t for conn_handle; returns
+// -1 when the inbox lacks room (the sender reports ERR_SERVER_BUSY). Peek/pop are for the owning
+// worker only: peek returns the oldest record or NULL, pop releases it.
+int ns_inbox_push(ns_shm_t *s, uint32_t worker_id, uint64_t conn_handle, uint32_t to_user_id, uint32_t kind,
+                  const uint8_t *data, uint32_t len);
+const ns_inbox_rec_t *ns_inbox_peek(ns_shm_t *s, uint32_t worker_id);
+void ns_inbox_pop(ns_shm_t *s, uint32_t worker_id, const ns_inbox_rec_t *rec);
+void ns_inbox_reset(ns_shm_t *s, uint32_t worker_id);
 
 // Ring buffer helpers
-void ns_chat_append(ns_shm_t *s, uint16_t room_id, uint32_t from_user_id, const char *msg, uint16_t msg_len);
-uint64_t ns_chat_latest_seq(const ns_shm_t *s);
-uint64_t ns_chat_read_from(ns_shm_t *s, uint64_t *inout_seq, ns_chat_event_t *out_events, uint32_t max_events);
+// Lay out the per-room chat rings: caps[r] bytes for room r (NULL = split the arena evenly),
+// rounded down to a multiple of 8. Each cap must be >= NS_CHAT_ROOM_MIN_BYTES and the total
+// <= NS_CHAT_ARENA_BYTES; returns -1 otherwise. Rooms whose ring moves lose their history.
+// Call before workers start.
+int ns_chat_set_room_caps(ns_shm_t *s, const uint32_t *caps);
+uint32_t ns_chat_room_cap(const ns_shm_t *s, uint16_t room_id);
+// Retained events and the ring bytes they occupy (including record headers and padding).
+void ns_chat_room_usage(ns_shm_t *s, uint16_t room_id, uint64_t *out_events, uint64_t *out_bytes,
+                        uint64_t *out_msg_bytes);
+// Append one message, evicting the room's oldest events as needed.
+// Returns -1 if the record is larger than the room's whole ring.
+int ns_chat_append(ns_shm_t *s, uint16_t room_id, uint32_t from_user_id, const char *msg, uint16_t msg_len);
+uint64_t ns_chat_latest_seq(const ns_shm_t *s, uint16_t room_id);
+// Cursor just past the newest event: reads from it return only later events.
+void ns_chat_cursor_latest(ns_shm_t *s, uint16_t room_id, ns_chat_cursor_t *out);
+// Cursor whose next read starts at event after_seq + 1, found through the room's seq index (no scan).
+// If that event was evicted the cursor starts at the oldest retained one and the number of lost
+// events is returned; otherwise 0. An after_seq beyond the newest event gives the latest cursor.
+uint64_t ns_chat_cursor_seek(ns_shm_t *s, uint16_t room_id, uint64_t after_seq, ns_chat_cursor_t *out);
+// Cursor for the newest `last` retained events (fewer if the room holds fewer).
+void ns_chat_cursor_last(ns_shm_t *s, uint16_t room_id, uint32_t last, ns_chat_cursor_t *out);
+// Copy the frames of room events after *cur, back to back into buf, and advance *cur.
+// Stops after max_events or when buf_cap cannot hold the next frame. A reader whose events
+// were evicted resumes at the oldest retained one; the events it missed are added to
+// *out_overrun (may be NULL).
+uint64_t ns_chat_read_frames(ns_shm_t *s, uint16_t room_id, ns_chat_cursor_t *cur, ns_chat_frame_ref_t *out_refs,
+                             uint32_t max_events, uint8_t *buf, size_t buf_cap, uint64_t *out_overrun);
 
 void ns_txn_append(ns_shm_t *s, uint16_t opcode, uint16_t status, uint32_t from_uid, uint32_t to_uid, int64_t amount);
+// Same, for an amount of another asset (ns_txn_append logs cash).
+void ns_txn_append_asset(ns_shm_t *s, uint8_t asset, uint16_t opcode, uint16_t status, uint32_t from_uid,
+                         uint32_t to_uid, int64_t amount);
+// Copy up to max of the user's events into out, newest first, following the per-user links, so
+// the cost is the events returned rather than the ring size. before_seq = 0 starts at the newest
+// event; a seq from an earlier call continues after it. Stops at the first event the ring has
+// already overwritten. Returns the number copied.
+uint32_t ns_txn_history(ns_shm_t *s, uint32_t user_id, uint64_t before_seq, ns_txn_event_t *out, uint32_t max);
+// Log a multi-leg batch as n consecutive events under one txn_mu hold, so no other op lands inside it.
+void ns_txn_append_batch(ns_shm_t *s, uint16_t opcode, uint16_t status, uint32_t from_uid,
+                         const ns_transfer_leg_t *legs, uint32_t n);
+
+// Lock the accounts in ids for a multi-account op: sorts ids, drops duplicates and locks acct_mu
+// in ascending order (the order OP_TRANSFER uses, so the two cannot deadlock). Returns the number
+// of distinct ids, left at the front of ids for ns_acct_unlock_many.
+uint32_t ns_acct_lock_many(ns_shm_t *s, uint32_t *ids, uint32_t n);
+void ns_acct_unlock_many(ns_shm_t *s, const uint32_t *ids, uint32_t n);
+
+// Rate limits. ns_rate_consume takes one token from the user's bucket of the class and returns
+// 0, or, if the bucket is empty, the ns until a token is due (nothing is taken then).
+// ns_rate_parse_limits applies a "class=rate[:burst],..." spec (classes ledger, orders, chat,
+// query; burst defaults to rate) on top of lim and returns -1 if it is malformed.
+ns_rate_class_t ns_rate_class(uint16_t opcode);
+const char *ns_rate_class_name(ns_rate_class_t cls);
+void ns_rate_set_limits(ns_shm_t *s, const ns_rate_limit_t lim[NS_RL_CLASSES]);
+void ns_rate_get_limits(const ns_shm_t *s, ns_rate_limit_t out[NS_RL_CLASSES]);
+uint64_t ns_rate_consume(ns_shm_t *s, uint32_t user_id, ns_rate_class_t cls, uint64_t now_ns);
+int ns_rate_parse_limits(const char *spec, ns_rate_limit_t lim[NS_RL_CLASSES]);
+
+// Scheduling class of a request opcode, its name, and latency histogram helpers (bucket of a
+// latency; the upper bound in us of the bucket holding the pct-th percentile, 0 if empty).
+ns_sched_class_t ns_sched_class(uint16_t opcode);
+const char *ns_sched_class_name(ns_sched_class_t cls);
+uint32_t ns_lat_bucket(uint64_t us);
+uint64_t ns_lat_percentile_us(const uint64_t hist[NS_LAT_BUCKETS], double pct);
 
-// Asset conservation invariant check
-// Returns 0 if invariant holds, -1 if violated
-// Computes: sum(balances) == initial_total + sum(deposits) - sum(withdrawals)
-int ns_check_asset_conservation(const ns_shm_t *s, int64_t *out_current_total, int64_t *out_expected_total);
+// Asset conservation invariant check, per asset
+// Returns 0 if invariant holds for every asset, -1 if violated
+// Computes, for each asset a: sum(balance[a]) (+ escrow for cash) == initial_total[a] +
+// sum(deposits of a) - sum(withdrawals of a). Both arrays are filled for every asset. Holds every
+// acct_mu while summing, so all ledger ops wait for it.
+int ns_check_asset_conservation(const ns_shm_t *s, int64_t out_current_total[NS_ASSETS],
+                                int64_t out_expected_total[NS_ASSETS]);
 
 
 
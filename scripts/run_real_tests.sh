@@ -63,9 +63,12 @@ append_run() {
 
 start_server() {
   local workers="$1"
-  echo "[2/4] Starting server: workers=${workers} port=${PORT} shm=${SHM}"
+  local integrity="${2:-full}"
+  local chat_flush_us="${3:-0}"
+  echo "[2/4] Starting server: workers=${workers} port=${PORT} shm=${SHM} integrity=${integrity} chat_flush_us=${chat_flush_us}"
   : >"$SERVER_LOG"
-  "$SERVER_BIN" --port "$PORT" --workers "$workers" --shm "$SHM" >>"$SERVER_LOG" 2>&1 &
+  "$SERVER_BIN" --port "$PORT" --workers "$workers" --shm "$SHM" --integrity "$integrity" \
+    --chat-flush-us "$chat_flush_us" >>"$SERVER_LOG" 2>&1 &
   SERVER_PID=$!
   # Wait briefly for server to bind
   sleep 0.5
@@ -86,6 +89,9 @@ run_client() {
   local mix="$2"
   local out_csv="$3"
   local payload_size="${4:-32}"  # Default 32 bytes if not specified
+  local integrity="${5:-full}"
+  local pipeline="${6:-1}"
+  local listeners="${7:-0}"
   "$CLIENT_BIN" \
     --host "$HOST" \
     --port "$PORT" \
@@ -94,6 +100,9 @@ run_client() {
     --duration "$DURATION" \
     --mix "$mix" \
     --payload-size "$payload_size" \
+    --integrity "$integrity" \
+    --pipeline "$pipeline" \
+    --listeners "$listeners" \
     --out "$out_csv"
 }
 
@@ -141,6 +150,50 @@ done
 
 stop_server
 
+# Integrity mode sweep (full CRC → header-only CRC → none), 1KB chat payloads
+echo "[3c/4] Integrity mode sweep..."
+start_server 4 full,header,none
+
+for integrity in full header none; do
+  run_id=$((run_id + 1))
+  tmp="${OUT_DIR}/tmp-${run_id}.csv"
+  scenario="w4_c100_chat-heavy_p1024_${integrity}"
+  echo "Run ${run_id}: ${scenario} (integrity=${integrity})"
+  run_client 100 chat-heavy "$tmp" 1024 "$integrity"
+  append_run "$run_id" "$scenario" "$tmp"
+done
+
+stop_server
+
+# Pipelining depth sweep: exercises the in-place receive ring with partial trailing frames
+echo "[3d/4] Pipelining sweep..."
+start_server 4
+
+for depth in 1 8 32; do
+  run_id=$((run_id + 1))
+  tmp="${OUT_DIR}/tmp-${run_id}.csv"
+  scenario="w4_c100_mixed_pipe${depth}"
+  echo "Run ${run_id}: ${scenario} (pipeline=${depth})"
+  run_client 100 mixed "$tmp" 256 full "$depth"
+  append_run "$run_id" "$scenario" "$tmp"
+done
+
+stop_server
+
+# Chat flush window sweep: push batching trades push latency for fewer frames/syscalls.
+# Listener connections report push_events/push_frames and push latency percentiles.
+echo "[3e/4] Chat flush window sweep..."
+for window in 0 250 500 1000 2000; do
+  start_server 4 full "$window"
+  run_id=$((run_id + 1))
+  tmp="${OUT_DIR}/tmp-${run_id}.csv"
+  scenario="w4_c100_chat-heavy_flush${window}"
+  echo "Run ${run_id}: ${scenario} (chat_flush_us=${window})"
+  run_client 100 chat-heavy "$tmp" 64 full 1 8
+  append_run "$run_id" "$scenario" "$tmp"
+  stop_server
+done
+
 echo "[4/4] Done."
 echo "- Results: ${RUNS_CSV}"
 echo "- Server log: ${SERVER_LOG}"
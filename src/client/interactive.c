@@ -22,6 +22,7 @@ static bool g_running = true;
 static uint32_t g_user_id = 0;
 static uint16_t g_room_id = UINT16_MAX; // Use UINT16_MAX to indicate "not in room"
 static uint64_t g_req_id = 0;
+static uint64_t g_last_seq = 0; // room seq of the last chat message shown (set by the reader thread)
 static pthread_mutex_t g_socket_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Response queue for storing responses by req_id
@@ -306,6 +307,31 @@ static void *heartbeat_thread(void *arg) {
   return NULL;
 }
 
+// Print one chat record (u16 room_id + u32 from_user_id + u16 msg_len + msg + u64 seq).
+// Returns the bytes consumed, or 0 if the record is truncated.
+static size_t print_chat_record(const uint8_t *p, size_t len) {
+  if (len < 16) return 0;
+  uint16_t room = ns_be16(p + 0);
+  uint32_t from_uid = ns_be32(p + 2);
+  uint16_t msg_len = ns_be16(p + 6);
+  if ((size_t)msg_len > len - 16) return 0;
+  uint64_t seq = ns_be64(p + 8 + msg_len);
+  __atomic_store_n(&g_last_seq, seq, __ATOMIC_RELAXED);
+  if (msg_len > 0) {
+    char msg[257];
+    size_t copy_len = (size_t)msg_len < 256 ? msg_len : 256;
+    memcpy(msg, p + 8, copy_len);
+    msg[copy_len] = '\0';
+    if (from_uid == g_user_id) {
+      printf("\n[Room %u #%llu] You: %s\n> ", room, (unsigned long long)seq, msg);
+    } else {
+      printf("\n[Room %u #%llu] User %u: %s\n> ", room, (unsigned long long)seq, from_uid, msg);
+    }
+    fflush(stdout);
+  }
+  return 16u + msg_len;
+}
+
 // Reader thread: reads all frames from socket and routes them appropriately
 // - Broadcasts (req_id == 0): immediately display chat messages
 // - Responses (req_id != 0): enqueue for send_and_wait to pick up
@@ -347,25 +373,39 @@ static void *reader_thread(void *arg) {
     
     if (opcode == OP_CHAT_BROADCAST && req_id == 0) {
       // Broadcast message: display immediately
-      // Server format: u16 room_id + u32 from_user_id + u16 msg_len + msg
-      if (body_len >= 8) {
-        uint16_t room = ns_be16(body + 0);
-        uint32_t from_uid = ns_be32(body + 2);
-        uint16_t msg_len = ns_be16(body + 6);
-        if (msg_len > 0 && msg_len <= body_len - 8) {
-          char msg[257];
-          size_t copy_len = (size_t)msg_len < 256 ? msg_len : 256;
-          memcpy(msg, body + 8, copy_len);
-          msg[copy_len] = '\0';
-          if (from_uid == g_user_id) {
-            printf("\n[Room %u] You: %s\n> ", room, msg);
-          } else {
-            printf("\n[Room %u] User %u: %s\n> ", room, from_uid, msg);
-          }
+      (void)print_chat_record(body, body_len);
+      free(body);
+    } else if (opcode == OP_CHAT_BROADCAST_BATCH && req_id == 0) {
+      // Coalesced broadcasts: u16 count + count records in the CHAT_BROADCAST format
+      if (body_len >= 2) {
+        uint16_t count = ns_be16(body);
+        size_t off = 2;
+        for (uint16_t k = 0; k < count; k++) {
+          size_t used = print_chat_record(body + off, body_len - off);
+          if (used == 0) break;
+          off += used;
+        }
+      }
+      free(body);
+    } else if (opcode == OP_DIRECT_PUSH && req_id == 0) {
+      // Direct message: u32 from_user_id + u16 msg_len + msg
+      if (body_len >= 6) {
+        uint32_t from_uid = ns_be32(body);
+        uint16_t msg_len = ns_be16(body + 4);
+        if ((size_t)msg_len <= body_len - 6u) {
+          printf("\n[DM] User %u: %.*s\n> ", from_uid, (int)(msg_len < 256 ? msg_len : 256), (const char *)(body + 6));
           fflush(stdout);
         }
       }
       free(body);
+    } else if (opcode == OP_BALANCE_PUSH && req_id == 0) {
+      // Balance update: u32 user_id + i64 balance + i64 credited + u32 credits
+      if (body_len >= NS_BALANCE_PUSH_BODY) {
+        printf("\n[Balance] %ld (+%ld from %u transfer%s)\n> ", (int64_t)ns_be64(body + 4),
+               (int64_t)ns_be64(body + 12), ns_be32(body + 20), ns_be32(body + 20) == 1 ? "" : "s");
+        fflush(stdout);
+      }
+      free(body);
     } else if (req_id != 0) {
       // Response to a request: enqueue for send_and_wait
       response_queue_enqueue(req_id, &hdr, body, body_len);
@@ -380,14 +420,18 @@ static void *reader_thread(void *arg) {
 
 static void print_menu(void) {
   printf("\n=== Menu ===\n");
-  printf("1. Join room (join <room_id>)\n");
+  printf("1. Join room (join <room_id> [last <n> | after <seq> | resume])\n");
   printf("2. Send message (chat <message>)\n");
-  printf("3. Check balance (balance)\n");
-  printf("4. Deposit (deposit <amount>)\n");
-  printf("5. Withdraw (withdraw <amount>)\n");
-  printf("6. Transfer (transfer <user_id> <amount>)\n");
+  printf("3. Check balance (balance [asset])\n");
+  printf("4. Deposit (deposit <amount> [asset])\n");
+  printf("5. Withdraw (withdraw <amount> [asset])\n");
+  printf("6. Transfer (transfer <user_id> <amount> [asset])\n");
   printf("7. Leave room (leave)\n");
-  printf("8. Quit (quit)\n");
+  printf("8. Direct message (dm <user_id> <message>)\n");
+  printf("9. Balance updates (watch on|off)\n");
+  printf("10. Transaction history (history [n])\n");
+  printf("11. Leaderboard (top [n])\n");
+  printf("12. Quit (quit)\n");
   printf("> ");
   fflush(stdout);
 }
@@ -403,11 +447,15 @@ static void handle_command(const char *line) {
   }
 
   if (strcmp(cmd, "balance") == 0 || strcmp(cmd, "bal") == 0) {
+    unsigned int asset = NS_ASSET_CASH;
+    uint8_t body[1];
+    uint32_t body_len = sscanf(line, "%*s %u", &asset) == 1 ? 1u : 0u;
+    body[0] = (uint8_t)asset;
     uint64_t rid = ++g_req_id;
     ns_header_t rh;
     uint8_t *rb = NULL;
     uint32_t rbl = 0;
-    if (send_and_wait(g_fd, OP_BALANCE, rid, NULL, 0, &rh, &rb, &rbl) != 0) {
+    if (send_and_wait(g_fd, OP_BALANCE, rid, body, body_len, &rh, &rb, &rbl) != 0) {
       printf("Failed to query balance\n");
       return;
     }
@@ -424,17 +472,36 @@ static void handle_command(const char *line) {
 
   if (strncmp(cmd, "join", 4) == 0) {
     uint16_t room = 0;
-    if (sscanf(line, "join %hu", &room) != 1) {
-      printf("Usage: join <room_id>\n");
+    char mode[16] = "";
+    unsigned long long arg = 0;
+    int got = sscanf(line, "join %hu %15s %llu", &room, mode, &arg);
+    uint8_t replay = NS_JOIN_LIVE;
+    if (got == 3 && strcmp(mode, "last") == 0) {
+      replay = NS_JOIN_LAST;
+    } else if (got == 3 && strcmp(mode, "after") == 0) {
+      replay = NS_JOIN_AFTER_SEQ;
+    } else if (got == 2 && strcmp(mode, "resume") == 0) {
+      // Pick up after the last message shown (e.g. rejoining after a leave)
+      replay = NS_JOIN_AFTER_SEQ;
+      arg = __atomic_load_n(&g_last_seq, __ATOMIC_RELAXED);
+    } else if (got != 1) {
+      printf("Usage: join <room_id> [last <n> | after <seq> | resume]\n");
       return;
     }
-    uint8_t body[2];
+    // u16 room_id [+ u8 replay + u64 arg]
+    uint8_t body[11];
+    uint32_t body_len = 2;
     ns_put_be16(body, room);
+    if (replay != NS_JOIN_LIVE) {
+      body[2] = replay;
+      ns_put_be64(body + 3, (uint64_t)arg);
+      body_len = 11;
+    }
     uint64_t rid = ++g_req_id;
     ns_header_t rh;
     uint8_t *rb = NULL;
     uint32_t rbl = 0;
-    if (send_and_wait(g_fd, OP_JOIN_ROOM, rid, body, 2, &rh, &rb, &rbl) != 0) {
+    if (send_and_wait(g_fd, OP_JOIN_ROOM, rid, body, body_len, &rh, &rb, &rbl) != 0) {
       printf("Failed to join room (connection error)\n");
       return;
     }
@@ -443,7 +510,14 @@ static void handle_command(const char *line) {
     uint64_t rrid = ns_be64(&rh.req_id);
     if (rop == OP_JOIN_ROOM && st == ST_OK && rrid == rid) {
       g_room_id = room;
-      printf("Joined room %u\n", room);
+      if (rbl >= 20) {
+        uint64_t missed = ns_be64(rb + 8);
+        printf("Joined room %u (seq %llu, replayed %u", room, (unsigned long long)ns_be64(rb), ns_be32(rb + 16));
+        if (missed) printf(", %llu older messages no longer available", (unsigned long long)missed);
+        printf(")\n");
+      } else {
+        printf("Joined room %u\n", room);
+      }
     } else {
       printf("Failed to join room: opcode=%u status=%u\n", rop, st);
     }
@@ -463,9 +537,9 @@ static void handle_command(const char *line) {
       return;
     }
     size_t msg_len = strlen(msg);
-    if (msg_len > NS_MAX_CHAT_MSG) msg_len = NS_MAX_CHAT_MSG;
+    if (msg_len > NS_CHAT_MSG_DEFAULT) msg_len = NS_CHAT_MSG_DEFAULT;
     
-    uint8_t body[4 + NS_MAX_CHAT_MSG];
+    uint8_t body[4 + NS_CHAT_MSG_DEFAULT];
     ns_put_be16(body + 0, g_room_id);
     ns_put_be16(body + 2, (uint16_t)msg_len);
     memcpy(body + 4, msg, msg_len);
@@ -487,19 +561,137 @@ static void handle_command(const char *line) {
     return;
   }
 
+  if (strcmp(cmd, "dm") == 0) {
+    unsigned to = 0;
+    int off = 0;
+    if (sscanf(line, "dm %u %n", &to, &off) != 1 || off == 0 || line[off] == '\0') {
+      printf("Usage: dm <user_id> <message>\n");
+      return;
+    }
+    const char *msg = line + off;
+    size_t msg_len = strlen(msg);
+    if (msg_len > NS_CHAT_MSG_DEFAULT) msg_len = NS_CHAT_MSG_DEFAULT;
+
+    uint8_t body[6 + NS_CHAT_MSG_DEFAULT];
+    ns_put_be32(body + 0, (uint32_t)to);
+    ns_put_be16(body + 4, (uint16_t)msg_len);
+    memcpy(body + 6, msg, msg_len);
+
+    uint64_t rid = ++g_req_id;
+    ns_header_t rh;
+    uint8_t *rb = NULL;
+    uint32_t rbl = 0;
+    if (send_and_wait(g_fd, OP_DIRECT_MSG, rid, body, (uint32_t)(6u + msg_len), &rh, &rb, &rbl) != 0) {
+      printf("Failed to send direct message\n");
+      return;
+    }
+    uint16_t st = ns_be16(&rh.status);
+    if (st == ST_ERR_NOT_FOUND) {
+      printf("User %u is not online\n", to);
+    } else if (st != ST_OK) {
+      printf("Failed to send direct message: status=%u\n", st);
+    }
+    free(rb);
+    return;
+  }
+
+  if (strcmp(cmd, "top") == 0) {
+    unsigned int max = 10;
+    (void)sscanf(line, "top %u", &max);
+    uint8_t body[2];
+    ns_put_be16(body, (uint16_t)(max > NS_LEADERBOARD_K ? NS_LEADERBOARD_K : max));
+    uint64_t rid = ++g_req_id;
+    ns_header_t rh;
+    uint8_t *rb = NULL;
+    uint32_t rbl = 0;
+    if (send_and_wait(g_fd, OP_LEADERBOARD, rid, body, 2, &rh, &rb, &rbl) != 0) {
+      printf("Failed to query leaderboard\n");
+      return;
+    }
+    uint16_t st = ns_be16(&rh.status);
+    uint16_t count = rbl >= 2 ? ns_be16(rb) : 0;
+    if (st != ST_OK || rbl < 2u + (uint32_t)count * NS_LEADERBOARD_REC) {
+      printf("Failed to query leaderboard: status=%u\n", st);
+      free(rb);
+      return;
+    }
+    for (uint16_t i = 0; i < count; i++) {
+      const uint8_t *r = rb + 2u + (size_t)i * NS_LEADERBOARD_REC;
+      printf("  %2u. user %u: %ld\n", i + 1u, ns_be32(r), (int64_t)ns_be64(r + 4));
+    }
+    free(rb);
+    return;
+  }
+
+  if (strcmp(cmd, "history") == 0) {
+    unsigned int max = 10;
+    (void)sscanf(line, "history %u", &max);
+    uint8_t body[2];
+    ns_put_be16(body, (uint16_t)(max > NS_TXN_HISTORY_MAX ? NS_TXN_HISTORY_MAX : max));
+    uint64_t rid = ++g_req_id;
+    ns_header_t rh;
+    uint8_t *rb = NULL;
+    uint32_t rbl = 0;
+    if (send_and_wait(g_fd, OP_TXN_HISTORY, rid, body, 2, &rh, &rb, &rbl) != 0) {
+      printf("Failed to query history\n");
+      return;
+    }
+    uint16_t st = ns_be16(&rh.status);
+    uint16_t count = rbl >= 2 ? ns_be16(rb) : 0;
+    if (st != ST_OK || rbl < 2u + (uint32_t)count * NS_TXN_HISTORY_REC) {
+      printf("Failed to query history: status=%u\n", st);
+      free(rb);
+      return;
+    }
+    printf("Last %u transactions:\n", count);
+    for (uint16_t i = 0; i < count; i++) {
+      const uint8_t *r = rb + 2u + (size_t)i * NS_TXN_HISTORY_REC;
+      printf("  #%llu op=0x%04x status=%u %u -> %u amount=%ld asset=%u\n", (unsigned long long)ns_be64(r),
+             ns_be16(r + 16), ns_be16(r + 18), ns_be32(r + 20), ns_be32(r + 24), (int64_t)ns_be64(r + 28), r[36]);
+    }
+    free(rb);
+    return;
+  }
+
+  if (strcmp(cmd, "watch") == 0) {
+    char arg[8] = "on";
+    (void)sscanf(line, "watch %7s", arg);
+    bool on = strcmp(arg, "off") != 0;
+    uint8_t body[1] = {on ? 1u : 0u};
+    uint64_t rid = ++g_req_id;
+    ns_header_t rh;
+    uint8_t *rb = NULL;
+    uint32_t rbl = 0;
+    if (send_and_wait(g_fd, OP_BALANCE_SUBSCRIBE, rid, body, 1, &rh, &rb, &rbl) != 0) {
+      printf("Failed to change balance updates\n");
+      return;
+    }
+    uint16_t st = ns_be16(&rh.status);
+    if (st == ST_OK && rbl >= 8) {
+      printf("Balance updates %s (balance: %ld)\n", on ? "on" : "off", (int64_t)ns_be64(rb));
+    } else {
+      printf("Failed to change balance updates: status=%u\n", st);
+    }
+    free(rb);
+    return;
+  }
+
   if (strncmp(cmd, "deposit", 7) == 0) {
     int64_t amount = 0;
-    if (sscanf(line, "deposit %ld", &amount) != 1 || amount <= 0) {
-      printf("Usage: deposit <amount>\n");
+    unsigned int asset = NS_ASSET_CASH;
+    int got = sscanf(line, "deposit %ld %u", &amount, &asset);
+    if (got < 1 || amount <= 0) {
+      printf("Usage: deposit <amount> [asset]\n");
       return;
     }
-    uint8_t body[8];
+    uint8_t body[9];
     ns_put_be64(body, (uint64_t)amount);
+    body[8] = (uint8_t)asset;
     uint64_t rid = ++g_req_id;
     ns_header_t rh;
     uint8_t *rb = NULL;
     uint32_t rbl = 0;
-    if (send_and_wait(g_fd, OP_DEPOSIT, rid, body, 8, &rh, &rb, &rbl) != 0) {
+    if (send_and_wait(g_fd, OP_DEPOSIT, rid, body, got == 2 ? 9u : 8u, &rh, &rb, &rbl) != 0) {
       printf("Failed to deposit\n");
       return;
     }
@@ -516,17 +708,20 @@ static void handle_command(const char *line) {
 
   if (strncmp(cmd, "withdraw", 8) == 0) {
     int64_t amount = 0;
-    if (sscanf(line, "withdraw %ld", &amount) != 1 || amount <= 0) {
-      printf("Usage: withdraw <amount>\n");
+    unsigned int asset = NS_ASSET_CASH;
+    int got = sscanf(line, "withdraw %ld %u", &amount, &asset);
+    if (got < 1 || amount <= 0) {
+      printf("Usage: withdraw <amount> [asset]\n");
       return;
     }
-    uint8_t body[8];
+    uint8_t body[9];
     ns_put_be64(body, (uint64_t)amount);
+    body[8] = (uint8_t)asset;
     uint64_t rid = ++g_req_id;
     ns_header_t rh;
     uint8_t *rb = NULL;
     uint32_t rbl = 0;
-    if (send_and_wait(g_fd, OP_WITHDRAW, rid, body, 8, &rh, &rb, &rbl) != 0) {
+    if (send_and_wait(g_fd, OP_WITHDRAW, rid, body, got == 2 ? 9u : 8u, &rh, &rb, &rbl) != 0) {
       printf("Failed to withdraw\n");
       return;
     }
@@ -546,18 +741,21 @@ static void handle_command(const char *line) {
   if (strncmp(cmd, "transfer", 8) == 0) {
     uint32_t to_uid = 0;
     int64_t amount = 0;
-    if (sscanf(line, "transfer %u %ld", &to_uid, &amount) != 2 || amount <= 0) {
-      printf("Usage: transfer <user_id> <amount>\n");
+    unsigned int asset = NS_ASSET_CASH;
+    int got = sscanf(line, "transfer %u %ld %u", &to_uid, &amount, &asset);
+    if (got < 2 || amount <= 0) {
+      printf("Usage: transfer <user_id> <amount> [asset]\n");
       return;
     }
-    uint8_t body[12];
+    uint8_t body[13];
     ns_put_be32(body + 0, to_uid);
     ns_put_be64(body + 4, (uint64_t)amount);
+    body[12] = (uint8_t)asset;
     uint64_t rid = ++g_req_id;
     ns_header_t rh;
     uint8_t *rb = NULL;
     uint32_t rbl = 0;
-    if (send_and_wait(g_fd, OP_TRANSFER, rid, body, 12, &rh, &rb, &rbl) != 0) {
+    if (send_and_wait(g_fd, OP_TRANSFER, rid, body, got == 3 ? 13u : 12u, &rh, &rb, &rbl) != 0) {
       printf("Failed to transfer\n");
       return;
     }
@@ -7,6 +7,7 @@
 #include "stats.h"
 
 #include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -16,11 +17,28 @@
 #include <time.h>
 #include <unistd.h>
 
+// Largest request body the load generator builds (CHAT_SEND: 4-byte prefix + 512-byte message)
+#define CHAT_BODY_MAX (4u + 512u)
+#define REQ_BODY_MAX (2u + NS_TRANSFER_MULTI_MAX * NS_TRANSFER_LEG_BYTES) // a full TRANSFER_MULTI
+// Chat messages start with "t=<16 hex digits CLOCK_MONOTONIC ns>;" when long enough,
+// so push listeners can measure send -> delivery latency.
+#define CHAT_TS_LEN 19u
+// orders mix: limit prices are the mid +/- 10 ticks
+#define ORDER_MID_PRICE 100u
+// md mix: ticks go to this many symbols after the order-book ones
+#define MD_MIX_SYMBOLS 16u
+// --rate: send times of in-flight requests, indexed by req_id modulo this
+#define OPEN_LOOP_SLOTS 65536u
+
 typedef enum
 {
   MIX_MIXED = 0,
   MIX_TRADE_HEAVY = 1,
   MIX_CHAT_HEAVY = 2,
+  MIX_DM_HEAVY = 3, // direct messages to the push listeners
+  MIX_SETTLE = 4,   // only transfers of --legs legs each (TRANSFER_MULTI, or TRANSFER for 1 leg)
+  MIX_ORDERS = 5,   // only ORDER_PLACE, random side around a fixed mid price (most orders cross)
+  MIX_MD = 6,       // only MD_PUBLISH ticks; the push listeners subscribe to every symbol
 } mix_t;
 
 typedef struct
@@ -35,10 +53,35 @@ typedef struct
   int duration_s;
   mix_t mix;
   int payload_size; // For CHAT_SEND payload size (bytes)
+  int pipeline;     // Requests in flight per connection (1 = request/response)
+  int legs;         // settle mix: legs per transfer request
+  uint32_t deadline_ms; // deadline carried by load requests (0 = none)
+  double rate;      // open loop: this thread's requests per second (0 = closed loop)
+  uint64_t dropped; // open loop: requests not sent because the socket buffer was full
 
   bool encrypt_payload; // Whether to enable demo XOR encryption
+  // Ledger ops carry NS_FLAG_IDEMPOTENT and one that times out is resent, same req_id, on a new connection
+  bool idempotent;
+  uint64_t retries;
+  ns_integrity_t integrity; // Requested in HELLO; server may downgrade to FULL
+  ns_integrity_t granted;   // Mode the server actually granted (reported in CSV)
+
+  // Push listener: one idle connection in the room that only reads chat pushes.
+  // stats.lat_us then holds delivery latencies instead of request latencies.
+  bool listener;
+  uint64_t push_events;
+  uint64_t push_frames;
+  uint64_t md_version[NS_MD_SYMBOLS]; // md mix: last MD_UPDATE version seen per symbol
+
+  // Listener user ids (UINT32_MAX until logged in), shared by all threads: dm-heavy targets.
+  uint32_t *dm_targets;
+  int ndm_targets;
+  int listener_idx; // a listener's slot in dm_targets
 
   stats_t stats;
+  // orders mix: latency of ORDER_PLACE requests that matched something, and units filled
+  stats_t match;
+  uint64_t filled;
 } thread_ctx_t;
 
 static void sleep_ms(int ms)
@@ -131,47 +174,42 @@ static int read_frame(int fd, ns_header_t *out_hdr, uint8_t **out_body, uint32_t
   return 0;
 }
 
-static int send_frame(int fd, uint16_t opcode, uint64_t req_id, const uint8_t *body, uint32_t body_len, bool encrypt)
+// Encode header + (optionally encrypted) body into out, which must hold
+// sizeof(ns_header_t) + body_len bytes. Returns the frame length.
+static size_t encode_frame(uint8_t *out, uint16_t opcode, uint64_t req_id, const uint8_t *body, uint32_t body_len,
+                           bool encrypt, ns_integrity_t integrity, uint8_t extra_flags, uint32_t deadline_ms)
 {
-  uint8_t hdrbuf[sizeof(ns_header_t)];
-  ns_header_t hdr;
-  const uint8_t *payload = body;
-  uint8_t *tmp = NULL;
-  uint8_t flags = 0;
-
+  uint8_t *payload = out + sizeof(ns_header_t);
+  uint8_t flags = (uint8_t)(ns_integrity_flags(integrity) | extra_flags);
+  if (body_len && body)
+    memcpy(payload, body, body_len);
   if (encrypt && body_len > 0 && body)
   {
-    tmp = (uint8_t *)malloc(body_len);
-    if (!tmp)
-      return -1;
-    memcpy(tmp, body, body_len);
-    ns_xor_crypt(tmp, body_len, NS_XOR_KEY);
-    payload = tmp;
+    ns_xor_crypt(payload, body_len, NS_XOR_KEY);
     flags |= NS_FLAG_ENCRYPTED;
   }
 
-  ns_build_header(&hdr, flags, opcode, ST_OK, req_id, payload, body_len);
-  memcpy(hdrbuf, &hdr, sizeof(hdr));
-  if (write_full(fd, hdrbuf, sizeof(hdrbuf)) != 0)
-  {
-    free(tmp);
-    return -1;
-  }
-  if (body_len && write_full(fd, payload, body_len) != 0)
-  {
-    free(tmp);
-    return -1;
-  }
-  free(tmp);
-  return 0;
+  ns_header_t hdr;
+  ns_build_header_deadline(&hdr, flags, opcode, req_id, deadline_ms, payload, body_len);
+  memcpy(out, &hdr, sizeof(hdr));
+  return sizeof(hdr) + body_len;
 }
 
-static int send_and_wait(int fd, uint16_t opcode, uint64_t req_id, const uint8_t *body, uint32_t body_len,
-                         ns_header_t *out_hdr, uint8_t **out_body, uint32_t *out_body_len, bool encrypt)
+static int send_frame(int fd, uint16_t opcode, uint64_t req_id, const uint8_t *body, uint32_t body_len, bool encrypt,
+                      ns_integrity_t integrity, uint8_t extra_flags, uint32_t deadline_ms)
 {
-  if (send_frame(fd, opcode, req_id, body, body_len, encrypt) != 0)
+  uint8_t *frame = (uint8_t *)malloc(sizeof(ns_header_t) + body_len);
+  if (!frame)
     return -1;
+  size_t len = encode_frame(frame, opcode, req_id, body, body_len, encrypt, integrity, extra_flags, deadline_ms);
+  int rc = write_full(fd, frame, len);
+  free(frame);
+  return rc;
+}
 
+// Read the next response frame, skipping server pushes (req_id == 0).
+static int recv_response(int fd, ns_header_t *out_hdr, uint8_t **out_body, uint32_t *out_body_len)
+{
   while (true)
   {
     ns_header_t rh;
@@ -187,15 +225,35 @@ static int send_and_wait(int fd, uint16_t opcode, uint64_t req_id, const uint8_t
       return -1;
     }
 
-    uint16_t rop = ns_be16(&rh.opcode);
-    uint64_t rrid = ns_be64(&rh.req_id);
-    if (rop == OP_CHAT_BROADCAST && rrid == 0)
+    if (ns_be64(&rh.req_id) == 0)
     {
-      // server push, ignore for sync request-response
+      // server push, ignore for request-response accounting
       free(rb);
       continue;
     }
-    if (rrid != req_id)
+
+    *out_hdr = rh;
+    *out_body = rb;
+    *out_body_len = rbl;
+    return 0;
+  }
+}
+
+static int send_and_wait(int fd, uint16_t opcode, uint64_t req_id, const uint8_t *body, uint32_t body_len,
+                         ns_header_t *out_hdr, uint8_t **out_body, uint32_t *out_body_len, bool encrypt,
+                         ns_integrity_t integrity, uint8_t extra_flags, uint32_t deadline_ms)
+{
+  if (send_frame(fd, opcode, req_id, body, body_len, encrypt, integrity, extra_flags, deadline_ms) != 0)
+    return -1;
+
+  while (true)
+  {
+    ns_header_t rh;
+    uint8_t *rb = NULL;
+    uint32_t rbl = 0;
+    if (recv_response(fd, &rh, &rb, &rbl) != 0)
+      return -1;
+    if (ns_be64(&rh.req_id) != req_id)
     {
       // unexpected frame; ignore for now
       free(rb);
@@ -209,21 +267,24 @@ static int send_and_wait(int fd, uint16_t opcode, uint64_t req_id, const uint8_t
   }
 }
 
-static int do_handshake_login(int fd, const char *username, uint32_t *out_user_id, uint64_t *inout_req_id)
+static int do_handshake_login(int fd, const char *username, uint32_t *out_user_id, uint64_t *inout_req_id,
+                              ns_integrity_t *inout_integrity)
 {
-  // HELLO -> nonce
+  // HELLO(u8 integrity mode) -> nonce + granted mode
   ns_header_t rh;
   uint8_t *rb = NULL;
   uint32_t rbl = 0;
+  uint8_t want = (uint8_t)*inout_integrity;
   uint64_t rid = ++(*inout_req_id);
-  if (send_and_wait(fd, OP_HELLO, rid, NULL, 0, &rh, &rb, &rbl, false) != 0)
+  if (send_and_wait(fd, OP_HELLO, rid, &want, 1, &rh, &rb, &rbl, false, NS_INTEGRITY_FULL, 0, 0) != 0)
     return -1;
-  if (ns_be16(&rh.status) != ST_OK || rbl != 8)
+  if (ns_be16(&rh.status) != ST_OK || rbl < 8)
   {
     free(rb);
     return -1;
   }
   uint64_t nonce = ns_be64(rb);
+  *inout_integrity = (rbl >= 9 && rb[8] < NS_INTEGRITY_COUNT) ? (ns_integrity_t)rb[8] : NS_INTEGRITY_FULL;
   free(rb);
 
   // LOGIN: u16 uname_len + uname + u32 token
@@ -240,7 +301,7 @@ static int do_handshake_login(int fd, const char *username, uint32_t *out_user_i
   ns_put_be32(body + 2 + ulen, token);
 
   rid = ++(*inout_req_id);
-  if (send_and_wait(fd, OP_LOGIN, rid, body, (uint32_t)(2u + ulen + 4u), &rh, &rb, &rbl, false) != 0)
+  if (send_and_wait(fd, OP_LOGIN, rid, body, (uint32_t)(2u + ulen + 4u), &rh, &rb, &rbl, false, *inout_integrity, 0, 0) != 0)
     return -1;
   if (ns_be16(&rh.status) != ST_OK || rbl < 4)
   {
@@ -252,7 +313,7 @@ static int do_handshake_login(int fd, const char *username, uint32_t *out_user_i
   return 0;
 }
 
-static int do_join_room(int fd, uint16_t room, uint64_t *inout_req_id)
+static int do_join_room(int fd, uint16_t room, uint64_t *inout_req_id, ns_integrity_t integrity)
 {
   uint8_t body[2];
   ns_put_be16(body, room);
@@ -260,13 +321,561 @@ static int do_join_room(int fd, uint16_t room, uint64_t *inout_req_id)
   uint8_t *rb = NULL;
   uint32_t rbl = 0;
   uint64_t rid = ++(*inout_req_id);
-  if (send_and_wait(fd, OP_JOIN_ROOM, rid, body, 2, &rh, &rb, &rbl, false) != 0)
+  if (send_and_wait(fd, OP_JOIN_ROOM, rid, body, 2, &rh, &rb, &rbl, false, integrity, 0, 0) != 0)
     return -1;
   uint16_t st = ns_be16(&rh.status);
   free(rb);
   return st == ST_OK ? 0 : -1;
 }
 
+// Pick an opcode by workload mix and fill its body; returns body length.
+static uint32_t make_request(thread_ctx_t *ctx, uint64_t *rng, uint32_t user_id, uint16_t *out_opcode, uint8_t *body)
+{
+  uint64_t r = xorshift64(rng);
+  uint16_t opcode = OP_BALANCE;
+  uint32_t body_len = 0;
+
+  // Pick opcode by mix
+  uint32_t pick = (uint32_t)(r % 100u);
+  if (ctx->mix == MIX_TRADE_HEAVY)
+  {
+    opcode = (pick < 40) ? OP_TRANSFER : (pick < 70) ? OP_WITHDRAW
+                                     : (pick < 90)   ? OP_DEPOSIT
+                                                     : OP_BALANCE;
+  }
+  else if (ctx->mix == MIX_CHAT_HEAVY)
+  {
+    opcode = (pick < 70) ? OP_CHAT_SEND : (pick < 85) ? OP_BALANCE
+                                                      : OP_TRANSFER;
+  }
+  else if (ctx->mix == MIX_SETTLE)
+  {
+    opcode = ctx->legs > 1 ? OP_TRANSFER_MULTI : OP_TRANSFER;
+  }
+  else if (ctx->mix == MIX_ORDERS)
+  {
+    opcode = OP_ORDER_PLACE;
+  }
+  else if (ctx->mix == MIX_MD)
+  {
+    opcode = OP_MD_PUBLISH;
+  }
+  else if (ctx->mix == MIX_DM_HEAVY)
+  {
+    opcode = (pick < 70) ? OP_DIRECT_MSG : (pick < 85) ? OP_BALANCE
+                                                       : OP_TRANSFER;
+  }
+  else
+  {
+    opcode = (pick < 30) ? OP_CHAT_SEND : (pick < 55) ? OP_TRANSFER
+                                      : (pick < 75)   ? OP_WITHDRAW
+                                      : (pick < 90)   ? OP_DEPOSIT
+                                                      : OP_BALANCE;
+  }
+
+  if (opcode == OP_CHAT_SEND)
+  {
+    // Generate message with specified payload size
+    // Body: u16 room_id + u16 msg_len + msg_bytes
+    // Total body = 4 + msg_len, so msg_len = payload_size - 4 (min 1)
+    uint16_t target_msg_len = (ctx->payload_size > 4) ? (uint16_t)(ctx->payload_size - 4) : 1;
+    if (target_msg_len > CHAT_BODY_MAX - 4u)
+      target_msg_len = CHAT_BODY_MAX - 4u; // Limit to buffer size
+
+    ns_put_be16(body + 0, (uint16_t)ctx->room_id);
+    ns_put_be16(body + 2, target_msg_len);
+    // Fill message with pattern (repeating "x" or random data)
+    for (uint16_t j = 0; j < target_msg_len; j++)
+    {
+      body[4 + j] = (uint8_t)('a' + (j % 26));
+    }
+    if (target_msg_len >= CHAT_TS_LEN)
+    {
+      char ts[CHAT_TS_LEN + 1];
+      snprintf(ts, sizeof(ts), "t=%016llx;", (unsigned long long)now_ns());
+      memcpy(body + 4, ts, CHAT_TS_LEN);
+    }
+    body_len = 4u + target_msg_len;
+  }
+  else if (opcode == OP_DIRECT_MSG)
+  {
+    // Body: u32 to_user_id + u16 msg_len + msg; without a logged-in listener yet, ask for the balance.
+    uint32_t to = UINT32_MAX;
+    if (ctx->ndm_targets > 0)
+      to = __atomic_load_n(&ctx->dm_targets[xorshift64(rng) % (uint64_t)ctx->ndm_targets], __ATOMIC_RELAXED);
+    if (to == UINT32_MAX)
+    {
+      opcode = OP_BALANCE;
+    }
+    else
+    {
+      uint16_t mlen = (ctx->payload_size > 6) ? (uint16_t)(ctx->payload_size - 6) : 1;
+      if (mlen > CHAT_BODY_MAX - 6u)
+        mlen = CHAT_BODY_MAX - 6u;
+      ns_put_be32(body + 0, to);
+      ns_put_be16(body + 4, mlen);
+      for (uint16_t j = 0; j < mlen; j++)
+        body[6 + j] = (uint8_t)('a' + (j % 26));
+      if (mlen >= CHAT_TS_LEN)
+      {
+        char ts[CHAT_TS_LEN + 1];
+        snprintf(ts, sizeof(ts), "t=%016llx;", (unsigned long long)now_ns());
+        memcpy(body + 6, ts, CHAT_TS_LEN);
+      }
+      body_len = 6u + mlen;
+    }
+  }
+  else if (opcode == OP_DEPOSIT || opcode == OP_WITHDRAW)
+  {
+    uint64_t amt = (xorshift64(rng) % 100u) + 1u;
+    ns_put_be64(body + 0, amt);
+    body_len = 8;
+  }
+  else if (opcode == OP_ORDER_PLACE)
+  {
+    // u8 symbol + u8 side + u8 flags + u32 price + u32 qty; a quarter are IOC so the books stay shallow
+    uint64_t x = xorshift64(rng);
+    body[0] = (uint8_t)(x % NS_BOOK_SYMBOLS);
+    body[1] = (uint8_t)((x >> 8u) & 1u);
+    body[2] = ((x >> 9u) & 3u) == 0 ? (uint8_t)NS_ORDER_IOC : 0u;
+    ns_put_be32(body + 3, ORDER_MID_PRICE - 10u + (uint32_t)((x >> 16u) % 21u));
+    ns_put_be32(body + 7, 1u + (uint32_t)((x >> 32u) % 10u));
+    body_len = 11;
+  }
+  else if (opcode == OP_MD_PUBLISH)
+  {
+    // u8 symbol + u32 bid + u32 ask + u32 last_price + u32 last_qty
+    uint64_t x = xorshift64(rng);
+    uint32_t px = 1000u + (uint32_t)((x >> 8u) % 100u);
+    body[0] = (uint8_t)(NS_BOOK_SYMBOLS + (uint32_t)(x % MD_MIX_SYMBOLS));
+    ns_put_be32(body + 1, px - 1u);
+    ns_put_be32(body + 5, px + 1u);
+    ns_put_be32(body + 9, px);
+    ns_put_be32(body + 13, 1u + (uint32_t)((x >> 32u) % 10u));
+    body_len = 17;
+  }
+  else if (opcode == OP_TRANSFER_MULTI)
+  {
+    // One unit to each of --legs random accounts, applied as one batch
+    ns_put_be16(body + 0, (uint16_t)ctx->legs);
+    for (int k = 0; k < ctx->legs; k++)
+    {
+      uint32_t to = (uint32_t)(xorshift64(rng) % NS_MAX_USERS);
+      ns_put_be32(body + 2u + (size_t)k * NS_TRANSFER_LEG_BYTES, to == user_id ? (to + 1) % NS_MAX_USERS : to);
+      ns_put_be64(body + 6u + (size_t)k * NS_TRANSFER_LEG_BYTES, 1u);
+    }
+    body_len = 2u + (uint32_t)ctx->legs * NS_TRANSFER_LEG_BYTES;
+  }
+  else if (opcode == OP_TRANSFER && ctx->mix == MIX_SETTLE)
+  {
+    uint32_t to = (uint32_t)(xorshift64(rng) % NS_MAX_USERS);
+    ns_put_be32(body + 0, to == user_id ? (to + 1) % NS_MAX_USERS : to);
+    ns_put_be64(body + 4, 1u);
+    body_len = 12;
+  }
+  else if (opcode == OP_TRANSFER)
+  {
+    uint32_t to = (uint32_t)(xorshift64(rng) % NS_MAX_USERS);
+    if (to == user_id)
+      to = (to + 1) % NS_MAX_USERS;
+    uint64_t amt = (xorshift64(rng) % 50u) + 1u;
+    ns_put_be32(body + 0, to);
+    ns_put_be64(body + 4, amt);
+    body_len = 12;
+  }
+  else
+  {
+    body_len = 0;
+  }
+
+  *out_opcode = opcode;
+  return body_len;
+}
+
+static uint8_t ledger_flags(const thread_ctx_t *ctx, uint16_t opcode)
+{
+  if (!ctx->idempotent)
+    return 0;
+  return (opcode == OP_DEPOSIT || opcode == OP_WITHDRAW || opcode == OP_TRANSFER || opcode == OP_TRANSFER_MULTI)
+             ? (uint8_t)NS_FLAG_IDEMPOTENT
+             : 0u;
+}
+
+static void record_status(thread_ctx_t *ctx, uint16_t st, uint32_t *backoff)
+{
+  if (st == ST_OK)
+  {
+    ctx->stats.ok++;
+    *backoff = 0; // Reset backoff on success
+  }
+  else if (st == ST_ERR_SERVER_BUSY)
+  {
+    ctx->stats.err++;
+    ctx->stats.err_server_busy++;
+    // Exponential backoff: start at 10ms, double each time, max 1000ms
+    if (*backoff == 0)
+      *backoff = 10;
+    else
+    {
+      *backoff *= 2;
+      if (*backoff > 1000)
+        *backoff = 1000;
+    }
+  }
+  else
+  {
+    ctx->stats.err++;
+    switch (st)
+    {
+    case ST_ERR_BAD_PACKET:
+      ctx->stats.err_bad_packet++;
+      break;
+    case ST_ERR_CHECKSUM_FAIL:
+      ctx->stats.err_checksum_fail++;
+      break;
+    case ST_ERR_UNAUTHORIZED:
+      ctx->stats.err_unauthorized++;
+      break;
+    case ST_ERR_NOT_FOUND:
+      ctx->stats.err_not_found++;
+      break;
+    case ST_ERR_INSUFFICIENT_FUNDS:
+      ctx->stats.err_insufficient_funds++;
+      break;
+    case ST_ERR_TIMEOUT:
+      ctx->stats.err_timeout++;
+      break;
+    case ST_ERR_INTERNAL:
+      ctx->stats.err_internal++;
+      break;
+    default:
+      break;
+    }
+    *backoff = 0;
+  }
+}
+
+// Pipelined round: send ctx->pipeline requests in a single write, then collect
+// every response (matched by req_id, in any order). Latency counts from the send.
+static int run_pipelined(thread_ctx_t *ctx, int fd, uint64_t *rng, uint32_t user_id, uint64_t *inout_req_id,
+                         ns_integrity_t integrity, uint32_t *backoff, uint8_t *batch, uint8_t *done)
+{
+  size_t depth = (size_t)ctx->pipeline;
+  uint64_t first = *inout_req_id + 1u;
+  size_t off = 0;
+  for (size_t k = 0; k < depth; k++)
+  {
+    uint16_t opcode = OP_BALANCE;
+    uint8_t body[REQ_BODY_MAX];
+    uint32_t body_len = make_request(ctx, rng, user_id, &opcode, body);
+    off += encode_frame(batch + off, opcode, ++(*inout_req_id), body_len ? body : NULL, body_len,
+                        ctx->encrypt_payload, integrity, ledger_flags(ctx, opcode), ctx->deadline_ms);
+  }
+  memset(done, 0, depth);
+
+  uint64_t t0 = now_ns();
+  if (write_full(fd, batch, off) != 0)
+    return -1;
+
+  size_t pending = depth;
+  while (pending > 0)
+  {
+    ns_header_t rh;
+    uint8_t *rb = NULL;
+    uint32_t rbl = 0;
+    if (recv_response(fd, &rh, &rb, &rbl) != 0)
+      return -1;
+    uint64_t rid = ns_be64(&rh.req_id);
+    free(rb);
+    if (rid < first || rid - first >= depth || done[rid - first])
+      continue;
+    done[rid - first] = 1;
+    pending--;
+
+    (void)stats_push_latency_us(&ctx->stats, (now_ns() - t0) / 1000ull);
+    record_status(ctx, ns_be16(&rh.status), backoff);
+  }
+  return 0;
+}
+
+// Open loop (--rate): send on a fixed schedule, round-robin over the connections, whatever the
+// responses do, so the offered load can exceed what the server sustains. Latency counts from the
+// scheduled send time, so a request that waited behind a late send is not measured as fast.
+// A request whose socket buffer is full is dropped (counted as err_timeout) rather than blocking
+// the schedule. Requests still in flight at the end are not counted.
+static void run_open_loop(thread_ctx_t *ctx, int *fds, const uint32_t *user_ids, uint64_t *req_ids,
+                          const ns_integrity_t *modes, uint64_t *rng, uint64_t end_ns)
+{
+  uint64_t *sent_at = (uint64_t *)calloc(OPEN_LOOP_SLOTS, sizeof(uint64_t));
+  struct pollfd *pfds = (struct pollfd *)calloc((size_t)ctx->conns, sizeof(struct pollfd));
+  if (!sent_at || !pfds)
+  {
+    free(sent_at);
+    free(pfds);
+    return;
+  }
+
+  // One req_id sequence for the whole thread keeps the slots unique across connections.
+  uint64_t seq = 0;
+  for (int i = 0; i < ctx->conns; i++)
+  {
+    if (req_ids[i] > seq)
+      seq = req_ids[i];
+  }
+  const uint64_t interval_ns = (uint64_t)(1e9 / ctx->rate) ? (uint64_t)(1e9 / ctx->rate) : 1u;
+  uint64_t next_ns = now_ns();
+  uint32_t unused_backoff = 0;
+  int rr = 0;
+
+  while (true)
+  {
+    uint64_t now = now_ns();
+    if (now >= end_ns)
+      break;
+
+    while (next_ns <= now)
+    {
+      int i = -1;
+      for (int k = 0; k < ctx->conns && i < 0; k++)
+      {
+        if (fds[(rr + k) % ctx->conns] >= 0)
+          i = (rr + k) % ctx->conns;
+      }
+      if (i < 0)
+        goto out;
+      rr = (i + 1) % ctx->conns;
+
+      uint16_t opcode = OP_BALANCE;
+      uint8_t body[REQ_BODY_MAX];
+      uint8_t frame[sizeof(ns_header_t) + REQ_BODY_MAX];
+      uint32_t body_len = make_request(ctx, rng, user_ids[i], &opcode, body);
+      uint64_t rid = req_ids[i] = ++seq;
+      size_t len = encode_frame(frame, opcode, rid, body_len ? body : NULL, body_len, ctx->encrypt_payload, modes[i],
+                                ledger_flags(ctx, opcode), ctx->deadline_ms);
+      ssize_t n = send(fds[i], frame, len, MSG_DONTWAIT);
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      {
+        ctx->dropped++;
+        ctx->stats.err++;
+        ctx->stats.err_timeout++;
+      }
+      else if (n < 0 || (n < (ssize_t)len && write_full(fds[i], frame + n, len - (size_t)n) != 0))
+      {
+        ctx->stats.err++;
+        close(fds[i]);
+        fds[i] = -1;
+      }
+      else
+      {
+        sent_at[rid % OPEN_LOOP_SLOTS] = next_ns;
+      }
+      next_ns += interval_ns;
+    }
+
+    // Collect whatever arrives until the next send is due.
+    for (int i = 0; i < ctx->conns; i++)
+    {
+      pfds[i].fd = fds[i];
+      pfds[i].events = POLLIN;
+      pfds[i].revents = 0;
+    }
+    uint64_t wait_ns = (next_ns < end_ns ? next_ns : end_ns) - now;
+    if (poll(pfds, (nfds_t)ctx->conns, (int)((wait_ns + 999999u) / 1000000u)) <= 0)
+      continue;
+    for (int i = 0; i < ctx->conns; i++)
+    {
+      if (fds[i] < 0 || !(pfds[i].revents & (POLLIN | POLLERR | POLLHUP)))
+        continue;
+      ns_header_t rh;
+      uint8_t *rb = NULL;
+      uint32_t rbl = 0;
+      // One frame per wakeup: waiting for a response behind a push would stall the schedule.
+      if (read_frame(fds[i], &rh, &rb, &rbl) != 0 || !ns_validate_header_basic(&rh, 65536) ||
+          !ns_validate_checksum(&rh, rb, rbl))
+      {
+        free(rb);
+        ctx->stats.err++;
+        close(fds[i]);
+        fds[i] = -1;
+        continue;
+      }
+      free(rb);
+      if (ns_be64(&rh.req_id) == 0)
+        continue;
+      uint64_t *slot = &sent_at[ns_be64(&rh.req_id) % OPEN_LOOP_SLOTS];
+      if (*slot == 0)
+        continue;
+      (void)stats_push_latency_us(&ctx->stats, (now_ns() - *slot) / 1000ull);
+      *slot = 0;
+      record_status(ctx, ns_be16(&rh.status), &unused_backoff);
+    }
+  }
+out:
+  free(sent_at);
+  free(pfds);
+}
+
+// Count one pushed message and, if it carries a send timestamp, its delivery latency.
+static void on_push_message(thread_ctx_t *ctx, const char *msg, uint16_t mlen, uint64_t now)
+{
+  ctx->push_events++;
+  if (mlen >= CHAT_TS_LEN && msg[0] == 't' && msg[1] == '=' && msg[CHAT_TS_LEN - 1] == ';')
+  {
+    char hex[17];
+    memcpy(hex, msg + 2, 16);
+    hex[16] = '\0';
+    uint64_t sent = (uint64_t)strtoull(hex, NULL, 16);
+    if (sent != 0 && sent <= now)
+      (void)stats_push_latency_us(&ctx->stats, (now - sent) / 1000ull);
+  }
+}
+
+// Account one CHAT_BROADCAST record (u16 room + u32 from + u16 len + msg + u64 seq); returns its size, 0 if malformed.
+static size_t on_chat_record(thread_ctx_t *ctx, const uint8_t *p, size_t n, uint64_t now)
+{
+  if (n < 16)
+    return 0;
+  uint16_t mlen = ns_be16(p + 6);
+  if ((size_t)mlen + 16u > n)
+    return 0;
+  on_push_message(ctx, (const char *)(p + 8), mlen, now);
+  return 16u + (size_t)mlen;
+}
+
+static void on_push(thread_ctx_t *ctx, const ns_header_t *hdr, const uint8_t *body, uint32_t body_len)
+{
+  uint16_t opcode = ns_be16(&hdr->opcode);
+  uint64_t now = now_ns();
+  if (opcode == OP_CHAT_BROADCAST)
+  {
+    ctx->push_frames++;
+    (void)on_chat_record(ctx, body, body_len, now);
+  }
+  else if (opcode == OP_CHAT_BROADCAST_BATCH && body_len >= 2)
+  {
+    // u16 count + count CHAT_BROADCAST bodies back to back
+    ctx->push_frames++;
+    uint16_t count = ns_be16(body);
+    size_t off = 2;
+    for (uint16_t k = 0; k < count; k++)
+    {
+      size_t used = on_chat_record(ctx, body + off, body_len - off, now);
+      if (used == 0)
+        break;
+      off += used;
+    }
+  }
+  else if (opcode == OP_MD_UPDATE && body_len >= NS_MD_UPDATE_BODY && body[0] < NS_MD_SYMBOLS)
+  {
+    // One frame per symbol however many ticks it covers: events counts the ticks, frames the updates.
+    uint64_t version = ns_be64(body + 25);
+    uint64_t ts = ns_be64(body + 33);
+    uint64_t *last = &ctx->md_version[body[0]];
+    ctx->push_frames++;
+    ctx->push_events += (*last != 0 && version > *last) ? version - *last : 1u;
+    *last = version;
+    if (ts != 0 && ts <= now)
+      (void)stats_push_latency_us(&ctx->stats, (now - ts) / 1000ull);
+  }
+  else if (opcode == OP_DIRECT_PUSH && body_len >= 6)
+  {
+    // u32 from_user_id + u16 msg_len + msg
+    uint16_t mlen = ns_be16(body + 4);
+    ctx->push_frames++;
+    if ((size_t)mlen + 6u <= body_len)
+      on_push_message(ctx, (const char *)(body + 6), mlen, now);
+  }
+}
+
+static void *listener_main(thread_ctx_t *ctx)
+{
+  int fd = net_connect_tcp(ctx->host, ctx->port, ctx->timeout_ms);
+  if (fd < 0)
+  {
+    ctx->stats.err++;
+    return NULL;
+  }
+  (void)net_set_tcp_nodelay(fd);
+  char uname[NS_MAX_USERNAME];
+  snprintf(uname, sizeof(uname), "listen%d", ctx->thread_id);
+  uint32_t user_id = 0;
+  uint64_t req_id = 0;
+  ns_integrity_t mode = ctx->integrity;
+  if (do_handshake_login(fd, uname, &user_id, &req_id, &mode) != 0 ||
+      do_join_room(fd, (uint16_t)ctx->room_id, &req_id, mode) != 0)
+  {
+    ctx->stats.err++;
+    close(fd);
+    return NULL;
+  }
+  if (ctx->mix == MIX_MD)
+  {
+    uint8_t all[8];
+    ns_put_be64(all, ~0ull);
+    ns_header_t sh;
+    uint8_t *sb = NULL;
+    uint32_t sbl = 0;
+    if (send_and_wait(fd, OP_MD_SUBSCRIBE, ++req_id, all, sizeof(all), &sh, &sb, &sbl, false, mode, 0, 0) != 0)
+    {
+      ctx->stats.err++;
+      close(fd);
+      return NULL;
+    }
+    free(sb);
+  }
+  __atomic_store_n(&ctx->dm_targets[ctx->listener_idx], user_id, __ATOMIC_RELAXED);
+  // Wake up periodically to notice the end of the run (and send a heartbeat, or the server drops us).
+  (void)net_set_timeouts_ms(fd, 200, ctx->timeout_ms);
+
+  uint64_t end_ns = now_ns() + (uint64_t)ctx->duration_s * 1000000000ull;
+  uint64_t next_hb = now_ns() + 5000000000ull;
+  while (now_ns() < end_ns)
+  {
+    if (now_ns() >= next_hb)
+    {
+      (void)send_frame(fd, OP_HEARTBEAT, ++req_id, NULL, 0, false, mode, 0, 0);
+      next_hb = now_ns() + 5000000000ull;
+    }
+    ns_header_t rh;
+    if (recv(fd, &rh, 1, MSG_PEEK) <= 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        continue;
+      break;
+    }
+    uint8_t *rb = NULL;
+    uint32_t rbl = 0;
+    if (read_frame(fd, &rh, &rb, &rbl) != 0)
+      break;
+    if (ns_validate_header_basic(&rh, 65536) && ns_validate_checksum(&rh, rb, rbl) && ns_be64(&rh.req_id) == 0)
+      on_push(ctx, &rh, rb, rbl);
+    free(rb);
+  }
+  close(fd);
+  return NULL;
+}
+
+// Connect, log in as this thread's i-th user and join the room. Returns the fd or -1.
+static int open_conn(thread_ctx_t *ctx, int i, uint32_t *user_id, uint64_t *inout_req_id, ns_integrity_t *mode)
+{
+  int fd = net_connect_tcp(ctx->host, ctx->port, ctx->timeout_ms);
+  if (fd < 0)
+    return -1;
+  (void)net_set_tcp_nodelay(fd);
+
+  char uname[NS_MAX_USERNAME];
+  snprintf(uname, sizeof(uname), "u%d_%d", ctx->thread_id, i);
+  *mode = ctx->integrity;
+  if (do_handshake_login(fd, uname, user_id, inout_req_id, mode) != 0 ||
+      do_join_room(fd, (uint16_t)ctx->room_id, inout_req_id, *mode) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  ctx->granted = *mode;
+  return fd;
+}
+
 static void *thread_main(void *arg)
 {
   thread_ctx_t *ctx = (thread_ctx_t *)arg;
@@ -275,57 +884,53 @@ static void *thread_main(void *arg)
   log_set_program(pname);
 
   stats_init(&ctx->stats);
+  if (ctx->listener)
+    return listener_main(ctx);
+  stats_init(&ctx->match);
 
   int *fds = (int *)calloc((size_t)ctx->conns, sizeof(int));
   uint64_t *req_ids = (uint64_t *)calloc((size_t)ctx->conns, sizeof(uint64_t));
   uint32_t *user_ids = (uint32_t *)calloc((size_t)ctx->conns, sizeof(uint32_t));
-  if (!fds || !req_ids || !user_ids)
+  ns_integrity_t *modes = (ns_integrity_t *)calloc((size_t)ctx->conns, sizeof(ns_integrity_t));
+  if (!fds || !req_ids || !user_ids || !modes)
     return NULL;
 
   uint64_t rng = (now_ms_wall() << 1u) ^ (uint64_t)(ctx->thread_id + 1);
 
   for (int i = 0; i < ctx->conns; i++)
   {
-    int fd = net_connect_tcp(ctx->host, ctx->port, ctx->timeout_ms);
-    if (fd < 0)
-    {
-      ctx->stats.err++;
-      fds[i] = -1;
-      continue;
-    }
-    (void)net_set_tcp_nodelay(fd);
-    fds[i] = fd;
-    req_ids[i] = 0;
-
-    char uname[NS_MAX_USERNAME];
-    snprintf(uname, sizeof(uname), "u%d_%d", ctx->thread_id, i);
-    if (do_handshake_login(fd, uname, &user_ids[i], &req_ids[i]) != 0)
-    {
-      ctx->stats.err++;
-      close(fd);
-      fds[i] = -1;
-      continue;
-    }
-    if (do_join_room(fd, (uint16_t)ctx->room_id, &req_ids[i]) != 0)
-    {
+    // Idempotency keys must not repeat across reconnects of the same user: start from the clock.
+    req_ids[i] = ctx->idempotent ? now_ms_wall() << 20u : 0;
+    fds[i] = open_conn(ctx, i, &user_ids[i], &req_ids[i], &modes[i]);
+    if (fds[i] < 0)
       ctx->stats.err++;
-      close(fd);
-      fds[i] = -1;
-      continue;
-    }
   }
 
   uint64_t end_ns = now_ns() + (uint64_t)ctx->duration_s * 1000000000ull;
   uint32_t *backoff_ms = (uint32_t *)calloc((size_t)ctx->conns, sizeof(uint32_t)); // per-connection backoff
-  if (!backoff_ms)
+  uint8_t *pipe_buf = NULL;
+  uint8_t *pipe_done = NULL;
+  if (ctx->pipeline > 1)
+  {
+    pipe_buf = (uint8_t *)malloc((size_t)ctx->pipeline * (sizeof(ns_header_t) + REQ_BODY_MAX));
+    pipe_done = (uint8_t *)malloc((size_t)ctx->pipeline);
+  }
+  if (!backoff_ms || (ctx->pipeline > 1 && (!pipe_buf || !pipe_done)))
   {
+    free(backoff_ms);
+    free(pipe_buf);
+    free(pipe_done);
     free(fds);
     free(req_ids);
     free(user_ids);
+    free(modes);
     return NULL;
   }
 
-  while (now_ns() < end_ns)
+  if (ctx->rate > 0)
+    run_open_loop(ctx, fds, user_ids, req_ids, modes, &rng, end_ns);
+
+  while (ctx->rate <= 0 && now_ns() < end_ns)
   {
     for (int i = 0; i < ctx->conns; i++)
     {
@@ -342,82 +947,47 @@ static void *thread_main(void *arg)
         continue;
       }
 
-      uint64_t r = xorshift64(&rng);
-      uint16_t opcode = OP_BALANCE;
-      uint8_t body[512];
-      uint32_t body_len = 0;
-
-      // Pick opcode by mix
-      uint32_t pick = (uint32_t)(r % 100u);
-      if (ctx->mix == MIX_TRADE_HEAVY)
+      if (ctx->pipeline > 1)
       {
-        opcode = (pick < 40) ? OP_TRANSFER : (pick < 70) ? OP_WITHDRAW
-                                         : (pick < 90)   ? OP_DEPOSIT
-                                                         : OP_BALANCE;
-      }
-      else if (ctx->mix == MIX_CHAT_HEAVY)
-      {
-        opcode = (pick < 70) ? OP_CHAT_SEND : (pick < 85) ? OP_BALANCE
-                                                          : OP_TRANSFER;
-      }
-      else
-      {
-        opcode = (pick < 30) ? OP_CHAT_SEND : (pick < 55) ? OP_TRANSFER
-                                          : (pick < 75)   ? OP_WITHDRAW
-                                          : (pick < 90)   ? OP_DEPOSIT
-                                                          : OP_BALANCE;
-      }
-
-      if (opcode == OP_CHAT_SEND)
-      {
-        // Generate message with specified payload size
-        // Body: u16 room_id + u16 msg_len + msg_bytes
-        // Total body = 4 + msg_len, so msg_len = payload_size - 4 (min 1)
-        uint16_t target_msg_len = (ctx->payload_size > 4) ? (uint16_t)(ctx->payload_size - 4) : 1;
-        if (target_msg_len > 512)
-          target_msg_len = 512; // Limit to buffer size
-
-        ns_put_be16(body + 0, (uint16_t)ctx->room_id);
-        ns_put_be16(body + 2, target_msg_len);
-        // Fill message with pattern (repeating "x" or random data)
-        for (uint16_t j = 0; j < target_msg_len; j++)
+        if (run_pipelined(ctx, fd, &rng, user_ids[i], &req_ids[i], modes[i], &backoff_ms[i], pipe_buf, pipe_done) != 0)
         {
-          body[4 + j] = (uint8_t)('a' + (j % 26));
+          ctx->stats.err++;
+          close(fd);
+          fds[i] = -1;
         }
-        body_len = 4u + target_msg_len;
-      }
-      else if (opcode == OP_DEPOSIT || opcode == OP_WITHDRAW)
-      {
-        uint64_t amt = (xorshift64(&rng) % 100u) + 1u;
-        ns_put_be64(body + 0, amt);
-        body_len = 8;
-      }
-      else if (opcode == OP_TRANSFER)
-      {
-        uint32_t to = (uint32_t)(xorshift64(&rng) % NS_MAX_USERS);
-        if (to == user_ids[i])
-          to = (to + 1) % NS_MAX_USERS;
-        uint64_t amt = (xorshift64(&rng) % 50u) + 1u;
-        ns_put_be32(body + 0, to);
-        ns_put_be64(body + 4, amt);
-        body_len = 12;
-      }
-      else
-      {
-        body_len = 0;
+        continue;
       }
 
+      uint16_t opcode = OP_BALANCE;
+      uint8_t body[REQ_BODY_MAX];
+      uint32_t body_len = make_request(ctx, &rng, user_ids[i], &opcode, body);
+
       ns_header_t rh;
       uint8_t *rb = NULL;
       uint32_t rbl = 0;
       uint64_t req_id = ++req_ids[i];
+      const uint8_t flags = ledger_flags(ctx, opcode);
       uint64_t t0 = now_ns();
-      if (send_and_wait(fd, opcode, req_id, body_len ? body : NULL, body_len,
-                        &rh, &rb, &rbl, ctx->encrypt_payload) != 0)
+      int rc = send_and_wait(fd, opcode, req_id, body_len ? body : NULL, body_len, &rh, &rb, &rbl,
+                             ctx->encrypt_payload, modes[i], flags, ctx->deadline_ms);
+      if (rc != 0 && flags != 0)
+      {
+        // The op may or may not have run; resending the same key gets its one result either way.
+        close(fd);
+        fd = fds[i] = open_conn(ctx, i, &user_ids[i], &req_ids[i], &modes[i]);
+        if (fd >= 0)
+        {
+          ctx->retries++;
+          rc = send_and_wait(fd, opcode, req_id, body_len ? body : NULL, body_len, &rh, &rb, &rbl,
+                             ctx->encrypt_payload, modes[i], flags, ctx->deadline_ms);
+        }
+      }
+      if (rc != 0)
       {
         ctx->stats.err++;
         free(rb);
-        close(fd);
+        if (fd >= 0)
+          close(fd);
         fds[i] = -1;
         continue;
       }
@@ -425,62 +995,22 @@ static void *thread_main(void *arg)
       uint64_t t1 = now_ns();
       uint64_t us = (t1 - t0) / 1000ull;
       (void)stats_push_latency_us(&ctx->stats, us);
-
-      if (st == ST_OK)
-      {
-        ctx->stats.ok++;
-        backoff_ms[i] = 0; // Reset backoff on success
-      }
-      else if (st == ST_ERR_SERVER_BUSY)
-      {
-        ctx->stats.err++;
-        ctx->stats.err_server_busy++;
-        // Exponential backoff: start at 10ms, double each time, max 1000ms
-        if (backoff_ms[i] == 0)
-          backoff_ms[i] = 10;
-        else
-        {
-          backoff_ms[i] *= 2;
-          if (backoff_ms[i] > 1000)
-            backoff_ms[i] = 1000;
-        }
-      }
-      else
+      record_status(ctx, st, &backoff_ms[i]);
+      // A rate-limited request says when to come back; wait that long instead of guessing.
+      if (st == ST_ERR_SERVER_BUSY && rbl >= 4)
+        backoff_ms[i] = ns_be32(rb) ? ns_be32(rb) : 1;
+      if (opcode == OP_ORDER_PLACE && st == ST_OK && rbl >= 12 && ns_be32(rb + 8) > 0)
       {
-        ctx->stats.err++;
-        switch (st)
-        {
-        case ST_ERR_BAD_PACKET:
-          ctx->stats.err_bad_packet++;
-          break;
-        case ST_ERR_CHECKSUM_FAIL:
-          ctx->stats.err_checksum_fail++;
-          break;
-        case ST_ERR_UNAUTHORIZED:
-          ctx->stats.err_unauthorized++;
-          break;
-        case ST_ERR_NOT_FOUND:
-          ctx->stats.err_not_found++;
-          break;
-        case ST_ERR_INSUFFICIENT_FUNDS:
-          ctx->stats.err_insufficient_funds++;
-          break;
-        case ST_ERR_TIMEOUT:
-          ctx->stats.err_timeout++;
-          break;
-        case ST_ERR_INTERNAL:
-          ctx->stats.err_internal++;
-          break;
-        default:
-          break;
-        }
-        backoff_ms[i] = 0;
+        (void)stats_push_latency_us(&ctx->match, us);
+        ctx->filled += ns_be32(rb + 8);
       }
       free(rb);
     }
   }
 
   free(backoff_ms);
+  free(pipe_buf);
+  free(pipe_done);
 
   for (int i = 0; i < ctx->conns; i++)
   {
@@ -490,13 +1020,16 @@ static void *thread_main(void *arg)
   free(fds);
   free(req_ids);
   free(user_ids);
+  free(modes);
   return NULL;
 }
 
 static void usage(const char *p)
 {
   fprintf(stderr,
-          "Usage: %s --host 127.0.0.1 --port 9000 --connections 100 --threads 16 --duration 60 --mix mixed --payload-size 32 --out results.csv\n",
+          "Usage: %s --host 127.0.0.1 --port 9000 --connections 100 --threads 16 --duration 60 --mix mixed|trade-heavy|chat-heavy|dm-heavy|settle|orders|md --payload-size 32 --out results.csv\n"
+          "       [--encrypt] [--integrity full|header|none] [--pipeline 1] [--listeners 0] [--rooms 1]\n"
+          "       [--idempotent] [--legs 50] [--rate 0] [--deadline-ms 0]\n",
           p);
 }
 
@@ -508,6 +1041,14 @@ static mix_t parse_mix(const char *s)
     return MIX_TRADE_HEAVY;
   if (strcmp(s, "chat-heavy") == 0)
     return MIX_CHAT_HEAVY;
+  if (strcmp(s, "dm-heavy") == 0)
+    return MIX_DM_HEAVY;
+  if (strcmp(s, "settle") == 0)
+    return MIX_SETTLE;
+  if (strcmp(s, "orders") == 0)
+    return MIX_ORDERS;
+  if (strcmp(s, "md") == 0)
+    return MIX_MD;
   return MIX_MIXED;
 }
 
@@ -524,6 +1065,14 @@ int main(int argc, char **argv)
   const char *out_path = "results.csv";
   int payload_size = 32; // Default payload size for CHAT_SEND (bytes)
   bool encrypt_payload = false;
+  bool idempotent = false;
+  ns_integrity_t integrity = NS_INTEGRITY_FULL;
+  int pipeline = 1;
+  int legs = 50;
+  int listeners = 0; // extra idle room members that measure chat push delivery latency
+  int rooms = 1;     // threads (and listeners) are spread round-robin over rooms 0..rooms-1
+  int rate = 0;      // open loop: total requests per second over all threads (0 = closed loop)
+  int deadline_ms = 0;
 
   for (int i = 1; i < argc; i++)
   {
@@ -545,6 +1094,28 @@ int main(int argc, char **argv)
       out_path = argv[++i];
     else if (strcmp(argv[i], "--encrypt") == 0)
       encrypt_payload = true;
+    else if (strcmp(argv[i], "--idempotent") == 0)
+      idempotent = true;
+    else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc)
+      pipeline = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--legs") == 0 && i + 1 < argc)
+      legs = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--listeners") == 0 && i + 1 < argc)
+      listeners = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--rooms") == 0 && i + 1 < argc)
+      rooms = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc)
+      rate = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--deadline-ms") == 0 && i + 1 < argc)
+      deadline_ms = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--integrity") == 0 && i + 1 < argc)
+    {
+      if (ns_integrity_parse(argv[++i], &integrity) != 0)
+      {
+        usage(argv[0]);
+        return 2;
+      }
+    }
     else if (strcmp(argv[i], "--help") == 0)
     {
       usage(argv[0]);
@@ -557,36 +1128,53 @@ int main(int argc, char **argv)
     }
   }
 
-  if (threads <= 0 || connections <= 0 || duration_s <= 0)
+  if (threads <= 0 || connections <= 0 || duration_s <= 0 || pipeline <= 0 || listeners < 0 || rooms <= 0 || rate < 0 || deadline_ms < 0 ||
+      rooms > (int)NS_MAX_ROOMS || legs <= 0 || legs > (int)NS_TRANSFER_MULTI_MAX)
     return 2;
 
   mix_t mix = parse_mix(mix_s);
   int base = connections / threads;
   int rem = connections % threads;
 
-  pthread_t *ths = (pthread_t *)calloc((size_t)threads, sizeof(pthread_t));
-  thread_ctx_t *ctxs = (thread_ctx_t *)calloc((size_t)threads, sizeof(thread_ctx_t));
-  if (!ths || !ctxs)
+  pthread_t *ths = (pthread_t *)calloc((size_t)(threads + listeners), sizeof(pthread_t));
+  thread_ctx_t *ctxs = (thread_ctx_t *)calloc((size_t)(threads + listeners), sizeof(thread_ctx_t));
+  uint32_t *dm_targets = (uint32_t *)malloc((size_t)(listeners + 1) * sizeof(uint32_t));
+  if (!ths || !ctxs || !dm_targets)
     return 1;
+  for (int i = 0; i < listeners; i++)
+    dm_targets[i] = UINT32_MAX;
 
-  for (int t = 0; t < threads; t++)
+  for (int t = 0; t < threads + listeners; t++)
   {
     ctxs[t].host = host;
     ctxs[t].port = port;
     ctxs[t].timeout_ms = 2000;
-    ctxs[t].room_id = 0;
+    ctxs[t].room_id = (t < threads ? t : t - threads) % rooms;
     ctxs[t].thread_id = t;
-    ctxs[t].conns = base + (t < rem ? 1 : 0);
+    ctxs[t].listener = t >= threads;
+    ctxs[t].conns = ctxs[t].listener ? 1 : base + (t < rem ? 1 : 0);
     ctxs[t].duration_s = duration_s;
     ctxs[t].mix = mix;
     ctxs[t].payload_size = payload_size;
+    ctxs[t].pipeline = pipeline;
+    ctxs[t].legs = legs;
+    ctxs[t].rate = (double)rate / (double)threads;
+    ctxs[t].deadline_ms = (uint32_t)deadline_ms;
     ctxs[t].encrypt_payload = encrypt_payload;
+    ctxs[t].idempotent = idempotent;
+    ctxs[t].integrity = integrity;
+    ctxs[t].granted = NS_INTEGRITY_FULL;
+    ctxs[t].dm_targets = dm_targets;
+    ctxs[t].ndm_targets = listeners;
+    ctxs[t].listener_idx = t - threads;
     (void)pthread_create(&ths[t], NULL, thread_main, &ctxs[t]);
   }
 
   uint64_t ok = 0, err = 0;
-  stats_t agg;
+  stats_t agg, match;
   stats_init(&agg);
+  stats_init(&match);
+  uint64_t filled = 0;
 
   for (int t = 0; t < threads; t++)
   {
@@ -599,6 +1187,33 @@ int main(int argc, char **argv)
       (void)stats_push_latency_us(&agg, ctxs[t].stats.lat_us[i]);
     }
     stats_free(&ctxs[t].stats);
+    filled += ctxs[t].filled;
+    for (size_t i = 0; i < ctxs[t].match.len; i++)
+      (void)stats_push_latency_us(&match, ctxs[t].match.lat_us[i]);
+    stats_free(&ctxs[t].match);
+  }
+
+  uint64_t push_events = 0, push_frames = 0;
+  stats_t push;
+  stats_init(&push);
+  for (int t = threads; t < threads + listeners; t++)
+  {
+    (void)pthread_join(ths[t], NULL);
+    push_events += ctxs[t].push_events;
+    push_frames += ctxs[t].push_frames;
+    for (size_t i = 0; i < ctxs[t].stats.len; i++)
+      (void)stats_push_latency_us(&push, ctxs[t].stats.lat_us[i]);
+    stats_free(&ctxs[t].stats);
+  }
+  uint64_t push_p50 = stats_percentile_us(&push, 50.0);
+  uint64_t push_p99 = stats_percentile_us(&push, 99.0);
+
+  // Report the weakest mode any thread actually got (server policy may downgrade)
+  ns_integrity_t granted = NS_INTEGRITY_FULL;
+  for (int t = 0; t < threads; t++)
+  {
+    if (ctxs[t].granted > granted)
+      granted = ctxs[t].granted;
   }
 
   uint64_t total = ok + err;
@@ -630,11 +1245,13 @@ int main(int argc, char **argv)
             "host,port,connections,threads,duration_s,total,ok,err,rps,"
             "p50_us,p95_us,p99_us,"
             "err_bad_packet,err_checksum_fail,err_unauthorized,err_not_found,"
-            "err_insufficient_funds,err_server_busy,err_timeout,err_internal\n");
+            "err_insufficient_funds,err_server_busy,err_timeout,err_internal,integrity,pipeline,"
+            "push_events,push_frames,push_p50_us,push_p99_us\n");
     fprintf(f,
             "%s,%u,%d,%d,%d,%llu,%llu,%llu,%.2f,"
             "%llu,%llu,%llu,"
-            "%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+            "%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%s,%d,"
+            "%llu,%llu,%llu,%llu\n",
             host, port, connections, threads, duration_s,
             (unsigned long long)total, (unsigned long long)ok, (unsigned long long)err,
             rps,
@@ -646,18 +1263,51 @@ int main(int argc, char **argv)
             (unsigned long long)err_insufficient_funds,
             (unsigned long long)err_server_busy,
             (unsigned long long)err_timeout,
-            (unsigned long long)err_internal);
+            (unsigned long long)err_internal,
+            ns_integrity_name(granted), pipeline,
+            (unsigned long long)push_events, (unsigned long long)push_frames,
+            (unsigned long long)push_p50, (unsigned long long)push_p99);
     fclose(f);
   }
 
-  printf("connections=%d threads=%d duration=%ds total=%llu ok=%llu err=%llu rps=%.2f p50=%lluus p95=%lluus p99=%lluus\n",
-         connections, threads, duration_s,
+  printf("connections=%d threads=%d duration=%ds integrity=%s pipeline=%d total=%llu ok=%llu err=%llu rps=%.2f p50=%lluus p95=%lluus p99=%lluus\n",
+         connections, threads, duration_s, ns_integrity_name(granted), pipeline,
          (unsigned long long)total, (unsigned long long)ok, (unsigned long long)err,
          rps,
          (unsigned long long)p50, (unsigned long long)p95, (unsigned long long)p99);
+  if (listeners > 0)
+    printf("listeners=%d push_events=%llu push_frames=%llu push_p50=%lluus push_p99=%lluus\n", listeners,
+           (unsigned long long)push_events, (unsigned long long)push_frames,
+           (unsigned long long)push_p50, (unsigned long long)push_p99);
+  if (mix == MIX_SETTLE)
+    printf("legs=%d legs_ok=%llu legs_per_sec=%.2f\n", legs, (unsigned long long)ok * (unsigned long long)legs,
+           duration_s > 0 ? (double)ok * (double)legs / (double)duration_s : 0.0);
+  if (mix == MIX_ORDERS)
+    printf("orders_per_sec=%.2f matched=%zu filled=%llu match_p50=%lluus match_p95=%lluus match_p99=%lluus\n",
+           duration_s > 0 ? (double)ok / (double)duration_s : 0.0, match.len, (unsigned long long)filled,
+           (unsigned long long)stats_percentile_us(&match, 50.0),
+           (unsigned long long)stats_percentile_us(&match, 95.0),
+           (unsigned long long)stats_percentile_us(&match, 99.0));
+  if (rate > 0)
+  {
+    uint64_t dropped = 0;
+    for (int t = 0; t < threads; t++)
+      dropped += ctxs[t].dropped;
+    printf("open_loop rate=%d dropped=%llu\n", rate, (unsigned long long)dropped);
+  }
+  if (idempotent)
+  {
+    uint64_t retries = 0;
+    for (int t = 0; t < threads; t++)
+      retries += ctxs[t].retries;
+    printf("idempotent retries=%llu\n", (unsigned long long)retries);
+  }
 
+  stats_free(&push);
+  stats_free(&match);
   stats_free(&agg);
   free(ths);
   free(ctxs);
+  free(dm_targets);
   return 0;
 }
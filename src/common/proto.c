@@ -58,18 +58,64 @@ uint32_t ns_crc32(const void *data, size_t len) {
   return ~crc;
 }
 
+uint32_t ns_crc32_extend(uint32_t crc, const void *data, size_t len) {
+  return ~crc32_update(~crc, data, len);
+}
+
 uint32_t ns_frame_checksum(const ns_header_t *hdr_be, const uint8_t *body, size_t body_len) {
-  // checksum is CRC32(header_without_checksum + body)
-  ns_header_t tmp;
-  memcpy(&tmp, hdr_be, sizeof(tmp));
-  tmp.checksum = 0;
+  // checksum is CRC32(header_without_checksum + body), narrowed by the CRC flags
+  ns_integrity_t mode = ns_frame_integrity(hdr_be);
+  if (mode == NS_INTEGRITY_NONE) return 0;
+  if (mode == NS_INTEGRITY_HEADER) body_len = 0;
+
+  // Hash the header in place with the checksum field taken as zero.
+  static const uint8_t zero_sum[sizeof(hdr_be->checksum)] = {0};
+  const uint8_t *h = (const uint8_t *)hdr_be;
+  const size_t sum_off = offsetof(ns_header_t, checksum);
+  const size_t after = sum_off + sizeof(hdr_be->checksum);
 
   uint32_t crc = 0xFFFFFFFFu;
-  crc = crc32_update(crc, &tmp, sizeof(tmp));
+  crc = crc32_update(crc, h, sum_off);
+  crc = crc32_update(crc, zero_sum, sizeof(zero_sum));
+  crc = crc32_update(crc, h + after, sizeof(ns_header_t) - after);
   if (body && body_len) crc = crc32_update(crc, body, body_len);
   return ~crc;
 }
 
+uint8_t ns_integrity_flags(ns_integrity_t mode) {
+  switch (mode) {
+    case NS_INTEGRITY_HEADER: return (uint8_t)NS_FLAG_CRC_HEADER_ONLY;
+    case NS_INTEGRITY_NONE: return (uint8_t)NS_FLAG_CRC_NONE;
+    default: return 0;
+  }
+}
+
+ns_integrity_t ns_frame_integrity(const ns_header_t *hdr_be) {
+  if ((hdr_be->flags & NS_FLAG_CRC_NONE) != 0u) return NS_INTEGRITY_NONE;
+  if ((hdr_be->flags & NS_FLAG_CRC_HEADER_ONLY) != 0u) return NS_INTEGRITY_HEADER;
+  return NS_INTEGRITY_FULL;
+}
+
+const char *ns_integrity_name(ns_integrity_t mode) {
+  switch (mode) {
+    case NS_INTEGRITY_FULL: return "full";
+    case NS_INTEGRITY_HEADER: return "header";
+    case NS_INTEGRITY_NONE: return "none";
+    default: return "unknown";
+  }
+}
+
+int ns_integrity_parse(const char *s, ns_integrity_t *out) {
+  if (!s || !out) return -1;
+  for (uint32_t m = 0; m < NS_INTEGRITY_COUNT; m++) {
+    if (strcmp(s, ns_integrity_name((ns_integrity_t)m)) == 0) {
+      *out = (ns_integrity_t)m;
+      return 0;
+    }
+  }
+  return -1;
+}
+
 void ns_xor_crypt(uint8_t *data, size_t len, uint32_t key) {
   if (!data || len == 0) return;
   uint8_t k[4];
@@ -79,13 +125,8 @@ void ns_xor_crypt(uint8_t *data, size_t len, uint32_t key) {
   }
 }
 
-void ns_build_header(ns_header_t *out_hdr_be,
-                     uint8_t flags,
-                     uint16_t opcode,
-                     uint16_t status,
-                     uint64_t req_id,
-                     const uint8_t *body,
-                     uint32_t body_len) {
+static void build_header(ns_header_t *out_hdr_be, uint8_t flags, uint16_t opcode, uint16_t status, uint64_t req_id,
+                         uint32_t deadline_ms, const uint8_t *body, uint32_t body_len) {
   memset(out_hdr_be, 0, sizeof(*out_hdr_be));
   ns_put_be16(&out_hdr_be->magic, (uint16_t)NS_MAGIC);
   out_hdr_be->version = (uint8_t)NS_VERSION;
@@ -95,11 +136,32 @@ void ns_build_header(ns_header_t *out_hdr_be,
   ns_put_be16(&out_hdr_be->opcode, opcode);
   ns_put_be16(&out_hdr_be->status, status);
   ns_put_be64(&out_hdr_be->req_id, req_id);
+  ns_put_be32(&out_hdr_be->deadline_ms, deadline_ms);
   out_hdr_be->checksum = 0;
   uint32_t sum = ns_frame_checksum(out_hdr_be, body, body_len);
   ns_put_be32(&out_hdr_be->checksum, sum);
 }
 
+void ns_build_header(ns_header_t *out_hdr_be,
+                     uint8_t flags,
+                     uint16_t opcode,
+                     uint16_t status,
+                     uint64_t req_id,
+                     const uint8_t *body,
+                     uint32_t body_len) {
+  build_header(out_hdr_be, flags, opcode, status, req_id, 0, body, body_len);
+}
+
+void ns_build_header_deadline(ns_header_t *out_hdr_be,
+                              uint8_t flags,
+                              uint16_t opcode,
+                              uint64_t req_id,
+                              uint32_t deadline_ms,
+                              const uint8_t *body,
+                              uint32_t body_len) {
+  build_header(out_hdr_be, flags, opcode, ST_OK, req_id, deadline_ms, body, body_len);
+}
+
 bool ns_validate_header_basic(const ns_header_t *hdr_be, uint32_t max_body_len) {
   if (ns_be16(&hdr_be->magic) != (uint16_t)NS_MAGIC) return false;
   if (hdr_be->version != (uint8_t)NS_VERSION) return false;
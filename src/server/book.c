@@ -0,0 +1,256 @@
+#include "book.h"
+
+#include "proto.h"
+
+#include <string.h>
+
+static uint64_t order_id(uint8_t symbol, uint32_t idx, uint32_t gen) {
+  return ((uint64_t)gen << 32u) | ((uint64_t)symbol << 24u) | (uint64_t)(idx + 1u);
+}
+
+static void mask_set(uint64_t *mask, uint32_t price, bool on) {
+  uint64_t bit = 1ull << (price % 64u);
+  if (on) mask[price / 64u] |= bit;
+  else mask[price / 64u] &= ~bit;
+}
+
+// Lowest non-empty level >= from, or 0.
+static uint32_t mask_next_up(const uint64_t *mask, uint32_t from) {
+  if (from >= NS_BOOK_LEVELS) return 0;
+  uint32_t w = from / 64u;
+  uint64_t bits = mask[w] & (~0ull << (from % 64u));
+  while (true) {
+    if (bits) return w * 64u + (uint32_t)__builtin_ctzll(bits);
+    if (++w == NS_BOOK_MASK_WORDS) return 0;
+    bits = mask[w];
+  }
+}
+
+// Highest non-empty level <= from, or 0.
+static uint32_t mask_next_down(const uint64_t *mask, uint32_t from) {
+  if (from == 0) return 0;
+  uint32_t w = from / 64u;
+  uint64_t bits = mask[w] & (~0ull >> (63u - from % 64u));
+  while (true) {
+    if (bits) return w * 64u + 63u - (uint32_t)__builtin_clzll(bits);
+    if (w-- == 0) return 0;
+    bits = mask[w];
+  }
+}
+
+static ns_book_level_t *book_level(ns_book_t *b, uint8_t side, uint32_t price) {
+  return side == NS_SIDE_BUY ? &b->bids[price] : &b->asks[price];
+}
+
+static void level_push(ns_book_t *b, uint32_t idx) {
+  ns_order_t *o = &b->orders[idx];
+  ns_book_level_t *l = book_level(b, o->side, o->price);
+  o->next = 0;
+  o->prev = l->tail;
+  if (l->tail) b->orders[l->tail - 1u].next = idx + 1u;
+  else l->head = idx + 1u;
+  l->tail = idx + 1u;
+  l->qty += o->qty;
+  if (o->side == NS_SIDE_BUY) {
+    mask_set(b->bid_mask, o->price, true);
+    if (o->price > b->best_bid) b->best_bid = o->price;
+  } else {
+    mask_set(b->ask_mask, o->price, true);
+    if (b->best_ask == 0 || o->price < b->best_ask) b->best_ask = o->price;
+  }
+}
+
+// Unlink an order (with its remaining qty) from its level and return the slot to the arena.
+static void level_remove(ns_book_t *b, uint32_t idx) {
+  ns_order_t *o = &b->orders[idx];
+  ns_book_level_t *l = book_level(b, o->side, o->price);
+  if (o->prev) b->orders[o->prev - 1u].next = o->next;
+  else l->head = o->next;
+  if (o->next) b->orders[o->next - 1u].prev = o->prev;
+  else l->tail = o->prev;
+  l->qty -= o->qty;
+  if (!l->head) {
+    if (o->side == NS_SIDE_BUY) {
+      mask_set(b->bid_mask, o->price, false);
+      if (b->best_bid == o->price) b->best_bid = mask_next_down(b->bid_mask, o->price);
+    } else {
+      mask_set(b->ask_mask, o->price, false);
+      if (b->best_ask == o->price) b->best_ask = mask_next_up(b->ask_mask, o->price);
+    }
+  }
+  o->live = 0;
+  o->gen++;
+  o->next = b->free_head;
+  b->free_head = idx + 1u;
+  b->live_orders--;
+}
+
+static bool order_alloc(ns_book_t *b, uint32_t *out_idx) {
+  if (b->free_head) {
+    *out_idx = b->free_head - 1u;
+    b->free_head = b->orders[*out_idx].next;
+  } else if (b->arena_used < NS_BOOK_ORDERS) {
+    *out_idx = b->arena_used++;
+  } else {
+    return false;
+  }
+  b->live_orders++;
+  return true;
+}
+
+static void lock_pair(ns_shm_t *s, uint32_t a, uint32_t b) {
+  uint32_t lo = a < b ? a : b, hi = a < b ? b : a;
+  pthread_mutex_lock(&s->acct_mu[lo]);
+  if (hi != lo) pthread_mutex_lock(&s->acct_mu[hi]);
+}
+
+static void unlock_pair(ns_shm_t *s, uint32_t a, uint32_t b) {
+  uint32_t lo = a < b ? a : b, hi = a < b ? b : a;
+  if (hi != lo) pthread_mutex_unlock(&s->acct_mu[hi]);
+  pthread_mutex_unlock(&s->acct_mu[lo]);
+}
+
+// Move qty units at price from seller to buyer. The buyer reserved reserved_price per unit.
+static void settle(ns_shm_t *s, uint8_t symbol, uint32_t buyer, uint32_t seller, uint32_t price,
+                   uint32_t reserved_price, uint32_t qty) {
+  const int64_t cash = (int64_t)price * qty;
+  lock_pair(s, buyer, seller);
+  s->escrow[buyer] -= (int64_t)reserved_price * qty;
+  s->balance[NS_ASSET_CASH][buyer] += (int64_t)(reserved_price - price) * qty;
+  s->balance[NS_ASSET_CASH][seller] += cash;
+  s->balance[NS_ASSET_OF_SYMBOL(symbol)][buyer] += qty;
+  s->balance[NS_ASSET_OF_SYMBOL(symbol)][seller] -= qty;
+  ns_leaderboard_update(s, buyer);
+  ns_leaderboard_update(s, seller);
+  unlock_pair(s, buyer, seller);
+  ns_txn_append(s, OP_ORDER_FILL, ST_OK, buyer, seller, cash);
+}
+
+uint16_t ns_book_place(ns_shm_t *s, uint32_t user_id, uint8_t symbol, uint8_t side, uint32_t price, uint32_t qty,
+                       uint8_t flags, ns_fill_fn on_fill, void *arg, ns_place_result_t *out) {
+  memset(out, 0, sizeof(*out));
+  if (!s || user_id >= NS_MAX_USERS || symbol >= NS_BOOK_SYMBOLS || side > NS_SIDE_SELL || price == 0 ||
+      price >= NS_BOOK_LEVELS || qty == 0) {
+    return ST_ERR_BAD_PACKET;
+  }
+  ns_book_t *b = &s->books[symbol];
+  pthread_mutex_lock(&b->mu);
+  const uint32_t bid0 = b->best_bid, ask0 = b->best_ask;
+
+  if (side == NS_SIDE_BUY) {
+    const int64_t reserve = (int64_t)price * qty;
+    pthread_mutex_lock(&s->acct_mu[user_id]);
+    bool funded = s->balance[NS_ASSET_CASH][user_id] >= reserve;
+    if (funded) {
+      s->balance[NS_ASSET_CASH][user_id] -= reserve;
+      s->escrow[user_id] += reserve;
+      ns_leaderboard_update(s, user_id);
+    }
+    out->balance = s->balance[NS_ASSET_CASH][user_id];
+    pthread_mutex_unlock(&s->acct_mu[user_id]);
+    if (!funded) {
+      pthread_mutex_unlock(&b->mu);
+      return ST_ERR_INSUFFICIENT_FUNDS;
+    }
+  }
+
+  // Match against the opposite side while it crosses, best price first, oldest order first.
+  uint32_t left = qty;
+  uint32_t last_px = 0;
+  const uint8_t maker_side = side == NS_SIDE_BUY ? NS_SIDE_SELL : NS_SIDE_BUY;
+  while (left > 0) {
+    uint32_t px = side == NS_SIDE_BUY ? b->best_ask : b->best_bid;
+    if (px == 0 || (side == NS_SIDE_BUY ? px > price : px < price)) break;
+    ns_book_level_t *l = book_level(b, maker_side, px);
+    uint32_t idx = l->head - 1u;
+    ns_order_t *o = &b->orders[idx];
+    uint32_t n = o->qty < left ? o->qty : left;
+
+    if (side == NS_SIDE_BUY) settle(s, symbol, user_id, o->user_id, px, price, n);
+    else settle(s, symbol, o->user_id, user_id, px, px, n);
+    o->qty -= n;
+    l->qty -= n;
+    left -= n;
+    out->filled += n;
+    out->notional += (int64_t)px * n;
+    last_px = px;
+    b->trades++;
+    b->volume += n;
+
+    if (on_fill) {
+      ns_fill_t f = {order_id(symbol, idx, o->gen), o->user_id, user_id, px, n, o->qty, symbol, maker_side};
+      on_fill(arg, &f);
+    }
+    if (o->qty == 0) level_remove(b, idx);
+  }
+
+  // Rest the remainder, or hand back what a buy reserved for it.
+  uint32_t idx = 0;
+  if (left > 0 && (flags & NS_ORDER_IOC) == 0 && order_alloc(b, &idx)) {
+    ns_order_t *o = &b->orders[idx];
+    o->user_id = user_id;
+    o->price = price;
+    o->qty = left;
+    o->side = side;
+    o->live = 1;
+    level_push(b, idx);
+    out->order_id = order_id(symbol, idx, o->gen);
+    out->rested = left;
+    left = 0;
+  }
+  pthread_mutex_lock(&s->acct_mu[user_id]);
+  if (left > 0 && side == NS_SIDE_BUY) {
+    s->escrow[user_id] -= (int64_t)price * left;
+    s->balance[NS_ASSET_CASH][user_id] += (int64_t)price * left;
+    ns_leaderboard_update(s, user_id);
+  }
+  out->balance = s->balance[NS_ASSET_CASH][user_id];
+  pthread_mutex_unlock(&s->acct_mu[user_id]);
+
+  // Published under the book lock, so the slot never goes back to an older top of book.
+  if (out->filled > 0 || b->best_bid != bid0 || b->best_ask != ask0) {
+    out->md_wake = ns_md_publish(s, symbol, b->best_bid, b->best_ask, last_px, out->filled);
+  }
+  pthread_mutex_unlock(&b->mu);
+  return ST_OK;
+}
+
+uint16_t ns_book_cancel(ns_shm_t *s, uint32_t user_id, uint64_t id, uint32_t *out_qty, int64_t *out_balance,
+                        uint64_t *out_md_wake) {
+  *out_qty = 0;
+  *out_balance = 0;
+  if (out_md_wake) *out_md_wake = 0;
+  uint32_t symbol = (uint32_t)(id >> 24u) & 0xffu;
+  uint32_t slot = (uint32_t)id & 0xffffffu;
+  if (!s || user_id >= NS_MAX_USERS || symbol >= NS_BOOK_SYMBOLS || slot == 0 || slot > NS_BOOK_ORDERS) {
+    return ST_ERR_NOT_FOUND;
+  }
+  ns_book_t *b = &s->books[symbol];
+  pthread_mutex_lock(&b->mu);
+  ns_order_t *o = &b->orders[slot - 1u];
+  if (!o->live || o->gen != (uint32_t)(id >> 32u) || o->user_id != user_id) {
+    pthread_mutex_unlock(&b->mu);
+    return ST_ERR_NOT_FOUND;
+  }
+  const uint32_t qty = o->qty;
+  const bool buy = o->side == NS_SIDE_BUY;
+  const int64_t release = (int64_t)o->price * qty;
+  const uint32_t bid0 = b->best_bid, ask0 = b->best_ask;
+  level_remove(b, slot - 1u);
+  if (b->best_bid != bid0 || b->best_ask != ask0) {
+    uint64_t wake = ns_md_publish(s, symbol, b->best_bid, b->best_ask, 0, 0);
+    if (out_md_wake) *out_md_wake = wake;
+  }
+
+  pthread_mutex_lock(&s->acct_mu[user_id]);
+  if (buy) {
+    s->escrow[user_id] -= release;
+    s->balance[NS_ASSET_CASH][user_id] += release;
+    ns_leaderboard_update(s, user_id);
+  }
+  *out_balance = s->balance[NS_ASSET_CASH][user_id];
+  pthread_mutex_unlock(&s->acct_mu[user_id]);
+  pthread_mutex_unlock(&b->mu);
+  *out_qty = qty;
+  return ST_OK;
+}
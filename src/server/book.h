@@ -0,0 +1,52 @@
+#pragma once
+
+#include "shm_state.h"
+
+#include <stdint.h>
+
+// Limit order books in shared memory, one per symbol. Each book is guarded by its own mutex, so
+// any worker may place or cancel; orders match by price, then time (FIFO within a level), at the
+// resting order's price.
+//
+// Settlement: a buy reserves price * qty of cash into escrow[] when placed; a fill pays the
+// seller from it and refunds the buyer the difference to the fill price. Fills move qty units of
+// the symbol's asset column from seller to buyer and are logged with
+// ns_txn_append(OP_ORDER_FILL, buyer -> seller, notional).
+// Account locks are taken inside the book lock, never the other way round.
+//
+// A place or cancel that moves the top of book or trades publishes the symbol's market-data
+// slot (ns_md_publish); the workers it returns must be woken by the caller.
+
+typedef struct {
+  uint64_t maker_order_id;
+  uint32_t maker_user_id;
+  uint32_t taker_user_id;
+  uint32_t price;
+  uint32_t qty;
+  uint32_t maker_remaining;
+  uint8_t symbol;
+  uint8_t maker_side; // ns_side_t
+} ns_fill_t;
+
+// Called for every fill while the book is still locked (keep it short: queue a notification).
+typedef void (*ns_fill_fn)(void *arg, const ns_fill_t *fill);
+
+typedef struct {
+  uint64_t order_id; // id of the resting remainder, 0 if nothing rests
+  uint32_t filled;
+  uint32_t rested;
+  int64_t notional;  // sum of price * qty over the fills
+  int64_t balance;   // the placing user's cash balance afterwards
+  uint64_t md_wake;  // workers to wake for the market-data update
+} ns_place_result_t;
+
+// Returns ST_OK, ST_ERR_BAD_PACKET (symbol, side, price or qty out of range) or
+// ST_ERR_INSUFFICIENT_FUNDS (a buy whose price * qty exceeds the balance; nothing happens).
+// A remainder that finds the book's arena full is cancelled like an IOC remainder.
+uint16_t ns_book_place(ns_shm_t *s, uint32_t user_id, uint8_t symbol, uint8_t side, uint32_t price, uint32_t qty,
+                       uint8_t flags, ns_fill_fn on_fill, void *arg, ns_place_result_t *out);
+
+// Cancel a resting order of user_id, releasing a buy's escrow. Returns ST_ERR_NOT_FOUND if the
+// id is unknown, stale (filled or cancelled since) or belongs to someone else. out_md_wake may be NULL.
+uint16_t ns_book_cancel(ns_shm_t *s, uint32_t user_id, uint64_t order_id, uint32_t *out_qty, int64_t *out_balance,
+                        uint64_t *out_md_wake);
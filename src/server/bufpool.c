@@ -0,0 +1,131 @@
+#include "bufpool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Smallest class whose block size is >= size, or -1 if it exceeds the largest class.
+static int class_for(size_t size) {
+  size_t sz = NS_POOL_MIN_BLOCK;
+  for (int k = 0; k < (int)NS_POOL_CLASSES; k++, sz <<= 1u) {
+    if (sz >= size) return k;
+  }
+  return -1;
+}
+
+// Class of a block of exactly cap bytes, or -1 if cap is not a class size.
+static int class_of(size_t cap) {
+  int k = class_for(cap);
+  return (k >= 0 && ((size_t)NS_POOL_MIN_BLOCK << (unsigned)k) == cap) ? k : -1;
+}
+
+void ns_bufpool_init(ns_bufpool_t *p, size_t max_cached_bytes) {
+  memset(p, 0, sizeof(*p));
+  p->max_cached_bytes = max_cached_bytes;
+}
+
+void ns_bufpool_destroy(ns_bufpool_t *p) {
+  if (!p) return;
+  for (uint32_t k = 0; k < NS_POOL_CLASSES; k++) {
+    for (size_t i = 0; i < p->rings[k].len; i++) ns_ring_free(&p->rings[k].items[i]);
+    free(p->rings[k].items);
+    void *b = p->blocks[k];
+    while (b) {
+      void *next = *(void **)b;
+      free(b);
+      b = next;
+    }
+  }
+  memset(p, 0, sizeof(*p));
+}
+
+int ns_bufpool_ring_get(ns_bufpool_t *p, ns_ring_t *out, size_t min_cap) {
+  int k = class_for(min_cap);
+  if (k >= 0) {
+    ns_ring_stack_t *st = &p->rings[k];
+    if (st->len > 0) {
+      *out = st->items[--st->len];
+      p->cached -= out->cap;
+      p->rx_in_use += out->cap;
+      return 0;
+    }
+    min_cap = (size_t)NS_POOL_MIN_BLOCK << (unsigned)k;
+  }
+  if (ns_ring_init(out, min_cap) != 0) return -1;
+  p->rx_in_use += out->cap;
+  return 0;
+}
+
+void ns_bufpool_ring_put(ns_bufpool_t *p, ns_ring_t *r) {
+  if (!r->base) return;
+  p->rx_in_use -= r->cap;
+  int k = class_of(r->cap);
+  if (k >= 0 && p->cached + r->cap <= p->max_cached_bytes) {
+    ns_ring_stack_t *st = &p->rings[k];
+    if (st->len == st->cap) {
+      size_t ncap = st->cap ? st->cap * 2u : 16u;
+      ns_ring_t *items = (ns_ring_t *)realloc(st->items, ncap * sizeof(*items));
+      if (items) {
+        st->items = items;
+        st->cap = ncap;
+      }
+    }
+    if (st->len < st->cap) {
+      r->head = r->tail = 0;
+      st->items[st->len++] = *r;
+      p->cached += r->cap;
+      memset(r, 0, sizeof(*r));
+      return;
+    }
+  }
+  ns_ring_free(r);
+}
+
+int ns_bufpool_ring_grow(ns_bufpool_t *p, ns_ring_t *r, size_t min_cap) {
+  size_t len = ns_ring_len(r);
+  if (min_cap < len) {
+    errno = EINVAL;
+    return -1;
+  }
+  ns_ring_t nr;
+  if (ns_bufpool_ring_get(p, &nr, min_cap) != 0) return -1;
+  if (len) memcpy(nr.base, ns_ring_data(r), len);
+  nr.tail = len;
+  ns_bufpool_ring_put(p, r);
+  *r = nr;
+  return 0;
+}
+
+uint8_t *ns_bufpool_get(ns_bufpool_t *p, size_t min_len, size_t *out_cap) {
+  int k = class_for(min_len);
+  size_t cap = min_len;
+  if (k >= 0) {
+    cap = (size_t)NS_POOL_MIN_BLOCK << (unsigned)k;
+    void *b = p->blocks[k];
+    if (b) {
+      p->blocks[k] = *(void **)b;
+      p->cached -= cap;
+      p->tx_in_use += cap;
+      *out_cap = cap;
+      return (uint8_t *)b;
+    }
+  }
+  uint8_t *b = (uint8_t *)malloc(cap);
+  if (!b) return NULL;
+  p->tx_in_use += cap;
+  *out_cap = cap;
+  return b;
+}
+
+void ns_bufpool_put(ns_bufpool_t *p, uint8_t *buf, size_t cap) {
+  if (!buf) return;
+  p->tx_in_use -= cap;
+  int k = class_of(cap);
+  if (k >= 0 && p->cached + cap <= p->max_cached_bytes) {
+    *(void **)buf = p->blocks[k];
+    p->blocks[k] = buf;
+    p->cached += cap;
+    return;
+  }
+  free(buf);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "ring.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-worker, size-classed buffer pool (single-threaded, no locking).
+// Class k holds blocks of NS_POOL_MIN_BLOCK << k bytes. Receive rings and
+// write buffers are attached to a connection only while it has pending bytes
+// and go back to the pool when drained, so idle connections own no buffers.
+#define NS_POOL_MIN_BLOCK 4096u
+#define NS_POOL_CLASSES 11u // 4 KB .. 4 MB; larger requests bypass the cache
+
+typedef struct {
+  ns_ring_t *items;
+  size_t len;
+  size_t cap;
+} ns_ring_stack_t;
+
+typedef struct {
+  ns_ring_stack_t rings[NS_POOL_CLASSES];
+  void *blocks[NS_POOL_CLASSES]; // free list linked through the first word
+
+  size_t max_cached_bytes; // beyond this, returned buffers are released to the OS
+
+  // Accounting (bytes)
+  size_t rx_in_use;
+  size_t tx_in_use;
+  size_t cached;
+} ns_bufpool_t;
+
+void ns_bufpool_init(ns_bufpool_t *p, size_t max_cached_bytes);
+void ns_bufpool_destroy(ns_bufpool_t *p);
+
+// Receive rings (capacity >= min_cap). Returns 0 on success.
+int ns_bufpool_ring_get(ns_bufpool_t *p, ns_ring_t *out, size_t min_cap);
+void ns_bufpool_ring_put(ns_bufpool_t *p, ns_ring_t *r);
+// Swap r for a pooled ring of at least min_cap, carrying over unread bytes.
+int ns_bufpool_ring_grow(ns_bufpool_t *p, ns_ring_t *r, size_t min_cap);
+
+// Plain byte blocks (write buffers). *out_cap receives the usable size.
+uint8_t *ns_bufpool_get(ns_bufpool_t *p, size_t min_len, size_t *out_cap);
+void ns_bufpool_put(ns_bufpool_t *p, uint8_t *buf, size_t cap);
@@ -2,6 +2,7 @@
 
 #include "log.h"
 #include "net.h"
+#include "proto.h"
 #include "shm_state.h"
 #include "worker.h"
 
@@ -44,24 +45,111 @@ static int parse_env_i(const char *name, int def, int min, int max) {
   return (int)n;
 }
 
+// Parse a comma-separated list of integrity modes ("full,header,none") into a bitmask.
+// FULL is always allowed; returns -1 on an unknown name or a list without any name.
+static int parse_integrity_modes(const char *s, uint32_t *out_mask) {
+  char buf[64];
+  if (!s || !out_mask || strlen(s) >= sizeof(buf)) return -1;
+  snprintf(buf, sizeof(buf), "%s", s);
+  uint32_t mask = 1u << NS_INTEGRITY_FULL;
+  uint32_t n = 0;
+  char *save = NULL;
+  for (char *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+    ns_integrity_t m;
+    if (ns_integrity_parse(tok, &m) != 0) return -1;
+    mask |= 1u << m;
+    n++;
+  }
+  if (n == 0) return -1;
+  *out_mask = mask;
+  return 0;
+}
+
 static int log_fatal_errno(const char *msg) {
   LOG_ERROR("%s: %s", msg, strerror(errno));
   return 1;
 }
 
+// Chat ring capacities in bytes: comma-separated "room:cap" entries give hot rooms their own
+// size, and an optional bare "cap" applies to every other room. Without one, the rooms not listed
+// share what is left of the arena evenly. Returns 0 and fills caps, or -1 if the spec is invalid
+// or does not fit in NS_CHAT_ARENA_BYTES.
+static int parse_chat_room_caps(const char *spec, uint32_t *caps) {
+  bool set[NS_MAX_ROOMS] = {false};
+  long def = -1;
+  uint64_t used = 0;
+  uint32_t unset = NS_MAX_ROOMS;
+  const char *p = spec;
+  while (*p) {
+    char *end = NULL;
+    long a = strtol(p, &end, 10);
+    if (end == p) return -1;
+    if (*end == ':') {
+      const char *q = end + 1;
+      long cap = strtol(q, &end, 10);
+      if (end == q || a < 0 || a >= (long)NS_MAX_ROOMS || set[a] || cap < (long)NS_CHAT_ROOM_MIN_BYTES ||
+          cap > (long)NS_CHAT_ARENA_BYTES)
+        return -1;
+      set[a] = true;
+      caps[a] = (uint32_t)cap;
+      used += (uint64_t)cap;
+      unset--;
+    } else {
+      if (def >= 0 || a < (long)NS_CHAT_ROOM_MIN_BYTES || a > (long)NS_CHAT_ARENA_BYTES) return -1;
+      def = a;
+    }
+    if (*end == ',') end++;
+    else if (*end != '\0') return -1;
+    p = end;
+  }
+  if (used > NS_CHAT_ARENA_BYTES) return -1;
+  if (def < 0) def = unset ? (long)((NS_CHAT_ARENA_BYTES - used) / unset) : 0;
+  for (uint32_t r = 0; r < NS_MAX_ROOMS; r++) {
+    if (!set[r]) caps[r] = (uint32_t)def;
+  }
+  // Sizes and the arena bound are checked again by ns_chat_set_room_caps.
+  return 0;
+}
+
+static void close_notify(const int *rfds, const int *wfds, int n) {
+  for (int i = 0; i < n; i++) {
+    close(rfds[i]);
+    if (wfds[i] != rfds[i]) close(wfds[i]);
+  }
+}
+
 static void usage(const char *prog) {
   fprintf(stderr,
-          "Usage: %s [--bind 0.0.0.0] [--port 9000] [--workers 4] [--shm /ns_shm]\n"
+          "Usage: %s [--bind 0.0.0.0] [--port 9000] [--workers 4] [--shm /ns_shm] [--integrity full,header,none]\n"
+          "       [--chat-flush-us 0] [--chat-room-caps ROOM:CAP,...[,CAP]] [--balance-push-us 5000]\n"
+          "       [--rate-limits CLASS=RATE[:BURST],...] [--shed-target-us 5000] [--shed-interval-ms 100]\n"
+          "       [--accept-rate 0]\n"
           "\n"
           "Environment variables (override defaults, overridden by CLI args):\n"
           "  NS_BIND_IP              Bind IP address (default: 0.0.0.0)\n"
           "  NS_PORT                 Port number (default: 9000)\n"
-          "  NS_WORKERS              Number of worker processes (default: 4, range: 1-1024)\n"
+          "  NS_WORKERS              Number of worker processes (default: 4, range: 1-64)\n"
           "  NS_SHM_NAME             Shared memory name (default: /ns_trading_chat)\n"
           "  NS_MAX_BODY_LEN         Max message body length (default: 65536, range: 1024-1048576)\n"
           "  NS_MAX_CONN_PER_WORKER  Max connections per worker (default: 1000, range: 1-100000)\n"
           "  NS_RECV_TIMEOUT_MS      Receive timeout in ms (default: 30000, range: 100-3600000)\n"
           "  NS_SEND_TIMEOUT_MS      Send timeout in ms (default: 30000, range: 100-3600000)\n"
+          "  NS_INTEGRITY_MODES      Integrity modes clients may negotiate (default: full; e.g. full,header,none)\n"
+          "  NS_ZEROCOPY_MIN         Min buffer size sent with MSG_ZEROCOPY, 0 disables (default: 16384)\n"
+          "  NS_CHAT_FLUSH_US        Chat push coalescing window in us, 0 disables (default: 0, range: 0-2000)\n"
+          "  NS_CHAT_MAX_MSG         Longest chat message accepted in bytes (default: 4096, range: 1-65535)\n"
+          "  NS_CHAT_ROOM_CAPS       Per-room chat history in bytes, e.g. 0:1048576,1:524288 (others split\n"
+          "                          the rest; a bare number sets them; total <= 4 MB, default: 64 KB each)\n"
+          "  NS_BALANCE_PUSH_US      Balance push coalescing window in us, 0 pushes each credit (default: 5000,\n"
+          "                          range: 0-1000000)\n"
+          "  NS_RATE_LIMITS          Per-user request limits per class (ledger, orders, chat, query), e.g.\n"
+          "                          ledger=200:400,chat=50 (per second[:burst]; default: none). Can be changed\n"
+          "                          while running with bin/metrics SHM --rate-limits SPEC\n"
+          "  NS_SHED_TARGET_US       Queueing delay above which requests are shed once it persists, 0 disables\n"
+          "                          (default: 5000, range: 0-1000000)\n"
+          "  NS_SHED_INTERVAL_MS     How long the delay must persist, and the longest delay accepted before\n"
+          "                          (default: 100, range: 1-10000)\n"
+          "  NS_ACCEPT_RATE          New connections accepted per second per worker, 0 = unlimited (default: 0)\n"
           "\n"
           "Example:\n"
           "  NS_WORKERS=8 NS_PORT=8080 %s\n"
@@ -96,6 +184,13 @@ int main(int argc, char **argv) {
   cfg.max_connections_per_worker = 1000; // Default limit per worker
   cfg.recv_timeout_ms = 30000; // 30 seconds
   cfg.send_timeout_ms = 30000; // 30 seconds
+  cfg.integrity_modes = 1u << NS_INTEGRITY_FULL; // CRC on every frame unless relaxed
+  cfg.zerocopy_min = 16384; // below this, page pinning + completion handling costs more than the copy
+  cfg.chat_max_msg = NS_CHAT_MSG_DEFAULT;
+  cfg.balance_push_us = 5000;
+  cfg.shed_target_us = 5000;
+  cfg.shed_interval_ms = 100;
+  cfg.accept_rate = 0;
 
   // Allow env overrides for quick tuning without recompiling.
   // Network settings
@@ -110,7 +205,7 @@ int main(int argc, char **argv) {
   }
   
   // Worker settings
-  cfg.workers = parse_env_i("NS_WORKERS", cfg.workers, 1, 1024);
+  cfg.workers = parse_env_i("NS_WORKERS", cfg.workers, 1, (int)NS_MAX_WORKERS);
   
   // Shared memory settings
   const char *env_shm = getenv("NS_SHM_NAME");
@@ -125,6 +220,18 @@ int main(int argc, char **argv) {
   cfg.max_connections_per_worker = parse_env_i("NS_MAX_CONN_PER_WORKER", cfg.max_connections_per_worker, 1, 100000);
   cfg.recv_timeout_ms = parse_env_i("NS_RECV_TIMEOUT_MS", cfg.recv_timeout_ms, 100, 3600000);
   cfg.send_timeout_ms = parse_env_i("NS_SEND_TIMEOUT_MS", cfg.send_timeout_ms, 100, 3600000);
+  cfg.zerocopy_min = (uint32_t)parse_env_i("NS_ZEROCOPY_MIN", (int)cfg.zerocopy_min, 0, 1048576);
+  cfg.chat_flush_us = (uint32_t)parse_env_i("NS_CHAT_FLUSH_US", (int)cfg.chat_flush_us, 0, 2000);
+  cfg.chat_max_msg = (uint32_t)parse_env_i("NS_CHAT_MAX_MSG", (int)cfg.chat_max_msg, 1, (int)NS_CHAT_MSG_LIMIT);
+  const char *chat_room_caps = getenv("NS_CHAT_ROOM_CAPS");
+  const char *rate_limits = getenv("NS_RATE_LIMITS");
+  cfg.balance_push_us = (uint32_t)parse_env_i("NS_BALANCE_PUSH_US", (int)cfg.balance_push_us, 0, 1000000);
+  cfg.shed_target_us = (uint32_t)parse_env_i("NS_SHED_TARGET_US", (int)cfg.shed_target_us, 0, 1000000);
+  cfg.shed_interval_ms = (uint32_t)parse_env_i("NS_SHED_INTERVAL_MS", (int)cfg.shed_interval_ms, 1, 10000);
+  cfg.accept_rate = (uint32_t)parse_env_i("NS_ACCEPT_RATE", (int)cfg.accept_rate, 0, 1000000);
+
+  // Integrity policy for this listener
+  const char *integrity_modes = getenv("NS_INTEGRITY_MODES");
 
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "--bind") == 0 && i + 1 < argc) {
@@ -133,8 +240,30 @@ int main(int argc, char **argv) {
       cfg.port = parse_u16(argv[++i], cfg.port);
     } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
       cfg.workers = parse_i(argv[++i], cfg.workers);
+      if (cfg.workers > (int)NS_MAX_WORKERS) cfg.workers = (int)NS_MAX_WORKERS; // one stats slot per worker in shm
     } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
       cfg.shm_name = argv[++i];
+    } else if (strcmp(argv[i], "--integrity") == 0 && i + 1 < argc) {
+      integrity_modes = argv[++i];
+    } else if (strcmp(argv[i], "--chat-flush-us") == 0 && i + 1 < argc) {
+      long v = strtol(argv[++i], NULL, 10);
+      if (v >= 0 && v <= 2000) cfg.chat_flush_us = (uint32_t)v;
+    } else if (strcmp(argv[i], "--chat-room-caps") == 0 && i + 1 < argc) {
+      chat_room_caps = argv[++i];
+    } else if (strcmp(argv[i], "--balance-push-us") == 0 && i + 1 < argc) {
+      long v = strtol(argv[++i], NULL, 10);
+      if (v >= 0 && v <= 1000000) cfg.balance_push_us = (uint32_t)v;
+    } else if (strcmp(argv[i], "--shed-target-us") == 0 && i + 1 < argc) {
+      long v = strtol(argv[++i], NULL, 10);
+      if (v >= 0 && v <= 1000000) cfg.shed_target_us = (uint32_t)v;
+    } else if (strcmp(argv[i], "--shed-interval-ms") == 0 && i + 1 < argc) {
+      long v = strtol(argv[++i], NULL, 10);
+      if (v >= 1 && v <= 10000) cfg.shed_interval_ms = (uint32_t)v;
+    } else if (strcmp(argv[i], "--accept-rate") == 0 && i + 1 < argc) {
+      long v = strtol(argv[++i], NULL, 10);
+      if (v >= 0 && v <= 1000000) cfg.accept_rate = (uint32_t)v;
+    } else if (strcmp(argv[i], "--rate-limits") == 0 && i + 1 < argc) {
+      rate_limits = argv[++i];
     } else if (strcmp(argv[i], "--help") == 0) {
       usage(argv[0]);
       return 0;
@@ -144,6 +273,39 @@ int main(int argc, char **argv) {
     }
   }
 
+  // A chat message must fit in the push body it is delivered in (which is larger than the CHAT_SEND request).
+  const uint32_t push_extra = NS_CHAT_BODY_HDR + NS_CHAT_BODY_SEQ;
+  if (cfg.chat_max_msg > cfg.max_body_len - push_extra) cfg.chat_max_msg = cfg.max_body_len - push_extra;
+
+  if (integrity_modes && *integrity_modes != '\0' &&
+      parse_integrity_modes(integrity_modes, &cfg.integrity_modes) != 0) {
+    LOG_ERROR("Invalid integrity modes '%s' (comma-separated full/header/none)", integrity_modes);
+    return 2;
+  }
+
+  uint32_t room_caps[NS_MAX_ROOMS];
+  for (uint32_t r = 0; r < NS_MAX_ROOMS; r++) room_caps[r] = NS_CHAT_ARENA_BYTES / NS_MAX_ROOMS;
+  if (chat_room_caps && *chat_room_caps != '\0' && parse_chat_room_caps(chat_room_caps, room_caps) != 0) {
+    LOG_ERROR("Invalid chat room capacities '%s' (ROOM:CAP entries and an optional default CAP >= %u, total <= %u)",
+              chat_room_caps, NS_CHAT_ROOM_MIN_BYTES, NS_CHAT_ARENA_BYTES);
+    return 2;
+  }
+  for (uint32_t r = 0; r < NS_MAX_ROOMS; r++) {
+    if (room_caps[r] < ns_chat_rec_size(cfg.chat_max_msg)) {
+      LOG_ERROR("Chat room %u capacity %u cannot hold a %u-byte message; lower NS_CHAT_MAX_MSG or raise the capacity",
+                r, room_caps[r], cfg.chat_max_msg);
+      return 2;
+    }
+  }
+
+  ns_rate_limit_t limits[NS_RL_CLASSES];
+  memset(limits, 0, sizeof(limits));
+  if (rate_limits && *rate_limits != '\0' && ns_rate_parse_limits(rate_limits, limits) != 0) {
+    LOG_ERROR("Invalid rate limits '%s' (CLASS=RATE[:BURST] entries, classes ledger/orders/chat/query, <= %u)",
+              rate_limits, NS_RATE_MAX);
+    return 2;
+  }
+
   signal(SIGINT, on_sig);
   signal(SIGTERM, on_sig);
 
@@ -156,6 +318,14 @@ int main(int argc, char **argv) {
     return 1;
   }
 
+  if (ns_chat_set_room_caps(shm_h.shm, room_caps) != 0) {
+    LOG_ERROR("Chat room capacities exceed the %u-byte arena", NS_CHAT_ARENA_BYTES);
+    ns_shm_close(&shm_h, cfg.shm_name, true);
+    return 2;
+  }
+
+  ns_rate_set_limits(shm_h.shm, limits);
+
   int listen_fd = net_listen_tcp(cfg.bind_ip, cfg.port, 4096, true);
   if (listen_fd < 0) {
     log_fatal_errno("listen failed");
@@ -163,38 +333,39 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  int notify_rfd = -1;
-  int notify_wfd = -1;
+  // One notification channel per worker, so a chat message wakes only the workers subscribed to its room.
+  int notify_rfds[NS_MAX_WORKERS];
+  int notify_wfds[NS_MAX_WORKERS];
+  int nchan = 0;
+  for (; nchan < cfg.workers; nchan++) {
 #ifdef __linux__
-  int efd = eventfd(0, EFD_NONBLOCK);
-  if (efd < 0) {
-    log_fatal_errno("eventfd failed");
-    close(listen_fd);
-    ns_shm_close(&shm_h, cfg.shm_name, true);
-    return 1;
-  }
-  notify_rfd = efd;
-  notify_wfd = efd;
+    int efd = eventfd(0, EFD_NONBLOCK);
+    if (efd < 0) break;
+    notify_rfds[nchan] = efd;
+    notify_wfds[nchan] = efd;
 #else
-  int pfd[2];
-  if (pipe(pfd) != 0) {
-    log_fatal_errno("pipe failed");
+    int pfd[2];
+    if (pipe(pfd) != 0) break;
+    (void)net_set_nonblocking(pfd[0], true);
+    (void)net_set_nonblocking(pfd[1], true);
+    notify_rfds[nchan] = pfd[0];
+    notify_wfds[nchan] = pfd[1];
+#endif
+  }
+  if (nchan < cfg.workers) {
+    log_fatal_errno("eventfd failed");
+    close_notify(notify_rfds, notify_wfds, nchan);
     close(listen_fd);
     ns_shm_close(&shm_h, cfg.shm_name, true);
     return 1;
   }
-  notify_rfd = pfd[0];
-  notify_wfd = pfd[1];
-#endif
 
-  LOG_INFO("Server starting: port=%u workers=%d shm=%s", cfg.port, cfg.workers, cfg.shm_name);
+  LOG_INFO("Server starting: port=%u workers=%d shm=%s integrity_modes=0x%x chat_flush_us=%u chat_max_msg=%u",
+           cfg.port, cfg.workers, cfg.shm_name, cfg.integrity_modes, cfg.chat_flush_us, cfg.chat_max_msg);
 
   pid_t *pids = (pid_t *)calloc((size_t)cfg.workers, sizeof(pid_t));
   if (!pids) {
-    if (notify_rfd >= 0) close(notify_rfd);
-#ifndef __linux__
-    if (notify_wfd >= 0) close(notify_wfd);
-#endif
+    close_notify(notify_rfds, notify_wfds, cfg.workers);
     close(listen_fd);
     ns_shm_close(&shm_h, cfg.shm_name, true);
     return 1;
@@ -209,7 +380,7 @@ int main(int argc, char **argv) {
     }
     if (pid == 0) {
       // worker
-      (void)worker_run2(w, listen_fd, notify_rfd, notify_wfd, shm_h.shm, &cfg);
+      (void)worker_run2(w, listen_fd, notify_rfds, notify_wfds, shm_h.shm, &cfg);
       _exit(0);
     }
     pids[w] = pid;
@@ -237,7 +408,7 @@ int main(int argc, char **argv) {
           pids[worker_idx] = 0; // Mark as failed
         } else if (new_pid == 0) {
           // worker
-          (void)worker_run2(worker_idx, listen_fd, notify_rfd, notify_wfd, shm_h.shm, &cfg);
+          (void)worker_run2(worker_idx, listen_fd, notify_rfds, notify_wfds, shm_h.shm, &cfg);
           _exit(0);
         } else {
           pids[worker_idx] = new_pid;
@@ -276,12 +447,7 @@ int main(int argc, char **argv) {
   }
 
   free(pids);
-#ifdef __linux__
-  close(notify_rfd);
-#else
-  close(notify_rfd);
-  close(notify_wfd);
-#endif
+  close_notify(notify_rfds, notify_wfds, cfg.workers);
   close(listen_fd);
   ns_shm_close(&shm_h, cfg.shm_name, true);
   LOG_INFO("Shutdown complete.");
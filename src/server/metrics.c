@@ -7,15 +7,20 @@
 #
 // Simple CLI tool to dump shared-memory metrics for debugging/auditing.
 // Usage:
-//   ./bin/metrics [shm_name]
+//   ./bin/metrics [shm_name] [--rate-limits CLASS=RATE[:BURST],...]
 // Default shm_name: /ns_trading_chat
+// --rate-limits changes the running server's per-user limits (unlisted classes keep theirs).
 #
 int main(int argc, char **argv)
 {
   const char *shm_name = "/ns_trading_chat";
-  if (argc >= 2)
+  const char *rate_limits = NULL;
+  for (int i = 1; i < argc; i++)
   {
-    shm_name = argv[1];
+    if (strcmp(argv[i], "--rate-limits") == 0 && i + 1 < argc)
+      rate_limits = argv[++i];
+    else
+      shm_name = argv[i];
   }
 
   log_set_program("metrics");
@@ -28,6 +33,19 @@ int main(int argc, char **argv)
   }
 
   ns_shm_t *s = h.shm;
+  if (rate_limits)
+  {
+    ns_rate_limit_t lim[NS_RL_CLASSES];
+    ns_rate_get_limits(s, lim);
+    if (ns_rate_parse_limits(rate_limits, lim) != 0)
+    {
+      fprintf(stderr, "Invalid rate limits '%s' (CLASS=RATE[:BURST], classes ledger/orders/chat/query)\n", rate_limits);
+      ns_shm_close(&h, NULL, false);
+      return 2;
+    }
+    ns_rate_set_limits(s, lim);
+  }
+
   printf("Shared memory metrics (shm=%s)\n", shm_name);
   printf("total_connections=%llu\n", (unsigned long long)s->total_connections);
   printf("total_requests=%llu\n", (unsigned long long)s->total_requests);
@@ -42,6 +60,122 @@ int main(int argc, char **argv)
     printf("  opcode=0x%04zx count=%llu\n", i, (unsigned long long)v);
   }
 
+  printf("workers:\n");
+  uint64_t dedup_hits = 0, dedup_lookups = 0;
+  uint64_t sched_lat[NS_SCHED_CLASSES][NS_LAT_BUCKETS] = {{0}};
+  for (uint32_t w = 0; w < NS_MAX_WORKERS; w++)
+  {
+    const ns_worker_stats_t *ws = &s->worker_stats[w];
+    if (ws->pid == 0)
+      continue;
+    uint64_t held = ws->conn_bytes + ws->rx_buf_bytes + ws->tx_buf_bytes;
+    printf("  worker=%u pid=%d connections=%u conn_bytes=%llu rx_buf_bytes=%llu tx_buf_bytes=%llu "
+           "pool_cached_bytes=%llu bytes_per_conn=%llu\n",
+           w, (int)ws->pid, ws->connections, (unsigned long long)ws->conn_bytes,
+           (unsigned long long)ws->rx_buf_bytes, (unsigned long long)ws->tx_buf_bytes,
+           (unsigned long long)ws->pool_cached_bytes,
+           (unsigned long long)(ws->connections ? held / ws->connections : 0));
+    printf("    tx_frames=%llu tx_bytes=%llu tx_bytes_copied=%llu copied_per_frame=%.1f tx_zerocopy_bytes=%llu\n",
+           (unsigned long long)ws->tx_frames, (unsigned long long)ws->tx_bytes,
+           (unsigned long long)ws->tx_bytes_copied,
+           ws->tx_frames ? (double)ws->tx_bytes_copied / (double)ws->tx_frames : 0.0,
+           (unsigned long long)ws->tx_zerocopy_bytes);
+    printf("    chat_events=%llu chat_frames=%llu events_per_frame=%.2f\n",
+           (unsigned long long)ws->chat_events, (unsigned long long)ws->chat_frames,
+           ws->chat_frames ? (double)ws->chat_events / (double)ws->chat_frames : 0.0);
+    printf("    chat_wakeups=%llu chat_overrun=%llu chat_replayed=%llu chat_resume_gaps=%llu\n",
+           (unsigned long long)ws->chat_wakeups, (unsigned long long)ws->chat_overrun,
+           (unsigned long long)ws->chat_replayed, (unsigned long long)ws->chat_resume_gaps);
+    printf("    dm_sent=%llu dm_delivered=%llu dm_stale=%llu dm_inbox_full=%llu\n", (unsigned long long)ws->dm_sent,
+           (unsigned long long)ws->dm_delivered, (unsigned long long)ws->dm_stale,
+           (unsigned long long)ws->dm_inbox_full);
+    printf("    bal_updates=%llu bal_pushes=%llu\n", (unsigned long long)ws->bal_updates,
+           (unsigned long long)ws->bal_pushes);
+    printf("    dedup_hits=%llu dedup_misses=%llu dedup_conflicts=%llu\n", (unsigned long long)ws->dedup_hits,
+           (unsigned long long)ws->dedup_misses, (unsigned long long)ws->dedup_conflicts);
+    printf("    orders_placed=%llu order_fills=%llu\n", (unsigned long long)ws->orders_placed,
+           (unsigned long long)ws->order_fills);
+    printf("    md_changes=%llu md_updates=%llu md_conflated=%llu\n", (unsigned long long)ws->md_changes,
+           (unsigned long long)ws->md_updates, (unsigned long long)ws->md_conflated);
+    printf("    throttled=%llu shed=%llu accepts_refused=%llu queue_delay_us=%llu overloaded=%u expired=%llu\n",
+           (unsigned long long)ws->throttled, (unsigned long long)ws->shed, (unsigned long long)ws->accepts_refused,
+           (unsigned long long)ws->queue_delay_us, ws->overloaded, (unsigned long long)ws->expired);
+    dedup_hits += ws->dedup_hits;
+    dedup_lookups += ws->dedup_hits + ws->dedup_misses + ws->dedup_conflicts;
+    for (uint32_t c = 0; c < NS_SCHED_CLASSES; c++)
+    {
+      for (uint32_t b = 0; b < NS_LAT_BUCKETS; b++)
+        sched_lat[c][b] += ws->sched_lat[c][b];
+    }
+  }
+
+  // Arrival (kernel receive time) -> response queued, per scheduling class over all workers.
+  // Percentiles are the upper bounds of power-of-two microsecond buckets.
+  printf("sched:\n");
+  for (uint32_t c = 0; c < NS_SCHED_CLASSES; c++)
+  {
+    uint64_t runs = 0;
+    for (uint32_t b = 0; b < NS_LAT_BUCKETS; b++)
+      runs += sched_lat[c][b];
+    printf("  class=%s runs=%llu p50_us<=%llu p99_us<=%llu p999_us<=%llu\n", ns_sched_class_name((ns_sched_class_t)c),
+           (unsigned long long)runs, (unsigned long long)ns_lat_percentile_us(sched_lat[c], 50.0),
+           (unsigned long long)ns_lat_percentile_us(sched_lat[c], 99.0),
+           (unsigned long long)ns_lat_percentile_us(sched_lat[c], 99.9));
+  }
+
+  // Idempotent ledger ops: hit_rate = retries answered from the table / idempotent requests.
+  printf("dedup: hits=%llu lookups=%llu hit_rate=%.4f entries_used=%u/%u table_bytes=%zu\n",
+         (unsigned long long)dedup_hits, (unsigned long long)dedup_lookups,
+         dedup_lookups ? (double)dedup_hits / (double)dedup_lookups : 0.0, ns_dedup_used(s),
+         NS_MAX_USERS * NS_DEDUP_WAYS, sizeof(s->dedup) + sizeof(s->dedup_next));
+
+  // Per-user limits per opcode class (rate 0 = unlimited) and the requests they refused.
+  printf("rate_limits:\n");
+  ns_rate_limit_t lim[NS_RL_CLASSES];
+  ns_rate_get_limits(s, lim);
+  for (uint32_t c = 0; c < NS_RL_CLASSES; c++)
+  {
+    printf("  class=%s rate=%u burst=%u throttled=%llu\n", ns_rate_class_name((ns_rate_class_t)c), lim[c].rate,
+           lim[c].burst, (unsigned long long)__atomic_load_n(&s->rate_throttled[c], __ATOMIC_RELAXED));
+  }
+
+  printf("books:\n");
+  for (uint32_t b = 0; b < NS_BOOK_SYMBOLS; b++)
+  {
+    const ns_book_t *bk = &s->books[b];
+    if (bk->arena_used == 0)
+      continue;
+    printf("  symbol=%u best_bid=%u best_ask=%u live_orders=%u arena_used=%u/%u trades=%llu volume=%llu\n", b,
+           bk->best_bid, bk->best_ask, bk->live_orders, bk->arena_used, NS_BOOK_ORDERS,
+           (unsigned long long)bk->trades, (unsigned long long)bk->volume);
+  }
+
+  // Latest value per symbol; version = publishes, of which subscribers only see the ones not conflated.
+  printf("market_data:\n");
+  for (uint32_t m = 0; m < NS_MD_SYMBOLS; m++)
+  {
+    ns_md_quote_t q;
+    if (!ns_md_read(s, m, &q) || q.version == 0)
+      continue;
+    printf("  symbol=%u bid=%u ask=%u last=%u@%u volume=%llu version=%llu workers=%d\n", m, q.bid, q.ask,
+           q.last_qty, q.last_price, (unsigned long long)q.volume, (unsigned long long)q.version,
+           __builtin_popcountll(__atomic_load_n(&s->md_workers[m], __ATOMIC_RELAXED)));
+  }
+
+  // Retained chat history per room; msg_share = message bytes / ring bytes in use.
+  printf("chat_rooms:\n");
+  for (uint16_t r = 0; r < (uint16_t)NS_MAX_ROOMS; r++)
+  {
+    uint64_t events = 0, bytes = 0, msg_bytes = 0;
+    ns_chat_room_usage(s, r, &events, &bytes, &msg_bytes);
+    if (ns_chat_latest_seq(s, r) == 0)
+      continue;
+    printf("  room=%u seq=%llu cap=%u retained_events=%llu retained_bytes=%llu bytes_per_event=%.1f msg_share=%.2f\n", r,
+           (unsigned long long)ns_chat_latest_seq(s, r), ns_chat_room_cap(s, r), (unsigned long long)events,
+           (unsigned long long)bytes, events ? (double)bytes / (double)events : 0.0,
+           bytes ? (double)msg_bytes / (double)bytes : 0.0);
+  }
+
   ns_shm_close(&h, NULL, false);
   return 0;
 }
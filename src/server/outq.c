@@ -0,0 +1,106 @@
+#include "outq.h"
+
+#include <string.h>
+
+#define OUTQ_MIN_SBUF 4096u
+
+ns_sbuf_t *ns_sbuf_new(ns_bufpool_t *p, size_t min_cap) {
+  size_t block = 0;
+  ns_sbuf_t *b = (ns_sbuf_t *)ns_bufpool_get(p, sizeof(ns_sbuf_t) + min_cap, &block);
+  if (!b) return NULL;
+  b->refs = 1;
+  b->len = 0;
+  b->cap = (uint32_t)(block - sizeof(ns_sbuf_t));
+  b->block = (uint32_t)block;
+  return b;
+}
+
+void ns_sbuf_unref(ns_bufpool_t *p, ns_sbuf_t *b) {
+  if (!b || --b->refs > 0) return;
+  ns_bufpool_put(p, (uint8_t *)b, b->block);
+}
+
+static ns_outq_ent_t *outq_tail(ns_outq_t *q) {
+  return q->count ? &q->ents[(q->head + q->count - 1u) % q->cap] : NULL;
+}
+
+// Room for one more entry; grows by moving to a larger pooled block.
+static int outq_reserve_ent(ns_outq_t *q, ns_bufpool_t *p) {
+  if (q->count < q->cap) return 0;
+  size_t block = 0;
+  size_t want = (q->cap ? (size_t)q->cap * 2u : 16u) * sizeof(ns_outq_ent_t);
+  ns_outq_ent_t *ents = (ns_outq_ent_t *)ns_bufpool_get(p, want, &block);
+  if (!ents) return -1;
+  for (uint32_t i = 0; i < q->count; i++) ents[i] = q->ents[(q->head + i) % q->cap];
+  if (q->ents) ns_bufpool_put(p, (uint8_t *)q->ents, q->ents_block);
+  q->ents = ents;
+  q->ents_block = (uint32_t)block;
+  q->cap = (uint32_t)(block / sizeof(ns_outq_ent_t));
+  q->head = 0;
+  return 0;
+}
+
+static void outq_push(ns_outq_t *q, ns_sbuf_t *b, uint32_t off, uint32_t len) {
+  ns_outq_ent_t *e = &q->ents[(q->head + q->count) % q->cap];
+  e->buf = b;
+  e->off = off;
+  e->len = len;
+  q->count++;
+  q->bytes += len;
+}
+
+uint8_t *ns_outq_reserve(ns_outq_t *q, ns_bufpool_t *p, size_t len) {
+  ns_outq_ent_t *t = outq_tail(q);
+  if (t && t->buf->refs == 1u && t->off + t->len == t->buf->len && t->buf->cap - t->buf->len >= len) {
+    uint8_t *dst = t->buf->data + t->buf->len;
+    t->buf->len += (uint32_t)len;
+    t->len += (uint32_t)len;
+    q->bytes += len;
+    return dst;
+  }
+  if (outq_reserve_ent(q, p) != 0) return NULL;
+  ns_sbuf_t *b = ns_sbuf_new(p, len > OUTQ_MIN_SBUF ? len : OUTQ_MIN_SBUF);
+  if (!b) return NULL;
+  b->len = (uint32_t)len;
+  outq_push(q, b, 0, (uint32_t)len);
+  return b->data;
+}
+
+int ns_outq_push_ref(ns_outq_t *q, ns_bufpool_t *p, ns_sbuf_t *b, uint32_t off, uint32_t len) {
+  if (outq_reserve_ent(q, p) != 0) return -1;
+  outq_push(q, ns_sbuf_ref(b), off, len);
+  return 0;
+}
+
+int ns_outq_iov(const ns_outq_t *q, struct iovec *iov, int max) {
+  int n = 0;
+  for (uint32_t i = 0; i < q->count && n < max; i++, n++) {
+    const ns_outq_ent_t *e = &q->ents[(q->head + i) % q->cap];
+    iov[n].iov_base = e->buf->data + e->off;
+    iov[n].iov_len = e->len;
+  }
+  return n;
+}
+
+void ns_outq_consume(ns_outq_t *q, ns_bufpool_t *p, size_t n) {
+  q->bytes -= n;
+  while (n > 0 && q->count > 0) {
+    ns_outq_ent_t *e = &q->ents[q->head];
+    if (n < e->len) {
+      e->off += (uint32_t)n;
+      e->len -= (uint32_t)n;
+      return;
+    }
+    n -= e->len;
+    ns_sbuf_unref(p, e->buf);
+    q->head = (q->head + 1u) % q->cap;
+    q->count--;
+  }
+  if (q->count == 0) ns_outq_clear(q, p);
+}
+
+void ns_outq_clear(ns_outq_t *q, ns_bufpool_t *p) {
+  for (uint32_t i = 0; i < q->count; i++) ns_sbuf_unref(p, q->ents[(q->head + i) % q->cap].buf);
+  if (q->ents) ns_bufpool_put(p, (uint8_t *)q->ents, q->ents_block);
+  memset(q, 0, sizeof(*q));
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "bufpool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// Refcounted output buffer, carved from a worker's bufpool block.
+// A broadcast payload is built once and referenced by every recipient's queue.
+typedef struct {
+  uint32_t refs;
+  uint32_t len;   // bytes written
+  uint32_t cap;   // usable bytes in data[]
+  uint32_t block; // size of the pool block holding this buffer
+  uint8_t data[];
+} ns_sbuf_t;
+
+// New buffer with refs=1 and at least min_cap usable bytes, or NULL.
+ns_sbuf_t *ns_sbuf_new(ns_bufpool_t *p, size_t min_cap);
+static inline ns_sbuf_t *ns_sbuf_ref(ns_sbuf_t *b) {
+  b->refs++;
+  return b;
+}
+void ns_sbuf_unref(ns_bufpool_t *p, ns_sbuf_t *b);
+
+typedef struct {
+  ns_sbuf_t *buf;
+  uint32_t off;
+  uint32_t len;
+} ns_outq_ent_t;
+
+// Per-connection output queue of buffer references, flushed with writev.
+// The entry array is attached from the pool while the queue is non-empty.
+typedef struct {
+  ns_outq_ent_t *ents; // circular, cap entries
+  uint32_t cap;
+  uint32_t ents_block; // pool block size holding ents
+  uint32_t head;
+  uint32_t count;
+  size_t bytes; // pending bytes
+} ns_outq_t;
+
+static inline size_t ns_outq_pending(const ns_outq_t *q) { return q->bytes; }
+
+// Reserve len contiguous bytes at the tail for the caller to fill in place.
+// Appends to the last buffer when it is private and has room. NULL on OOM.
+uint8_t *ns_outq_reserve(ns_outq_t *q, ns_bufpool_t *p, size_t len);
+// Queue [off, off+len) of a shared buffer; takes its own reference.
+int ns_outq_push_ref(ns_outq_t *q, ns_bufpool_t *p, ns_sbuf_t *b, uint32_t off, uint32_t len);
+// Fill up to max iovecs from the head; returns the number filled.
+int ns_outq_iov(const ns_outq_t *q, struct iovec *iov, int max);
+// Head entry (for per-entry sends); NULL when empty.
+static inline const ns_outq_ent_t *ns_outq_front(const ns_outq_t *q) { return q->count ? &q->ents[q->head] : NULL; }
+// i-th entry from the head, i < q->count.
+static inline const ns_outq_ent_t *ns_outq_at(const ns_outq_t *q, uint32_t i) { return &q->ents[(q->head + i) % q->cap]; }
+// Drop n sent bytes from the head, releasing finished buffers.
+void ns_outq_consume(ns_outq_t *q, ns_bufpool_t *p, size_t n);
+void ns_outq_clear(ns_outq_t *q, ns_bufpool_t *p);
@@ -0,0 +1,62 @@
+#define _GNU_SOURCE
+#include "ring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+int ns_ring_init(ns_ring_t *r, size_t cap) {
+  memset(r, 0, sizeof(*r));
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  if (cap == 0) cap = page;
+  cap = (cap + page - 1u) / page * page;
+
+  int fd = memfd_create("ns_ring", MFD_CLOEXEC);
+  if (fd < 0) return -1;
+  if (ftruncate(fd, (off_t)cap) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  // Reserve 2*cap of address space, then map the same pages into both halves.
+  uint8_t *base = (uint8_t *)mmap(NULL, 2u * cap, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+  if (mmap(base, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+      mmap(base + cap, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    int saved = errno;
+    munmap(base, 2u * cap);
+    close(fd);
+    errno = saved;
+    return -1;
+  }
+  close(fd); // the mappings keep the memory alive
+
+  r->base = base;
+  r->cap = cap;
+  return 0;
+}
+
+void ns_ring_free(ns_ring_t *r) {
+  if (!r || !r->base) return;
+  munmap(r->base, 2u * r->cap);
+  memset(r, 0, sizeof(*r));
+}
+
+int ns_ring_resize(ns_ring_t *r, size_t cap) {
+  size_t len = ns_ring_len(r);
+  if (cap < len) {
+    errno = EINVAL;
+    return -1;
+  }
+  ns_ring_t nr;
+  if (ns_ring_init(&nr, cap) != 0) return -1;
+  if (len) memcpy(nr.base, ns_ring_data(r), len);
+  nr.tail = len;
+  ns_ring_free(r);
+  *r = nr;
+  return 0;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Mirrored-mapping byte ring (Linux-only).
+// The same pages are mapped twice back to back, so any readable or writable
+// span is contiguous in memory even when it wraps: frames are parsed in place
+// and a partial trailing frame never has to be moved to the front.
+typedef struct {
+  uint8_t *base; // 2 * cap bytes of address space; [cap, 2*cap) mirrors [0, cap)
+  size_t cap;    // multiple of the page size
+  uint64_t head; // read position (monotonic)
+  uint64_t tail; // write position (monotonic)
+} ns_ring_t;
+
+// cap is rounded up to a page multiple. Returns 0 on success, -1 with errno set.
+int ns_ring_init(ns_ring_t *r, size_t cap);
+void ns_ring_free(ns_ring_t *r);
+// Move to a ring of at least cap bytes (rounded up to a page multiple),
+// carrying over unread bytes. cap must be >= ns_ring_len(r). On failure r is unchanged.
+int ns_ring_resize(ns_ring_t *r, size_t cap);
+
+static inline size_t ns_ring_len(const ns_ring_t *r) { return (size_t)(r->tail - r->head); }
+static inline size_t ns_ring_space(const ns_ring_t *r) { return r->cap - ns_ring_len(r); }
+
+// Contiguous view of ns_ring_len() readable bytes.
+static inline uint8_t *ns_ring_data(const ns_ring_t *r) { return r->base + (size_t)(r->head % r->cap); }
+// Contiguous view of ns_ring_space() writable bytes.
+static inline uint8_t *ns_ring_tail(const ns_ring_t *r) { return r->base + (size_t)(r->tail % r->cap); }
+
+static inline void ns_ring_commit(ns_ring_t *r, size_t n) { r->tail += n; }
+static inline void ns_ring_consume(ns_ring_t *r, size_t n) {
+  r->head += n;
+  if (r->head == r->tail) r->head = r->tail = 0;
+}
@@ -20,6 +20,12 @@ static uint64_t now_ms(void) {
   return (uint64_t)ts.tv_sec * 1000ull + (uint64_t)(ts.tv_nsec / 1000000ull);
 }
 
+static uint64_t now_mono_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
 int ns_shm_create_or_open(ns_shm_handle_t *out, const char *name, bool create) {
   memset(out, 0, sizeof(*out));
   int flags = O_RDWR;
@@ -70,11 +76,11 @@ int ns_shm_init_if_needed(ns_shm_handle_t *h) {
   }
 
   ns_shm_t *s = h->shm;
-  if (s->magic == NS_SHM_MAGIC && s->version == 1u) return 0;
+  if (s->magic == NS_SHM_MAGIC && s->version == NS_SHM_VERSION) return 0;
 
   memset(s, 0, sizeof(*s));
   s->magic = NS_SHM_MAGIC;
-  s->version = 1u;
+  s->version = NS_SHM_VERSION;
 
   // Nonce: best-effort randomness
   uint64_t seed = now_ms() ^ ((uint64_t)getpid() << 32u);
@@ -85,18 +91,27 @@ int ns_shm_init_if_needed(ns_shm_handle_t *h) {
   if (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0) return -1;
 
   if (init_mutex(&s->user_mu, &attr) != 0) return -1;
-  if (init_mutex(&s->chat_mu, &attr) != 0) return -1;
   if (init_mutex(&s->txn_mu, &attr) != 0) return -1;
 
   for (uint32_t i = 0; i < NS_MAX_USERS; i++) {
     if (init_mutex(&s->acct_mu[i], &attr) != 0) return -1;
-    s->balance[i] = 100000; // initial balance for demos/tests
+    s->balance[NS_ASSET_CASH][i] = NS_INITIAL_CASH; // initial balance for demos/tests
   }
   for (uint32_t r = 0; r < NS_MAX_ROOMS; r++) {
     if (init_mutex(&s->room_mu[r], &attr) != 0) return -1;
+    if (init_mutex(&s->chat_rooms[r].mu, &attr) != 0) return -1;
+  }
+  for (uint32_t i = 0; i < NS_MAX_WORKERS; i++) {
+    if (init_mutex(&s->inbox[i].mu, &attr) != 0) return -1;
   }
+  for (uint32_t i = 0; i < NS_BOOK_SYMBOLS; i++) {
+    if (init_mutex(&s->books[i].mu, &attr) != 0) return -1;
+  }
+  if (init_mutex(&s->leaderboard.mu, &attr) != 0) return -1;
+  ns_leaderboard_reset(s);
 
   pthread_mutexattr_destroy(&attr);
+  if (ns_chat_set_room_caps(s, NULL) != 0) return -1;
   LOG_INFO("Initialized shared memory state (nonce=%llu)", (unsigned long long)s->server_nonce);
   return 0;
 }
@@ -136,6 +151,10 @@ int ns_user_find_or_create(ns_shm_t *s, const char *uname, uint32_t *out_user_id
       s->user_online[id] = true;
       memset(s->username[id], 0, NS_MAX_USERNAME);
       memcpy(s->username[id], uname, n);
+      // Rank the user from now on, under acct_mu like every other leaderboard update
+      pthread_mutex_lock(&s->acct_mu[id]);
+      ns_leaderboard_update(s, id);
+      pthread_mutex_unlock(&s->acct_mu[id]);
       *out_user_id = id;
       return 0;
     }
@@ -175,52 +194,628 @@ bool ns_room_is_member(const ns_shm_t *s, uint16_t room_id, uint32_t user_id) {
   return bit_get(s->room_members[room_id], user_id);
 }
 
-void ns_chat_append(ns_shm_t *s, uint16_t room_id, uint32_t from_user_id, const char *msg, uint16_t msg_len) {
-  if (!s || !msg) return;
+void ns_room_set_worker(ns_shm_t *s, uint16_t room_id, uint32_t worker_id, bool interested) {
+  if (!s) return;
   if (room_id >= NS_MAX_ROOMS) return;
-  if (msg_len > NS_MAX_CHAT_MSG) msg_len = NS_MAX_CHAT_MSG;
+  if (worker_id >= NS_MAX_WORKERS) return;
+  uint64_t bit = 1ull << worker_id;
+  if (interested) {
+    (void)__atomic_fetch_or(&s->room_workers[room_id], bit, __ATOMIC_SEQ_CST);
+  } else {
+    (void)__atomic_fetch_and(&s->room_workers[room_id], ~bit, __ATOMIC_SEQ_CST);
+  }
+}
 
-  pthread_mutex_lock(&s->chat_mu);
-  uint64_t seq = ++s->chat_write_seq;
-  ns_chat_event_t *e = &s->chat_ring[seq % NS_CHAT_RING_SIZE];
-  memset(e, 0, sizeof(*e));
-  e->seq = seq;
-  e->ts_ms = now_ms();
-  e->room_id = room_id;
-  e->from_user_id = from_user_id;
-  e->msg_len = msg_len;
-  memcpy(e->msg, msg, msg_len);
-  pthread_mutex_unlock(&s->chat_mu);
+uint64_t ns_room_workers(const ns_shm_t *s, uint16_t room_id) {
+  if (!s) return 0;
+  if (room_id >= NS_MAX_ROOMS) return 0;
+  return __atomic_load_n(&s->room_workers[room_id], __ATOMIC_SEQ_CST);
+}
+
+// Route layout: connection generation (32) | worker id + 1 (8) | connection slot (24).
+#define ROUTE_SLOT_MASK 0xffffffull
+
+uint64_t ns_route_set(ns_shm_t *s, uint32_t user_id, uint32_t worker_id, uint64_t conn_handle) {
+  if (!s || user_id >= NS_MAX_USERS || worker_id >= NS_MAX_WORKERS) return 0;
+  if ((conn_handle & 0xffffffffull) > ROUTE_SLOT_MASK) return 0;
+  uint64_t route = (conn_handle & ~0xffffffffull) | ((uint64_t)(worker_id + 1u) << 24u) | (conn_handle & ROUTE_SLOT_MASK);
+  __atomic_store_n(&s->user_route[user_id], route, __ATOMIC_RELEASE);
+  return route;
+}
+
+bool ns_route_clear(ns_shm_t *s, uint32_t user_id, uint64_t route) {
+  if (!s || user_id >= NS_MAX_USERS || route == 0) return false;
+  return __atomic_compare_exchange_n(&s->user_route[user_id], &route, 0, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+bool ns_route_get(const ns_shm_t *s, uint32_t user_id, uint32_t *out_worker_id, uint64_t *out_conn_handle) {
+  if (!s || user_id >= NS_MAX_USERS) return false;
+  uint64_t route = __atomic_load_n(&s->user_route[user_id], __ATOMIC_ACQUIRE);
+  if (route == 0) return false;
+  if (out_worker_id) *out_worker_id = (uint32_t)((route >> 24u) & 0xffu) - 1u;
+  if (out_conn_handle) *out_conn_handle = (route & ~0xffffffffull) | (route & ROUTE_SLOT_MASK);
+  return true;
+}
+
+void ns_route_clear_worker(ns_shm_t *s, uint32_t worker_id) {
+  if (!s || worker_id >= NS_MAX_WORKERS) return;
+  for (uint32_t u = 0; u < NS_MAX_USERS; u++) {
+    uint64_t route = __atomic_load_n(&s->user_route[u], __ATOMIC_ACQUIRE);
+    if (route != 0 && ((route >> 24u) & 0xffu) == worker_id + 1u && ns_route_clear(s, u, route)) {
+      ns_balance_watch_set(s, u, false);
+    }
+  }
+}
+
+void ns_balance_watch_set(ns_shm_t *s, uint32_t user_id, bool on) {
+  if (!s || user_id >= NS_MAX_USERS) return;
+  uint64_t bit = 1ull << (user_id % 64u);
+  if (on) {
+    (void)__atomic_fetch_or(&s->balance_watch[user_id / 64u], bit, __ATOMIC_RELEASE);
+  } else {
+    (void)__atomic_fetch_and(&s->balance_watch[user_id / 64u], ~bit, __ATOMIC_RELEASE);
+  }
+}
+
+bool ns_balance_watched(const ns_shm_t *s, uint32_t user_id) {
+  if (!s || user_id >= NS_MAX_USERS) return false;
+  return (__atomic_load_n(&s->balance_watch[user_id / 64u], __ATOMIC_ACQUIRE) >> (user_id % 64u) & 1ull) != 0;
+}
+
+// Slot fields are accessed with relaxed atomics: readers may race a writer and throw the copy away.
+#define MD_LOAD(f) __atomic_load_n(&(f), __ATOMIC_RELAXED)
+#define MD_STORE(f, v) __atomic_store_n(&(f), (v), __ATOMIC_RELAXED)
+
+uint64_t ns_md_publish(ns_shm_t *s, uint32_t symbol, uint32_t bid, uint32_t ask, uint32_t trade_price,
+                       uint32_t trade_qty) {
+  if (!s || symbol >= NS_MD_SYMBOLS) return 0;
+  ns_md_slot_t *m = &s->md[symbol];
+  uint32_t seq = __atomic_load_n(&m->seq, __ATOMIC_RELAXED);
+  while ((seq & 1u) != 0u ||
+         !__atomic_compare_exchange_n(&m->seq, &seq, seq + 1u, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    seq = __atomic_load_n(&m->seq, __ATOMIC_RELAXED);
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE); // the odd seq is visible before any field changes
+
+  MD_STORE(m->q.bid, bid);
+  MD_STORE(m->q.ask, ask);
+  if (trade_qty > 0) {
+    MD_STORE(m->q.last_price, trade_price);
+    MD_STORE(m->q.last_qty, trade_qty);
+    MD_STORE(m->q.volume, MD_LOAD(m->q.volume) + trade_qty);
+  }
+  MD_STORE(m->q.version, MD_LOAD(m->q.version) + 1u);
+  MD_STORE(m->q.ts_ns, now_mono_ns());
+  __atomic_store_n(&m->seq, seq + 2u, __ATOMIC_RELEASE);
+
+  uint64_t wake = 0;
+  uint64_t workers = __atomic_load_n(&s->md_workers[symbol], __ATOMIC_SEQ_CST);
+  while (workers) {
+    uint32_t w = (uint32_t)__builtin_ctzll(workers);
+    workers &= workers - 1u;
+    if (__atomic_fetch_or(&s->md_dirty[w], 1ull << symbol, __ATOMIC_SEQ_CST) == 0) wake |= 1ull << w;
+  }
+  return wake;
+}
+
+bool ns_md_read(const ns_shm_t *s, uint32_t symbol, ns_md_quote_t *out) {
+  if (!s || symbol >= NS_MD_SYMBOLS) return false;
+  const ns_md_slot_t *m = &s->md[symbol];
+  while (true) {
+    uint32_t before = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+    if ((before & 1u) != 0u) continue;
+    out->bid = MD_LOAD(m->q.bid);
+    out->ask = MD_LOAD(m->q.ask);
+    out->last_price = MD_LOAD(m->q.last_price);
+    out->last_qty = MD_LOAD(m->q.last_qty);
+    out->volume = MD_LOAD(m->q.volume);
+    out->version = MD_LOAD(m->q.version);
+    out->ts_ns = MD_LOAD(m->q.ts_ns);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&m->seq, __ATOMIC_RELAXED) == before) return true;
+  }
+}
+
+void ns_md_set_worker(ns_shm_t *s, uint32_t symbol, uint32_t worker_id, bool interested) {
+  if (!s || symbol >= NS_MD_SYMBOLS || worker_id >= NS_MAX_WORKERS) return;
+  uint64_t bit = 1ull << worker_id;
+  if (interested) {
+    (void)__atomic_fetch_or(&s->md_workers[symbol], bit, __ATOMIC_SEQ_CST);
+  } else {
+    (void)__atomic_fetch_and(&s->md_workers[symbol], ~bit, __ATOMIC_SEQ_CST);
+  }
+}
+
+uint64_t ns_md_take_dirty(ns_shm_t *s, uint32_t worker_id) {
+  if (!s || worker_id >= NS_MAX_WORKERS) return 0;
+  return __atomic_exchange_n(&s->md_dirty[worker_id], 0, __ATOMIC_SEQ_CST);
+}
+
+enum { LB_NONE = 0, LB_TOP = 1, LB_REST = 2 };
+
+// Rank order: higher balance first, lower user id on ties.
+static bool lb_better(const ns_leaderboard_t *lb, uint32_t a, uint32_t b) {
+  return lb->key[a] > lb->key[b] || (lb->key[a] == lb->key[b] && a < b);
+}
+
+// Whether a belongs above b: the top heap keeps its worst member at the root, the rest heap its best.
+static bool lb_above(const ns_leaderboard_t *lb, uint8_t heap, uint32_t a, uint32_t b) {
+  return heap == LB_TOP ? lb_better(lb, b, a) : lb_better(lb, a, b);
+}
+
+static void lb_place(ns_leaderboard_t *lb, uint8_t heap, uint32_t i, uint32_t user_id) {
+  (heap == LB_TOP ? lb->top : lb->rest)[i] = user_id;
+  lb->pos[user_id] = (uint16_t)i;
+  lb->heap[user_id] = heap;
+}
+
+// Move the entry at i up or down to where its key now belongs.
+static void lb_sift(ns_leaderboard_t *lb, uint8_t heap, uint32_t i) {
+  const uint32_t *a = heap == LB_TOP ? lb->top : lb->rest;
+  const uint32_t n = heap == LB_TOP ? lb->top_len : lb->rest_len;
+  const uint32_t u = a[i];
+  while (i > 0 && lb_above(lb, heap, u, a[(i - 1u) / 2u])) {
+    lb_place(lb, heap, i, a[(i - 1u) / 2u]);
+    i = (i - 1u) / 2u;
+  }
+  while (2u * i + 1u < n) {
+    uint32_t c = 2u * i + 1u;
+    if (c + 1u < n && lb_above(lb, heap, a[c + 1u], a[c])) c++;
+    if (!lb_above(lb, heap, a[c], u)) break;
+    lb_place(lb, heap, i, a[c]);
+    i = c;
+  }
+  lb_place(lb, heap, i, u);
+}
+
+void ns_leaderboard_update(ns_shm_t *s, uint32_t user_id) {
+  if (!s || user_id >= NS_MAX_USERS || !s->user_used[user_id]) return; // e.g. a transfer to an unclaimed id
+  ns_leaderboard_t *lb = &s->leaderboard;
+  pthread_mutex_lock(&lb->mu);
+  lb->key[user_id] = s->balance[NS_ASSET_CASH][user_id];
+  if (lb->heap[user_id] == LB_NONE) {
+    if (lb->top_len < NS_LEADERBOARD_K) {
+      lb_place(lb, LB_TOP, lb->top_len++, user_id);
+    } else {
+      lb_place(lb, LB_REST, lb->rest_len++, user_id);
+    }
+  }
+  lb_sift(lb, lb->heap[user_id], lb->pos[user_id]);
+  // Only one key changed, so at most one pair of users trades places between the heaps.
+  if (lb->top_len == NS_LEADERBOARD_K && lb->rest_len > 0 && lb_better(lb, lb->rest[0], lb->top[0])) {
+    uint32_t up = lb->rest[0], down = lb->top[0];
+    lb_place(lb, LB_TOP, 0, up);
+    lb_place(lb, LB_REST, 0, down);
+    lb_sift(lb, LB_TOP, 0);
+    lb_sift(lb, LB_REST, 0);
+  }
+  pthread_mutex_unlock(&lb->mu);
+}
+
+uint32_t ns_leaderboard_top(ns_shm_t *s, ns_lb_entry_t *out, uint32_t max) {
+  if (!s || !out) return 0;
+  ns_leaderboard_t *lb = &s->leaderboard;
+  ns_lb_entry_t all[NS_LEADERBOARD_K];
+  pthread_mutex_lock(&lb->mu);
+  const uint32_t n = lb->top_len;
+  for (uint32_t i = 0; i < n; i++) {
+    all[i].user_id = lb->top[i];
+    all[i].balance = lb->key[lb->top[i]];
+  }
+  pthread_mutex_unlock(&lb->mu);
+  // Insertion sort of at most K entries, best first.
+  for (uint32_t i = 1; i < n; i++) {
+    ns_lb_entry_t v = all[i];
+    uint32_t j = i;
+    while (j > 0 && (all[j - 1].balance < v.balance ||
+                     (all[j - 1].balance == v.balance && all[j - 1].user_id > v.user_id))) {
+      all[j] = all[j - 1];
+      j--;
+    }
+    all[j] = v;
+  }
+  const uint32_t m = n < max ? n : max;
+  memcpy(out, all, (size_t)m * sizeof(*out));
+  return m;
+}
+
+void ns_leaderboard_reset(ns_shm_t *s) {
+  if (!s) return;
+  ns_leaderboard_t *lb = &s->leaderboard;
+  pthread_mutex_lock(&lb->mu);
+  lb->top_len = 0;
+  lb->rest_len = 0;
+  memset(lb->heap, 0, sizeof(lb->heap));
+  pthread_mutex_unlock(&lb->mu);
+  for (uint32_t u = 0; u < NS_MAX_USERS; u++) {
+    if (s->user_used[u]) ns_leaderboard_update(s, u);
+  }
+}
+
+ns_dedup_result_t ns_dedup_lookup(const ns_shm_t *s, uint32_t user_id, uint64_t req_id, uint16_t opcode,
+                                  uint32_t body_crc, uint16_t *out_status, int64_t *out_balance) {
+  if (!s || user_id >= NS_MAX_USERS || req_id == 0) return NS_DEDUP_MISS;
+  for (uint32_t i = 0; i < NS_DEDUP_WAYS; i++) {
+    const ns_dedup_entry_t *e = &s->dedup[user_id][i];
+    if (e->req_id != req_id) continue;
+    if (e->opcode != opcode || e->body_crc != body_crc) return NS_DEDUP_CONFLICT;
+    if (out_status) *out_status = e->status;
+    if (out_balance) *out_balance = e->balance;
+    return NS_DEDUP_HIT;
+  }
+  return NS_DEDUP_MISS;
+}
+
+void ns_dedup_record(ns_shm_t *s, uint32_t user_id, uint64_t req_id, uint16_t opcode, uint32_t body_crc,
+                     uint16_t status, int64_t balance) {
+  if (!s || user_id >= NS_MAX_USERS || req_id == 0) return;
+  uint8_t slot = s->dedup_next[user_id];
+  ns_dedup_entry_t *e = &s->dedup[user_id][slot % NS_DEDUP_WAYS];
+  e->req_id = req_id;
+  e->body_crc = body_crc;
+  e->opcode = opcode;
+  e->status = status;
+  e->balance = balance;
+  s->dedup_next[user_id] = (uint8_t)((slot + 1u) % NS_DEDUP_WAYS);
+}
+
+uint32_t ns_dedup_used(const ns_shm_t *s) {
+  if (!s) return 0;
+  uint32_t n = 0;
+  for (uint32_t u = 0; u < NS_MAX_USERS; u++) {
+    if (!s->user_used[u]) continue;
+    for (uint32_t i = 0; i < NS_DEDUP_WAYS; i++) n += s->dedup[u][i].req_id != 0;
+  }
+  return n;
+}
+
+int ns_inbox_push(ns_shm_t *s, uint32_t worker_id, uint64_t conn_handle, uint32_t to_user_id, uint32_t kind,
+                  const uint8_t *data, uint32_t len) {
+  if (!s || !data || len == 0 || worker_id >= NS_MAX_WORKERS) return -1;
+  uint32_t need = ns_inbox_rec_size(len);
+  if (need > NS_INBOX_BYTES) return -1;
+
+  ns_inbox_t *ib = &s->inbox[worker_id];
+  int rc = -1;
+  pthread_mutex_lock(&ib->mu);
+  uint64_t tail = ib->tail; // only producers move tail, under mu
+  uint64_t head = __atomic_load_n(&ib->head, __ATOMIC_ACQUIRE);
+  uint32_t left = NS_INBOX_BYTES - (uint32_t)(tail % NS_INBOX_BYTES);
+  uint32_t skip = need > left ? left : 0;
+  if (tail + skip + need - head <= NS_INBOX_BYTES) {
+    if (skip >= sizeof(ns_inbox_rec_t)) {
+      ns_inbox_rec_t *m = (ns_inbox_rec_t *)(ib->buf + tail % NS_INBOX_BYTES);
+      memset(m, 0, sizeof(*m));
+      m->size = skip;
+    }
+    tail += skip;
+    ns_inbox_rec_t *r = (ns_inbox_rec_t *)(ib->buf + tail % NS_INBOX_BYTES);
+    r->size = need;
+    r->frame_len = len;
+    r->conn_handle = conn_handle;
+    r->to_user_id = to_user_id;
+    r->kind = kind;
+    memcpy(r + 1, data, len);
+    __atomic_store_n(&ib->tail, tail + need, __ATOMIC_RELEASE);
+    rc = 0;
+  }
+  pthread_mutex_unlock(&ib->mu);
+  return rc;
+}
+
+const ns_inbox_rec_t *ns_inbox_peek(ns_shm_t *s, uint32_t worker_id) {
+  if (!s || worker_id >= NS_MAX_WORKERS) return NULL;
+  ns_inbox_t *ib = &s->inbox[worker_id];
+  uint64_t head = __atomic_load_n(&ib->head, __ATOMIC_RELAXED); // only this worker moves head
+  uint64_t tail = __atomic_load_n(&ib->tail, __ATOMIC_ACQUIRE);
+  while (head < tail) {
+    uint32_t left = NS_INBOX_BYTES - (uint32_t)(head % NS_INBOX_BYTES);
+    const ns_inbox_rec_t *r = (const ns_inbox_rec_t *)(ib->buf + head % NS_INBOX_BYTES);
+    if (left >= sizeof(ns_inbox_rec_t) && r->frame_len != 0) return r;
+    head += left;
+    __atomic_store_n(&ib->head, head, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+void ns_inbox_pop(ns_shm_t *s, uint32_t worker_id, const ns_inbox_rec_t *rec) {
+  if (!s || !rec || worker_id >= NS_MAX_WORKERS) return;
+  ns_inbox_t *ib = &s->inbox[worker_id];
+  uint64_t head = __atomic_load_n(&ib->head, __ATOMIC_RELAXED);
+  __atomic_store_n(&ib->head, head + rec->size, __ATOMIC_RELEASE);
+}
+
+void ns_inbox_reset(ns_shm_t *s, uint32_t worker_id) {
+  if (!s || worker_id >= NS_MAX_WORKERS) return;
+  ns_inbox_t *ib = &s->inbox[worker_id];
+  __atomic_store_n(&ib->head, __atomic_load_n(&ib->tail, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+static uint32_t chat_default_cap(void) { return NS_CHAT_ARENA_BYTES / NS_MAX_ROOMS; }
+
+int ns_chat_set_room_caps(ns_shm_t *s, const uint32_t *caps) {
+  if (!s) {
+    errno = EINVAL;
+    return -1;
+  }
+  uint64_t total = 0;
+  for (uint32_t r = 0; r < NS_MAX_ROOMS; r++) {
+    uint32_t cap = (caps ? caps[r] : chat_default_cap()) & ~7u;
+    if (cap < NS_CHAT_ROOM_MIN_BYTES) {
+      errno = EINVAL;
+      return -1;
+    }
+    total += cap;
+  }
+  if (total > NS_CHAT_ARENA_BYTES) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  // Index slots follow the byte layout: sum(cap / REC_MIN) <= ARENA / REC_MIN.
+  uint32_t base = 0, idx_base = 0;
+  for (uint32_t r = 0; r < NS_MAX_ROOMS; r++) {
+    ns_chat_room_t *room = &s->chat_rooms[r];
+    uint32_t cap = (caps ? caps[r] : chat_default_cap()) & ~7u;
+    pthread_mutex_lock(&room->mu);
+    if (room->base != base || room->cap != cap) {
+      room->base = base;
+      room->cap = cap;
+      room->idx_base = idx_base;
+      room->idx_cap = cap / NS_CHAT_REC_MIN;
+      room->head_seq = 1;
+      room->head_pos = room->tail_pos = 0;
+      room->live_msg_bytes = 0;
+      __atomic_store_n(&room->write_seq, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&room->mu);
+    base += cap;
+    idx_base += cap / NS_CHAT_REC_MIN;
+  }
+  return 0;
+}
+
+uint32_t ns_chat_room_cap(const ns_shm_t *s, uint16_t room_id) {
+  if (!s || room_id >= NS_MAX_ROOMS) return 0;
+  return s->chat_rooms[room_id].cap;
+}
+
+void ns_chat_room_usage(ns_shm_t *s, uint16_t room_id, uint64_t *out_events, uint64_t *out_bytes,
+                        uint64_t *out_msg_bytes) {
+  uint64_t events = 0, bytes = 0, msg_bytes = 0;
+  if (s && room_id < NS_MAX_ROOMS) {
+    ns_chat_room_t *room = &s->chat_rooms[room_id];
+    pthread_mutex_lock(&room->mu);
+    events = room->write_seq + 1u - room->head_seq;
+    bytes = room->tail_pos - room->head_pos;
+    msg_bytes = room->live_msg_bytes;
+    pthread_mutex_unlock(&room->mu);
+  }
+  if (out_events) *out_events = events;
+  if (out_bytes) *out_bytes = bytes;
+  if (out_msg_bytes) *out_msg_bytes = msg_bytes;
+}
+
+static ns_chat_rec_t *chat_rec_at(ns_shm_t *s, const ns_chat_room_t *room, uint64_t pos) {
+  return (ns_chat_rec_t *)(s->chat_arena + room->base + (uint32_t)(pos % room->cap));
+}
+
+// Bytes left before the end of the ring at pos, when they are a gap rather than a record. Caller holds room->mu.
+static uint32_t chat_gap_at(ns_shm_t *s, const ns_chat_room_t *room, uint64_t pos) {
+  uint32_t left = room->cap - (uint32_t)(pos % room->cap);
+  if (left < sizeof(ns_chat_rec_t) || chat_rec_at(s, room, pos)->frame_len == 0) return left;
+  return 0;
+}
+
+// Drop the oldest record (or wrap gap). Caller holds room->mu and the ring is not empty.
+static void chat_evict_one(ns_shm_t *s, ns_chat_room_t *room) {
+  uint32_t gap = chat_gap_at(s, room, room->head_pos);
+  if (gap) {
+    room->head_pos += gap;
+    return;
+  }
+  const ns_chat_rec_t *r = chat_rec_at(s, room, room->head_pos);
+  room->head_pos += r->size;
+  room->head_seq++;
+  room->live_msg_bytes -= r->msg_len;
+}
+
+int ns_chat_append(ns_shm_t *s, uint16_t room_id, uint32_t from_user_id, const char *msg, uint16_t msg_len) {
+  if (!s || (!msg && msg_len)) return -1;
+  if (room_id >= NS_MAX_ROOMS) return -1;
+
+  // Build the push frame outside the lock; every worker sends these bytes as-is. The seq is
+  // the body's last field, so the CRC over everything before it is computed here too and only
+  // extended over the 8 seq bytes once the seq is assigned.
+  uint8_t small[512];
+  uint32_t frame_len = ns_chat_frame_len(msg_len);
+  uint8_t *frame = frame_len <= sizeof(small) ? small : (uint8_t *)malloc(frame_len);
+  if (!frame) return -1;
+  uint8_t *body = frame + sizeof(ns_header_t);
+  uint32_t body_len = NS_CHAT_BODY_HDR + (uint32_t)msg_len + NS_CHAT_BODY_SEQ;
+  ns_put_be16(body + 0, room_id);
+  ns_put_be32(body + 2, from_user_id);
+  ns_put_be16(body + 6, msg_len);
+  if (msg_len) memcpy(body + NS_CHAT_BODY_HDR, msg, msg_len);
+  ns_build_header((ns_header_t *)frame, 0, OP_CHAT_BROADCAST, ST_OK, 0, NULL, body_len);
+  const uint32_t seq_off = (uint32_t)sizeof(ns_header_t) + body_len - NS_CHAT_BODY_SEQ;
+  uint32_t partial = ns_frame_checksum((const ns_header_t *)frame, body, body_len - NS_CHAT_BODY_SEQ);
+
+  uint32_t need = ns_chat_rec_size(msg_len);
+  ns_chat_room_t *room = &s->chat_rooms[room_id];
+  int rc = -1;
+  pthread_mutex_lock(&room->mu);
+  if (need <= room->cap) {
+    // A record never straddles the end: claim the tail gap first, then room for the record.
+    uint32_t left = room->cap - (uint32_t)(room->tail_pos % room->cap);
+    if (need > left) {
+      while (room->tail_pos + left - room->head_pos > room->cap) chat_evict_one(s, room);
+      if (left >= sizeof(ns_chat_rec_t)) {
+        ns_chat_rec_t *m = chat_rec_at(s, room, room->tail_pos);
+        memset(m, 0, sizeof(*m));
+        m->size = left;
+      }
+      room->tail_pos += left;
+    }
+    while (room->tail_pos + need - room->head_pos > room->cap) chat_evict_one(s, room);
+
+    uint64_t seq = room->write_seq + 1u;
+    ns_chat_rec_t *r = chat_rec_at(s, room, room->tail_pos);
+    r->size = need;
+    r->frame_len = frame_len;
+    r->seq = seq;
+    r->ts_ms = now_ms();
+    r->from_user_id = from_user_id;
+    r->room_id = room_id;
+    r->msg_len = msg_len;
+    uint8_t *dst = (uint8_t *)(r + 1);
+    memcpy(dst, frame, seq_off);
+    ns_put_be64(dst + seq_off, seq);
+    ns_put_be32(&((ns_header_t *)dst)->checksum, ns_crc32_extend(partial, dst + seq_off, NS_CHAT_BODY_SEQ));
+    s->chat_index[room->idx_base + (uint32_t)(seq % room->idx_cap)] = room->tail_pos;
+    room->tail_pos += need;
+    room->live_msg_bytes += msg_len;
+    __atomic_store_n(&room->write_seq, seq, __ATOMIC_RELEASE); // peeked without the lock by ns_chat_latest_seq
+    rc = 0;
+  }
+  pthread_mutex_unlock(&room->mu);
+  if (frame != small) free(frame);
+  return rc;
+}
+
+uint64_t ns_chat_latest_seq(const ns_shm_t *s, uint16_t room_id) {
+  if (!s || room_id >= NS_MAX_ROOMS) return 0;
+  return __atomic_load_n(&s->chat_rooms[room_id].write_seq, __ATOMIC_ACQUIRE);
+}
+
+void ns_chat_cursor_latest(ns_shm_t *s, uint16_t room_id, ns_chat_cursor_t *out) {
+  memset(out, 0, sizeof(*out));
+  if (!s || room_id >= NS_MAX_ROOMS) return;
+  ns_chat_room_t *room = &s->chat_rooms[room_id];
+  pthread_mutex_lock(&room->mu);
+  out->seq = room->write_seq;
+  out->pos = room->tail_pos;
+  pthread_mutex_unlock(&room->mu);
+}
+
+// Cursor before event after_seq + 1, clamped to the retained range. Caller holds room->mu.
+static uint64_t chat_cursor_at(ns_shm_t *s, const ns_chat_room_t *room, uint64_t after_seq, ns_chat_cursor_t *out) {
+  if (after_seq >= room->write_seq) {
+    out->seq = room->write_seq;
+    out->pos = room->tail_pos;
+    return 0;
+  }
+  if (after_seq + 1u < room->head_seq) {
+    out->seq = room->head_seq - 1u;
+    out->pos = room->head_pos;
+    return room->head_seq - 1u - after_seq;
+  }
+  out->seq = after_seq;
+  out->pos = s->chat_index[room->idx_base + (uint32_t)((after_seq + 1u) % room->idx_cap)];
+  return 0;
 }
 
-uint64_t ns_chat_latest_seq(const ns_shm_t *s) {
-  return s ? s->chat_write_seq : 0;
+uint64_t ns_chat_cursor_seek(ns_shm_t *s, uint16_t room_id, uint64_t after_seq, ns_chat_cursor_t *out) {
+  memset(out, 0, sizeof(*out));
+  if (!s || room_id >= NS_MAX_ROOMS) return 0;
+  ns_chat_room_t *room = &s->chat_rooms[room_id];
+  pthread_mutex_lock(&room->mu);
+  uint64_t missed = chat_cursor_at(s, room, after_seq, out);
+  pthread_mutex_unlock(&room->mu);
+  return missed;
 }
 
-uint64_t ns_chat_read_from(ns_shm_t *s, uint64_t *inout_seq, ns_chat_event_t *out_events, uint32_t max_events) {
-  if (!s || !inout_seq || !out_events || max_events == 0) return 0;
+void ns_chat_cursor_last(ns_shm_t *s, uint16_t room_id, uint32_t last, ns_chat_cursor_t *out) {
+  memset(out, 0, sizeof(*out));
+  if (!s || room_id >= NS_MAX_ROOMS) return;
+  ns_chat_room_t *room = &s->chat_rooms[room_id];
+  pthread_mutex_lock(&room->mu);
+  uint64_t after = room->write_seq > last ? room->write_seq - last : 0;
+  if (after + 1u < room->head_seq) after = room->head_seq - 1u;
+  (void)chat_cursor_at(s, room, after, out);
+  pthread_mutex_unlock(&room->mu);
+}
 
-  pthread_mutex_lock(&s->chat_mu);
-  uint64_t latest = s->chat_write_seq;
-  uint64_t seq = *inout_seq;
+uint64_t ns_chat_read_frames(ns_shm_t *s, uint16_t room_id, ns_chat_cursor_t *cur, ns_chat_frame_ref_t *out_refs,
+                             uint32_t max_events, uint8_t *buf, size_t buf_cap, uint64_t *out_overrun) {
+  if (!s || !cur || !out_refs || !buf || max_events == 0 || room_id >= NS_MAX_ROOMS) return 0;
 
-  if (seq + NS_CHAT_RING_SIZE < latest) {
-    // fell behind; skip to the oldest available
-    seq = latest > NS_CHAT_RING_SIZE ? (latest - NS_CHAT_RING_SIZE) : 0;
+  ns_chat_room_t *room = &s->chat_rooms[room_id];
+  pthread_mutex_lock(&room->mu);
+  if (cur->seq > room->write_seq || cur->pos > room->tail_pos) {
+    // The ring was reset under this reader; continue from the present.
+    cur->seq = room->write_seq;
+    cur->pos = room->tail_pos;
+  } else if (cur->seq + 1u < room->head_seq || cur->pos < room->head_pos) {
+    // Fell behind: the next events were evicted. Resume at the oldest retained one.
+    if (out_overrun && room->head_seq > cur->seq + 1u) *out_overrun += room->head_seq - (cur->seq + 1u);
+    cur->seq = room->head_seq - 1u;
+    cur->pos = room->head_pos;
   }
 
   uint64_t count = 0;
-  for (uint64_t cur = seq + 1; cur <= latest && count < max_events; cur++) {
-    out_events[count] = s->chat_ring[cur % NS_CHAT_RING_SIZE];
+  size_t off = 0;
+  const uint8_t *ring = s->chat_arena + room->base;
+  uint32_t at = (uint32_t)(cur->pos % room->cap); // ring offset of cur->pos, advanced without dividing
+  while (cur->pos < room->tail_pos && count < max_events) {
+    uint32_t left = room->cap - at;
+    const ns_chat_rec_t *r = (const ns_chat_rec_t *)(ring + at);
+    if (left < sizeof(ns_chat_rec_t) || r->frame_len == 0) {
+      cur->pos += left;
+      at = 0;
+      continue;
+    }
+    if (r->seq != cur->seq + 1u) {
+      // Out of step with the ring (should not happen under the lock); resynchronize at the tail.
+      if (out_overrun) *out_overrun += room->write_seq - cur->seq;
+      cur->seq = room->write_seq;
+      cur->pos = room->tail_pos;
+      break;
+    }
+    if (off + r->frame_len > buf_cap) break;
+    memcpy(buf + off, r + 1, r->frame_len);
+    out_refs[count].seq = r->seq;
+    out_refs[count].ts_ms = r->ts_ms;
+    out_refs[count].room_id = r->room_id;
+    out_refs[count].msg_len = r->msg_len;
+    out_refs[count].from_user_id = r->from_user_id;
+    out_refs[count].off = (uint32_t)off;
+    out_refs[count].len = r->frame_len;
+    off += r->frame_len;
     count++;
-    seq = cur;
+    cur->seq = r->seq;
+    cur->pos += r->size;
+    at += r->size;
+    if (at == room->cap) at = 0;
   }
-  *inout_seq = seq;
-  pthread_mutex_unlock(&s->chat_mu);
+  pthread_mutex_unlock(&room->mu);
   return count;
 }
 
-void ns_txn_append(ns_shm_t *s, uint16_t opcode, uint16_t status, uint32_t from_uid, uint32_t to_uid, int64_t amount) {
+// Thread e (already filled in) onto its users' history chains. Caller holds txn_mu.
+static void txn_link(ns_shm_t *s, ns_txn_event_t *e) {
+  if (e->from_user_id < NS_MAX_USERS) {
+    e->prev_from_seq = s->txn_user_head[e->from_user_id];
+    s->txn_user_head[e->from_user_id] = e->seq;
+  }
+  if (e->to_user_id < NS_MAX_USERS && e->to_user_id != e->from_user_id) {
+    e->prev_to_seq = s->txn_user_head[e->to_user_id];
+    s->txn_user_head[e->to_user_id] = e->seq;
+  }
+}
+
+// The retained event with this seq, or NULL if it was never written or has been overwritten.
+static const ns_txn_event_t *txn_at(const ns_shm_t *s, uint64_t seq) {
+  const ns_txn_event_t *e = &s->txn_ring[seq % NS_TXN_RING_SIZE];
+  return seq != 0 && e->seq == seq ? e : NULL;
+}
+
+static uint64_t txn_prev(const ns_txn_event_t *e, uint32_t user_id) {
+  return e->from_user_id == user_id ? e->prev_from_seq : e->prev_to_seq;
+}
+
+void ns_txn_append_asset(ns_shm_t *s, uint8_t asset, uint16_t opcode, uint16_t status, uint32_t from_uid,
+                         uint32_t to_uid, int64_t amount) {
   if (!s) return;
   pthread_mutex_lock(&s->txn_mu);
   uint64_t seq = ++s->txn_write_seq;
@@ -232,29 +827,252 @@ void ns_txn_append(ns_shm_t *s, uint16_t opcode, uint16_t status, uint32_t from_
   e->status = status;
   e->from_user_id = from_uid;
   e->to_user_id = to_uid;
+  e->asset = asset;
   e->amount = amount;
+  txn_link(s, e);
+  pthread_mutex_unlock(&s->txn_mu);
+}
+
+void ns_txn_append(ns_shm_t *s, uint16_t opcode, uint16_t status, uint32_t from_uid, uint32_t to_uid, int64_t amount) {
+  ns_txn_append_asset(s, NS_ASSET_CASH, opcode, status, from_uid, to_uid, amount);
+}
+
+uint32_t ns_txn_history(ns_shm_t *s, uint32_t user_id, uint64_t before_seq, ns_txn_event_t *out, uint32_t max) {
+  if (!s || !out || user_id >= NS_MAX_USERS) return 0;
+  uint32_t n = 0;
+  pthread_mutex_lock(&s->txn_mu);
+  uint64_t seq = s->txn_user_head[user_id];
+  if (before_seq != 0) {
+    // Continue from an event of this user; anything else (or an evicted one) ends the history.
+    const ns_txn_event_t *e = txn_at(s, before_seq);
+    seq = e && (e->from_user_id == user_id || e->to_user_id == user_id) ? txn_prev(e, user_id) : 0;
+  }
+  while (n < max) {
+    const ns_txn_event_t *e = txn_at(s, seq);
+    if (!e) break;
+    out[n++] = *e;
+    seq = txn_prev(e, user_id);
+  }
+  pthread_mutex_unlock(&s->txn_mu);
+  return n;
+}
+
+void ns_txn_append_batch(ns_shm_t *s, uint16_t opcode, uint16_t status, uint32_t from_uid,
+                         const ns_transfer_leg_t *legs, uint32_t n) {
+  if (!s || !legs || n == 0 || n > UINT16_MAX) return;
+  uint64_t ts = now_ms();
+  pthread_mutex_lock(&s->txn_mu);
+  for (uint32_t i = 0; i < n; i++) {
+    uint64_t seq = ++s->txn_write_seq;
+    ns_txn_event_t *e = &s->txn_ring[seq % NS_TXN_RING_SIZE];
+    memset(e, 0, sizeof(*e));
+    e->seq = seq;
+    e->ts_ms = ts;
+    e->opcode = opcode;
+    e->status = status;
+    e->from_user_id = from_uid;
+    e->to_user_id = legs[i].to_user_id;
+    e->batch_idx = (uint16_t)i;
+    e->batch_len = (uint16_t)n;
+    e->amount = legs[i].amount;
+    txn_link(s, e);
+  }
   pthread_mutex_unlock(&s->txn_mu);
 }
 
-int ns_check_asset_conservation(const ns_shm_t *s, int64_t *out_current_total, int64_t *out_expected_total) {
+uint32_t ns_acct_lock_many(ns_shm_t *s, uint32_t *ids, uint32_t n) {
+  if (!s || !ids) return 0;
+  // Insertion sort: n is at most NS_TRANSFER_MULTI_MAX + 1
+  for (uint32_t i = 1; i < n; i++) {
+    uint32_t v = ids[i];
+    uint32_t j = i;
+    while (j > 0 && ids[j - 1] > v) {
+      ids[j] = ids[j - 1];
+      j--;
+    }
+    ids[j] = v;
+  }
+  uint32_t m = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (ids[i] >= NS_MAX_USERS || (m > 0 && ids[m - 1] == ids[i])) continue;
+    ids[m++] = ids[i];
+  }
+  for (uint32_t i = 0; i < m; i++) pthread_mutex_lock(&s->acct_mu[ids[i]]);
+  return m;
+}
+
+void ns_acct_unlock_many(ns_shm_t *s, const uint32_t *ids, uint32_t n) {
+  if (!s || !ids) return;
+  for (uint32_t i = n; i > 0; i--) pthread_mutex_unlock(&s->acct_mu[ids[i - 1]]);
+}
+
+static const char *const rate_class_names[NS_RL_CLASSES] = {"ledger", "orders", "chat", "query"};
+
+ns_rate_class_t ns_rate_class(uint16_t opcode) {
+  switch (opcode) {
+    case OP_DEPOSIT:
+    case OP_WITHDRAW:
+    case OP_TRANSFER:
+    case OP_TRANSFER_MULTI:
+      return NS_RL_LEDGER;
+    case OP_ORDER_PLACE:
+    case OP_ORDER_CANCEL:
+    case OP_MD_PUBLISH:
+      return NS_RL_ORDERS;
+    case OP_CHAT_SEND:
+    case OP_DIRECT_MSG:
+      return NS_RL_CHAT;
+    case OP_BALANCE:
+    case OP_TXN_HISTORY:
+    case OP_LEADERBOARD:
+      return NS_RL_QUERY;
+    default:
+      return NS_RL_NONE;
+  }
+}
+
+const char *ns_rate_class_name(ns_rate_class_t cls) {
+  return cls < NS_RL_CLASSES ? rate_class_names[cls] : "none";
+}
+
+static const char *const sched_class_names[NS_SCHED_CLASSES] = {"trading", "control", "chat"};
+
+ns_sched_class_t ns_sched_class(uint16_t opcode) {
+  switch (opcode) {
+    case OP_CHAT_SEND:
+    case OP_DIRECT_MSG:
+      return NS_SCHED_CHAT;
+    case OP_HELLO:
+    case OP_LOGIN:
+    case OP_LOGOUT:
+    case OP_HEARTBEAT:
+    case OP_JOIN_ROOM:
+    case OP_LEAVE_ROOM:
+    case OP_BALANCE_SUBSCRIBE:
+    case OP_MD_SUBSCRIBE:
+      return NS_SCHED_CONTROL;
+    default:
+      return NS_SCHED_TRADING;
+  }
+}
+
+const char *ns_sched_class_name(ns_sched_class_t cls) {
+  return cls < NS_SCHED_CLASSES ? sched_class_names[cls] : "unknown";
+}
+
+uint32_t ns_lat_bucket(uint64_t us) {
+  uint32_t b = us ? 64u - (uint32_t)__builtin_clzll(us) : 0u;
+  return b < NS_LAT_BUCKETS ? b : NS_LAT_BUCKETS - 1u;
+}
+
+uint64_t ns_lat_percentile_us(const uint64_t hist[NS_LAT_BUCKETS], double pct) {
+  uint64_t total = 0;
+  for (uint32_t b = 0; b < NS_LAT_BUCKETS; b++) total += hist[b];
+  if (total == 0) return 0;
+  uint64_t rank = (uint64_t)((double)total * pct / 100.0);
+  if (rank >= total) rank = total - 1u;
+  uint64_t seen = 0;
+  for (uint32_t b = 0; b < NS_LAT_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen > rank) return 1ull << b;
+  }
+  return 1ull << (NS_LAT_BUCKETS - 1u);
+}
+
+void ns_rate_set_limits(ns_shm_t *s, const ns_rate_limit_t lim[NS_RL_CLASSES]) {
+  if (!s || !lim) return;
+  for (uint32_t c = 0; c < NS_RL_CLASSES; c++) {
+    uint64_t v = lim[c].rate ? ((uint64_t)lim[c].rate << 32u) | (lim[c].burst ? lim[c].burst : 1u) : 0u;
+    __atomic_store_n(&s->rate_limit[c], v, __ATOMIC_RELAXED);
+  }
+}
+
+void ns_rate_get_limits(const ns_shm_t *s, ns_rate_limit_t out[NS_RL_CLASSES]) {
+  if (!s || !out) return;
+  for (uint32_t c = 0; c < NS_RL_CLASSES; c++) {
+    uint64_t v = __atomic_load_n(&s->rate_limit[c], __ATOMIC_RELAXED);
+    out[c].rate = (uint32_t)(v >> 32u);
+    out[c].burst = (uint32_t)v;
+  }
+}
+
+uint64_t ns_rate_consume(ns_shm_t *s, uint32_t user_id, ns_rate_class_t cls, uint64_t now_ns) {
+  if (!s || user_id >= NS_MAX_USERS || cls >= NS_RL_CLASSES) return 0;
+  uint64_t lim = __atomic_load_n(&s->rate_limit[cls], __ATOMIC_RELAXED);
+  const uint32_t rate = (uint32_t)(lim >> 32u);
+  if (rate == 0) return 0;
+  // A token every interval; a bucket that has been idle holds burst of them, i.e. the due time
+  // may run up to window ahead of now.
+  const uint64_t interval = 1000000000ull / rate;
+  const uint64_t window = interval * (uint32_t)lim;
+  uint64_t *tat = &s->rate_tat[user_id][cls];
+  uint64_t cur = __atomic_load_n(tat, __ATOMIC_RELAXED);
+  while (true) {
+    uint64_t next = (cur > now_ns ? cur : now_ns) + interval;
+    if (next - now_ns > window) return next - now_ns - window;
+    if (__atomic_compare_exchange_n(tat, &cur, next, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return 0;
+  }
+}
+
+int ns_rate_parse_limits(const char *spec, ns_rate_limit_t lim[NS_RL_CLASSES]) {
+  if (!spec || !lim) return -1;
+  ns_rate_limit_t out[NS_RL_CLASSES];
+  memcpy(out, lim, sizeof(out));
+  const char *p = spec;
+  while (*p != '\0') {
+    const char *eq = strchr(p, '=');
+    if (!eq) return -1;
+    uint32_t cls = 0;
+    while (cls < NS_RL_CLASSES && (strlen(rate_class_names[cls]) != (size_t)(eq - p) ||
+                                   strncmp(p, rate_class_names[cls], (size_t)(eq - p)) != 0)) {
+      cls++;
+    }
+    if (cls == NS_RL_CLASSES) return -1;
+    char *end = NULL;
+    unsigned long rate = strtoul(eq + 1, &end, 10);
+    if (end == eq + 1 || rate > NS_RATE_MAX) return -1;
+    unsigned long burst = rate;
+    if (*end == ':') {
+      const char *b = end + 1;
+      burst = strtoul(b, &end, 10);
+      if (end == b || burst == 0 || burst > NS_RATE_MAX) return -1;
+    }
+    if (*end != ',' && *end != '\0') return -1;
+    out[cls].rate = (uint32_t)rate;
+    out[cls].burst = (uint32_t)burst;
+    p = *end == ',' ? end + 1 : end;
+  }
+  memcpy(lim, out, sizeof(out));
+  return 0;
+}
+
+// Sum of one asset column; a plain loop over contiguous int64s, which the compiler vectorizes.
+static int64_t column_sum(const int64_t *col, uint32_t n) {
+  int64_t sum = 0;
+  for (uint32_t i = 0; i < n; i++) sum += col[i];
+  return sum;
+}
+
+int ns_check_asset_conservation(const ns_shm_t *s, int64_t out_current_total[NS_ASSETS],
+                                int64_t out_expected_total[NS_ASSETS]) {
   if (!s || !out_current_total || !out_expected_total) {
     errno = EINVAL;
     return -1;
   }
 
-  // Compute current sum of balances (need to lock all account mutexes)
-  int64_t current_total = 0;
-  for (uint32_t i = 0; i < NS_MAX_USERS; i++) {
-    pthread_mutex_lock((pthread_mutex_t *)&s->acct_mu[i]);
-    current_total += s->balance[i];
-    pthread_mutex_unlock((pthread_mutex_t *)&s->acct_mu[i]);
-  }
+  // Take every account lock (ascending, the ledger's lock order) so all columns are summed from
+  // one consistent snapshot; this blocks every ledger op until the sums are done, so call it
+  // sparingly at runtime. Cash held by resting buy orders still belongs to its owner
+  pthread_mutex_t *acct_mu = (pthread_mutex_t *)s->acct_mu;
+  for (uint32_t i = 0; i < NS_MAX_USERS; i++) pthread_mutex_lock(&acct_mu[i]);
+  for (uint32_t a = 0; a < NS_ASSETS; a++) out_current_total[a] = column_sum(s->balance[a], NS_MAX_USERS);
+  out_current_total[NS_ASSET_CASH] += column_sum(s->escrow, NS_MAX_USERS);
+  for (uint32_t i = NS_MAX_USERS; i > 0; i--) pthread_mutex_unlock(&acct_mu[i - 1]);
 
-  // Compute expected total: initial_total + deposits - withdrawals
-  // Initial total: NS_MAX_USERS * 100000 (from shm_state.c line 91)
-  const int64_t initial_total = (int64_t)NS_MAX_USERS * 100000LL;
-  int64_t deposits = 0;
-  int64_t withdrawals = 0;
+  // Expected per asset: initial_total + deposits - withdrawals. Every user starts with
+  // NS_INITIAL_CASH and no instruments; fills and transfers only move units between users.
+  for (uint32_t a = 0; a < NS_ASSETS; a++) out_expected_total[a] = 0;
+  out_expected_total[NS_ASSET_CASH] = (int64_t)NS_MAX_USERS * NS_INITIAL_CASH;
 
   pthread_mutex_lock((pthread_mutex_t *)&s->txn_mu);
   uint64_t latest_seq = s->txn_write_seq;
@@ -263,22 +1081,22 @@ int ns_check_asset_conservation(const ns_shm_t *s, int64_t *out_current_total, i
   for (uint64_t seq = start_seq; seq <= latest_seq; seq++) {
     const ns_txn_event_t *e = &s->txn_ring[seq % NS_TXN_RING_SIZE];
     if (e->seq != seq) continue; // Skip uninitialized entries
-    if (e->status != ST_OK) continue; // Only count successful transactions
-    
+    if (e->status != ST_OK || e->asset >= NS_ASSETS) continue; // Only count successful transactions
+
     if (e->opcode == OP_DEPOSIT) {
-      deposits += e->amount;
+      out_expected_total[e->asset] += e->amount;
     } else if (e->opcode == OP_WITHDRAW) {
-      withdrawals += e->amount;
+      out_expected_total[e->asset] -= e->amount;
     }
-    // TRANSFER doesn't change total (debit + credit cancel out)
+    // TRANSFER and fills don't change totals (debit + credit cancel out)
   }
   pthread_mutex_unlock((pthread_mutex_t *)&s->txn_mu);
 
-  int64_t expected_total = initial_total + deposits - withdrawals;
-  *out_current_total = current_total;
-  *out_expected_total = expected_total;
-
-  return (current_total == expected_total) ? 0 : -1;
+  int rc = 0;
+  for (uint32_t a = 0; a < NS_ASSETS; a++) {
+    if (out_current_total[a] != out_expected_total[a]) rc = -1;
+  }
+  return rc;
 }
 
 
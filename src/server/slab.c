@@ -0,0 +1,91 @@
+#include "slab.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  uint32_t gen;       // odd = allocated
+  uint32_t next_free; // valid while free
+} slot_hdr_t;
+
+// Objects start after the header at max_align_t alignment.
+#define SLOT_HDR_SIZE ((sizeof(slot_hdr_t) + _Alignof(max_align_t) - 1u) & ~(_Alignof(max_align_t) - 1u))
+
+static slot_hdr_t *slot_hdr(const ns_slab_t *s, uint32_t idx) {
+  uint8_t *chunk = s->chunks[idx / NS_SLAB_CHUNK_SLOTS];
+  return (slot_hdr_t *)(chunk + (size_t)(idx % NS_SLAB_CHUNK_SLOTS) * s->stride);
+}
+
+static void *slot_obj(slot_hdr_t *h) { return (uint8_t *)h + SLOT_HDR_SIZE; }
+
+int ns_slab_init(ns_slab_t *s, size_t obj_size, uint32_t max_slots) {
+  memset(s, 0, sizeof(*s));
+  if (obj_size == 0 || max_slots == 0) return -1;
+  if (max_slots > NS_SLAB_MAX_SLOTS) max_slots = NS_SLAB_MAX_SLOTS;
+  size_t align = _Alignof(max_align_t);
+  s->obj_size = obj_size;
+  s->stride = (SLOT_HDR_SIZE + obj_size + align - 1u) & ~(align - 1u);
+  s->max_slots = max_slots;
+  s->free_head = UINT32_MAX;
+  size_t maxchunks = ((size_t)max_slots + NS_SLAB_CHUNK_SLOTS - 1u) / NS_SLAB_CHUNK_SLOTS;
+  s->chunks = (uint8_t **)calloc(maxchunks, sizeof(uint8_t *));
+  return s->chunks ? 0 : -1;
+}
+
+void ns_slab_destroy(ns_slab_t *s) {
+  if (!s || !s->chunks) return;
+  for (size_t i = 0; i < s->nchunks; i++) free(s->chunks[i]);
+  free(s->chunks);
+  memset(s, 0, sizeof(*s));
+}
+
+void *ns_slab_alloc(ns_slab_t *s, uint64_t *out_handle) {
+  uint32_t idx;
+  slot_hdr_t *h;
+  if (s->free_head != UINT32_MAX) {
+    idx = s->free_head;
+    h = slot_hdr(s, idx);
+    s->free_head = h->next_free;
+  } else {
+    if (s->hwm >= s->max_slots) return NULL;
+    idx = s->hwm;
+    if (idx / NS_SLAB_CHUNK_SLOTS >= s->nchunks) {
+      uint8_t *chunk = (uint8_t *)calloc(NS_SLAB_CHUNK_SLOTS, s->stride);
+      if (!chunk) return NULL;
+      s->chunks[s->nchunks++] = chunk;
+    }
+    s->hwm++;
+    h = slot_hdr(s, idx);
+  }
+  h->gen++; // even -> odd
+  s->live++;
+  void *obj = slot_obj(h);
+  memset(obj, 0, s->obj_size);
+  *out_handle = ((uint64_t)h->gen << 32) | idx;
+  return obj;
+}
+
+void ns_slab_free(ns_slab_t *s, uint64_t handle) {
+  uint32_t idx = (uint32_t)handle;
+  if (idx >= s->hwm) return;
+  slot_hdr_t *h = slot_hdr(s, idx);
+  if (h->gen != (uint32_t)(handle >> 32) || (h->gen & 1u) == 0u) return;
+  h->gen++; // odd -> even
+  h->next_free = s->free_head;
+  s->free_head = idx;
+  s->live--;
+}
+
+void *ns_slab_get(const ns_slab_t *s, uint64_t handle) {
+  uint32_t idx = (uint32_t)handle;
+  if (idx >= s->hwm) return NULL;
+  slot_hdr_t *h = slot_hdr(s, idx);
+  if (h->gen != (uint32_t)(handle >> 32) || (h->gen & 1u) == 0u) return NULL;
+  return slot_obj(h);
+}
+
+void *ns_slab_at(const ns_slab_t *s, uint32_t idx) {
+  if (idx >= s->hwm) return NULL;
+  slot_hdr_t *h = slot_hdr(s, idx);
+  return (h->gen & 1u) ? slot_obj(h) : NULL;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-worker slab of fixed-size objects (single-threaded, no locking).
+// Objects live in chunks that are never moved or returned to the OS while the
+// slab exists, so pointers stay valid and connect/disconnect storms reuse
+// slots from a free list instead of going through malloc/free.
+//
+// Each slot carries a generation counter: odd while allocated, even while
+// free, bumped on every alloc and free. A handle packs (generation << 32 | slot),
+// so a handle kept after its object was freed (e.g. a stale epoll event for a
+// reused fd) fails ns_slab_get() with one compare.
+#define NS_SLAB_CHUNK_SLOTS 256u
+#define NS_SLAB_MAX_SLOTS 0x7fffffffu
+
+typedef struct {
+  uint8_t **chunks;  // chunks[i] holds NS_SLAB_CHUNK_SLOTS slots
+  size_t nchunks;    // chunks allocated so far
+  size_t stride;     // slot size: header + object, rounded for alignment
+  size_t obj_size;
+  uint32_t max_slots;
+  uint32_t hwm;       // slots ever handed out; live slots are all below this
+  uint32_t free_head; // UINT32_MAX when empty
+  uint32_t live;
+} ns_slab_t;
+
+// max_slots is clamped to NS_SLAB_MAX_SLOTS. Returns 0 on success.
+int ns_slab_init(ns_slab_t *s, size_t obj_size, uint32_t max_slots);
+void ns_slab_destroy(ns_slab_t *s);
+
+// Zeroed object, or NULL when the slab is full or out of memory.
+void *ns_slab_alloc(ns_slab_t *s, uint64_t *out_handle);
+// Stale or foreign handles are ignored.
+void ns_slab_free(ns_slab_t *s, uint64_t handle);
+// Object for a live handle, NULL if it was freed (or reused) since.
+void *ns_slab_get(const ns_slab_t *s, uint64_t handle);
+// Object in slot idx if allocated, else NULL (for iterating [0, hwm)).
+void *ns_slab_at(const ns_slab_t *s, uint32_t idx);
+
+static inline uint32_t ns_slab_hwm(const ns_slab_t *s) { return s->hwm; }
+static inline uint32_t ns_slab_live(const ns_slab_t *s) { return s->live; }
+// Bytes held by allocated chunks (live and free slots).
+static inline size_t ns_slab_bytes(const ns_slab_t *s) { return s->nchunks * NS_SLAB_CHUNK_SLOTS * s->stride; }
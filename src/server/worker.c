@@ -1,11 +1,19 @@
 #define _POSIX_C_SOURCE 200809L
 #include "worker.h"
 
+#include "book.h"
+#include "bufpool.h"
+#include "outq.h"
 #include "log.h"
+#include "ring.h"
+#include "slab.h"
 #include "net.h"
 #include "proto.h"
 
 #include <errno.h>
+#include <asm/socket.h> // SO_ZEROCOPY, not exposed under strict _POSIX_C_SOURCE
+#include <linux/errqueue.h>
+#include <netinet/in.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,24 +21,162 @@
 #include <sys/epoll.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
+// Receive ring attached while a connection has unread bytes; frames larger than
+// this grow it on demand (up to max_body_len). Both come from the worker's pool.
+#define CONN_RX_DEFAULT 65536u
+// Free buffers a worker keeps cached for reuse before returning memory to the OS.
+#define WORKER_POOL_CACHE_BYTES (64u << 20)
+
+// epoll tags for the worker's own fds. Connection tags are slab handles, whose
+// generation (high word) is odd, so these can never match a live connection.
+#define EP_TAG_LISTEN ((uint64_t)UINT32_MAX)
+#define EP_TAG_NOTIFY ((uint64_t)UINT32_MAX - 1u)
+#define EP_TAG_CHAT_TIMER ((uint64_t)UINT32_MAX - 2u)
+#define EP_TAG_BAL_TIMER ((uint64_t)UINT32_MAX - 3u)
+// Chat events copied from shm per batch, into a shared buffer of at least this many bytes.
+#define WORKER_CHAT_BATCH 64u
+#define WORKER_CHAT_READ_BYTES 65536u
+// Largest CHAT_BROADCAST_BATCH body; more pending events are split over several frames.
+#define WORKER_CHAT_BATCH_BODY_MAX 16384u
+// Max buffer references handed to one sendmsg().
+#define CONN_IOV_MAX 64
+// Requests run per loop iteration before the worker polls again; what is left stays queued.
+#define WORKER_SCHED_BUDGET 512u
+
 typedef struct conn {
   int fd;
+  uint64_t handle; // slab handle, also the epoll tag
   bool authed;
   uint32_t user_id;
   uint64_t last_seen_ms; // for heartbeat timeout detection
-
-  uint8_t rbuf[65536];
-  size_t rlen;
-
-  uint8_t *wbuf;
-  size_t wcap;
-  size_t wlen;
-  size_t wpos;
+  ns_integrity_t integrity; // negotiated in HELLO; weakest coverage accepted and sent
+
+  ns_ring_t rx; // mirrored receive ring, attached from the pool while bytes are pending
+
+  ns_outq_t outq;  // pending output: references to pooled, possibly shared, buffers
+  ns_outq_t chatq; // chat push frames held for the flush window (chat_flush_us > 0)
+  bool want_out;  // EPOLLOUT currently registered
+  uint64_t rooms[NS_ROOM_MASK_WORDS]; // rooms joined on this connection (chat push subscriptions)
+  uint64_t route; // this connection's user_route entry while it is the user's newest login
+
+  // OP_BALANCE_SUBSCRIBE: credits received since the last BALANCE_PUSH
+  bool balance_sub;
+  bool bal_queued; // in worker_t.bal_pending
+  uint32_t bal_credits;
+  int64_t bal_credited;
+
+  // OP_MD_SUBSCRIBE: symbols subscribed, and those changed since the last MD_UPDATE sent here
+  uint64_t md_sub;
+  uint64_t md_pending;
+
+  // MSG_ZEROCOPY sends whose buffers the kernel may still read (completion ids are per socket)
+  bool zc_enabled;
+  uint32_t zc_next_id;
+  struct conn_zc *zc;
+  uint32_t zc_len;
+  uint32_t zc_cap;
+
+  // When the oldest unparsed input arrived (CLOCK_REALTIME ns): the kernel's receive timestamp
+  // with SO_TIMESTAMPNS, else the time it was read. Admission control measures queueing from it,
+  // and request deadlines (ns_header_t.deadline_ms) count from it.
+  bool rx_tstamp;
+  uint64_t rx_ns;
+
+  // Ready queue membership: the connection waits in the queue of its oldest parsed request's class.
+  bool queued;
+  bool rx_paused; // EPOLLIN dropped while queued, so unread input does not wake the worker
+  uint8_t sched_class;
+  uint32_t sched_prev; // slab index + 1 of the neighbours in that queue, 0 = none
+  uint32_t sched_next;
 } conn_t;
 
+typedef struct conn_zc {
+  uint32_t id;
+  ns_sbuf_t *buf;
+} conn_zc_t;
+
+// Per-process worker state, passed to handlers instead of a long argument list.
+typedef struct {
+  int worker_id;
+  int epfd;
+  const int *notify_wfds; // one per worker, indexed by worker id
+  int nworkers;
+  ns_shm_t *shm;
+  const server_cfg_t *cfg;
+  ns_slab_t conns; // conn_t slots; live connections are ns_slab_live()
+  ns_bufpool_t pool;
+
+  int chat_timer_fd;      // timerfd armed for the chat flush window
+  bool chat_flush_armed;  // some connection has chat pushes waiting in chatq
+  bool chat_kick;         // a local OP_CHAT_SEND hit a room with local subscribers; drain after this batch
+  bool dm_kick;           // a direct message was queued to a local connection; flush after this batch
+
+  int bal_timer_fd;       // timerfd armed for the balance push window
+  bool bal_flush_armed;
+  bool bal_kick;          // balance pushes are due and no window applies; send after this batch
+  uint64_t *bal_pending;  // handles of connections with credits waiting for a BALANCE_PUSH
+  uint32_t bal_pending_len;
+  uint32_t bal_pending_cap;
+
+  bool md_kick;           // a local publish dirtied this worker's symbols; deliver after this batch
+  uint32_t md_refs[NS_MD_SYMBOLS]; // local subscribers per symbol (interest mirrored in shm md_workers)
+
+  // Chat interest: local connections per room, and the rooms with any (mirrored in shm room_workers)
+  uint32_t room_refs[NS_MAX_ROOMS];
+  uint64_t room_mask[NS_ROOM_MASK_WORDS];
+  ns_chat_cursor_t room_cur[NS_MAX_ROOMS]; // read position per subscribed room
+
+  // Output accounting, published to worker_stats
+  uint64_t tx_frames;
+  uint64_t tx_bytes;
+  uint64_t tx_bytes_copied;
+  uint64_t tx_zerocopy_bytes;
+  uint64_t chat_events;
+  uint64_t chat_frames;
+  uint64_t chat_wakeups;
+  uint64_t chat_overrun;
+  uint64_t chat_replayed;
+  uint64_t chat_resume_gaps;
+  uint64_t dm_sent;
+  uint64_t dm_delivered;
+  uint64_t dm_stale;
+  uint64_t dm_inbox_full;
+  uint64_t bal_updates;
+  uint64_t bal_pushes;
+  uint64_t dedup_hits;
+  uint64_t dedup_misses;
+  uint64_t dedup_conflicts;
+  uint64_t orders_placed;
+  uint64_t order_fills;
+  uint64_t md_changes;
+  uint64_t md_updates;
+  uint64_t md_conflated;
+  uint64_t throttled;
+
+  // Admission control (cfg->shed_target_us) and the accept-rate limit (cfg->accept_rate)
+  uint64_t shed_ok_ns;     // last time a request was handled within the target
+  uint64_t shed_win_ns;    // start of the current interval, and the lowest delay seen in it
+  uint64_t shed_win_min_ns;
+  bool overloaded;
+  uint64_t accept_tat_ns;  // GCRA state, as in ns_rate_consume
+  uint64_t shed;
+  uint64_t accepts_refused;
+  uint64_t queue_delay_us;
+  uint64_t expired; // requests answered ST_ERR_TIMEOUT unexecuted (deadline passed while queued)
+
+  // Ready queues, one per ns_sched_class_t: connections with a complete request, oldest first
+  // (slab index + 1, 0 = empty), and per-class latencies for worker_stats.
+  uint32_t ready_head[NS_SCHED_CLASSES];
+  uint32_t ready_tail[NS_SCHED_CLASSES];
+  uint32_t ready_len;
+  uint64_t sched_lat[NS_SCHED_CLASSES][NS_LAT_BUCKETS];
+} worker_t;
+
 static void metric_inc_u64(uint64_t *p, uint64_t v) {
   (void)__atomic_fetch_add(p, v, __ATOMIC_RELAXED);
 }
@@ -41,6 +187,18 @@ static uint64_t now_ms(void) {
   return (uint64_t)ts.tv_sec * 1000ull + (uint64_t)(ts.tv_nsec / 1000000ull);
 }
 
+static uint64_t now_real_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t now_mono_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
 static void conn_cleanup_session(ns_shm_t *shm, conn_t *c) {
   if (!c || !c->authed) return;
   // Remove user from all rooms
@@ -49,6 +207,9 @@ static void conn_cleanup_session(ns_shm_t *shm, conn_t *c) {
     ns_room_set_member(shm, r, c->user_id, false);
     pthread_mutex_unlock(&shm->room_mu[r]);
   }
+  // Stop routing direct messages and balance pushes here (unless the user has logged in elsewhere since)
+  if (ns_route_clear(shm, c->user_id, c->route) && c->balance_sub) ns_balance_watch_set(shm, c->user_id, false);
+  c->route = 0;
   // Mark user offline
   pthread_mutex_lock(&shm->user_mu);
   if (c->user_id < NS_MAX_USERS) {
@@ -57,82 +218,438 @@ static void conn_cleanup_session(ns_shm_t *shm, conn_t *c) {
   pthread_mutex_unlock(&shm->user_mu);
 }
 
-static void conn_free(conn_t *c) {
+static void conn_zc_release_all(worker_t *w, conn_t *c) {
+  for (uint32_t i = 0; i < c->zc_len; i++) ns_sbuf_unref(&w->pool, c->zc[i].buf);
+  free(c->zc);
+  c->zc = NULL;
+  c->zc_len = c->zc_cap = 0;
+}
+
+static bool conn_in_room(const conn_t *c, uint16_t room) {
+  return (c->rooms[room / 64u] >> (room % 64u) & 1ull) != 0;
+}
+
+// Track c's subscription to room; the worker advertises interest while any local connection is subscribed.
+static void conn_set_room(worker_t *w, conn_t *c, uint16_t room, bool joined) {
+  if (conn_in_room(c, room) == joined) return;
+  uint64_t bit = 1ull << (room % 64u);
+  if (joined) {
+    c->rooms[room / 64u] |= bit;
+    if (w->room_refs[room]++ == 0) {
+      // Start from the present: subscribers see messages sent after they joined.
+      ns_chat_cursor_latest(w->shm, room, &w->room_cur[room]);
+      w->room_mask[room / 64u] |= bit;
+      ns_room_set_worker(w->shm, room, (uint32_t)w->worker_id, true);
+    }
+  } else {
+    c->rooms[room / 64u] &= ~bit;
+    if (--w->room_refs[room] == 0) {
+      w->room_mask[room / 64u] &= ~bit;
+      ns_room_set_worker(w->shm, room, (uint32_t)w->worker_id, false);
+    }
+  }
+}
+
+static void conn_leave_rooms(worker_t *w, conn_t *c) {
+  for (uint16_t r = 0; r < (uint16_t)NS_MAX_ROOMS; r++) conn_set_room(w, c, r, false);
+}
+
+// Replace c's market-data subscription; the worker advertises interest in a symbol while any
+// local connection has it.
+static void conn_set_md(worker_t *w, conn_t *c, uint64_t mask) {
+  uint64_t changed = c->md_sub ^ mask;
+  while (changed) {
+    uint32_t sym = (uint32_t)__builtin_ctzll(changed);
+    changed &= changed - 1u;
+    bool on = (mask >> sym & 1ull) != 0;
+    if (on ? w->md_refs[sym]++ == 0 : --w->md_refs[sym] == 0) {
+      ns_md_set_worker(w->shm, sym, (uint32_t)w->worker_id, on);
+    }
+  }
+  c->md_sub = mask;
+  c->md_pending &= mask;
+}
+
+// Ready queues are intrusive lists through conn_t; a connection is in at most one of them.
+static void sched_push(worker_t *w, conn_t *c, ns_sched_class_t cls) {
+  const uint32_t self = (uint32_t)c->handle + 1u;
+  c->queued = true;
+  c->sched_class = (uint8_t)cls;
+  c->sched_prev = w->ready_tail[cls];
+  c->sched_next = 0;
+  if (c->sched_prev) ((conn_t *)ns_slab_at(&w->conns, c->sched_prev - 1u))->sched_next = self;
+  else w->ready_head[cls] = self;
+  w->ready_tail[cls] = self;
+  w->ready_len++;
+}
+
+static void sched_remove(worker_t *w, conn_t *c) {
+  const uint32_t cls = c->sched_class;
+  if (c->sched_prev) ((conn_t *)ns_slab_at(&w->conns, c->sched_prev - 1u))->sched_next = c->sched_next;
+  else w->ready_head[cls] = c->sched_next;
+  if (c->sched_next) ((conn_t *)ns_slab_at(&w->conns, c->sched_next - 1u))->sched_prev = c->sched_prev;
+  else w->ready_tail[cls] = c->sched_prev;
+  c->queued = false;
+  c->sched_prev = c->sched_next = 0;
+  w->ready_len--;
+}
+
+static void conn_free(worker_t *w, conn_t *c) {
   if (!c) return;
+  if (c->queued) sched_remove(w, c);
+  conn_leave_rooms(w, c);
+  conn_set_md(w, c, 0);
   if (c->fd >= 0) close(c->fd);
-  free(c->wbuf);
-  free(c);
-}
-
-static int conn_ensure_wcap(conn_t *c, size_t need) {
-  if (c->wcap >= need) return 0;
-  size_t newcap = c->wcap ? c->wcap : 4096u;
-  while (newcap < need) newcap *= 2u;
-  uint8_t *p = (uint8_t *)realloc(c->wbuf, newcap);
-  if (!p) return -1;
-  c->wbuf = p;
-  c->wcap = newcap;
-  return 0;
+  ns_bufpool_ring_put(&w->pool, &c->rx);
+  ns_outq_clear(&c->outq, &w->pool);
+  ns_outq_clear(&c->chatq, &w->pool);
+  conn_zc_release_all(w, c); // the socket is gone; nobody reads these bytes any more
+  ns_slab_free(&w->conns, c->handle);
 }
 
-static int conn_queue(conn_t *c, const uint8_t *data, size_t len) {
-  if (conn_ensure_wcap(c, c->wlen + len) != 0) return -1;
-  memcpy(c->wbuf + c->wlen, data, len);
-  c->wlen += len;
+// Queue a copy of a complete prebuilt frame for c.
+static int conn_queue_frame(worker_t *w, conn_t *c, const uint8_t *frame, uint32_t len) {
+  uint8_t *dst = ns_outq_reserve(&c->outq, &w->pool, len);
+  if (!dst) return -1;
+  memcpy(dst, frame, len);
+  w->tx_frames++;
+  w->tx_bytes += len;
+  w->tx_bytes_copied += len;
   return 0;
 }
 
-static int ep_mod(int epfd, int fd, uint32_t events, void *ptr) {
+// Reserve a frame of body_len at the tail of c's output queue; the header and body are written in place.
+static uint8_t *conn_reserve_frame(worker_t *w, conn_t *c, uint32_t body_len) {
+  uint8_t *dst = ns_outq_reserve(&c->outq, &w->pool, sizeof(ns_header_t) + (size_t)body_len);
+  if (!dst) return NULL;
+  w->tx_frames++;
+  w->tx_bytes += sizeof(ns_header_t) + (size_t)body_len;
+  w->tx_bytes_copied += body_len;
+  return dst;
+}
+
+// Send c the latest value of each symbol changed since its last update. Nothing is queued while
+// its socket is backed up: changes collect in md_pending and go out once it drains, one update
+// per symbol however many ticks were published meanwhile.
+static void conn_push_md(worker_t *w, conn_t *c) {
+  if (c->want_out) return;
+  while (c->md_pending) {
+    uint32_t sym = (uint32_t)__builtin_ctzll(c->md_pending);
+    ns_md_quote_t q;
+    if (ns_md_read(w->shm, sym, &q) && q.version > 0) {
+      uint8_t *dst = conn_reserve_frame(w, c, NS_MD_UPDATE_BODY);
+      if (!dst) return; // still pending; retried on the next change or drain
+      uint8_t *body = dst + sizeof(ns_header_t);
+      body[0] = (uint8_t)sym;
+      ns_put_be32(body + 1, q.bid);
+      ns_put_be32(body + 5, q.ask);
+      ns_put_be32(body + 9, q.last_price);
+      ns_put_be32(body + 13, q.last_qty);
+      ns_put_be64(body + 17, q.volume);
+      ns_put_be64(body + 25, q.version);
+      ns_put_be64(body + 33, q.ts_ns);
+      ns_build_header((ns_header_t *)dst, ns_integrity_flags(c->integrity), OP_MD_UPDATE, ST_OK, 0, body,
+                      NS_MD_UPDATE_BODY);
+      w->md_updates++;
+    }
+    c->md_pending &= c->md_pending - 1u;
+  }
+}
+
+static int ep_mod(int epfd, int fd, uint32_t events, uint64_t tag) {
   struct epoll_event ev;
   memset(&ev, 0, sizeof(ev));
   ev.events = events;
-  ev.data.ptr = ptr;
+  ev.data.u64 = tag;
   return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
 }
 
-static int ep_add(int epfd, int fd, uint32_t events, void *ptr) {
+static int ep_add(int epfd, int fd, uint32_t events, uint64_t tag) {
   struct epoll_event ev;
   memset(&ev, 0, sizeof(ev));
   ev.events = events;
-  ev.data.ptr = ptr;
+  ev.data.u64 = tag;
   return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
 }
 
-static void send_simple_response(conn_t *c, uint16_t opcode, uint16_t status, uint64_t req_id,
+static void conn_set_events(worker_t *w, conn_t *c, bool want_out, bool rx_paused) {
+  if (want_out == c->want_out && rx_paused == c->rx_paused) return; // only touch epoll when interest changes
+  (void)ep_mod(w->epfd, c->fd, (rx_paused ? 0u : EPOLLIN) | EPOLLRDHUP | (want_out ? EPOLLOUT : 0u), c->handle);
+  c->want_out = want_out;
+  c->rx_paused = rx_paused;
+}
+
+static void conn_set_want_out(worker_t *w, conn_t *c, bool want) { conn_set_events(w, c, want, c->rx_paused); }
+
+// Release buffers of MSG_ZEROCOPY sends the kernel has completed (ids [lo, hi]).
+static void conn_zc_complete(worker_t *w, conn_t *c, uint32_t lo, uint32_t hi) {
+  uint32_t keep = 0;
+  for (uint32_t i = 0; i < c->zc_len; i++) {
+    if (c->zc[i].id - lo <= hi - lo) {
+      ns_sbuf_unref(&w->pool, c->zc[i].buf);
+    } else {
+      c->zc[keep++] = c->zc[i];
+    }
+  }
+  c->zc_len = keep;
+}
+
+static void conn_reap_zerocopy(worker_t *w, conn_t *c) {
+  while (c->zc_len > 0) {
+    uint8_t control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+            (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+        continue;
+      }
+      const struct sock_extended_err *ee = (const struct sock_extended_err *)CMSG_DATA(cm);
+      if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+      conn_zc_complete(w, c, ee->ee_info, ee->ee_data);
+    }
+  }
+}
+
+static ssize_t conn_send_iov(conn_t *c, struct iovec *iov, int cnt, int flags) {
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = (size_t)cnt;
+  return sendmsg(c->fd, &msg, flags | MSG_NOSIGNAL);
+}
+
+// Send the head entry with MSG_ZEROCOPY; its buffer stays referenced until the kernel reports completion.
+static ssize_t conn_send_zerocopy(worker_t *w, conn_t *c, struct iovec *iov) {
+#ifdef MSG_ZEROCOPY
+  if (c->zc_len == c->zc_cap) {
+    uint32_t ncap = c->zc_cap ? c->zc_cap * 2u : 8u;
+    conn_zc_t *zc = (conn_zc_t *)realloc(c->zc, ncap * sizeof(*zc));
+    if (!zc) return conn_send_iov(c, iov, 1, 0);
+    c->zc = zc;
+    c->zc_cap = ncap;
+  }
+  ssize_t n = conn_send_iov(c, iov, 1, MSG_ZEROCOPY);
+  if (n < 0 && errno == ENOBUFS) return conn_send_iov(c, iov, 1, 0); // optmem exhausted: copy instead
+  if (n > 0) {
+    c->zc[c->zc_len].id = c->zc_next_id++;
+    c->zc[c->zc_len].buf = ns_sbuf_ref(ns_outq_front(&c->outq)->buf);
+    c->zc_len++;
+    w->tx_zerocopy_bytes += (uint64_t)n;
+  }
+  return n;
+#else
+  (void)w;
+  return conn_send_iov(c, iov, 1, 0);
+#endif
+}
+
+// Write as much of the output queue as the socket takes, then set EPOLLOUT interest accordingly.
+static int conn_flush(worker_t *w, conn_t *c) {
+  if (c->zc_len > 0) conn_reap_zerocopy(w, c);
+  const uint32_t zc_min = w->cfg->zerocopy_min;
+  while (ns_outq_pending(&c->outq) > 0) {
+    struct iovec iov[CONN_IOV_MAX];
+    int cnt = ns_outq_iov(&c->outq, iov, CONN_IOV_MAX);
+    ssize_t n;
+    if (c->zc_enabled && iov[0].iov_len >= zc_min) {
+      n = conn_send_zerocopy(w, c, iov);
+    } else {
+      if (c->zc_enabled) {
+        // Stop the copied batch before the next zero-copy candidate.
+        for (int i = 1; i < cnt; i++) {
+          if (iov[i].iov_len >= zc_min) {
+            cnt = i;
+            break;
+          }
+        }
+      }
+      n = conn_send_iov(c, iov, cnt, 0);
+    }
+    if (n > 0) {
+      ns_outq_consume(&c->outq, &w->pool, (size_t)n);
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else {
+      return -1;
+    }
+  }
+  conn_set_want_out(w, c, ns_outq_pending(&c->outq) > 0);
+  return 0;
+}
+
+static void send_simple_response(worker_t *w, conn_t *c, uint16_t opcode, uint16_t status, uint64_t req_id,
                                  const uint8_t *body, uint32_t body_len) {
-  uint8_t frame[sizeof(ns_header_t) + 1024];
   if (body_len > 1024u) return;
-  ns_header_t hdr;
-  ns_build_header(&hdr, NS_FLAG_IS_RESPONSE, opcode, status, req_id, body, body_len);
-  memcpy(frame, &hdr, sizeof(hdr));
-  if (body_len) memcpy(frame + sizeof(hdr), body, body_len);
-  (void)conn_queue(c, frame, sizeof(hdr) + body_len);
+  uint8_t *dst = conn_reserve_frame(w, c, body_len);
+  if (!dst) return;
+  // The body is copied once into the queue and the header built next to it; the
+  // checksum covers the queued copy.
+  if (body_len) memcpy(dst + sizeof(ns_header_t), body, body_len);
+  uint8_t flags = (uint8_t)(NS_FLAG_IS_RESPONSE | ns_integrity_flags(c->integrity));
+  ns_build_header((ns_header_t *)dst, flags, opcode, status, req_id, body_len ? dst + sizeof(ns_header_t) : NULL,
+                  body_len);
 }
 
-static void handle_chat_broadcast(ns_shm_t *shm, conn_t **fdmap, size_t fdcap, uint64_t *inout_seq) {
-  ns_chat_event_t batch[64];
-  uint64_t n = ns_chat_read_from(shm, inout_seq, batch, 64);
-  for (uint64_t i = 0; i < n; i++) {
-    const ns_chat_event_t *e = &batch[i];
-    uint8_t body[2 + 4 + 2 + NS_MAX_CHAT_MSG];
-    ns_put_be16(body + 0, e->room_id);
-    ns_put_be32(body + 2, e->from_user_id);
-    ns_put_be16(body + 6, e->msg_len);
-    memcpy(body + 8, e->msg, e->msg_len);
-    uint32_t body_len = 8u + (uint32_t)e->msg_len;
+// Move the chat push frames referenced by q to c's output queue and empty q: a lone event goes
+// out as its prebuilt CHAT_BROADCAST frame, several are coalesced into CHAT_BROADCAST_BATCH frames.
+static void conn_coalesce_chat(worker_t *w, conn_t *c, ns_outq_t *q) {
+  const uint32_t n = q->count;
+  uint32_t i = 0;
+  while (i < n) {
+    size_t body_len = 2u;
+    uint32_t j = i;
+    while (j < n && body_len + (ns_outq_at(q, j)->len - sizeof(ns_header_t)) <= WORKER_CHAT_BATCH_BODY_MAX) {
+      body_len += ns_outq_at(q, j)->len - sizeof(ns_header_t);
+      j++;
+    }
+    if (j - i <= 1u) {
+      const ns_outq_ent_t *e = ns_outq_at(q, i);
+      if (ns_outq_push_ref(&c->outq, &w->pool, e->buf, e->off, e->len) == 0) {
+        w->tx_frames++;
+        w->tx_bytes += e->len;
+        w->chat_frames++;
+      }
+      i++;
+      continue;
+    }
+    uint8_t *dst = conn_reserve_frame(w, c, (uint32_t)body_len);
+    if (!dst) break;
+    uint8_t *body = dst + sizeof(ns_header_t);
+    ns_put_be16(body, (uint16_t)(j - i));
+    size_t off = 2u;
+    for (; i < j; i++) {
+      const ns_outq_ent_t *e = ns_outq_at(q, i);
+      size_t rec = e->len - sizeof(ns_header_t);
+      memcpy(body + off, e->buf->data + e->off + sizeof(ns_header_t), rec);
+      off += rec;
+    }
+    ns_build_header((ns_header_t *)dst, ns_integrity_flags(c->integrity), OP_CHAT_BROADCAST_BATCH, ST_OK, 0, body,
+                    (uint32_t)body_len);
+    w->chat_frames++;
+  }
+  ns_outq_clear(q, &w->pool);
+}
 
-    for (size_t fd = 0; fd < fdcap; fd++) {
-      conn_t *c = fdmap[fd];
-      if (!c || !c->authed) continue;
-      if (!ns_room_is_member(shm, e->room_id, c->user_id)) continue;
+// Send c's held chat pushes (the flush window closed or other output is going out).
+static void conn_flush_chat(worker_t *w, conn_t *c) {
+  w->chat_events += c->chatq.count;
+  conn_coalesce_chat(w, c, &c->chatq);
+}
 
-      // Push frame: opcode=CHAT_BROADCAST, req_id=0
-      uint8_t frame[sizeof(ns_header_t) + sizeof(body)];
-      ns_header_t hdr;
-      ns_build_header(&hdr, 0, OP_CHAT_BROADCAST, ST_OK, 0, body, body_len);
-      memcpy(frame, &hdr, sizeof(hdr));
-      memcpy(frame + sizeof(hdr), body, body_len);
-      (void)conn_queue(c, frame, sizeof(hdr) + body_len);
+// Push every connection's pending output now rather than waiting for its next request.
+// held_chat also releases the chat pushes held for the flush window.
+static void worker_flush_pending(worker_t *w, bool held_chat) {
+  for (uint32_t idx = 0; idx < ns_slab_hwm(&w->conns); idx++) {
+    conn_t *c = (conn_t *)ns_slab_at(&w->conns, idx);
+    if (!c) continue;
+    if (held_chat && c->chatq.count > 0) conn_flush_chat(w, c);
+    if (c->want_out || ns_outq_pending(&c->outq) == 0) continue;
+    if (conn_flush(w, c) != 0) {
+      conn_cleanup_session(w->shm, c);
+      conn_free(w, c);
+    }
+  }
+}
+
+// Deliver new events of one room to its local subscribers. Returns the number of events read.
+static uint64_t worker_drain_room(worker_t *w, uint16_t room, bool hold) {
+  ns_shm_t *shm = w->shm;
+  ns_chat_frame_ref_t refs[WORKER_CHAT_BATCH];
+  uint64_t total = 0;
+  while (true) {
+    // Frames are prebuilt in shm; copy a batch once into a shared buffer that every recipient references.
+    // Records hold only the bytes actually sent, so the buffer is sized in bytes, not slots.
+    size_t want = ns_chat_frame_len(w->cfg->chat_max_msg);
+    ns_sbuf_t *frames = ns_sbuf_new(&w->pool, want > WORKER_CHAT_READ_BYTES ? want : WORKER_CHAT_READ_BYTES);
+    if (!frames) break;
+    uint64_t n = ns_chat_read_frames(shm, room, &w->room_cur[room], refs, WORKER_CHAT_BATCH, frames->data, frames->cap,
+                                     &w->chat_overrun);
+    for (uint64_t i = 0; i < n; i++) {
+      const ns_chat_frame_ref_t *e = &refs[i];
+      frames->len += e->len;
+      w->tx_bytes_copied += e->len;
+      for (uint32_t idx = 0; idx < ns_slab_hwm(&w->conns); idx++) {
+        conn_t *c = (conn_t *)ns_slab_at(&w->conns, idx);
+        if (!c || !c->authed || !conn_in_room(c, e->room_id)) continue;
+        if (!ns_room_is_member(shm, e->room_id, c->user_id)) continue;
+        if (hold) {
+          (void)ns_outq_push_ref(&c->chatq, &w->pool, frames, e->off, e->len);
+        } else if (ns_outq_push_ref(&c->outq, &w->pool, frames, e->off, e->len) == 0) {
+          w->tx_frames++;
+          w->tx_bytes += e->len;
+          w->chat_events++;
+          w->chat_frames++;
+        }
+      }
+    }
+    ns_sbuf_unref(&w->pool, frames);
+    total += n;
+    if (n == 0 || w->room_cur[room].seq >= ns_chat_latest_seq(shm, room)) break;
+  }
+  return total;
+}
+
+// Collect into q the room's events after cur, up to this worker's own cursor: later events reach
+// c as live pushes. Events evicted while reading are added to *missed. Returns the events queued.
+static uint32_t conn_collect_replay(worker_t *w, uint16_t room, ns_chat_cursor_t cur, ns_outq_t *q, uint64_t *missed) {
+  const uint64_t upto = w->room_cur[room].seq;
+  ns_chat_frame_ref_t refs[WORKER_CHAT_BATCH];
+  uint32_t total = 0;
+  while (cur.seq < upto) {
+    size_t want = ns_chat_frame_len(w->cfg->chat_max_msg);
+    ns_sbuf_t *frames = ns_sbuf_new(&w->pool, want > WORKER_CHAT_READ_BYTES ? want : WORKER_CHAT_READ_BYTES);
+    if (!frames) break;
+    uint64_t left = upto - cur.seq;
+    uint32_t max = left < WORKER_CHAT_BATCH ? (uint32_t)left : WORKER_CHAT_BATCH;
+    uint64_t n = ns_chat_read_frames(w->shm, room, &cur, refs, max, frames->data, frames->cap, missed);
+    for (uint64_t i = 0; i < n; i++) {
+      const ns_chat_frame_ref_t *e = &refs[i];
+      frames->len += e->len;
+      w->tx_bytes_copied += e->len;
+      // After an eviction the read may have skipped past upto; those events are still coming live.
+      if (e->seq > upto) continue;
+      if (ns_outq_push_ref(q, &w->pool, frames, e->off, e->len) == 0) total++;
+    }
+    ns_sbuf_unref(&w->pool, frames);
+    if (n == 0) break;
+  }
+  return total;
+}
+
+static void handle_chat_broadcast(worker_t *w) {
+  const bool hold = w->cfg->chat_flush_us > 0 && w->chat_timer_fd >= 0;
+  uint64_t total = 0;
+  // Only rooms with local subscribers; a room with nothing new (the common case on the
+  // periodic drain) costs one atomic load and never takes its lock.
+  for (uint32_t wi = 0; wi < NS_ROOM_MASK_WORDS; wi++) {
+    uint64_t bits = w->room_mask[wi];
+    while (bits) {
+      uint16_t room = (uint16_t)(wi * 64u + (uint32_t)__builtin_ctzll(bits));
+      bits &= bits - 1u;
+      if (ns_chat_latest_seq(w->shm, room) == w->room_cur[room].seq) continue;
+      total += worker_drain_room(w, room, hold);
+    }
+  }
+  if (total == 0) return;
+
+  if (!hold) {
+    worker_flush_pending(w, true);
+  } else if (!w->chat_flush_armed) {
+    // The window starts at the first held event; later ones ride along.
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)(w->cfg->chat_flush_us / 1000000u);
+    its.it_value.tv_nsec = (long)(w->cfg->chat_flush_us % 1000000u) * 1000L;
+    if (timerfd_settime(w->chat_timer_fd, 0, &its, NULL) == 0) {
+      w->chat_flush_armed = true;
+    } else {
+      worker_flush_pending(w, true);
     }
   }
 }
@@ -150,30 +667,362 @@ static uint64_t rd_u64(const uint8_t *p, size_t n, size_t off, bool *ok) {
   return ns_be64(p + off);
 }
 
-static size_t count_active_connections(conn_t **fdmap, size_t fdcap) {
-  size_t count = 0;
-  for (size_t i = 0; i < fdcap; i++) {
-    if (fdmap[i] != NULL) count++;
+static void worker_publish_stats(worker_t *w) {
+  ns_worker_stats_t *st = &w->shm->worker_stats[w->worker_id];
+  __atomic_store_n(&st->connections, ns_slab_live(&w->conns), __ATOMIC_RELAXED);
+  __atomic_store_n(&st->conn_bytes, (uint64_t)ns_slab_bytes(&w->conns), __ATOMIC_RELAXED);
+  __atomic_store_n(&st->rx_buf_bytes, (uint64_t)w->pool.rx_in_use, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->tx_buf_bytes, (uint64_t)w->pool.tx_in_use, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->pool_cached_bytes, (uint64_t)w->pool.cached, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->tx_frames, w->tx_frames, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->tx_bytes, w->tx_bytes, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->tx_bytes_copied, w->tx_bytes_copied, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->tx_zerocopy_bytes, w->tx_zerocopy_bytes, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->chat_events, w->chat_events, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->chat_frames, w->chat_frames, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->chat_wakeups, w->chat_wakeups, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->chat_overrun, w->chat_overrun, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->chat_replayed, w->chat_replayed, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->chat_resume_gaps, w->chat_resume_gaps, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->dm_sent, w->dm_sent, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->dm_delivered, w->dm_delivered, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->dm_stale, w->dm_stale, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->dm_inbox_full, w->dm_inbox_full, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->bal_updates, w->bal_updates, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->bal_pushes, w->bal_pushes, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->dedup_hits, w->dedup_hits, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->dedup_misses, w->dedup_misses, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->dedup_conflicts, w->dedup_conflicts, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->orders_placed, w->orders_placed, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->order_fills, w->order_fills, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->md_changes, w->md_changes, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->md_updates, w->md_updates, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->md_conflated, w->md_conflated, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->throttled, w->throttled, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->shed, w->shed, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->accepts_refused, w->accepts_refused, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->queue_delay_us, w->queue_delay_us, __ATOMIC_RELAXED);
+  __atomic_store_n(&st->expired, w->expired, __ATOMIC_RELAXED);
+  for (uint32_t cls = 0; cls < NS_SCHED_CLASSES; cls++) {
+    for (uint32_t b = 0; b < NS_LAT_BUCKETS; b++) {
+      __atomic_store_n(&st->sched_lat[cls][b], w->sched_lat[cls][b], __ATOMIC_RELAXED);
+    }
+  }
+  __atomic_store_n(&st->overloaded, w->overloaded ? 1u : 0u, __ATOMIC_RELAXED);
+}
+
+static void worker_wake(worker_t *w, int id) {
+  uint64_t one = 1;
+  ssize_t wn;
+  do {
+    wn = write(w->notify_wfds[id], &one, sizeof(one));
+  } while (wn < 0 && errno == EINTR);
+  if (wn < 0 && errno != EAGAIN) {
+    LOG_WARN("notify write to worker %d failed: %s", id, strerror(errno));
+  }
+}
+
+// Wake only the workers with local subscribers in room; this worker drains its own after the event batch.
+static void worker_notify_room(worker_t *w, uint16_t room) {
+  uint64_t mask = ns_room_workers(w->shm, room);
+  while (mask) {
+    int id = __builtin_ctzll(mask);
+    mask &= mask - 1u;
+    if (id == w->worker_id) {
+      w->chat_kick = true;
+      continue;
+    }
+    if (id >= w->nworkers) continue;
+    worker_wake(w, id);
+  }
+}
+
+// Wake the workers ns_md_publish reported; this worker delivers its own after the event batch.
+static void worker_notify_md(worker_t *w, uint64_t wake) {
+  while (wake) {
+    int id = __builtin_ctzll(wake);
+    wake &= wake - 1u;
+    if (id == w->worker_id) {
+      w->md_kick = true;
+    } else if (id < w->nworkers) {
+      worker_wake(w, id);
+    }
+  }
+}
+
+// Mark the symbols changed since the last look on their local subscribers and send what each
+// one can take. The cost is symbols changed times local connections, however many ticks were
+// published in between. Returns false if nothing had changed.
+static bool worker_drain_md(worker_t *w) {
+  uint64_t dirty = ns_md_take_dirty(w->shm, (uint32_t)w->worker_id);
+  if (!dirty) return false;
+  w->md_changes += (uint64_t)__builtin_popcountll(dirty);
+  for (uint32_t idx = 0; idx < ns_slab_hwm(&w->conns); idx++) {
+    conn_t *c = (conn_t *)ns_slab_at(&w->conns, idx);
+    if (!c || (c->md_sub & dirty) == 0) continue;
+    uint64_t hit = c->md_sub & dirty;
+    w->md_conflated += (uint64_t)__builtin_popcountll(c->md_pending & hit);
+    c->md_pending |= hit;
+    conn_push_md(w, c);
+  }
+  return true;
+}
+
+// Send one BALANCE_PUSH to every connection with pending credits, carrying its balance as of now.
+static void worker_flush_balances(worker_t *w) {
+  for (uint32_t i = 0; i < w->bal_pending_len; i++) {
+    conn_t *c = (conn_t *)ns_slab_get(&w->conns, w->bal_pending[i]);
+    if (!c || !c->bal_queued) continue;
+    c->bal_queued = false;
+    pthread_mutex_lock(&w->shm->acct_mu[c->user_id]);
+    int64_t bal = w->shm->balance[NS_ASSET_CASH][c->user_id];
+    pthread_mutex_unlock(&w->shm->acct_mu[c->user_id]);
+    uint8_t *dst = conn_reserve_frame(w, c, NS_BALANCE_PUSH_BODY);
+    if (dst) {
+      uint8_t *body = dst + sizeof(ns_header_t);
+      ns_put_be32(body + 0, c->user_id);
+      ns_put_be64(body + 4, (uint64_t)bal);
+      ns_put_be64(body + 12, (uint64_t)c->bal_credited);
+      ns_put_be32(body + 20, c->bal_credits);
+      ns_build_header((ns_header_t *)dst, ns_integrity_flags(c->integrity), OP_BALANCE_PUSH, ST_OK, 0, body,
+                      NS_BALANCE_PUSH_BODY);
+      w->bal_pushes++;
+    }
+    c->bal_credits = 0;
+    c->bal_credited = 0;
   }
-  return count;
+  w->bal_pending_len = 0;
+  worker_flush_pending(w, false);
 }
 
-static void handle_request(ns_shm_t *shm, int notify_wfd, conn_t *c,
-                           conn_t **fdmap, size_t fdcap,
-                           const server_cfg_t *cfg,
+// Record a credit for a subscribed local connection. The first credit in a window queues the
+// connection and starts the window; later ones are folded into the same push.
+static void conn_note_credit(worker_t *w, conn_t *c, int64_t amount) {
+  if (!c->balance_sub) return;
+  c->bal_credits++;
+  c->bal_credited += amount;
+  w->bal_updates++;
+  if (c->bal_queued) return;
+  if (w->bal_pending_len == w->bal_pending_cap) {
+    uint32_t ncap = w->bal_pending_cap ? w->bal_pending_cap * 2u : 64u;
+    uint64_t *p = (uint64_t *)realloc(w->bal_pending, (size_t)ncap * sizeof(*p));
+    if (!p) return; // counted; the next credit retries
+    w->bal_pending = p;
+    w->bal_pending_cap = ncap;
+  }
+  w->bal_pending[w->bal_pending_len++] = c->handle;
+  c->bal_queued = true;
+  if (w->bal_flush_armed) return;
+  if (w->bal_timer_fd >= 0) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t)(w->cfg->balance_push_us / 1000000u);
+    its.it_value.tv_nsec = (long)(w->cfg->balance_push_us % 1000000u) * 1000L;
+    if (timerfd_settime(w->bal_timer_fd, 0, &its, NULL) == 0) {
+      w->bal_flush_armed = true;
+      return;
+    }
+  }
+  w->bal_kick = true;
+}
+
+// Tell to_uid's connection, wherever it lives, that it was credited (subscribers only).
+static void worker_notify_credit(worker_t *w, uint32_t to_uid, int64_t amount) {
+  if (!ns_balance_watched(w->shm, to_uid)) return;
+  uint32_t owner = 0;
+  uint64_t handle = 0;
+  if (!ns_route_get(w->shm, to_uid, &owner, &handle) || owner >= (uint32_t)w->nworkers) return;
+  if (owner == (uint32_t)w->worker_id) {
+    conn_t *c = (conn_t *)ns_slab_get(&w->conns, handle);
+    if (c && c->authed && c->user_id == to_uid) conn_note_credit(w, c, amount);
+    return;
+  }
+  uint8_t data[8];
+  ns_put_be64(data, (uint64_t)amount);
+  if (ns_inbox_push(w->shm, owner, handle, to_uid, NS_INBOX_BALANCE, data, sizeof(data)) != 0) {
+    w->dm_inbox_full++; // the recipient still sees the credit on its next BALANCE
+    return;
+  }
+  worker_wake(w, (int)owner);
+}
+
+// Handle what other workers left in this worker's inbox: direct messages are queued for their
+// recipients, balance credits noted for the next push. Records for connections that have since
+// closed are dropped. Returns the number of frames queued.
+static uint32_t worker_drain_inbox(worker_t *w) {
+  uint32_t n = 0;
+  const ns_inbox_rec_t *r;
+  while ((r = ns_inbox_peek(w->shm, (uint32_t)w->worker_id)) != NULL) {
+    conn_t *c = (conn_t *)ns_slab_get(&w->conns, r->conn_handle);
+    if (!c || !c->authed || c->user_id != r->to_user_id) {
+      w->dm_stale++;
+    } else if (r->kind == NS_INBOX_BALANCE) {
+      conn_note_credit(w, c, (int64_t)ns_be64(r + 1));
+    } else if (conn_queue_frame(w, c, (const uint8_t *)(r + 1), r->frame_len) == 0) {
+      n++;
+    } else {
+      w->dm_stale++;
+    }
+    ns_inbox_pop(w->shm, (uint32_t)w->worker_id, r);
+  }
+  w->dm_delivered += n;
+  return n;
+}
+
+// Deliver a prebuilt push frame to user `to`'s newest login: queued directly when it is local,
+// else through its worker's inbox. Returns ST_ERR_NOT_FOUND if the user is offline.
+static uint16_t worker_route_frame(worker_t *w, uint32_t to, const uint8_t *frame, uint32_t frame_len) {
+  uint32_t owner = 0;
+  uint64_t handle = 0;
+  if (!ns_route_get(w->shm, to, &owner, &handle) || owner >= (uint32_t)w->nworkers) return ST_ERR_NOT_FOUND;
+
+  uint16_t st = ST_OK;
+  if (owner == (uint32_t)w->worker_id) {
+    conn_t *c = (conn_t *)ns_slab_get(&w->conns, handle);
+    if (!c || !c->authed || c->user_id != to) {
+      st = ST_ERR_NOT_FOUND;
+    } else if (conn_queue_frame(w, c, frame, frame_len) != 0) {
+      st = ST_ERR_INTERNAL;
+    } else {
+      w->dm_delivered++;
+      w->dm_kick = true;
+    }
+  } else if (ns_inbox_push(w->shm, owner, handle, to, NS_INBOX_FRAME, frame, frame_len) != 0) {
+    w->dm_inbox_full++;
+    st = ST_ERR_SERVER_BUSY;
+  } else {
+    worker_wake(w, (int)owner);
+  }
+  return st;
+}
+
+static uint16_t worker_send_direct(worker_t *w, uint32_t from, uint32_t to, const uint8_t *msg, uint16_t mlen) {
+  if (!ns_route_get(w->shm, to, NULL, NULL)) return ST_ERR_NOT_FOUND;
+
+  uint8_t small[512];
+  uint32_t frame_len = ns_dm_frame_len(mlen);
+  uint8_t *frame = frame_len <= sizeof(small) ? small : (uint8_t *)malloc(frame_len);
+  if (!frame) return ST_ERR_INTERNAL;
+  uint8_t *body = frame + sizeof(ns_header_t);
+  ns_put_be32(body + 0, from);
+  ns_put_be16(body + 4, mlen);
+  if (mlen) memcpy(body + NS_DM_BODY_HDR, msg, mlen);
+  // Full CRC, like chat pushes: the frame is built before the recipient's integrity mode is known.
+  ns_build_header((ns_header_t *)frame, 0, OP_DIRECT_PUSH, ST_OK, 0, body, NS_DM_BODY_HDR + (uint32_t)mlen);
+
+  uint16_t st = worker_route_frame(w, to, frame, frame_len);
+  if (frame != small) free(frame);
+  if (st == ST_OK) w->dm_sent++;
+  return st;
+}
+
+// ns_book_place callback: tell the maker about its fill (best effort; an offline maker misses it).
+static void worker_on_fill(void *arg, const ns_fill_t *f) {
+  worker_t *w = (worker_t *)arg;
+  uint8_t frame[sizeof(ns_header_t) + NS_ORDER_FILL_BODY];
+  uint8_t *body = frame + sizeof(ns_header_t);
+  ns_put_be64(body + 0, f->maker_order_id);
+  body[8] = f->symbol;
+  body[9] = f->maker_side;
+  ns_put_be32(body + 10, f->price);
+  ns_put_be32(body + 14, f->qty);
+  ns_put_be32(body + 18, f->maker_remaining);
+  ns_build_header((ns_header_t *)frame, 0, OP_ORDER_FILL, ST_OK, 0, body, NS_ORDER_FILL_BODY);
+  w->order_fills++;
+  (void)worker_route_frame(w, f->maker_user_id, frame, (uint32_t)sizeof(frame));
+}
+
+// Count the dedup outcome of a ledger op. Returns false if the request must be refused because
+// its req_id was already used by a different request.
+static bool worker_count_dedup(worker_t *w, bool idem, ns_dedup_result_t seen) {
+  if (!idem) return true;
+  if (seen == NS_DEDUP_HIT) {
+    w->dedup_hits++;
+  } else if (seen == NS_DEDUP_CONFLICT) {
+    w->dedup_conflicts++;
+    return false;
+  } else {
+    w->dedup_misses++;
+  }
+  return true;
+}
+
+typedef enum {
+  SHED_NEVER = 0, // session upkeep and ops that take load off (cancel, leave)
+  SHED_LATE = 1,  // ledger and order writes
+  SHED_EARLY = 2, // chat, queries, subscriptions
+} shed_prio_t;
+
+static shed_prio_t shed_priority(uint16_t opcode) {
+  switch (opcode) {
+    case OP_HELLO:
+    case OP_LOGIN:
+    case OP_HEARTBEAT:
+    case OP_LEAVE_ROOM:
+    case OP_ORDER_CANCEL:
+      return SHED_NEVER;
+    case OP_DEPOSIT:
+    case OP_WITHDRAW:
+    case OP_TRANSFER:
+    case OP_TRANSFER_MULTI:
+    case OP_ORDER_PLACE:
+      return SHED_LATE;
+    default:
+      return SHED_EARLY;
+  }
+}
+
+// CoDel-style admission. While some request was served within the target during the last interval,
+// queueing is a passing burst and up to an interval of delay is accepted. Otherwise the queue is
+// standing: low-priority requests that waited past the target, and the rest past twice the target,
+// are refused until it drains, which keeps the delay of what is served bounded.
+static bool worker_admit(worker_t *w, shed_prio_t prio, uint64_t now_ns, uint64_t arrival_ns) {
+  const server_cfg_t *cfg = w->cfg;
+  if (cfg->shed_target_us == 0 || arrival_ns == 0) return true;
+  const uint64_t target = (uint64_t)cfg->shed_target_us * 1000ull;
+  const uint64_t interval = (uint64_t)cfg->shed_interval_ms * 1000000ull;
+  const uint64_t delay = now_ns > arrival_ns ? now_ns - arrival_ns : 0;
+  if (delay < target || now_ns < w->shed_ok_ns) w->shed_ok_ns = now_ns;
+  if (delay < w->shed_win_min_ns) w->shed_win_min_ns = delay;
+  if (now_ns - w->shed_win_ns >= interval) {
+    w->queue_delay_us = w->shed_win_min_ns / 1000ull;
+    w->shed_win_ns = now_ns;
+    w->shed_win_min_ns = UINT64_MAX;
+  }
+  w->overloaded = now_ns - w->shed_ok_ns > interval;
+  if (prio == SHED_NEVER) return true;
+  const uint64_t limit = !w->overloaded ? interval : prio == SHED_EARLY ? target : 2u * target;
+  return delay <= limit;
+}
+
+// Accept-rate limit: the GCRA of ns_rate_consume, local to this worker, with a tenth of a second of burst.
+static bool worker_accept_admit(worker_t *w, uint64_t now_ns) {
+  const uint32_t rate = w->cfg->accept_rate;
+  if (rate == 0) return true;
+  const uint64_t interval = 1000000000ull / rate;
+  const uint64_t window = interval * (rate / 10u ? rate / 10u : 1u);
+  uint64_t next = (w->accept_tat_ns > now_ns ? w->accept_tat_ns : now_ns) + interval;
+  if (next - now_ns > window) return false;
+  w->accept_tat_ns = next;
+  return true;
+}
+
+static void handle_request(worker_t *w, conn_t *c,
                            const ns_header_t *hdr, const uint8_t *body, uint32_t body_len) {
+  ns_shm_t *shm = w->shm;
+  const server_cfg_t *cfg = w->cfg;
   const uint16_t opcode = ns_be16(&hdr->opcode);
   const uint64_t req_id = ns_be64(&hdr->req_id);
 
   // Update last_seen for heartbeat timeout detection
-  c->last_seen_ms = now_ms();
+  const uint64_t now_ns = now_real_ns();
+  c->last_seen_ms = now_ns / 1000000ull;
 
   // Check server busy condition (connection limit per worker)
   if (cfg->max_connections_per_worker > 0) {
-    size_t active_conns = count_active_connections(fdmap, fdcap);
-    if (active_conns >= (size_t)cfg->max_connections_per_worker) {
+    if (ns_slab_live(&w->conns) >= cfg->max_connections_per_worker) {
       metric_inc_u64(&shm->total_errors, 1);
-      send_simple_response(c, opcode, ST_ERR_SERVER_BUSY, req_id, NULL, 0);
+      send_simple_response(w, c, opcode, ST_ERR_SERVER_BUSY, req_id, NULL, 0);
       return;
     }
   }
@@ -186,16 +1035,65 @@ static void handle_request(ns_shm_t *shm, int notify_wfd, conn_t *c,
   // Require login for most ops
   if (!c->authed) {
     if (opcode != OP_HELLO && opcode != OP_LOGIN && opcode != OP_HEARTBEAT) {
-      send_simple_response(c, opcode, ST_ERR_UNAUTHORIZED, req_id, NULL, 0);
+      send_simple_response(w, c, opcode, ST_ERR_UNAUTHORIZED, req_id, NULL, 0);
+      return;
+    }
+  }
+
+  // The client has given up on a request whose deadline passed while it queued: skip the work.
+  const uint32_t deadline_ms = ns_be32(&hdr->deadline_ms);
+  if (deadline_ms != 0 && now_ns > c->rx_ns && now_ns - c->rx_ns >= (uint64_t)deadline_ms * 1000000ull) {
+    w->expired++;
+    metric_inc_u64(&shm->total_errors, 1);
+    send_simple_response(w, c, opcode, ST_ERR_TIMEOUT, req_id, NULL, 0);
+    return;
+  }
+
+  // Shed work that has queued too long; the client is told to come back after an interval.
+  if (!worker_admit(w, shed_priority(opcode), now_ns, c->rx_ns)) {
+    w->shed++;
+    metric_inc_u64(&shm->total_errors, 1);
+    uint8_t resp[4];
+    ns_put_be32(resp, cfg->shed_interval_ms);
+    send_simple_response(w, c, opcode, ST_ERR_SERVER_BUSY, req_id, resp, (uint32_t)sizeof(resp));
+    return;
+  }
+
+  // Per-user rate limit of the op's class (shared by all workers). A refusal carries
+  // u32 retry_after_ms: the wait until the bucket has a token again.
+  const ns_rate_class_t rl = ns_rate_class(opcode);
+  if (rl != NS_RL_NONE) {
+    uint64_t wait_ns = ns_rate_consume(shm, c->user_id, rl, now_mono_ns());
+    if (wait_ns != 0) {
+      w->throttled++;
+      metric_inc_u64(&shm->rate_throttled[rl], 1);
+      metric_inc_u64(&shm->total_errors, 1);
+      uint8_t resp[4];
+      ns_put_be32(resp, (uint32_t)((wait_ns + 999999ull) / 1000000ull));
+      send_simple_response(w, c, opcode, ST_ERR_SERVER_BUSY, req_id, resp, (uint32_t)sizeof(resp));
       return;
     }
   }
 
   switch (opcode) {
     case OP_HELLO: {
-      uint8_t resp[8];
+      // Body (optional): u8 requested integrity mode.
+      // Response: u64 nonce [+ u8 granted mode, only if one was requested].
+      uint8_t resp[8 + 1];
+      uint32_t resp_len = 8u;
       ns_put_be64(resp, shm->server_nonce);
-      send_simple_response(c, OP_HELLO, ST_OK, req_id, resp, (uint32_t)sizeof(resp));
+      ns_integrity_t granted = NS_INTEGRITY_FULL;
+      if (body_len >= 1u) {
+        uint8_t want = body[0];
+        if (want < NS_INTEGRITY_COUNT && (cfg->integrity_modes & (1u << want)) != 0u) {
+          granted = (ns_integrity_t)want;
+        }
+        resp[8] = (uint8_t)granted;
+        resp_len = 9u;
+      }
+      // The HELLO reply itself still uses the previous mode so the client can verify it.
+      send_simple_response(w, c, OP_HELLO, ST_OK, req_id, resp, resp_len);
+      c->integrity = granted;
       break;
     }
     case OP_LOGIN: {
@@ -203,13 +1101,13 @@ static void handle_request(ns_shm_t *shm, int notify_wfd, conn_t *c,
       bool ok = true;
       uint16_t ulen = rd_u16(body, body_len, 0, &ok);
       if (!ok || ulen == 0 || (size_t)ulen + 2u + 4u > body_len || ulen >= NS_MAX_USERNAME) {
-        send_simple_response(c, OP_LOGIN, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        send_simple_response(w, c, OP_LOGIN, ST_ERR_BAD_PACKET, req_id, NULL, 0);
         break;
       }
       const char *uname = (const char *)(body + 2);
       uint32_t token = rd_u32(body, body_len, 2u + (size_t)ulen, &ok);
       if (!ok) {
-        send_simple_response(c, OP_LOGIN, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        send_simple_response(w, c, OP_LOGIN, ST_ERR_BAD_PACKET, req_id, NULL, 0);
         break;
       }
 
@@ -219,7 +1117,7 @@ static void handle_request(ns_shm_t *shm, int notify_wfd, conn_t *c,
       ns_put_be64(tmp + ulen, shm->server_nonce);
       uint32_t want = ns_crc32(tmp, (size_t)ulen + 8u);
       if (token != want) {
-        send_simple_response(c, OP_LOGIN, ST_ERR_UNAUTHORIZED, req_id, NULL, 0);
+        send_simple_response(w, c, OP_LOGIN, ST_ERR_UNAUTHORIZED, req_id, NULL, 0);
         break;
       }
 
@@ -231,48 +1129,80 @@ static void handle_request(ns_shm_t *shm, int notify_wfd, conn_t *c,
       int rc = ns_user_find_or_create(shm, ustr, &uid);
       pthread_mutex_unlock(&shm->user_mu);
       if (rc != 0) {
-        send_simple_response(c, OP_LOGIN, ST_ERR_INTERNAL, req_id, NULL, 0);
+        send_simple_response(w, c, OP_LOGIN, ST_ERR_INTERNAL, req_id, NULL, 0);
         break;
       }
+      if (c->authed && ns_route_clear(shm, c->user_id, c->route) && c->balance_sub) {
+        ns_balance_watch_set(shm, c->user_id, false); // re-login as another user
+      }
+      c->balance_sub = false;
       c->authed = true;
       c->user_id = uid;
+      // Direct messages to this user now come to this connection.
+      c->route = ns_route_set(shm, uid, (uint32_t)w->worker_id, c->handle);
 
       // Response body: u32 user_id + i64 balance
       uint8_t resp[4 + 8];
       ns_put_be32(resp, uid);
-      int64_t bal = shm->balance[uid];
+      int64_t bal = shm->balance[NS_ASSET_CASH][uid];
       ns_put_be64(resp + 4, (uint64_t)bal);
-      send_simple_response(c, OP_LOGIN, ST_OK, req_id, resp, (uint32_t)sizeof(resp));
+      send_simple_response(w, c, OP_LOGIN, ST_OK, req_id, resp, (uint32_t)sizeof(resp));
       break;
     }
     case OP_HEARTBEAT: {
-      send_simple_response(c, OP_HEARTBEAT, ST_OK, req_id, NULL, 0);
+      send_simple_response(w, c, OP_HEARTBEAT, ST_OK, req_id, NULL, 0);
       break;
     }
     case OP_JOIN_ROOM: {
+      // Body: u16 room_id [+ u8 replay + u64 arg]
       bool ok = true;
       uint16_t room = rd_u16(body, body_len, 0, &ok);
-      if (!ok || room >= NS_MAX_ROOMS) {
-        send_simple_response(c, OP_JOIN_ROOM, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+      uint8_t replay = body_len >= 3u ? body[2] : (uint8_t)NS_JOIN_LIVE;
+      uint64_t arg = replay != NS_JOIN_LIVE ? rd_u64(body, body_len, 3, &ok) : 0;
+      if (!ok || room >= NS_MAX_ROOMS || replay > NS_JOIN_LAST) {
+        send_simple_response(w, c, OP_JOIN_ROOM, ST_ERR_BAD_PACKET, req_id, NULL, 0);
         break;
       }
       pthread_mutex_lock(&shm->room_mu[room]);
       ns_room_set_member(shm, room, c->user_id, true);
       pthread_mutex_unlock(&shm->room_mu[room]);
-      send_simple_response(c, OP_JOIN_ROOM, ST_OK, req_id, NULL, 0);
+      conn_set_room(w, c, room, true);
+
+      // Replay ends at the worker's cursor for the room; everything after it is delivered live.
+      ns_chat_cursor_t from = {0, 0};
+      uint64_t missed = 0;
+      if (replay == NS_JOIN_AFTER_SEQ) {
+        missed = ns_chat_cursor_seek(shm, room, arg, &from);
+      } else if (replay == NS_JOIN_LAST) {
+        ns_chat_cursor_last(shm, room, arg > UINT32_MAX ? UINT32_MAX : (uint32_t)arg, &from);
+      }
+      ns_outq_t q;
+      memset(&q, 0, sizeof(q));
+      uint32_t replayed = replay != NS_JOIN_LIVE ? conn_collect_replay(w, room, from, &q, &missed) : 0;
+      if (missed) w->chat_resume_gaps++;
+
+      // Resp: u64 seq (last event before live pushes) + u64 missed (> 0: the cursor fell off the ring) + u32 replayed
+      uint8_t resp[20];
+      ns_put_be64(resp + 0, w->room_cur[room].seq);
+      ns_put_be64(resp + 8, missed);
+      ns_put_be32(resp + 16, replayed);
+      send_simple_response(w, c, OP_JOIN_ROOM, ST_OK, req_id, resp, (uint32_t)sizeof(resp));
+      w->chat_replayed += replayed;
+      conn_coalesce_chat(w, c, &q);
       break;
     }
     case OP_LEAVE_ROOM: {
       bool ok = true;
       uint16_t room = rd_u16(body, body_len, 0, &ok);
       if (!ok || room >= NS_MAX_ROOMS) {
-        send_simple_response(c, OP_LEAVE_ROOM, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        send_simple_response(w, c, OP_LEAVE_ROOM, ST_ERR_BAD_PACKET, req_id, NULL, 0);
         break;
       }
       pthread_mutex_lock(&shm->room_mu[room]);
       ns_room_set_member(shm, room, c->user_id, false);
       pthread_mutex_unlock(&shm->room_mu[room]);
-      send_simple_response(c, OP_LEAVE_ROOM, ST_OK, req_id, NULL, 0);
+      conn_set_room(w, c, room, false);
+      send_simple_response(w, c, OP_LEAVE_ROOM, ST_OK, req_id, NULL, 0);
       break;
     }
     case OP_CHAT_SEND: {
@@ -280,233 +1210,650 @@ static void handle_request(ns_shm_t *shm, int notify_wfd, conn_t *c,
       bool ok = true;
       uint16_t room = rd_u16(body, body_len, 0, &ok);
       uint16_t mlen = rd_u16(body, body_len, 2, &ok);
-      if (!ok || room >= NS_MAX_ROOMS || (size_t)mlen + 4u > body_len) {
-        send_simple_response(c, OP_CHAT_SEND, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+      // Messages above the configured limit are rejected rather than truncated.
+      if (!ok || room >= NS_MAX_ROOMS || (size_t)mlen + 4u > body_len || mlen > w->cfg->chat_max_msg) {
+        send_simple_response(w, c, OP_CHAT_SEND, ST_ERR_BAD_PACKET, req_id, NULL, 0);
         break;
       }
       pthread_mutex_lock(&shm->room_mu[room]);
       bool member = ns_room_is_member(shm, room, c->user_id);
       pthread_mutex_unlock(&shm->room_mu[room]);
       if (!member) {
-        send_simple_response(c, OP_CHAT_SEND, ST_ERR_UNAUTHORIZED, req_id, NULL, 0);
+        send_simple_response(w, c, OP_CHAT_SEND, ST_ERR_UNAUTHORIZED, req_id, NULL, 0);
         break;
       }
 
-      ns_chat_append(shm, room, c->user_id, (const char *)(body + 4), mlen);
-      // notify all workers
-      uint64_t one = 1;
-      ssize_t wn;
-      do {
-        wn = write(notify_wfd, &one, sizeof(one));
-      } while (wn < 0 && errno == EINTR);
-      if (wn < 0) {
-        LOG_WARN("notify write failed: %s", strerror(errno));
+      if (ns_chat_append(shm, room, c->user_id, (const char *)(body + 4), mlen) != 0) {
+        send_simple_response(w, c, OP_CHAT_SEND, ST_ERR_INTERNAL, req_id, NULL, 0);
+        break;
+      }
+      worker_notify_room(w, room);
+      send_simple_response(w, c, OP_CHAT_SEND, ST_OK, req_id, NULL, 0);
+      break;
+    }
+    case OP_DIRECT_MSG: {
+      // Body: u32 to_user_id + u16 msg_len + msg
+      bool ok = true;
+      uint32_t to = rd_u32(body, body_len, 0, &ok);
+      uint16_t mlen = rd_u16(body, body_len, 4, &ok);
+      if (!ok || to >= NS_MAX_USERS || (size_t)mlen + 6u > body_len || mlen > w->cfg->chat_max_msg) {
+        send_simple_response(w, c, OP_DIRECT_MSG, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        break;
       }
-      send_simple_response(c, OP_CHAT_SEND, ST_OK, req_id, NULL, 0);
+      uint16_t st = worker_send_direct(w, c->user_id, to, body + 6, mlen);
+      send_simple_response(w, c, OP_DIRECT_MSG, st, req_id, NULL, 0);
       break;
     }
     case OP_DEPOSIT:
     case OP_WITHDRAW: {
+      // Body: i64 amount [+ u8 asset] (absent = cash)
       bool ok = true;
       if (body_len < 8u) {
-        send_simple_response(c, opcode, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        send_simple_response(w, c, opcode, ST_ERR_BAD_PACKET, req_id, NULL, 0);
         break;
       }
       int64_t amount = (int64_t)rd_u64(body, body_len, 0, &ok);
-      if (!ok) {
-        send_simple_response(c, opcode, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+      const uint8_t asset = body_len > 8u ? body[8] : (uint8_t)NS_ASSET_CASH;
+      if (!ok || asset >= NS_ASSETS) {
+        send_simple_response(w, c, opcode, ST_ERR_BAD_PACKET, req_id, NULL, 0);
         break;
       }
       if (amount <= 0) {
-        send_simple_response(c, opcode, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        send_simple_response(w, c, opcode, ST_ERR_BAD_PACKET, req_id, NULL, 0);
         break;
       }
 
+      const bool idem = (hdr->flags & NS_FLAG_IDEMPOTENT) != 0u && req_id != 0;
+      const uint32_t body_crc = idem ? ns_crc32(body, body_len) : 0;
+      ns_dedup_result_t seen = NS_DEDUP_MISS;
       uint16_t st = ST_OK;
+      int64_t bal = 0;
       pthread_mutex_lock(&shm->acct_mu[c->user_id]);
-      if (opcode == OP_WITHDRAW && shm->balance[c->user_id] < amount) {
-        st = ST_ERR_INSUFFICIENT_FUNDS;
-      } else {
-        shm->balance[c->user_id] += (opcode == OP_DEPOSIT) ? amount : -amount;
+      if (idem) seen = ns_dedup_lookup(shm, c->user_id, req_id, opcode, body_crc, &st, &bal);
+      if (seen == NS_DEDUP_MISS) {
+        int64_t *col = shm->balance[asset];
+        if (opcode == OP_WITHDRAW && col[c->user_id] < amount) {
+          st = ST_ERR_INSUFFICIENT_FUNDS;
+        } else {
+          col[c->user_id] += (opcode == OP_DEPOSIT) ? amount : -amount;
+          if (asset == NS_ASSET_CASH) ns_leaderboard_update(shm, c->user_id);
+        }
+        bal = col[c->user_id];
+        if (idem) ns_dedup_record(shm, c->user_id, req_id, opcode, body_crc, st, bal);
       }
-      int64_t bal = shm->balance[c->user_id];
       pthread_mutex_unlock(&shm->acct_mu[c->user_id]);
 
-      ns_txn_append(shm, opcode, st, c->user_id, c->user_id, amount);
+      if (!worker_count_dedup(w, idem, seen)) {
+        send_simple_response(w, c, opcode, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        break;
+      }
+      if (seen == NS_DEDUP_MISS) ns_txn_append_asset(shm, asset, opcode, st, c->user_id, c->user_id, amount);
 
       uint8_t resp[8];
       ns_put_be64(resp, (uint64_t)bal);
-      send_simple_response(c, opcode, st, req_id, resp, (uint32_t)sizeof(resp));
+      send_simple_response(w, c, opcode, st, req_id, resp, (uint32_t)sizeof(resp));
       break;
     }
     case OP_TRANSFER: {
-      // Body: u32 to_user_id + i64 amount
+      // Body: u32 to_user_id + i64 amount [+ u8 asset] (absent = cash)
       bool ok = true;
       uint32_t to_uid = rd_u32(body, body_len, 0, &ok);
       int64_t amount = (int64_t)rd_u64(body, body_len, 4, &ok);
-      if (!ok || to_uid >= NS_MAX_USERS || amount <= 0) {
-        send_simple_response(c, OP_TRANSFER, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+      const uint8_t asset = body_len > 12u ? body[12] : (uint8_t)NS_ASSET_CASH;
+      if (!ok || to_uid >= NS_MAX_USERS || amount <= 0 || asset >= NS_ASSETS) {
+        send_simple_response(w, c, OP_TRANSFER, ST_ERR_BAD_PACKET, req_id, NULL, 0);
         break;
       }
       uint32_t from = c->user_id;
       uint32_t a = from < to_uid ? from : to_uid;
       uint32_t b = from < to_uid ? to_uid : from;
 
+      const bool idem = (hdr->flags & NS_FLAG_IDEMPOTENT) != 0u && req_id != 0;
+      const uint32_t body_crc = idem ? ns_crc32(body, body_len) : 0;
+      ns_dedup_result_t seen = NS_DEDUP_MISS;
       uint16_t st = ST_OK;
+      int64_t bal = 0;
       pthread_mutex_lock(&shm->acct_mu[a]);
       pthread_mutex_lock(&shm->acct_mu[b]);
-      if (shm->balance[from] < amount) {
-        st = ST_ERR_INSUFFICIENT_FUNDS;
-      } else {
-        shm->balance[from] -= amount;
-        shm->balance[to_uid] += amount;
+      if (idem) seen = ns_dedup_lookup(shm, from, req_id, OP_TRANSFER, body_crc, &st, &bal);
+      if (seen == NS_DEDUP_MISS) {
+        int64_t *col = shm->balance[asset];
+        if (col[from] < amount) {
+          st = ST_ERR_INSUFFICIENT_FUNDS;
+        } else {
+          col[from] -= amount;
+          col[to_uid] += amount;
+          if (asset == NS_ASSET_CASH) {
+            ns_leaderboard_update(shm, from);
+            ns_leaderboard_update(shm, to_uid);
+          }
+        }
+        bal = col[from];
+        if (idem) ns_dedup_record(shm, from, req_id, OP_TRANSFER, body_crc, st, bal);
       }
-      int64_t bal = shm->balance[from];
       pthread_mutex_unlock(&shm->acct_mu[b]);
       pthread_mutex_unlock(&shm->acct_mu[a]);
 
-      ns_txn_append(shm, OP_TRANSFER, st, from, to_uid, amount);
+      if (!worker_count_dedup(w, idem, seen)) {
+        send_simple_response(w, c, OP_TRANSFER, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        break;
+      }
+      if (seen == NS_DEDUP_MISS) {
+        ns_txn_append_asset(shm, asset, OP_TRANSFER, st, from, to_uid, amount);
+        if (st == ST_OK && to_uid != from && asset == NS_ASSET_CASH) worker_notify_credit(w, to_uid, amount);
+      }
+
+      uint8_t resp[8];
+      ns_put_be64(resp, (uint64_t)bal);
+      send_simple_response(w, c, OP_TRANSFER, st, req_id, resp, (uint32_t)sizeof(resp));
+      break;
+    }
+    case OP_TRANSFER_MULTI: {
+      // Body: u16 count + count * (u32 to_user_id + i64 amount), every leg debited from the caller.
+      // All accounts are locked up front and the funds check covers the whole batch, so either every
+      // leg is applied or none is.
+      bool ok = true;
+      uint16_t n = rd_u16(body, body_len, 0, &ok);
+      if (!ok || n == 0 || n > NS_TRANSFER_MULTI_MAX || body_len != 2u + (uint32_t)n * NS_TRANSFER_LEG_BYTES) {
+        send_simple_response(w, c, OP_TRANSFER_MULTI, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        break;
+      }
+      const uint32_t from = c->user_id;
+      ns_transfer_leg_t legs[NS_TRANSFER_MULTI_MAX];
+      uint32_t ids[NS_TRANSFER_MULTI_MAX + 1u];
+      int64_t debit = 0;
+      for (uint16_t i = 0; i < n && ok; i++) {
+        size_t off = 2u + (size_t)i * NS_TRANSFER_LEG_BYTES;
+        legs[i].to_user_id = rd_u32(body, body_len, off, &ok);
+        legs[i].amount = (int64_t)rd_u64(body, body_len, off + 4u, &ok);
+        if (legs[i].to_user_id >= NS_MAX_USERS || legs[i].amount <= 0 || legs[i].amount > INT64_MAX - debit) ok = false;
+        if (ok && legs[i].to_user_id != from) debit += legs[i].amount;
+        ids[i] = legs[i].to_user_id;
+      }
+      if (!ok) {
+        send_simple_response(w, c, OP_TRANSFER_MULTI, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        break;
+      }
+      ids[n] = from;
+
+      const bool idem = (hdr->flags & NS_FLAG_IDEMPOTENT) != 0u && req_id != 0;
+      const uint32_t body_crc = idem ? ns_crc32(body, body_len) : 0;
+      ns_dedup_result_t seen = NS_DEDUP_MISS;
+      uint16_t st = ST_OK;
+      int64_t bal = 0;
+      uint32_t nlocked = ns_acct_lock_many(shm, ids, (uint32_t)n + 1u);
+      if (idem) seen = ns_dedup_lookup(shm, from, req_id, OP_TRANSFER_MULTI, body_crc, &st, &bal);
+      if (seen == NS_DEDUP_MISS) {
+        int64_t *cash = shm->balance[NS_ASSET_CASH];
+        if (cash[from] < debit) {
+          st = ST_ERR_INSUFFICIENT_FUNDS;
+        } else {
+          for (uint16_t i = 0; i < n; i++) {
+            cash[from] -= legs[i].amount;
+            cash[legs[i].to_user_id] += legs[i].amount;
+          }
+          for (uint32_t i = 0; i < nlocked; i++) ns_leaderboard_update(shm, ids[i]);
+        }
+        bal = cash[from];
+        if (idem) ns_dedup_record(shm, from, req_id, OP_TRANSFER_MULTI, body_crc, st, bal);
+        // Logged while the accounts are still held, so the log order matches the ledger order.
+        ns_txn_append_batch(shm, OP_TRANSFER_MULTI, st, from, legs, n);
+      }
+      ns_acct_unlock_many(shm, ids, nlocked);
+
+      if (!worker_count_dedup(w, idem, seen)) {
+        send_simple_response(w, c, OP_TRANSFER_MULTI, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        break;
+      }
+      if (seen == NS_DEDUP_MISS && st == ST_OK) {
+        for (uint16_t i = 0; i < n; i++) {
+          if (legs[i].to_user_id != from) worker_notify_credit(w, legs[i].to_user_id, legs[i].amount);
+        }
+      }
 
       uint8_t resp[8];
       ns_put_be64(resp, (uint64_t)bal);
-      send_simple_response(c, OP_TRANSFER, st, req_id, resp, (uint32_t)sizeof(resp));
+      send_simple_response(w, c, OP_TRANSFER_MULTI, st, req_id, resp, (uint32_t)sizeof(resp));
+      break;
+    }
+    case OP_ORDER_PLACE: {
+      bool ok = true;
+      uint32_t price = rd_u32(body, body_len, 3, &ok);
+      uint32_t qty = rd_u32(body, body_len, 7, &ok);
+      if (!ok) {
+        send_simple_response(w, c, OP_ORDER_PLACE, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        break;
+      }
+      ns_place_result_t r;
+      uint16_t st = ns_book_place(shm, c->user_id, body[0], body[1], price, qty, body[2], worker_on_fill, w, &r);
+      if (st == ST_ERR_BAD_PACKET) {
+        send_simple_response(w, c, OP_ORDER_PLACE, st, req_id, NULL, 0);
+        break;
+      }
+      w->orders_placed++;
+      worker_notify_md(w, r.md_wake);
+      uint8_t resp[32];
+      ns_put_be64(resp + 0, r.order_id);
+      ns_put_be32(resp + 8, r.filled);
+      ns_put_be32(resp + 12, r.rested);
+      ns_put_be64(resp + 16, (uint64_t)r.notional);
+      ns_put_be64(resp + 24, (uint64_t)r.balance);
+      send_simple_response(w, c, OP_ORDER_PLACE, st, req_id, resp, (uint32_t)sizeof(resp));
+      break;
+    }
+    case OP_ORDER_CANCEL: {
+      bool ok = true;
+      uint64_t id = rd_u64(body, body_len, 0, &ok);
+      if (!ok) {
+        send_simple_response(w, c, OP_ORDER_CANCEL, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        break;
+      }
+      uint32_t qty = 0;
+      int64_t bal = 0;
+      uint64_t wake = 0;
+      uint16_t st = ns_book_cancel(shm, c->user_id, id, &qty, &bal, &wake);
+      worker_notify_md(w, wake);
+      uint8_t resp[12];
+      ns_put_be32(resp + 0, qty);
+      ns_put_be64(resp + 4, (uint64_t)bal);
+      send_simple_response(w, c, OP_ORDER_CANCEL, st, req_id, resp, st == ST_OK ? (uint32_t)sizeof(resp) : 0u);
       break;
     }
     case OP_BALANCE: {
+      // Body: [u8 asset] (absent = cash)
+      const uint8_t asset = body_len >= 1u ? body[0] : (uint8_t)NS_ASSET_CASH;
+      if (asset >= NS_ASSETS) {
+        send_simple_response(w, c, OP_BALANCE, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        break;
+      }
       pthread_mutex_lock(&shm->acct_mu[c->user_id]);
-      int64_t bal = shm->balance[c->user_id];
+      int64_t bal = shm->balance[asset][c->user_id];
       pthread_mutex_unlock(&shm->acct_mu[c->user_id]);
       uint8_t resp[8];
       ns_put_be64(resp, (uint64_t)bal);
-      send_simple_response(c, OP_BALANCE, ST_OK, req_id, resp, (uint32_t)sizeof(resp));
+      send_simple_response(w, c, OP_BALANCE, ST_OK, req_id, resp, (uint32_t)sizeof(resp));
+      break;
+    }
+    case OP_LEADERBOARD: {
+      // Body: [u16 n] (absent or 0 = NS_LEADERBOARD_K). Served from the maintained top K, no scan.
+      uint32_t max = body_len >= 2u ? ns_be16(body) : 0u;
+      if (max == 0 || max > NS_LEADERBOARD_K) max = NS_LEADERBOARD_K;
+      ns_lb_entry_t top[NS_LEADERBOARD_K];
+      uint32_t n = ns_leaderboard_top(shm, top, max);
+      uint8_t resp[2u + NS_LEADERBOARD_K * NS_LEADERBOARD_REC];
+      ns_put_be16(resp, (uint16_t)n);
+      for (uint32_t i = 0; i < n; i++) {
+        ns_put_be32(resp + 2u + i * NS_LEADERBOARD_REC, top[i].user_id);
+        ns_put_be64(resp + 6u + i * NS_LEADERBOARD_REC, (uint64_t)top[i].balance);
+      }
+      send_simple_response(w, c, OP_LEADERBOARD, ST_OK, req_id, resp, 2u + n * NS_LEADERBOARD_REC);
+      break;
+    }
+    case OP_TXN_HISTORY: {
+      // Body: [u16 max (0 = NS_TXN_HISTORY_MAX) [+ u64 before_seq]], for paging back from an earlier response.
+      uint32_t max = body_len >= 2u ? ns_be16(body) : 0u;
+      uint64_t before = body_len >= 10u ? ns_be64(body + 2) : 0u;
+      if (max == 0 || max > NS_TXN_HISTORY_MAX) max = NS_TXN_HISTORY_MAX;
+      ns_txn_event_t ev[NS_TXN_HISTORY_MAX];
+      uint32_t n = ns_txn_history(shm, c->user_id, before, ev, max);
+      const uint32_t resp_len = 2u + n * NS_TXN_HISTORY_REC;
+      uint8_t *dst = conn_reserve_frame(w, c, resp_len);
+      if (!dst) break;
+      uint8_t *resp = dst + sizeof(ns_header_t);
+      ns_put_be16(resp, (uint16_t)n);
+      for (uint32_t i = 0; i < n; i++) {
+        uint8_t *r = resp + 2u + i * NS_TXN_HISTORY_REC;
+        ns_put_be64(r + 0, ev[i].seq);
+        ns_put_be64(r + 8, ev[i].ts_ms);
+        ns_put_be16(r + 16, ev[i].opcode);
+        ns_put_be16(r + 18, ev[i].status);
+        ns_put_be32(r + 20, ev[i].from_user_id);
+        ns_put_be32(r + 24, ev[i].to_user_id);
+        ns_put_be64(r + 28, (uint64_t)ev[i].amount);
+        r[36] = ev[i].asset;
+      }
+      ns_build_header((ns_header_t *)dst, (uint8_t)(NS_FLAG_IS_RESPONSE | ns_integrity_flags(c->integrity)),
+                      OP_TXN_HISTORY, ST_OK, req_id, resp, resp_len);
+      break;
+    }
+    case OP_BALANCE_SUBSCRIBE: {
+      // Body: [u8 on] (absent = subscribe). Pushes go to the user's newest login.
+      bool on = body_len < 1u || body[0] != 0;
+      c->balance_sub = on;
+      ns_balance_watch_set(shm, c->user_id, on);
+      pthread_mutex_lock(&shm->acct_mu[c->user_id]);
+      int64_t bal = shm->balance[NS_ASSET_CASH][c->user_id];
+      pthread_mutex_unlock(&shm->acct_mu[c->user_id]);
+      uint8_t resp[8];
+      ns_put_be64(resp, (uint64_t)bal);
+      send_simple_response(w, c, OP_BALANCE_SUBSCRIBE, ST_OK, req_id, resp, (uint32_t)sizeof(resp));
+      break;
+    }
+    case OP_MD_SUBSCRIBE: {
+      // Body: u64 symbol mask. The current value of each subscribed symbol follows the response.
+      bool ok = true;
+      uint64_t mask = rd_u64(body, body_len, 0, &ok);
+      if (!ok) {
+        send_simple_response(w, c, OP_MD_SUBSCRIBE, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        break;
+      }
+      conn_set_md(w, c, mask);
+      c->md_pending = mask;
+      send_simple_response(w, c, OP_MD_SUBSCRIBE, ST_OK, req_id, NULL, 0);
+      conn_push_md(w, c);
+      break;
+    }
+    case OP_MD_PUBLISH: {
+      // Body: u8 symbol + u32 bid + u32 ask + u32 last_price + u32 last_qty. Book symbols are
+      // published by their order books only.
+      bool ok = true;
+      uint32_t bid = rd_u32(body, body_len, 1, &ok);
+      uint32_t ask = rd_u32(body, body_len, 5, &ok);
+      uint32_t last_price = rd_u32(body, body_len, 9, &ok);
+      uint32_t last_qty = rd_u32(body, body_len, 13, &ok);
+      if (!ok || body[0] < NS_BOOK_SYMBOLS || body[0] >= NS_MD_SYMBOLS) {
+        send_simple_response(w, c, OP_MD_PUBLISH, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+        break;
+      }
+      worker_notify_md(w, ns_md_publish(shm, body[0], bid, ask, last_price, last_qty));
+      send_simple_response(w, c, OP_MD_PUBLISH, ST_OK, req_id, NULL, 0);
       break;
     }
     default:
-      send_simple_response(c, opcode, ST_ERR_BAD_PACKET, req_id, NULL, 0);
+      send_simple_response(w, c, opcode, ST_ERR_BAD_PACKET, req_id, NULL, 0);
       break;
   }
 }
 
-static int handle_conn_io(int epfd, ns_shm_t *shm, int notify_wfd, conn_t *c,
-                          conn_t **fdmap, size_t fdcap, const server_cfg_t *cfg) {
-  // Read
-  while (true) {
-    ssize_t n = recv(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen, 0);
+// recv() that also reports when the data arrived (CLOCK_REALTIME ns, see conn_t.rx_ns) if out_arrival_ns is set.
+static ssize_t conn_recv(conn_t *c, void *buf, size_t len, uint64_t *out_arrival_ns) {
+  if (!out_arrival_ns) return recv(c->fd, buf, len, 0);
+#ifdef SO_TIMESTAMPNS
+  if (c->rx_tstamp) {
+    struct iovec iov = {buf, len};
+    union {
+      char buf[CMSG_SPACE(sizeof(struct timespec))];
+      struct cmsghdr align;
+    } ctl;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    ssize_t n = recvmsg(c->fd, &msg, 0);
     if (n > 0) {
-      c->rlen += (size_t)n;
-    } else if (n == 0) {
-      return -1;
-    } else {
-      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
-      return -1;
+      *out_arrival_ns = now_real_ns();
+      for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_TIMESTAMPNS) continue;
+        struct timespec ts;
+        memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+        uint64_t t = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+        if (t != 0 && t < *out_arrival_ns) *out_arrival_ns = t;
+      }
     }
+    return n;
   }
+#endif
+  ssize_t n = recv(c->fd, buf, len, 0);
+  if (n > 0) *out_arrival_ns = now_real_ns();
+  return n;
+}
 
-  // Parse frames
-  size_t off = 0;
-  while (c->rlen - off >= sizeof(ns_header_t)) {
-    ns_header_t hdr;
-    memcpy(&hdr, c->rbuf + off, sizeof(hdr));
-    if (!ns_validate_header_basic(&hdr, cfg->max_body_len)) {
-      metric_inc_u64(&shm->total_errors, 1);
-      return -1;
+// Check c's oldest unparsed frame: 1 if it is complete (its length in *out_len), 0 if more bytes
+// are needed (the ring grows for a frame larger than it), -1 if the header is invalid.
+static int conn_head_frame(worker_t *w, conn_t *c, size_t *out_len) {
+  if (!c->rx.base || ns_ring_len(&c->rx) < sizeof(ns_header_t)) return 0;
+  const ns_header_t *hdr = (const ns_header_t *)ns_ring_data(&c->rx);
+  if (!ns_validate_header_basic(hdr, w->cfg->max_body_len)) {
+    metric_inc_u64(&w->shm->total_errors, 1);
+    return -1;
+  }
+  size_t frame_len = sizeof(ns_header_t) + (size_t)ns_be32(&hdr->body_len);
+  if (ns_ring_len(&c->rx) < frame_len) {
+    if (frame_len > c->rx.cap) {
+      // Large frame: grow so it can complete (epoll is level-triggered, the rest is read next wakeup).
+      size_t cap = c->rx.cap;
+      while (cap < frame_len) cap *= 2u;
+      if (ns_bufpool_ring_grow(&w->pool, &c->rx, cap) != 0) {
+        LOG_WARN("Receive ring grow to %zu failed: %s", cap, strerror(errno));
+        return -1;
+      }
     }
-    uint32_t body_len = ns_be32(&hdr.body_len);
-    size_t frame_len = sizeof(ns_header_t) + (size_t)body_len;
-    if (c->rlen - off < frame_len) break;
+    return 0;
+  }
+  *out_len = frame_len;
+  return 1;
+}
+
+// Queue c in the ready queue of its oldest request's class once that request is complete; a
+// connection with no input left gives its receive ring back. A connection that stays out of the
+// queues reads again. Returns -1 on malformed input.
+static int conn_schedule(worker_t *w, conn_t *c) {
+  size_t frame_len = 0;
+  int rc = conn_head_frame(w, c, &frame_len);
+  if (rc < 0) return -1;
+  if (rc > 0) {
+    const ns_header_t *hdr = (const ns_header_t *)ns_ring_data(&c->rx);
+    sched_push(w, c, ns_sched_class(ns_be16(&hdr->opcode)));
+    return 0;
+  }
+  if (c->rx.base && ns_ring_len(&c->rx) == 0) {
+    ns_bufpool_ring_put(&w->pool, &c->rx); // idle connections hold no receive buffer
+  }
+  if (c->rx_paused) conn_set_events(w, c, c->want_out, false); // epoll reports what arrived meanwhile
+  return 0;
+}
 
-    uint8_t *body = (body_len ? (c->rbuf + off + sizeof(ns_header_t)) : NULL);
-    if (!ns_validate_checksum(&hdr, body, body_len)) {
+// Run up to max of c's complete requests, in arrival order, while they are of class cls (the first
+// one is). Frames are parsed in place; consumed bytes are released without compaction.
+// Returns the number run, or -1 if the connection must be closed.
+static int conn_run(worker_t *w, conn_t *c, ns_sched_class_t cls, uint32_t max) {
+  ns_shm_t *shm = w->shm;
+  uint32_t ran = 0;
+  while (ran < max) {
+    size_t frame_len = 0;
+    int rc = conn_head_frame(w, c, &frame_len);
+    if (rc < 0) return -1;
+    if (rc == 0) break;
+    uint8_t *p = ns_ring_data(&c->rx);
+    const ns_header_t *hdr = (const ns_header_t *)p;
+    const uint16_t opcode = ns_be16(&hdr->opcode);
+    if (ran > 0 && ns_sched_class(opcode) != cls) break;
+
+    uint32_t body_len = ns_be32(&hdr->body_len);
+    uint8_t *body = (body_len ? (p + sizeof(ns_header_t)) : NULL);
+    if (ns_frame_integrity(hdr) > c->integrity || !ns_validate_checksum(hdr, body, body_len)) {
       metric_inc_u64(&shm->total_errors, 1);
       // respond with checksum error and close
-      send_simple_response(c, ns_be16(&hdr.opcode), ST_ERR_CHECKSUM_FAIL, ns_be64(&hdr.req_id), NULL, 0);
+      send_simple_response(w, c, opcode, ST_ERR_CHECKSUM_FAIL, ns_be64(&hdr->req_id), NULL, 0);
+      (void)conn_flush(w, c);
       return -1;
     }
 
     // Decrypt payload if encrypted flag is set (demo XOR encryption).
-    if ((hdr.flags & NS_FLAG_ENCRYPTED) != 0u && body && body_len > 0) {
+    if ((hdr->flags & NS_FLAG_ENCRYPTED) != 0u && body && body_len > 0) {
       ns_xor_crypt(body, body_len, NS_XOR_KEY);
     }
 
-    handle_request(shm, notify_wfd, c, fdmap, fdcap, cfg, &hdr, body, body_len);
-
-    off += frame_len;
-  }
+    handle_request(w, c, hdr, body, body_len);
 
-  if (off > 0) {
-    memmove(c->rbuf, c->rbuf + off, c->rlen - off);
-    c->rlen -= off;
+    const uint64_t done_ns = now_real_ns();
+    w->sched_lat[cls][ns_lat_bucket(done_ns > c->rx_ns ? (done_ns - c->rx_ns) / 1000ull : 0)]++;
+    ns_ring_consume(&c->rx, frame_len);
+    ran++;
   }
+  return (int)ran;
+}
 
-  // Write
-  while (c->wpos < c->wlen) {
-    ssize_t n = send(c->fd, c->wbuf + c->wpos, c->wlen - c->wpos, 0);
-    if (n > 0) c->wpos += (size_t)n;
-    else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
-    else return -1;
+// Each round of worker_run_ready gives every class this many connection turns, and a turn runs up
+// to this many of the connection's consecutive requests of the class. Chat keeps moving under
+// trading load but a chat flood cannot hold trading up.
+static const uint32_t sched_weight[NS_SCHED_CLASSES] = {8u, 4u, 1u};
+
+// Run queued requests by weighted class, up to WORKER_SCHED_BUDGET per loop iteration.
+static void worker_run_ready(worker_t *w) {
+  uint32_t budget = WORKER_SCHED_BUDGET;
+  while (budget > 0 && w->ready_len > 0) {
+    for (uint32_t cls = 0; cls < NS_SCHED_CLASSES && budget > 0; cls++) {
+      for (uint32_t turn = 0; turn < sched_weight[cls] && w->ready_head[cls] != 0 && budget > 0; turn++) {
+        conn_t *c = (conn_t *)ns_slab_at(&w->conns, w->ready_head[cls] - 1u);
+        sched_remove(w, c);
+        int ran = conn_run(w, c, (ns_sched_class_t)cls, sched_weight[cls] < budget ? sched_weight[cls] : budget);
+        // A connection with more requests queued is flushed after its last turn, one send for them all.
+        if (ran < 0 || conn_schedule(w, c) != 0 || (!c->queued && conn_flush(w, c) != 0)) {
+          conn_cleanup_session(w->shm, c);
+          conn_free(w, c);
+          continue;
+        }
+        budget -= ran > 0 ? (uint32_t)ran : 1u;
+      }
+    }
   }
+}
 
-  if (c->wpos == c->wlen) {
-    c->wpos = c->wlen = 0;
-    // back to read-only interest
-    (void)ep_mod(epfd, c->fd, EPOLLIN | EPOLLRDHUP, c);
+static int handle_conn_io(worker_t *w, conn_t *c) {
+  // A queued connection is not read until its parsed requests have run: what waits in the socket
+  // keeps its own receive timestamp, and the ring stays a bound on per-connection backlog. Its
+  // EPOLLIN is dropped meanwhile (level-triggered, it would report the same input on every wait)
+  // and restored by conn_schedule once it leaves the ready queues.
+  if (c->queued) {
+    conn_set_events(w, c, c->want_out, true);
   } else {
-    (void)ep_mod(epfd, c->fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, c);
+    // Read (attach a pooled ring only for the duration of pending input)
+    if (!c->rx.base && ns_bufpool_ring_get(&w->pool, &c->rx, CONN_RX_DEFAULT) != 0) {
+      LOG_WARN("Receive ring allocation failed: %s", strerror(errno));
+      return -1;
+    }
+    // Frames completed by this read count as arriving with its first chunk (what is left in the
+    // ring from earlier reads is at most a partial frame, which was not ready before). TCP reports the
+    // time of the last segment a recvmsg() copied, so the stamped read takes only a header's worth:
+    // that is the oldest request waiting, not the newest.
+    bool stamp = true;
+    while (ns_ring_space(&c->rx) > 0) {
+      size_t want = ns_ring_space(&c->rx);
+      if (stamp && c->rx_tstamp && want > sizeof(ns_header_t)) want = sizeof(ns_header_t);
+      ssize_t n = conn_recv(c, ns_ring_tail(&c->rx), want, stamp ? &c->rx_ns : NULL);
+      if (n > 0) {
+        ns_ring_commit(&c->rx, (size_t)n);
+        stamp = false;
+      } else if (n == 0) {
+        return -1;
+      } else {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+        return -1;
+      }
+    }
+    // Complete requests run from the ready queues after this batch of events (worker_run_ready).
+    if (conn_schedule(w, c) != 0) return -1;
   }
 
+  if (conn_flush(w, c) != 0) return -1;
+  if (c->md_pending && !c->want_out) {
+    // The socket drained: send the market data that changed while it was backed up.
+    conn_push_md(w, c);
+    return conn_flush(w, c);
+  }
   return 0;
 }
 
-int worker_run(int worker_id, int listen_fd, int notify_efd, ns_shm_t *shm, const server_cfg_t *cfg) {
+int worker_run(int worker_id, int listen_fd, const int *notify_efds, ns_shm_t *shm, const server_cfg_t *cfg) {
   // Backwards-compatible wrapper: on Linux eventfd uses same fd for read/write.
-  return worker_run2(worker_id, listen_fd, notify_efd, notify_efd, shm, cfg);
+  return worker_run2(worker_id, listen_fd, notify_efds, notify_efds, shm, cfg);
 }
 
-int worker_run2(int worker_id, int listen_fd, int notify_rfd, int notify_wfd, ns_shm_t *shm, const server_cfg_t *cfg) {
+int worker_run2(int worker_id, int listen_fd, const int *notify_rfds, const int *notify_wfds, ns_shm_t *shm,
+                const server_cfg_t *cfg) {
   char pname[64];
   snprintf(pname, sizeof(pname), "server-w%d", worker_id);
   log_set_program(pname);
 
+  if (worker_id < 0 || (uint32_t)worker_id >= NS_MAX_WORKERS || worker_id >= cfg->workers) return -1;
+  const int notify_rfd = notify_rfds[worker_id];
+
+  worker_t wk;
+  memset(&wk, 0, sizeof(wk));
+  worker_t *w = &wk;
+  w->worker_id = worker_id;
+  w->notify_wfds = notify_wfds;
+  w->nworkers = cfg->workers;
+  w->shm = shm;
+  w->cfg = cfg;
+
   int epfd = epoll_create1(0);
   if (epfd < 0) return -1;
+  w->epfd = epfd;
 
-  // fd map for connection pointers
+  // Connection slots; no more connections than open files, or than the per-worker limit.
   struct rlimit rl;
   if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
     close(epfd);
     return -1;
   }
-  size_t fdcap = (size_t)rl.rlim_cur;
-  if (fdcap > 200000u) fdcap = 200000u;
-  conn_t **fdmap = (conn_t **)calloc(fdcap, sizeof(conn_t *));
-  if (!fdmap) {
+  uint32_t max_slots = (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > 200000u) ? 200000u : (uint32_t)rl.rlim_cur;
+  if (cfg->max_connections_per_worker > 0 && cfg->max_connections_per_worker < max_slots) {
+    max_slots = cfg->max_connections_per_worker;
+  }
+  if (ns_slab_init(&w->conns, sizeof(conn_t), max_slots) != 0) {
     close(epfd);
     return -1;
   }
+  ns_bufpool_init(&w->pool, WORKER_POOL_CACHE_BYTES);
+
+  // Chat flush window: epoll_wait only has millisecond resolution, so use a timerfd.
+  w->chat_timer_fd = -1;
+  if (cfg->chat_flush_us > 0) {
+    w->chat_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (w->chat_timer_fd < 0 || ep_add(epfd, w->chat_timer_fd, EPOLLIN, EP_TAG_CHAT_TIMER) != 0) {
+      LOG_WARN("Chat flush timer unavailable (%s); pushing chat events immediately", strerror(errno));
+      if (w->chat_timer_fd >= 0) close(w->chat_timer_fd);
+      w->chat_timer_fd = -1;
+    }
+  }
+
+  // Balance push window: credits to one connection within it share a single BALANCE_PUSH.
+  w->bal_timer_fd = -1;
+  if (cfg->balance_push_us > 0) {
+    w->bal_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (w->bal_timer_fd < 0 || ep_add(epfd, w->bal_timer_fd, EPOLLIN, EP_TAG_BAL_TIMER) != 0) {
+      LOG_WARN("Balance push timer unavailable (%s); pushing balance updates immediately", strerror(errno));
+      if (w->bal_timer_fd >= 0) close(w->bal_timer_fd);
+      w->bal_timer_fd = -1;
+    }
+  }
 
   // add listen fd and notify read fd
   (void)net_set_nonblocking(listen_fd, true);
-  if (ep_add(epfd, listen_fd, EPOLLIN, (void *)(uintptr_t)listen_fd) != 0) {
-    free(fdmap);
-    close(epfd);
-    return -1;
-  }
-  if (ep_add(epfd, notify_rfd, EPOLLIN, (void *)(uintptr_t)notify_rfd) != 0) {
-    free(fdmap);
+  if (ep_add(epfd, listen_fd, EPOLLIN, EP_TAG_LISTEN) != 0 ||
+      ep_add(epfd, notify_rfd, EPOLLIN, EP_TAG_NOTIFY) != 0) {
+    if (w->chat_timer_fd >= 0) close(w->chat_timer_fd);
+    if (w->bal_timer_fd >= 0) close(w->bal_timer_fd);
+    ns_slab_destroy(&w->conns);
     close(epfd);
     return -1;
   }
 
-  uint64_t last_chat_seq = ns_chat_latest_seq(shm);
+  // A restarted worker starts with no subscribers or connections; drop interest, routes and
+  // undelivered direct messages left behind by its predecessor.
+  for (uint16_t r = 0; r < (uint16_t)NS_MAX_ROOMS; r++) ns_room_set_worker(shm, r, (uint32_t)worker_id, false);
+  ns_route_clear_worker(shm, (uint32_t)worker_id);
+  ns_inbox_reset(shm, (uint32_t)worker_id);
+  for (uint32_t sym = 0; sym < NS_MD_SYMBOLS; sym++) ns_md_set_worker(shm, sym, (uint32_t)worker_id, false);
+  (void)ns_md_take_dirty(shm, (uint32_t)worker_id);
+
   struct epoll_event events[256];
   uint64_t last_timeout_check_ms = now_ms();
   const uint64_t HEARTBEAT_TIMEOUT_MS = 30000u; // 30 seconds
   const uint64_t TIMEOUT_CHECK_INTERVAL_MS = 5000u; // Check every 5 seconds
 
+  w->shed_ok_ns = w->shed_win_ns = now_real_ns();
+  w->shed_win_min_ns = UINT64_MAX;
+  shm->worker_stats[worker_id].pid = (int32_t)getpid();
   LOG_INFO("Worker started (pid=%d)", (int)getpid());
 
   while (true) {
-    int n = epoll_wait(epfd, events, 256, 1000);
+    // Requests left over from the last iteration's budget: poll without waiting.
+    int n = epoll_wait(epfd, events, 256, w->ready_len > 0 ? 0 : 1000);
     if (n < 0) {
       if (errno == EINTR) continue;
       break;
@@ -517,26 +1864,27 @@ int worker_run2(int worker_id, int listen_fd, int notify_rfd, int notify_wfd, ns
     // Periodic heartbeat timeout check
     if (now - last_timeout_check_ms >= TIMEOUT_CHECK_INTERVAL_MS) {
       last_timeout_check_ms = now;
-      for (size_t fd = 0; fd < fdcap; fd++) {
-        conn_t *c = fdmap[fd];
+      for (uint32_t idx = 0; idx < ns_slab_hwm(&w->conns); idx++) {
+        conn_t *c = (conn_t *)ns_slab_at(&w->conns, idx);
         if (!c || !c->authed) continue;
         if (now - c->last_seen_ms >= HEARTBEAT_TIMEOUT_MS) {
-          LOG_INFO("Connection timeout: fd=%zu user_id=%u last_seen=%llu ms ago",
-                   fd, c->user_id, (unsigned long long)(now - c->last_seen_ms));
+          LOG_INFO("Connection timeout: fd=%d user_id=%u last_seen=%llu ms ago",
+                   c->fd, c->user_id, (unsigned long long)(now - c->last_seen_ms));
           conn_cleanup_session(shm, c);
           epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
-          fdmap[fd] = NULL;
-          conn_free(c);
+          conn_free(w, c);
         }
       }
     }
 
-    // periodic broadcast drain (in case notifications are coalesced)
-    handle_chat_broadcast(shm, fdmap, fdcap, &last_chat_seq);
+    // periodic broadcast and inbox drain (in case notifications are coalesced)
+    handle_chat_broadcast(w);
+    if (worker_drain_inbox(w) > 0) w->dm_kick = true;
+    if (worker_drain_md(w)) w->dm_kick = true;
 
     for (int i = 0; i < n; i++) {
-      void *ptr = events[i].data.ptr;
-      if (ptr == (void *)(uintptr_t)listen_fd) {
+      uint64_t tag = events[i].data.u64;
+      if (tag == EP_TAG_LISTEN) {
         while (true) {
           struct sockaddr_storage ss;
           socklen_t sl = (socklen_t)sizeof(ss);
@@ -545,11 +1893,16 @@ int worker_run2(int worker_id, int listen_fd, int notify_rfd, int notify_wfd, ns
             if (errno == EAGAIN || errno == EWOULDBLOCK) break;
             break;
           }
+          if (!worker_accept_admit(w, now_mono_ns())) {
+            w->accepts_refused++;
+            close(cfd);
+            continue;
+          }
           // Check connection limit per worker
-          size_t active_conns = count_active_connections(fdmap, fdcap);
           if (cfg->max_connections_per_worker > 0 &&
-              active_conns >= (size_t)cfg->max_connections_per_worker) {
-            LOG_WARN("Connection limit reached: %zu >= %u, rejecting", active_conns, cfg->max_connections_per_worker);
+              ns_slab_live(&w->conns) >= cfg->max_connections_per_worker) {
+            LOG_WARN("Connection limit reached: %u >= %u, rejecting", ns_slab_live(&w->conns),
+                     cfg->max_connections_per_worker);
             close(cfd);
             continue;
           }
@@ -562,59 +1915,124 @@ int worker_run2(int worker_id, int listen_fd, int notify_rfd, int notify_wfd, ns
           }
           metric_inc_u64(&shm->total_connections, 1);
 
-          if ((size_t)cfd >= fdcap) {
+          // Buffers are attached lazily from the pool; an idle connection is just its slab slot.
+          uint64_t handle = 0;
+          conn_t *c = (conn_t *)ns_slab_alloc(&w->conns, &handle);
+          if (!c) {
             close(cfd);
             continue;
           }
-
-          conn_t *c = (conn_t *)calloc(1, sizeof(*c));
           c->fd = cfd;
-          c->wcap = 0;
-          c->wbuf = NULL;
+          c->handle = handle;
           c->last_seen_ms = now_ms(); // Initialize last_seen
-          fdmap[cfd] = c;
+          c->integrity = NS_INTEGRITY_FULL;
+#ifdef SO_TIMESTAMPNS
+          {
+            int one = 1;
+            c->rx_tstamp = setsockopt(cfd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) == 0;
+          }
+#endif
+#ifdef SO_ZEROCOPY
+          if (cfg->zerocopy_min > 0) {
+            int one = 1;
+            c->zc_enabled = setsockopt(cfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+          }
+#endif
 
-          (void)ep_add(epfd, cfd, EPOLLIN | EPOLLRDHUP, c);
+          if (ep_add(epfd, cfd, EPOLLIN | EPOLLRDHUP, handle) != 0) {
+            conn_free(w, c);
+          }
         }
         continue;
       }
 
-      if (ptr == (void *)(uintptr_t)notify_rfd) {
+      if (tag == EP_TAG_NOTIFY) {
         uint64_t val = 0;
         while (read(notify_rfd, &val, sizeof(val)) > 0) {
           // drain
         }
-        handle_chat_broadcast(shm, fdmap, fdcap, &last_chat_seq);
+        w->chat_wakeups++;
+        handle_chat_broadcast(w);
+        if (worker_drain_inbox(w) > 0) w->dm_kick = true;
+        if (worker_drain_md(w)) w->dm_kick = true;
+        continue;
+      }
+
+      if (tag == EP_TAG_BAL_TIMER) {
+        uint64_t expirations = 0;
+        (void)read(w->bal_timer_fd, &expirations, sizeof(expirations));
+        w->bal_flush_armed = false;
+        worker_flush_balances(w);
         continue;
       }
 
-      conn_t *c = (conn_t *)ptr;
-      int fd = c->fd;
-      if (fd < 0 || (size_t)fd >= fdcap || fdmap[fd] != c) continue;
+      if (tag == EP_TAG_CHAT_TIMER) {
+        uint64_t expirations = 0;
+        (void)read(w->chat_timer_fd, &expirations, sizeof(expirations));
+        w->chat_flush_armed = false;
+        worker_flush_pending(w, true);
+        continue;
+      }
+
+      // Stale events (connection closed earlier in this batch, fd since reused) fail the generation check.
+      conn_t *c = (conn_t *)ns_slab_get(&w->conns, tag);
+      if (!c) continue;
+
+      uint32_t ev = events[i].events;
+      if ((ev & EPOLLERR) != 0u && c->zc_len > 0) {
+        // Zero-copy completions are reported through the error queue; only a pending SO_ERROR is fatal.
+        conn_reap_zerocopy(w, c);
+        int err = 0;
+        socklen_t errlen = (socklen_t)sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0 && err == 0) ev &= ~(uint32_t)EPOLLERR;
+      }
 
-      if ((events[i].events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) != 0u) {
+      if ((ev & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) != 0u) {
         conn_cleanup_session(shm, c);
-        fdmap[fd] = NULL;
-        conn_free(c);
+        conn_free(w, c);
         continue;
       }
 
-      if (handle_conn_io(epfd, shm, notify_wfd, c, fdmap, fdcap, cfg) != 0) {
+      if (handle_conn_io(w, c) != 0) {
         conn_cleanup_session(shm, c);
-        fdmap[fd] = NULL;
-        conn_free(c);
+        conn_free(w, c);
         continue;
       }
     }
+
+    worker_run_ready(w);
+
+    if (w->chat_kick) {
+      w->chat_kick = false;
+      handle_chat_broadcast(w);
+    }
+    if (w->md_kick) {
+      w->md_kick = false;
+      if (worker_drain_md(w)) w->dm_kick = true;
+    }
+    if (w->bal_kick) {
+      w->bal_kick = false;
+      w->dm_kick = false;
+      worker_flush_balances(w); // also flushes queued direct messages
+    }
+    if (w->dm_kick) {
+      w->dm_kick = false;
+      worker_flush_pending(w, false);
+    }
+
+    worker_publish_stats(w);
   }
 
   // cleanup
-  for (size_t fd = 0; fd < fdcap; fd++) {
-    if (fdmap[fd]) conn_free(fdmap[fd]);
+  for (uint32_t idx = 0; idx < ns_slab_hwm(&w->conns); idx++) {
+    conn_t *c = (conn_t *)ns_slab_at(&w->conns, idx);
+    if (c) conn_free(w, c);
   }
-  free(fdmap);
+  ns_bufpool_destroy(&w->pool);
+  ns_slab_destroy(&w->conns);
+  if (w->chat_timer_fd >= 0) close(w->chat_timer_fd);
+  if (w->bal_timer_fd >= 0) close(w->bal_timer_fd);
+  free(w->bal_pending);
   close(epfd);
   return 0;
 }
-
-
@@ -13,11 +13,24 @@ typedef struct {
   uint32_t max_connections_per_worker; // 0 = unlimited
   int recv_timeout_ms;
   int send_timeout_ms;
+  uint32_t integrity_modes; // bitmask of ns_integrity_t a client may negotiate (FULL is always allowed)
+  uint32_t zerocopy_min;    // send queued buffers of at least this many bytes with MSG_ZEROCOPY; 0 = never
+  uint32_t chat_flush_us;   // hold chat pushes this long and coalesce them per connection; 0 = push each event
+  uint32_t chat_max_msg;    // longest CHAT_SEND message accepted (<= NS_CHAT_MSG_LIMIT)
+  uint32_t balance_push_us; // coalesce credits to a BALANCE_SUBSCRIBE connection this long; 0 = push each one
+  // Admission control: shed requests that queued longer than shed_target_us once none has come in
+  // under it for shed_interval_ms (CoDel); 0 = off. accept_rate caps new connections per second per
+  // worker; 0 = unlimited.
+  uint32_t shed_target_us;
+  uint32_t shed_interval_ms;
+  uint32_t accept_rate;
 } server_cfg_t;
 
-int worker_run(int worker_id, int listen_fd, int notify_efd, ns_shm_t *shm, const server_cfg_t *cfg);
-// notify_rfd is used for epoll read; notify_wfd is used to wake other workers.
-// On Linux with eventfd you can pass the same fd for both.
-int worker_run2(int worker_id, int listen_fd, int notify_rfd, int notify_wfd, ns_shm_t *shm, const server_cfg_t *cfg);
+int worker_run(int worker_id, int listen_fd, const int *notify_efds, ns_shm_t *shm, const server_cfg_t *cfg);
+// Each worker has its own notification channel: cfg->workers entries indexed by worker id.
+// notify_rfds[worker_id] is polled by this worker; notify_wfds[i] wakes worker i.
+// On Linux with eventfd you can pass the same array for both.
+int worker_run2(int worker_id, int listen_fd, const int *notify_rfds, const int *notify_wfds, ns_shm_t *shm,
+                const server_cfg_t *cfg);
 
 
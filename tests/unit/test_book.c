@@ -0,0 +1,132 @@
+#include "book.h"
+#include "proto.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static void init_local_shm(ns_shm_t *s) {
+  memset(s, 0, sizeof(*s));
+  pthread_mutex_init(&s->txn_mu, NULL);
+  for (uint32_t i = 0; i < NS_MAX_USERS; i++) {
+    pthread_mutex_init(&s->acct_mu[i], NULL);
+    s->balance[NS_ASSET_CASH][i] = NS_INITIAL_CASH;
+  }
+  for (uint32_t i = 0; i < NS_BOOK_SYMBOLS; i++) pthread_mutex_init(&s->books[i].mu, NULL);
+  pthread_mutex_init(&s->leaderboard.mu, NULL);
+}
+
+typedef struct {
+  ns_fill_t fills[16];
+  int n;
+} fill_log_t;
+
+static void log_fill(void *arg, const ns_fill_t *f) {
+  fill_log_t *log = (fill_log_t *)arg;
+  if (log->n < 16) log->fills[log->n++] = *f;
+}
+
+static void assert_conserved(const ns_shm_t *s) {
+  int64_t current[NS_ASSETS], expected[NS_ASSETS];
+  assert(ns_check_asset_conservation(s, current, expected) == 0);
+}
+
+static void test_price_time_priority(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+  const int64_t *cash = s.balance[NS_ASSET_CASH], *units = s.balance[NS_ASSET_OF_SYMBOL(0)];
+  ns_place_result_t r;
+  fill_log_t log = {0};
+
+  // Asks: user 1 @101 x5, user 2 @100 x3, user 3 @100 x4 (after user 2).
+  assert(ns_book_place(&s, 1, 0, NS_SIDE_SELL, 101, 5, 0, NULL, NULL, &r) == ST_OK && r.rested == 5);
+  uint64_t ask2 = 0;
+  assert(ns_book_place(&s, 2, 0, NS_SIDE_SELL, 100, 3, 0, NULL, NULL, &r) == ST_OK);
+  ask2 = r.order_id;
+  assert(ns_book_place(&s, 3, 0, NS_SIDE_SELL, 100, 4, 0, NULL, NULL, &r) == ST_OK);
+  assert(s.books[0].best_ask == 100 && s.books[0].asks[100].qty == 7);
+
+  // A buy of 9 @101 takes 100 first (user 2 before 3), then 2 of user 1's 101, at the makers' prices.
+  assert(ns_book_place(&s, 9, 0, NS_SIDE_BUY, 101, 9, 0, log_fill, &log, &r) == ST_OK);
+  assert(r.filled == 9 && r.rested == 0 && r.order_id == 0 && r.notional == 7 * 100 + 2 * 101);
+  assert(log.n == 3 && log.fills[0].maker_user_id == 2 && log.fills[0].maker_order_id == ask2);
+  assert(log.fills[1].maker_user_id == 3 && log.fills[2].maker_user_id == 1 && log.fills[2].maker_remaining == 3);
+  assert(cash[9] == 100000 - r.notional && s.escrow[9] == 0 && r.balance == cash[9]);
+  assert(cash[2] == 100300 && units[9] == 9 && units[1] == -2 && units[2] == -3);
+  assert(s.books[0].best_ask == 101 && s.books[0].asks[100].qty == 0 && s.books[0].live_orders == 1);
+  // The symbol's market-data slot follows the top of book and carries the taker's last fill.
+  ns_md_quote_t q;
+  assert(ns_md_read(&s, 0, &q) && q.bid == 0 && q.ask == 101 && q.last_price == 101 && q.last_qty == 9);
+  assert(q.volume == 9 && q.version == 3); // two new best asks, then the trade
+  assert_conserved(&s);
+}
+
+static void test_rest_cancel_ioc(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+  ns_place_result_t r;
+
+  // A resting buy holds its cash in escrow until cancelled.
+  assert(ns_book_place(&s, 4, 1, NS_SIDE_BUY, 50, 10, 0, NULL, NULL, &r) == ST_OK && r.rested == 10);
+  assert(s.balance[NS_ASSET_CASH][4] == 99500 && s.escrow[4] == 500 && s.books[1].best_bid == 50);
+  uint64_t id = r.order_id;
+  uint32_t qty = 0;
+  int64_t bal = 0;
+  assert(ns_book_cancel(&s, 5, id, &qty, &bal, NULL) == ST_ERR_NOT_FOUND); // someone else's
+  assert(ns_book_cancel(&s, 4, id, &qty, &bal, NULL) == ST_OK && qty == 10 && bal == 100000 && s.escrow[4] == 0);
+  assert(ns_book_cancel(&s, 4, id, &qty, &bal, NULL) == ST_ERR_NOT_FOUND); // already gone
+  assert(s.books[1].best_bid == 0 && s.books[1].live_orders == 0);
+
+  // The slot is reused under a new generation; the old id stays dead.
+  assert(ns_book_place(&s, 4, 1, NS_SIDE_BUY, 40, 1, 0, NULL, NULL, &r) == ST_OK && r.order_id != id);
+  assert((uint32_t)r.order_id == (uint32_t)id);
+
+  // IOC fills what crosses and refunds the rest; a buy it cannot fund changes nothing.
+  assert(ns_book_place(&s, 6, 1, NS_SIDE_SELL, 30, 3, NS_ORDER_IOC, NULL, NULL, &r) == ST_OK);
+  assert(r.filled == 1 && r.rested == 0 && r.notional == 40 && s.books[1].best_bid == 0);
+  assert(ns_book_place(&s, 7, 1, NS_SIDE_BUY, 4000, 100, 0, NULL, NULL, &r) == ST_ERR_INSUFFICIENT_FUNDS);
+  assert(s.balance[NS_ASSET_CASH][7] == 100000 && s.escrow[7] == 0);
+  assert(ns_book_place(&s, 7, 1, NS_SIDE_BUY, NS_BOOK_LEVELS, 1, 0, NULL, NULL, &r) == ST_ERR_BAD_PACKET);
+  assert(ns_book_place(&s, 7, NS_BOOK_SYMBOLS, NS_SIDE_BUY, 1, 1, 0, NULL, NULL, &r) == ST_ERR_BAD_PACKET);
+  assert_conserved(&s);
+}
+
+static void test_best_price_tracking(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+  ns_place_result_t r;
+
+  // Levels far apart (different mask words) are found again when the best one empties.
+  uint64_t ids[3];
+  const uint32_t px[3] = {3000, 70, 1};
+  for (int i = 0; i < 3; i++) {
+    assert(ns_book_place(&s, 1, 2, NS_SIDE_BUY, px[i], 1, 0, NULL, NULL, &r) == ST_OK);
+    ids[i] = r.order_id;
+  }
+  assert(s.books[2].best_bid == 3000);
+  uint32_t qty = 0;
+  int64_t bal = 0;
+  assert(ns_book_cancel(&s, 1, ids[0], &qty, &bal, NULL) == ST_OK && s.books[2].best_bid == 70);
+  assert(ns_book_place(&s, 2, 2, NS_SIDE_SELL, 1, 2, 0, NULL, NULL, &r) == ST_OK && r.filled == 2);
+  assert(s.books[2].best_bid == 0 && s.books[2].best_ask == 0);
+
+  // Cancelling from the middle of a FIFO keeps the rest of it in order.
+  for (int i = 0; i < 3; i++) {
+    assert(ns_book_place(&s, (uint32_t)(10 + i), 2, NS_SIDE_SELL, 2000, 1, 0, NULL, NULL, &r) == ST_OK);
+    ids[i] = r.order_id;
+  }
+  assert(ns_book_cancel(&s, 11, ids[1], &qty, &bal, NULL) == ST_OK);
+  fill_log_t log = {0};
+  assert(ns_book_place(&s, 3, 2, NS_SIDE_BUY, 2000, 5, 0, log_fill, &log, &r) == ST_OK);
+  assert(log.n == 2 && log.fills[0].maker_user_id == 10 && log.fills[1].maker_user_id == 12 && r.rested == 3);
+  assert(s.books[2].best_bid == 2000 && s.books[2].best_ask == 0);
+  assert_conserved(&s);
+}
+
+int main(void) {
+  test_price_time_priority();
+  test_rest_cancel_ioc();
+  test_best_price_tracking();
+  printf("test_book: OK\n");
+  return 0;
+}
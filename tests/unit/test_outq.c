@@ -0,0 +1,97 @@
+#include "outq.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static void test_reserve_appends_in_place(void) {
+  ns_bufpool_t p;
+  ns_bufpool_init(&p, 1u << 20);
+  ns_outq_t q;
+  memset(&q, 0, sizeof(q));
+
+  uint8_t *a = ns_outq_reserve(&q, &p, 5);
+  memcpy(a, "hello", 5);
+  uint8_t *b = ns_outq_reserve(&q, &p, 6);
+  memcpy(b, " world", 6);
+  assert(b == a + 5); // same private buffer, one entry
+  assert(q.count == 1 && ns_outq_pending(&q) == 11);
+
+  struct iovec iov[4];
+  assert(ns_outq_iov(&q, iov, 4) == 1);
+  assert(iov[0].iov_len == 11 && memcmp(iov[0].iov_base, "hello world", 11) == 0);
+
+  ns_outq_consume(&q, &p, 6);
+  assert(ns_outq_pending(&q) == 5);
+  assert(ns_outq_iov(&q, iov, 4) == 1 && memcmp(iov[0].iov_base, "world", 5) == 0);
+  ns_outq_consume(&q, &p, 5);
+  assert(ns_outq_pending(&q) == 0 && q.ents == NULL); // entry array returned when drained
+  assert(p.tx_in_use == 0);
+
+  ns_bufpool_destroy(&p);
+}
+
+static void test_shared_refs(void) {
+  ns_bufpool_t p;
+  ns_bufpool_init(&p, 1u << 20);
+  ns_outq_t q1, q2;
+  memset(&q1, 0, sizeof(q1));
+  memset(&q2, 0, sizeof(q2));
+
+  ns_sbuf_t *f = ns_sbuf_new(&p, 16);
+  memcpy(f->data, "broadcast", 9);
+  f->len = 9;
+  assert(ns_outq_push_ref(&q1, &p, f, 0, f->len) == 0);
+  assert(ns_outq_push_ref(&q2, &p, f, 0, f->len) == 0);
+  ns_sbuf_unref(&p, f);
+  assert(f->refs == 2);
+
+  // A shared buffer is never appended to; the reply gets its own entry.
+  uint8_t *r = ns_outq_reserve(&q1, &p, 3);
+  memcpy(r, "ack", 3);
+  assert(q1.count == 2 && f->len == 9);
+
+  struct iovec iov[4];
+  assert(ns_outq_iov(&q1, iov, 4) == 2);
+  assert(iov[0].iov_base == f->data && iov[1].iov_len == 3);
+
+  ns_outq_consume(&q1, &p, 10); // all of the shared frame + 1 byte of the reply
+  assert(f->refs == 1 && ns_outq_pending(&q1) == 2);
+  ns_outq_clear(&q1, &p);
+  ns_outq_clear(&q2, &p);
+  assert(p.tx_in_use == 0);
+
+  ns_bufpool_destroy(&p);
+}
+
+static void test_many_entries_wrap(void) {
+  ns_bufpool_t p;
+  ns_bufpool_init(&p, 1u << 20);
+  ns_outq_t q;
+  memset(&q, 0, sizeof(q));
+  ns_sbuf_t *f = ns_sbuf_new(&p, 1);
+  f->data[0] = 'x';
+  f->len = 1;
+
+  // Interleave pushes and consumes so the circular array wraps, then grow it.
+  for (int i = 0; i < 100; i++) assert(ns_outq_push_ref(&q, &p, f, 0, 1) == 0);
+  ns_outq_consume(&q, &p, 90);
+  for (int i = 0; i < 500; i++) assert(ns_outq_push_ref(&q, &p, f, 0, 1) == 0);
+  assert(q.count == 510 && ns_outq_pending(&q) == 510 && f->refs == 511);
+  struct iovec iov[64];
+  assert(ns_outq_iov(&q, iov, 64) == 64);
+  ns_outq_consume(&q, &p, 510);
+  assert(q.count == 0 && f->refs == 1);
+  ns_sbuf_unref(&p, f);
+  assert(p.tx_in_use == 0);
+
+  ns_bufpool_destroy(&p);
+}
+
+int main(void) {
+  test_reserve_appends_in_place();
+  test_shared_refs();
+  test_many_entries_wrap();
+  printf("test_outq: OK\n");
+  return 0;
+}
@@ -21,12 +21,47 @@ static void test_crc_and_checksum(void) {
   uint32_t c1 = ns_crc32(msg, strlen(msg));
   uint32_t c2 = ns_crc32(msg, strlen(msg));
   assert(c1 == c2);
+  // Extending a finished CRC equals hashing the concatenation.
+  assert(ns_crc32_extend(ns_crc32(msg, 5), msg + 5, strlen(msg) - 5) == c1);
 
   ns_header_t hdr;
   memset(&hdr, 0, sizeof(hdr));
   ns_build_header(&hdr, 0, OP_HELLO, ST_OK, 42, (const uint8_t *)msg, (uint32_t)strlen(msg));
   assert(ns_validate_header_basic(&hdr, 65536));
   assert(ns_validate_checksum(&hdr, (const uint8_t *)msg, strlen(msg)));
+  assert(ns_be32(&hdr.deadline_ms) == 0u);
+
+  // The deadline sits in the old reserved bytes, is covered by the checksum and leaves the layout at 32 bytes.
+  assert(sizeof(ns_header_t) == 32u);
+  ns_build_header_deadline(&hdr, 0, OP_BALANCE, 43, 250, (const uint8_t *)msg, (uint32_t)strlen(msg));
+  assert(ns_be32(&hdr.deadline_ms) == 250u && ns_be16(&hdr.status) == ST_OK);
+  assert(ns_validate_checksum(&hdr, (const uint8_t *)msg, strlen(msg)));
+  ns_put_be32(&hdr.deadline_ms, 251);
+  assert(!ns_validate_checksum(&hdr, (const uint8_t *)msg, strlen(msg)));
+}
+
+static void test_integrity_modes(void) {
+  uint8_t body[] = {'p', 'a', 'y'};
+  ns_header_t hdr;
+
+  // Header-only: body tampering goes unnoticed, header tampering does not.
+  ns_build_header(&hdr, ns_integrity_flags(NS_INTEGRITY_HEADER), OP_BALANCE, ST_OK, 7, body, sizeof(body));
+  assert(ns_frame_integrity(&hdr) == NS_INTEGRITY_HEADER);
+  assert(ns_validate_checksum(&hdr, body, sizeof(body)));
+  body[0] ^= 0xffu;
+  assert(ns_validate_checksum(&hdr, body, sizeof(body)));
+  hdr.req_id ^= 1u;
+  assert(!ns_validate_checksum(&hdr, body, sizeof(body)));
+
+  // None: checksum field is zero and always accepted.
+  ns_build_header(&hdr, ns_integrity_flags(NS_INTEGRITY_NONE), OP_BALANCE, ST_OK, 7, body, sizeof(body));
+  assert(ns_frame_integrity(&hdr) == NS_INTEGRITY_NONE);
+  assert(ns_be32(&hdr.checksum) == 0u);
+  assert(ns_validate_checksum(&hdr, body, sizeof(body)));
+
+  ns_integrity_t m;
+  assert(ns_integrity_parse("header", &m) == 0 && m == NS_INTEGRITY_HEADER);
+  assert(ns_integrity_parse("bogus", &m) != 0);
 }
 
 static void test_xor_crypt(void) {
@@ -44,6 +79,7 @@ static void test_xor_crypt(void) {
 int main(void) {
   test_be_helpers();
   test_crc_and_checksum();
+  test_integrity_modes();
   test_xor_crypt();
   printf("test_proto: OK\n");
   return 0;
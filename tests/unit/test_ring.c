@@ -0,0 +1,100 @@
+#include "bufpool.h"
+#include "ring.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static void test_basic_io(void) {
+  ns_ring_t r;
+  assert(ns_ring_init(&r, 100) == 0);
+  assert(r.cap >= 100 && ns_ring_len(&r) == 0 && ns_ring_space(&r) == r.cap);
+
+  memcpy(ns_ring_tail(&r), "abc", 3);
+  ns_ring_commit(&r, 3);
+  assert(ns_ring_len(&r) == 3);
+  assert(memcmp(ns_ring_data(&r), "abc", 3) == 0);
+  ns_ring_consume(&r, 3);
+  assert(ns_ring_len(&r) == 0);
+  ns_ring_free(&r);
+}
+
+static void test_wrap_is_contiguous(void) {
+  ns_ring_t r;
+  assert(ns_ring_init(&r, 4096) == 0);
+
+  // Leave a partial record straddling the end of the buffer.
+  ns_ring_commit(&r, r.cap - 4);
+  ns_ring_consume(&r, r.cap - 8);
+  memcpy(ns_ring_tail(&r), "0123456789", 10); // writes across the wrap point
+  ns_ring_commit(&r, 10);
+
+  // Readable span is one contiguous view and mirrors the physical start.
+  assert(ns_ring_len(&r) == 14);
+  assert(memcmp(ns_ring_data(&r) + 4, "0123456789", 10) == 0);
+  assert(memcmp(r.base, "456789", 6) == 0);
+  assert(ns_ring_space(&r) == r.cap - 14);
+  ns_ring_free(&r);
+}
+
+static void test_resize_keeps_unread(void) {
+  ns_ring_t r;
+  assert(ns_ring_init(&r, 4096) == 0);
+  ns_ring_commit(&r, r.cap - 2);
+  ns_ring_consume(&r, r.cap - 2);
+  memcpy(ns_ring_tail(&r), "wrapped", 7);
+  ns_ring_commit(&r, 7);
+
+  assert(ns_ring_resize(&r, 3 * 4096) == 0);
+  assert(r.cap >= 3 * 4096);
+  assert(ns_ring_len(&r) == 7);
+  assert(memcmp(ns_ring_data(&r), "wrapped", 7) == 0);
+  assert(ns_ring_resize(&r, 2) != 0); // would drop unread bytes
+  ns_ring_free(&r);
+}
+
+static void test_pool_reuse_and_accounting(void) {
+  ns_bufpool_t p;
+  ns_bufpool_init(&p, 1u << 20);
+
+  ns_ring_t r;
+  assert(ns_bufpool_ring_get(&p, &r, 5000) == 0);
+  assert(r.cap == 8192 && p.rx_in_use == 8192);
+  uint8_t *base = r.base;
+  ns_bufpool_ring_put(&p, &r);
+  assert(r.base == NULL && p.rx_in_use == 0 && p.cached == 8192);
+  assert(ns_bufpool_ring_get(&p, &r, 8192) == 0);
+  assert(r.base == base && p.cached == 0); // served from the cache
+
+  memcpy(ns_ring_tail(&r), "keep", 4);
+  ns_ring_commit(&r, 4);
+  assert(ns_bufpool_ring_grow(&p, &r, 20000) == 0);
+  assert(r.cap == 32768 && ns_ring_len(&r) == 4 && memcmp(ns_ring_data(&r), "keep", 4) == 0);
+  assert(p.rx_in_use == 32768 && p.cached == 8192);
+  ns_bufpool_ring_put(&p, &r);
+
+  size_t cap = 0;
+  uint8_t *b = ns_bufpool_get(&p, 100, &cap);
+  assert(b && cap == 4096 && p.tx_in_use == 4096);
+  ns_bufpool_put(&p, b, cap);
+  assert(p.tx_in_use == 0 && ns_bufpool_get(&p, 4096, &cap) == b);
+  ns_bufpool_put(&p, b, cap);
+
+  // Above the cache budget, returned buffers are released instead of cached.
+  size_t before = p.cached;
+  b = ns_bufpool_get(&p, 2u << 20, &cap);
+  assert(b && cap == (2u << 20));
+  ns_bufpool_put(&p, b, cap);
+  assert(p.cached == before);
+
+  ns_bufpool_destroy(&p);
+}
+
+int main(void) {
+  test_basic_io();
+  test_wrap_is_contiguous();
+  test_resize_keeps_unread();
+  test_pool_reuse_and_accounting();
+  printf("test_ring: OK\n");
+  return 0;
+}
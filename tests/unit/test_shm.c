@@ -7,19 +7,22 @@
 
 static void init_local_shm(ns_shm_t *s) {
   memset(s, 0, sizeof(*s));
-  pthread_mutex_init(&s->chat_mu, NULL);
   pthread_mutex_init(&s->txn_mu, NULL);
   for (uint32_t i = 0; i < NS_MAX_USERS; i++) {
     pthread_mutex_init(&s->acct_mu[i], NULL);
-    s->balance[i] = 100000; // mirror ns_shm_init_if_needed default
+    s->balance[NS_ASSET_CASH][i] = NS_INITIAL_CASH; // mirror ns_shm_init_if_needed default
   }
   for (uint32_t r = 0; r < NS_MAX_ROOMS; r++) {
     pthread_mutex_init(&s->room_mu[r], NULL);
+    pthread_mutex_init(&s->chat_rooms[r].mu, NULL);
   }
+  for (uint32_t i = 0; i < NS_MAX_WORKERS; i++) pthread_mutex_init(&s->inbox[i].mu, NULL);
+  pthread_mutex_init(&s->leaderboard.mu, NULL);
+  assert(ns_chat_set_room_caps(s, NULL) == 0);
 }
 
 static void test_room_membership(void) {
-  ns_shm_t s;
+  static ns_shm_t s;
   init_local_shm(&s);
 
   uint16_t room = 1;
@@ -32,29 +35,535 @@ static void test_room_membership(void) {
 }
 
 static void test_chat_ring(void) {
-  ns_shm_t s;
+  static ns_shm_t s;
   init_local_shm(&s);
 
-  uint64_t seq = 0;
-  ns_chat_event_t evs[4];
+  ns_chat_cursor_t cur = {0, 0};
+  ns_chat_frame_ref_t refs[4];
+  uint8_t buf[1024];
 
-  ns_chat_append(&s, 1, 10, "hi", 2);
-  ns_chat_append(&s, 1, 11, "yo", 2);
+  assert(ns_chat_append(&s, 1, 10, "hi", 2) == 0);
+  assert(ns_chat_append(&s, 1, 11, "yo", 2) == 0);
 
-  uint64_t n = ns_chat_read_from(&s, &seq, evs, 4);
-  assert(n == 2);
-  assert(evs[0].room_id == 1 && evs[0].from_user_id == 10);
-  assert(evs[1].room_id == 1 && evs[1].from_user_id == 11);
+  uint64_t n = ns_chat_read_frames(&s, 1, &cur, refs, 4, buf, sizeof(buf), NULL);
+  assert(n == 2 && cur.seq == 2);
+  assert(refs[0].room_id == 1 && refs[0].from_user_id == 10 && refs[0].seq == 1);
+  assert(refs[1].room_id == 1 && refs[1].from_user_id == 11 && refs[1].msg_len == 2);
+  assert(memcmp(ns_chat_frame_msg(buf + refs[1].off), "yo", 2) == 0);
+
+  // Nothing new: the cursor stays put.
+  assert(ns_chat_read_frames(&s, 1, &cur, refs, 4, buf, sizeof(buf), NULL) == 0 && cur.seq == 2);
+}
+
+static void test_chat_prebuilt_frames(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+
+  ns_chat_append(&s, 3, 42, "hello", 5);
+  ns_chat_append(&s, 3, 43, "x", 1);
+
+  ns_chat_cursor_t cur = {0, 0};
+  ns_chat_frame_ref_t refs[4];
+  uint8_t buf[1024];
+  uint64_t n = ns_chat_read_frames(&s, 3, &cur, refs, 4, buf, sizeof(buf), NULL);
+  assert(n == 2 && cur.seq == 2);
+  assert(refs[0].room_id == 3 && refs[0].from_user_id == 42 && refs[0].off == 0);
+  assert(refs[1].off == refs[0].len && refs[1].len == ns_chat_frame_len(1));
+
+  // Each frame is a complete, checksummed CHAT_BROADCAST push.
+  const ns_header_t *h = (const ns_header_t *)buf;
+  const uint8_t *body = buf + sizeof(ns_header_t);
+  assert(ns_validate_header_basic(h, 65536));
+  assert(ns_be16(&h->opcode) == OP_CHAT_BROADCAST && ns_be64(&h->req_id) == 0);
+  assert(ns_frame_integrity(h) == NS_INTEGRITY_FULL);
+  assert(ns_validate_checksum(h, body, ns_be32(&h->body_len)));
+  assert(ns_be16(body) == 3 && ns_be32(body + 2) == 42 && ns_be16(body + 6) == 5);
+  assert(memcmp(body + NS_CHAT_BODY_HDR, "hello", 5) == 0);
+  assert(ns_be64(body + NS_CHAT_BODY_HDR + 5) == 1); // the room seq closes the body, under the CRC
+  h = (const ns_header_t *)(buf + refs[1].off);
+  assert(ns_validate_checksum(h, buf + refs[1].off + sizeof(ns_header_t), ns_be32(&h->body_len)));
+  assert(ns_be64(buf + refs[1].off + refs[1].len - NS_CHAT_BODY_SEQ) == 2);
+
+  // A buffer too small for the next frame stops the read without skipping it.
+  memset(&cur, 0, sizeof(cur));
+  n = ns_chat_read_frames(&s, 3, &cur, refs, 4, buf, refs[0].len, NULL);
+  assert(n == 1 && cur.seq == 1);
+  n = ns_chat_read_frames(&s, 3, &cur, refs, 4, buf, sizeof(buf), NULL);
+  assert(n == 1 && cur.seq == 2 && refs[0].from_user_id == 43);
+}
+
+static void test_chat_room_rings(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+
+  // Capacities must each hold NS_CHAT_ROOM_MIN_BYTES and fit the arena together.
+  uint32_t caps[NS_MAX_ROOMS];
+  for (uint32_t r = 0; r < NS_MAX_ROOMS; r++) caps[r] = NS_CHAT_ROOM_MIN_BYTES;
+  caps[0] = NS_CHAT_ARENA_BYTES;
+  assert(ns_chat_set_room_caps(&s, caps) != 0);
+  caps[0] = NS_CHAT_ROOM_MIN_BYTES - 8u;
+  assert(ns_chat_set_room_caps(&s, caps) != 0);
+  caps[0] = 8192;
+  assert(ns_chat_set_room_caps(&s, caps) == 0);
+  assert(ns_chat_room_cap(&s, 0) == 8192 && ns_chat_room_cap(&s, 1) == NS_CHAT_ROOM_MIN_BYTES);
+
+  // A noisy room wraps its own ring only; the quiet room keeps its history.
+  ns_chat_append(&s, 1, 7, "quiet", 5);
+  for (uint32_t i = 0; i < 1000; i++) ns_chat_append(&s, 0, 8, "noise", 5);
+  assert(ns_chat_latest_seq(&s, 0) == 1000 && ns_chat_latest_seq(&s, 1) == 1);
+
+  ns_chat_frame_ref_t refs[4];
+  uint8_t buf[1024];
+  ns_chat_cursor_t cur = {0, 0};
+  assert(ns_chat_read_frames(&s, 1, &cur, refs, 4, buf, sizeof(buf), NULL) == 1);
+  assert(refs[0].from_user_id == 7 && memcmp(ns_chat_frame_msg(buf), "quiet", 5) == 0);
+
+  // Records take only their own bytes: a 5-byte message needs one 8-byte-aligned record.
+  uint64_t events = 0, bytes = 0, msg_bytes = 0;
+  ns_chat_room_usage(&s, 0, &events, &bytes, &msg_bytes);
+  uint32_t rec = ns_chat_rec_size(5);
+  assert(events == 8192u / rec || events == 8192u / rec - 1u);
+  assert(bytes <= 8192u && msg_bytes == events * 5u);
+
+  // A reader that fell behind resumes at the oldest retained event and counts what it missed.
+  uint64_t overrun = 0;
+  memset(&cur, 0, sizeof(cur));
+  assert(ns_chat_read_frames(&s, 0, &cur, refs, 1, buf, sizeof(buf), &overrun) == 1);
+  assert(refs[0].seq == 1000 - events + 1 && overrun == 1000 - events && cur.seq == refs[0].seq);
+
+  // A cursor at the latest event sees only later ones.
+  ns_chat_cursor_latest(&s, 0, &cur);
+  assert(ns_chat_read_frames(&s, 0, &cur, refs, 4, buf, sizeof(buf), NULL) == 0);
+  ns_chat_append(&s, 0, 9, "new", 3);
+  assert(ns_chat_read_frames(&s, 0, &cur, refs, 4, buf, sizeof(buf), NULL) == 1 && refs[0].from_user_id == 9);
+}
+
+static void test_chat_variable_records(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+
+  // Mixed sizes wrap the ring many times; every read returns exactly the bytes appended, in order.
+  static char big[NS_CHAT_MSG_LIMIT];
+  for (size_t i = 0; i < sizeof(big); i++) big[i] = (char)('a' + i % 26u);
+  static uint8_t buf[2u * 65600u];
+  ns_chat_frame_ref_t refs[8];
+  ns_chat_cursor_t cur = {0, 0};
+  uint64_t overrun = 0, seen = 0;
+  const uint16_t sizes[] = {1, 20, 300, 4000, 0, 777, 13};
+  for (uint32_t i = 0; i < 2000; i++) {
+    uint16_t len = sizes[i % (sizeof(sizes) / sizeof(sizes[0]))];
+    assert(ns_chat_append(&s, 5, i, big, len) == 0);
+    uint64_t n = ns_chat_read_frames(&s, 5, &cur, refs, 8, buf, sizeof(buf), &overrun);
+    assert(n == 1 && refs[0].from_user_id == i && refs[0].msg_len == len);
+    assert(refs[0].len == ns_chat_frame_len(len) && memcmp(ns_chat_frame_msg(buf), big, len) == 0);
+    seen++;
+  }
+  assert(overrun == 0 && seen == 2000 && cur.seq == 2000);
+
+  // A message larger than the room's whole ring is refused; one that fits is stored whole.
+  uint32_t caps[NS_MAX_ROOMS];
+  for (uint32_t r = 0; r < NS_MAX_ROOMS; r++) caps[r] = NS_CHAT_ROOM_MIN_BYTES;
+  caps[5] = 131072;
+  assert(ns_chat_set_room_caps(&s, caps) == 0);
+  assert(ns_chat_append(&s, 4, 1, big, 5000) != 0);
+  assert(ns_chat_append(&s, 5, 1, big, (uint16_t)NS_CHAT_MSG_LIMIT) == 0);
+  memset(&cur, 0, sizeof(cur));
+  assert(ns_chat_read_frames(&s, 5, &cur, refs, 8, buf, sizeof(buf), NULL) == 1);
+  assert(refs[0].msg_len == NS_CHAT_MSG_LIMIT && memcmp(ns_chat_frame_msg(buf), big, NS_CHAT_MSG_LIMIT) == 0);
+}
+
+static void test_chat_resume(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+
+  ns_chat_cursor_t cur;
+  ns_chat_frame_ref_t refs[4];
+  uint8_t buf[1024];
+  // Mixed sizes so record positions are irregular; the seq index still finds each one.
+  for (uint32_t i = 1; i <= 10; i++) assert(ns_chat_append(&s, 2, i, "0123456789abcdef", (uint16_t)(i % 3u * 7u)) == 0);
+
+  assert(ns_chat_cursor_seek(&s, 2, 6, &cur) == 0 && cur.seq == 6);
+  assert(ns_chat_read_frames(&s, 2, &cur, refs, 4, buf, sizeof(buf), NULL) == 4);
+  assert(refs[0].seq == 7 && refs[0].from_user_id == 7 && refs[3].seq == 10);
+
+  ns_chat_cursor_last(&s, 2, 2, &cur);
+  assert(ns_chat_read_frames(&s, 2, &cur, refs, 4, buf, sizeof(buf), NULL) == 2 && refs[0].seq == 9);
+  ns_chat_cursor_last(&s, 2, 100, &cur);
+  assert(ns_chat_read_frames(&s, 2, &cur, refs, 1, buf, sizeof(buf), NULL) == 1 && refs[0].seq == 1);
+
+  // At or past the newest event: nothing to replay.
+  assert(ns_chat_cursor_seek(&s, 2, 10, &cur) == 0 && cur.seq == 10);
+  assert(ns_chat_cursor_seek(&s, 2, 99, &cur) == 0 && cur.seq == 10);
+  assert(ns_chat_read_frames(&s, 2, &cur, refs, 4, buf, sizeof(buf), NULL) == 0);
+
+  // Wrap the 64 KB ring: a cursor that fell off it starts at the oldest event and reports the gap.
+  for (uint32_t i = 11; i <= 2000; i++) assert(ns_chat_append(&s, 2, i, "0123456789abcdef", 16) == 0);
+  uint64_t events = 0;
+  ns_chat_room_usage(&s, 2, &events, NULL, NULL);
+  const uint64_t oldest = 2000 - events + 1;
+  assert(ns_chat_cursor_seek(&s, 2, 5, &cur) == oldest - 6 && cur.seq == oldest - 1);
+  assert(ns_chat_read_frames(&s, 2, &cur, refs, 1, buf, sizeof(buf), NULL) == 1 && refs[0].seq == oldest);
+  assert(ns_chat_cursor_seek(&s, 2, 1500, &cur) == 0);
+  assert(ns_chat_read_frames(&s, 2, &cur, refs, 1, buf, sizeof(buf), NULL) == 1);
+  assert(refs[0].seq == 1501 && refs[0].from_user_id == 1501);
+}
+
+static void test_direct_routes(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+
+  uint32_t worker = 0;
+  uint64_t handle = 0;
+  assert(!ns_route_get(&s, 9, &worker, &handle));
+  const uint64_t h1 = (3ull << 32) | 17u, h2 = (5ull << 32) | 4u;
+  uint64_t r1 = ns_route_set(&s, 9, 2, h1);
+  assert(r1 != 0 && ns_route_get(&s, 9, &worker, &handle) && worker == 2 && handle == h1);
+
+  // A newer login wins; the old connection closing does not clear it.
+  uint64_t r2 = ns_route_set(&s, 9, 0, h2);
+  ns_route_clear(&s, 9, r1);
+  assert(ns_route_get(&s, 9, &worker, &handle) && worker == 0 && handle == h2);
+  ns_route_clear(&s, 9, r2);
+  assert(!ns_route_get(&s, 9, NULL, NULL));
+
+  // Slots beyond 24 bits are not routable; a restarted worker drops its routes.
+  assert(ns_route_set(&s, 9, 1, 1ull << 24) == 0);
+  (void)ns_route_set(&s, 9, 1, h1);
+  (void)ns_route_set(&s, 10, 2, h2);
+  ns_balance_watch_set(&s, 9, true);
+  ns_balance_watch_set(&s, 10, true);
+  assert(ns_balance_watched(&s, 9) && !ns_balance_watched(&s, 11));
+  ns_route_clear_worker(&s, 1);
+  assert(!ns_route_get(&s, 9, NULL, NULL) && ns_route_get(&s, 10, &worker, NULL) && worker == 2);
+  assert(!ns_balance_watched(&s, 9) && ns_balance_watched(&s, 10));
+  ns_balance_watch_set(&s, 10, false);
+  assert(!ns_balance_watched(&s, 10));
+}
+
+static void test_dedup(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+  s.user_used[5] = true;
+
+  uint16_t st = 0;
+  int64_t bal = 0;
+  assert(ns_dedup_lookup(&s, 5, 42, OP_TRANSFER, 0xabcdu, &st, &bal) == NS_DEDUP_MISS);
+  ns_dedup_record(&s, 5, 42, OP_TRANSFER, 0xabcdu, ST_ERR_INSUFFICIENT_FUNDS, 77);
+  assert(ns_dedup_lookup(&s, 5, 42, OP_TRANSFER, 0xabcdu, &st, &bal) == NS_DEDUP_HIT);
+  assert(st == ST_ERR_INSUFFICIENT_FUNDS && bal == 77);
+
+  // Same key with another body or opcode is a different request; keys are per user; 0 is never a key.
+  assert(ns_dedup_lookup(&s, 5, 42, OP_TRANSFER, 0xabceu, NULL, NULL) == NS_DEDUP_CONFLICT);
+  assert(ns_dedup_lookup(&s, 5, 42, OP_DEPOSIT, 0xabcdu, NULL, NULL) == NS_DEDUP_CONFLICT);
+  assert(ns_dedup_lookup(&s, 6, 42, OP_TRANSFER, 0xabcdu, NULL, NULL) == NS_DEDUP_MISS);
+  ns_dedup_record(&s, 5, 0, OP_DEPOSIT, 1, ST_OK, 1);
+  assert(ns_dedup_used(&s) == 1);
+
+  // The window holds the user's last NS_DEDUP_WAYS results.
+  for (uint64_t k = 1; k < NS_DEDUP_WAYS; k++) ns_dedup_record(&s, 5, 100 + k, OP_DEPOSIT, 1, ST_OK, (int64_t)k);
+  assert(ns_dedup_lookup(&s, 5, 42, OP_TRANSFER, 0xabcdu, NULL, NULL) == NS_DEDUP_HIT);
+  ns_dedup_record(&s, 5, 200, OP_DEPOSIT, 1, ST_OK, 0);
+  assert(ns_dedup_lookup(&s, 5, 42, OP_TRANSFER, 0xabcdu, NULL, NULL) == NS_DEDUP_MISS);
+  assert(ns_dedup_lookup(&s, 5, 101, OP_DEPOSIT, 1, NULL, &bal) == NS_DEDUP_HIT && bal == 1);
+  assert(ns_dedup_used(&s) == NS_DEDUP_WAYS);
+}
+
+static void test_inbox(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+
+  static uint8_t frame[10000];
+  for (size_t i = 0; i < sizeof(frame); i++) frame[i] = (uint8_t)i;
+  assert(ns_inbox_peek(&s, 3) == NULL);
+
+  // Fill until refused, drain, repeat: records wrap the ring and come back intact and in order.
+  uint32_t pushed = 0, popped = 0;
+  for (int round = 0; round < 5; round++) {
+    while (ns_inbox_push(&s, 3, pushed, pushed, NS_INBOX_FRAME, frame, 1000u + pushed % 7u * 1000u) == 0) pushed++;
+    const ns_inbox_rec_t *r;
+    while ((r = ns_inbox_peek(&s, 3)) != NULL) {
+      assert(r->conn_handle == popped && r->to_user_id == popped);
+      assert(r->frame_len == 1000u + popped % 7u * 1000u && memcmp(r + 1, frame, r->frame_len) == 0);
+      ns_inbox_pop(&s, 3, r);
+      popped++;
+    }
+    assert(popped == pushed);
+  }
+  assert(pushed > 5u * NS_INBOX_BYTES / 10000u);
+
+  // Other workers' inboxes are independent; reset discards what is pending.
+  assert(ns_inbox_push(&s, 4, 1, 1, NS_INBOX_BALANCE, frame, 8) == 0);
+  assert(ns_inbox_peek(&s, 3) == NULL && ns_inbox_peek(&s, 4)->kind == NS_INBOX_BALANCE);
+  ns_inbox_reset(&s, 4);
+  assert(ns_inbox_peek(&s, 4) == NULL);
+}
+
+static void test_room_workers(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+
+  assert(ns_room_workers(&s, 7) == 0);
+  ns_room_set_worker(&s, 7, 0, true);
+  ns_room_set_worker(&s, 7, 63, true);
+  ns_room_set_worker(&s, 8, 2, true);
+  assert(ns_room_workers(&s, 7) == (1ull | (1ull << 63)));
+  ns_room_set_worker(&s, 7, 0, false);
+  assert(ns_room_workers(&s, 7) == 1ull << 63);
+  assert(ns_room_workers(&s, 8) == 1ull << 2);
+  // Out-of-range ids are ignored.
+  ns_room_set_worker(&s, (uint16_t)NS_MAX_ROOMS, 0, true);
+  ns_room_set_worker(&s, 7, NS_MAX_WORKERS, true);
+  assert(ns_room_workers(&s, 7) == 1ull << 63);
+}
+
+static void *md_writer(void *arg) {
+  ns_shm_t *s = (ns_shm_t *)arg;
+  for (uint32_t i = 1; i <= 200000; i++) (void)ns_md_publish(s, 9, i, i + 1u, i, 1);
+  return NULL;
+}
+
+static void test_market_data(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+  ns_md_quote_t q;
+
+  // Only the workers whose dirty set was empty are reported for a wake-up.
+  ns_md_set_worker(&s, 5, 0, true);
+  ns_md_set_worker(&s, 5, 3, true);
+  ns_md_set_worker(&s, 6, 3, true);
+  assert(ns_md_publish(&s, 5, 99, 101, 100, 7) == ((1ull << 0) | (1ull << 3)));
+  assert(ns_md_publish(&s, 5, 98, 101, 0, 0) == 0);
+  assert(ns_md_publish(&s, 6, 10, 11, 10, 1) == 0);
+  assert(ns_md_take_dirty(&s, 3) == ((1ull << 5) | (1ull << 6)) && ns_md_take_dirty(&s, 3) == 0);
+  assert(ns_md_take_dirty(&s, 0) == 1ull << 5);
+  assert(ns_md_publish(&s, 6, 10, 12, 0, 0) == 1ull << 3);
+
+  // Conflated: the slot holds the newest bid/ask and the last trade; volume and version accumulate.
+  assert(ns_md_read(&s, 5, &q) && q.bid == 98 && q.ask == 101 && q.last_price == 100 && q.last_qty == 7);
+  assert(q.volume == 7 && q.version == 2 && q.ts_ns != 0);
+  assert(ns_md_read(&s, 7, &q) && q.version == 0);
+  assert(!ns_md_read(&s, NS_MD_SYMBOLS, &q) && ns_md_publish(&s, NS_MD_SYMBOLS, 1, 2, 0, 0) == 0);
+  ns_md_set_worker(&s, 5, 0, false);
+  assert(s.md_workers[5] == 1ull << 3);
+
+  // Readers racing two writers never see a torn quote.
+  pthread_t th[2];
+  for (int i = 0; i < 2; i++) assert(pthread_create(&th[i], NULL, md_writer, &s) == 0);
+  for (int i = 0; i < 100000; i++) {
+    assert(ns_md_read(&s, 9, &q));
+    assert(q.version == 0 || (q.ask == q.bid + 1u && q.last_price == q.bid));
+  }
+  for (int i = 0; i < 2; i++) pthread_join(th[i], NULL);
+  assert(ns_md_read(&s, 9, &q) && q.version == 400000 && q.volume == 400000);
+}
+
+// The leaderboard must always equal a full sort of the cash column, whatever order updates arrive in.
+static void test_leaderboard(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+  int64_t *cash = s.balance[NS_ASSET_CASH];
+  ns_leaderboard_reset(&s);
+  ns_lb_entry_t top[NS_LEADERBOARD_K];
+
+  // No registered users: nothing to rank, and updates for unclaimed ids are ignored.
+  assert(ns_leaderboard_top(&s, top, NS_LEADERBOARD_K) == 0);
+  ns_leaderboard_update(&s, 7);
+  assert(ns_leaderboard_top(&s, top, NS_LEADERBOARD_K) == 0);
+
+  // Users enter as their slots are claimed, fewer than K so far.
+  char name[NS_MAX_USERNAME];
+  uint32_t id = 0;
+  for (uint32_t i = 0; i < 4; i++) {
+    snprintf(name, sizeof(name), "lb%u", i);
+    assert(ns_user_find_or_create(&s, name, &id) == 0);
+  }
+  assert(ns_leaderboard_top(&s, top, NS_LEADERBOARD_K) == 4);
+  for (uint32_t k = 0; k < 4; k++) assert(s.user_used[top[k].user_id]);
+
+  for (uint32_t i = 4; i < 200; i++) {
+    snprintf(name, sizeof(name), "lb%u", i);
+    assert(ns_user_find_or_create(&s, name, &id) == 0);
+  }
+
+  uint64_t rng = 88172645463325252ull;
+  for (int iter = 0; iter < 20000; iter++) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    uint32_t u = (uint32_t)(rng % NS_MAX_USERS);
+    cash[u] += (int64_t)((rng >> 32) % 2001u) - 1000;
+    ns_leaderboard_update(&s, u);
+    if (iter % 997 != 0) continue;
+
+    uint32_t n = ns_leaderboard_top(&s, top, 5);
+    assert(n == 5);
+    bool taken[NS_MAX_USERS] = {false};
+    for (uint32_t k = 0; k < n; k++) {
+      uint32_t best = UINT32_MAX;
+      for (uint32_t v = 0; v < NS_MAX_USERS; v++) {
+        if (!s.user_used[v] || taken[v]) continue;
+        if (best == UINT32_MAX || cash[v] > cash[best]) best = v;
+      }
+      taken[best] = true;
+      assert(top[k].user_id == best && top[k].balance == cash[best]);
+    }
+  }
+  // Unclaimed slots never appear, however much cash they hold.
+  assert(ns_leaderboard_top(&s, top, NS_LEADERBOARD_K) == NS_LEADERBOARD_K);
+  for (uint32_t k = 0; k < NS_LEADERBOARD_K; k++) assert(s.user_used[top[k].user_id]);
+
+  // A rebuild ranks the same registered users.
+  ns_lb_entry_t again[NS_LEADERBOARD_K];
+  ns_leaderboard_reset(&s);
+  assert(ns_leaderboard_top(&s, again, NS_LEADERBOARD_K) == NS_LEADERBOARD_K);
+  for (uint32_t k = 0; k < NS_LEADERBOARD_K; k++) {
+    assert(again[k].user_id == top[k].user_id && again[k].balance == top[k].balance);
+  }
+
+  // A user falling out of the top is replaced by the best of the rest.
+  uint32_t first = top[0].user_id;
+  cash[first] = -1;
+  ns_leaderboard_update(&s, first);
+  assert(ns_leaderboard_top(&s, top, NS_LEADERBOARD_K) == NS_LEADERBOARD_K);
+  for (uint32_t k = 0; k < NS_LEADERBOARD_K; k++) assert(top[k].user_id != first);
+}
+
+static void test_txn_history(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+  ns_txn_event_t ev[8];
+
+  ns_txn_append(&s, OP_DEPOSIT, ST_OK, 1, 1, 50);   // seq 1
+  ns_txn_append(&s, OP_TRANSFER, ST_OK, 2, 3, 5);   // seq 2, not user 1's
+  ns_txn_append(&s, OP_TRANSFER, ST_OK, 3, 1, 7);   // seq 3
+  const ns_transfer_leg_t legs[2] = {{1, 10}, {4, 20}};
+  ns_txn_append_batch(&s, OP_TRANSFER_MULTI, ST_OK, 2, legs, 2); // seqs 4, 5
+  ns_txn_append(&s, OP_TRANSFER, ST_OK, 1, 2, 1);   // seq 6
+
+  // Newest first, only the user's own events, whichever side of them it was on.
+  assert(ns_txn_history(&s, 1, 0, ev, 8) == 4);
+  assert(ev[0].seq == 6 && ev[1].seq == 4 && ev[2].seq == 3 && ev[3].seq == 1);
+  assert(ns_txn_history(&s, 2, 0, ev, 8) == 4 && ev[1].seq == 5 && ev[2].seq == 4 && ev[3].seq == 2);
+  assert(ns_txn_history(&s, 9, 0, ev, 8) == 0);
+
+  // Paging continues after the last seq returned; a seq that is not the user's ends it.
+  assert(ns_txn_history(&s, 1, 0, ev, 2) == 2 && ev[1].seq == 4);
+  assert(ns_txn_history(&s, 1, 4, ev, 8) == 2 && ev[0].seq == 3 && ev[1].seq == 1);
+  assert(ns_txn_history(&s, 1, 5, ev, 8) == 0);
+
+  // Once the ring wraps, the chain stops at the oldest event still retained.
+  for (uint32_t i = 0; i < NS_TXN_RING_SIZE - 2u; i++) ns_txn_append(&s, OP_DEPOSIT, ST_OK, 7, 7, 1);
+  assert(ns_txn_history(&s, 1, 0, ev, 8) == 1 && ev[0].seq == 6);
+  assert(ns_txn_history(&s, 7, 0, ev, 8) == 8 && ev[0].seq == s.txn_write_seq);
+}
+
+static void test_transfer_multi_locking(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+
+  // Accounts come back sorted and distinct, and stay locked until unlocked.
+  uint32_t ids[] = {9, 3, 700, 3, 9, 1, 700};
+  uint32_t n = ns_acct_lock_many(&s, ids, 7);
+  assert(n == 4 && ids[0] == 1 && ids[1] == 3 && ids[2] == 9 && ids[3] == 700);
+  assert(pthread_mutex_trylock(&s.acct_mu[9]) != 0 && pthread_mutex_trylock(&s.acct_mu[2]) == 0);
+  pthread_mutex_unlock(&s.acct_mu[2]);
+  ns_acct_unlock_many(&s, ids, n);
+  assert(pthread_mutex_trylock(&s.acct_mu[9]) == 0);
+  pthread_mutex_unlock(&s.acct_mu[9]);
+
+  // A batch is logged as consecutive events marked with their position in it.
+  ns_txn_append(&s, OP_TRANSFER, ST_OK, 1, 2, 5);
+  const ns_transfer_leg_t legs[3] = {{3, 10}, {9, 20}, {3, 30}};
+  ns_txn_append_batch(&s, OP_TRANSFER_MULTI, ST_OK, 1, legs, 3);
+  assert(s.txn_write_seq == 4 && s.txn_ring[1].batch_len == 0);
+  for (uint32_t i = 0; i < 3; i++) {
+    const ns_txn_event_t *e = &s.txn_ring[2 + i];
+    assert(e->seq == 2 + i && e->batch_idx == i && e->batch_len == 3);
+    assert(e->to_user_id == legs[i].to_user_id && e->amount == legs[i].amount);
+  }
+  int64_t current[NS_ASSETS], expected[NS_ASSETS];
+  assert(ns_check_asset_conservation(&s, current, expected) == 0);
+}
+
+typedef struct {
+  ns_shm_t *s;
+  uint64_t now;
+  uint32_t allowed;
+} rate_arg_t;
+
+static void *rate_hammer(void *p) {
+  rate_arg_t *a = (rate_arg_t *)p;
+  for (int i = 0; i < 100000; i++) {
+    if (ns_rate_consume(a->s, 3, NS_RL_CHAT, a->now) == 0) a->allowed++;
+  }
+  return NULL;
+}
+
+static void test_sched_classes(void) {
+  assert(ns_sched_class(OP_TRANSFER) == NS_SCHED_TRADING && ns_sched_class(OP_BALANCE) == NS_SCHED_TRADING);
+  assert(ns_sched_class(OP_LOGIN) == NS_SCHED_CONTROL && ns_sched_class(OP_JOIN_ROOM) == NS_SCHED_CONTROL);
+  assert(ns_sched_class(OP_CHAT_SEND) == NS_SCHED_CHAT && ns_sched_class(OP_DIRECT_MSG) == NS_SCHED_CHAT);
+  assert(strcmp(ns_sched_class_name(NS_SCHED_CHAT), "chat") == 0);
+
+  // Buckets are powers of two in us; percentiles report the upper bound of their bucket.
+  assert(ns_lat_bucket(0) == 0 && ns_lat_bucket(1) == 1 && ns_lat_bucket(2) == 2 && ns_lat_bucket(3) == 2);
+  assert(ns_lat_bucket(1000) == 10 && ns_lat_bucket(UINT64_MAX) == NS_LAT_BUCKETS - 1u);
+  uint64_t hist[NS_LAT_BUCKETS] = {0};
+  assert(ns_lat_percentile_us(hist, 99.0) == 0);
+  hist[ns_lat_bucket(50)] = 98;   // < 64 us
+  hist[ns_lat_bucket(3000)] = 2;  // < 4096 us
+  assert(ns_lat_percentile_us(hist, 50.0) == 64 && ns_lat_percentile_us(hist, 97.0) == 64);
+  assert(ns_lat_percentile_us(hist, 99.0) == 4096 && ns_lat_percentile_us(hist, 100.0) == 4096);
+}
+
+static void test_rate_limits(void) {
+  static ns_shm_t s;
+  init_local_shm(&s);
+  assert(ns_rate_class(OP_TRANSFER_MULTI) == NS_RL_LEDGER && ns_rate_class(OP_ORDER_CANCEL) == NS_RL_ORDERS);
+  assert(ns_rate_class(OP_LOGIN) == NS_RL_NONE && ns_rate_class(OP_LEADERBOARD) == NS_RL_QUERY);
+
+  // A spec changes only the classes it names, and a bad one changes nothing.
+  ns_rate_limit_t lim[NS_RL_CLASSES] = {{0, 0}, {0, 0}, {0, 0}, {7, 7}};
+  assert(ns_rate_parse_limits("ledger=10:3,chat=1000", lim) == 0);
+  assert(lim[NS_RL_LEDGER].rate == 10 && lim[NS_RL_LEDGER].burst == 3 && lim[NS_RL_CHAT].burst == 1000);
+  assert(lim[NS_RL_ORDERS].rate == 0 && lim[NS_RL_QUERY].rate == 7);
+  assert(ns_rate_parse_limits("ledger=5,bogus=1", lim) == -1 && lim[NS_RL_LEDGER].rate == 10);
+  assert(ns_rate_parse_limits("chat=1:0", lim) == -1 && ns_rate_parse_limits("chat=", lim) == -1);
+  ns_rate_set_limits(&s, lim);
+  ns_rate_limit_t got[NS_RL_CLASSES];
+  ns_rate_get_limits(&s, got);
+  assert(memcmp(got, lim, sizeof(got)) == 0);
+
+  // 10/s with a burst of 3: three back to back, then one every 100 ms; the refusal says how long.
+  const uint64_t t0 = 5000000000ull, ms = 1000000ull;
+  for (int i = 0; i < 3; i++) assert(ns_rate_consume(&s, 1, NS_RL_LEDGER, t0) == 0);
+  assert(ns_rate_consume(&s, 1, NS_RL_LEDGER, t0) == 100 * ms);
+  assert(ns_rate_consume(&s, 1, NS_RL_LEDGER, t0 + 40 * ms) == 60 * ms);
+  assert(ns_rate_consume(&s, 1, NS_RL_LEDGER, t0 + 100 * ms) == 0);
+  assert(ns_rate_consume(&s, 1, NS_RL_LEDGER, t0 + 100 * ms) != 0);
+  // Buckets are per user and per class; unlimited classes always pass.
+  assert(ns_rate_consume(&s, 2, NS_RL_LEDGER, t0) == 0 && ns_rate_consume(&s, 1, NS_RL_ORDERS, t0) == 0);
+  // An idle bucket refills up to the burst, not beyond.
+  for (int i = 0; i < 3; i++) assert(ns_rate_consume(&s, 1, NS_RL_LEDGER, t0 + 60000 * ms) == 0);
+  assert(ns_rate_consume(&s, 1, NS_RL_LEDGER, t0 + 60000 * ms) != 0);
+
+  // Concurrent consumers of one bucket at a fixed time get exactly the burst between them.
+  rate_arg_t args[2] = {{&s, t0, 0}, {&s, t0, 0}};
+  pthread_t th[2];
+  for (int i = 0; i < 2; i++) pthread_create(&th[i], NULL, rate_hammer, &args[i]);
+  for (int i = 0; i < 2; i++) pthread_join(th[i], NULL);
+  assert(args[0].allowed + args[1].allowed == 1000);
 }
 
 static void test_asset_conservation(void) {
-  ns_shm_t s;
+  static ns_shm_t s;
   init_local_shm(&s);
 
-  int64_t current = 0, expected = 0;
-  // 初始狀態：所有帳戶都是 100000，應該通過資產守恆檢查
-  assert(ns_check_asset_conservation(&s, &current, &expected) == 0);
-  assert(current == expected);
+  int64_t current[NS_ASSETS], expected[NS_ASSETS];
+  // 初始狀態：所有帳戶都是 100000 現金、沒有商品，應該通過資產守恆檢查
+  assert(ns_check_asset_conservation(&s, current, expected) == 0);
+  assert(current[NS_ASSET_CASH] == expected[NS_ASSET_CASH] && current[NS_ASSET_CASH] == NS_MAX_USERS * NS_INITIAL_CASH);
+  for (uint32_t a = NS_ASSET_SYMBOL0; a < NS_ASSETS; a++) assert(current[a] == 0 && expected[a] == 0);
 
   // 模擬一次成功 DEPOSIT 與 WITHDRAW
   uint32_t uid = 5;
@@ -62,28 +571,64 @@ static void test_asset_conservation(void) {
   int64_t wd = 500;
 
   pthread_mutex_lock(&s.acct_mu[uid]);
-  s.balance[uid] += dep;
+  s.balance[NS_ASSET_CASH][uid] += dep;
   pthread_mutex_unlock(&s.acct_mu[uid]);
   ns_txn_append(&s, OP_DEPOSIT, ST_OK, uid, uid, dep);
 
   pthread_mutex_lock(&s.acct_mu[uid]);
-  s.balance[uid] -= wd;
+  s.balance[NS_ASSET_CASH][uid] -= wd;
   pthread_mutex_unlock(&s.acct_mu[uid]);
   ns_txn_append(&s, OP_WITHDRAW, ST_OK, uid, uid, wd);
 
-  assert(ns_check_asset_conservation(&s, &current, &expected) == 0);
-  assert(current == expected);
+  assert(ns_check_asset_conservation(&s, current, expected) == 0);
+  assert(current[NS_ASSET_CASH] == expected[NS_ASSET_CASH]);
+
+  // 其他資產各自守恆：存入商品 1、轉一部分給別人，再提領
+  const uint32_t asset = NS_ASSET_OF_SYMBOL(1);
+  s.balance[asset][uid] += 40;
+  ns_txn_append_asset(&s, (uint8_t)asset, OP_DEPOSIT, ST_OK, uid, uid, 40);
+  s.balance[asset][uid] -= 15;
+  s.balance[asset][7] += 15;
+  ns_txn_append_asset(&s, (uint8_t)asset, OP_TRANSFER, ST_OK, uid, 7, 15);
+  s.balance[asset][7] -= 5;
+  ns_txn_append_asset(&s, (uint8_t)asset, OP_WITHDRAW, ST_OK, 7, 7, 5);
+  assert(ns_check_asset_conservation(&s, current, expected) == 0);
+  assert(current[asset] == 35 && expected[asset] == 35);
+  assert(s.txn_ring[3].asset == asset && s.txn_ring[1].asset == NS_ASSET_CASH);
+
+  // 記在錯誤資產上的存款：兩邊的總額都不平衡
+  s.balance[asset][uid] += 10;
+  ns_txn_append(&s, OP_DEPOSIT, ST_OK, uid, uid, 10);
+  assert(ns_check_asset_conservation(&s, current, expected) == -1);
+  assert(current[asset] == expected[asset] + 10 && current[NS_ASSET_CASH] == expected[NS_ASSET_CASH] - 10);
+  s.balance[asset][uid] -= 10;
+  s.balance[NS_ASSET_CASH][uid] += 10;
+  assert(ns_check_asset_conservation(&s, current, expected) == 0);
 
   // 人為破壞一個帳戶餘額，應該檢查失敗
   pthread_mutex_lock(&s.acct_mu[0]);
-  s.balance[0] += 1;
+  s.balance[NS_ASSET_CASH][0] += 1;
   pthread_mutex_unlock(&s.acct_mu[0]);
-  assert(ns_check_asset_conservation(&s, &current, &expected) == -1);
+  assert(ns_check_asset_conservation(&s, current, expected) == -1);
 }
 
 int main(void) {
   test_room_membership();
   test_chat_ring();
+  test_chat_prebuilt_frames();
+  test_chat_room_rings();
+  test_chat_variable_records();
+  test_chat_resume();
+  test_direct_routes();
+  test_dedup();
+  test_transfer_multi_locking();
+  test_txn_history();
+  test_leaderboard();
+  test_inbox();
+  test_room_workers();
+  test_market_data();
+  test_rate_limits();
+  test_sched_classes();
   test_asset_conservation();
   printf("test_shm: OK\n");
   return 0;